@@ -0,0 +1,777 @@
+/*
+  Throughput benchmarks for the parser entry points.
+
+  Each case generates a reproducible synthetic input (seeded), then runs the
+  matching parser entry point over it and reports MB/s and objects/s.
+  Compile it the same way as main.c, for example:
+
+    cl /O2 bench.c
+    cc -O2 bench.c -o bench
+
+  Usage:
+    bench [--size BYTES] [--iterations N] [--seed N] [--depth N]
+          [--case NAME] [--format text|json|csv] [--dump DIR]
+
+  --dump writes every generated input to DIR/<case>.txt so that a given run
+  can be reproduced or inspected outside of the benchmark.
+ */
+
+#define PDF_NO_MAIN
+#include "main.c"
+
+// ----------------------------------------------------------------------------
+// Synthetic corpus generator
+// ----------------------------------------------------------------------------
+
+// NOTE(Sam): The parser happily reads one or two bytes past the end of
+//            the buffer, we keep some padding after the data. It must not
+//            be white space ('\0' is one) since skipping white spaces is
+//            not bounded by the buffer length.
+#define BENCH_BUFFER_PADDING 16
+#define BENCH_BUFFER_PADDING_BYTE 'E'
+
+typedef struct {
+	uint8_t* data;
+	size_t length;
+	size_t capacity;
+} BenchBuffer;
+
+typedef struct {
+	uint64_t state;
+} BenchRandom;
+
+// xorshift64*, good enough and identical on every platform
+uint64_t bench_random_next(BenchRandom* rng)
+{
+	rng->state ^= rng->state >> 12;
+	rng->state ^= rng->state << 25;
+	rng->state ^= rng->state >> 27;
+	return rng->state * 0x2545F4914F6CDD1DULL;
+}
+
+uint32_t bench_random_range(BenchRandom* rng, uint32_t min, uint32_t max)
+{
+	return min + (uint32_t)(bench_random_next(rng) % (uint64_t)(max - min + 1));
+}
+
+void bench_buffer_push(BenchBuffer* buf, const void* data, size_t length)
+{
+	if(buf->length + length + BENCH_BUFFER_PADDING > buf->capacity)
+	{
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		while(buf->length + length + BENCH_BUFFER_PADDING > capacity) capacity *= 2;
+		buf->data = (uint8_t*)realloc(buf->data, capacity);
+		if(buf->data == NULL)
+		{
+			printf("ERROR: Not enough memory...\n");
+			exit(1);
+		}
+		buf->capacity = capacity;
+	}
+	memcpy(buf->data + buf->length, data, length);
+	buf->length += length;
+	memset(buf->data + buf->length, BENCH_BUFFER_PADDING_BYTE, BENCH_BUFFER_PADDING);
+}
+
+void bench_buffer_push_char(BenchBuffer* buf, char c)
+{
+	bench_buffer_push(buf, &c, 1);
+}
+
+void bench_buffer_push_str(BenchBuffer* buf, const char* str)
+{
+	bench_buffer_push(buf, str, strlen(str));
+}
+
+void bench_buffer_push_number(BenchBuffer* buf, BenchRandom* rng)
+{
+	char tmp[32];
+	int len;
+	switch(bench_random_range(rng, 0, 3))
+	{
+	case 0: len = snprintf(tmp, sizeof(tmp), "%u", bench_random_range(rng, 0, 9)); break;
+	case 1: len = snprintf(tmp, sizeof(tmp), "-%u", bench_random_range(rng, 1, 100000)); break;
+	case 2: len = snprintf(tmp, sizeof(tmp), "%u", bench_random_range(rng, 10, 1000000)); break;
+	default:
+		len = snprintf(tmp, sizeof(tmp), "%u.%u",
+					   bench_random_range(rng, 0, 999), bench_random_range(rng, 0, 9999));
+	}
+	bench_buffer_push(buf, tmp, (size_t)len);
+}
+
+void bench_buffer_push_key(BenchBuffer* buf, BenchRandom* rng, size_t id)
+{
+	static const char* prefixes[] = {
+		"Type", "Subtype", "Font", "Resources", "MediaBox", "Contents",
+		"Filter", "Length", "Width", "Height", "ColorSpace", "BitsPerComponent",
+	};
+	char tmp[64];
+	const char* prefix = prefixes[bench_random_range(rng, 0, sizeof(prefixes)/sizeof(prefixes[0]) - 1)];
+	int len = snprintf(tmp, sizeof(tmp), "/%s%zu", prefix, id);
+	bench_buffer_push(buf, tmp, (size_t)len);
+}
+
+// Many literal strings with a high density of escape sequences
+// (named escapes, escaped parenthesis, octal codes and split lines).
+void bench_generate_literal_strings_escaped(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	static const char* escapes[] = {
+		"\\n", "\\r", "\\t", "\\b", "\\f", "\\(", "\\)", "\\\\",
+		"\\053", "\\53", "\\3", "\\245", "\\\n", "\\q",
+	};
+	while(buf->length < size)
+	{
+		uint32_t count = bench_random_range(rng, 8, 128);
+		bench_buffer_push_char(buf, '(');
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			if(bench_random_range(rng, 0, 2) == 0)
+				bench_buffer_push_char(buf, (char)bench_random_range(rng, 'a', 'z'));
+			else
+				bench_buffer_push_str(buf, escapes[bench_random_range(rng, 0, sizeof(escapes)/sizeof(escapes[0]) - 1)]);
+		}
+		bench_buffer_push_str(buf, ")\n");
+	}
+}
+
+// Many literal strings made of plain printable characters only
+void bench_generate_literal_strings_plain(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	while(buf->length < size)
+	{
+		uint32_t count = bench_random_range(rng, 16, 512);
+		bench_buffer_push_char(buf, '(');
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			char c = (char)bench_random_range(rng, ' ', '~');
+			if(c == '(' || c == ')' || c == '\\') c = ' ';
+			bench_buffer_push_char(buf, c);
+		}
+		bench_buffer_push_str(buf, ")\n");
+	}
+}
+
+// Long hexadecimal strings, mixed case, wrapped every 64 digits
+void bench_generate_hex_strings(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	static const char digits[] = "0123456789abcdefABCDEF";
+	while(buf->length < size)
+	{
+		uint32_t count = bench_random_range(rng, 256, 8192);
+		bench_buffer_push_char(buf, '<');
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			if(i > 0 && i % 64 == 0) bench_buffer_push_char(buf, '\n');
+			bench_buffer_push_char(buf, digits[bench_random_range(rng, 0, sizeof(digits) - 2)]);
+		}
+		bench_buffer_push_str(buf, ">\n");
+	}
+}
+
+// A stream of names, some of them using '#xx' sequences
+void bench_generate_names(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	size_t id = 0;
+	while(buf->length < size)
+	{
+		bench_buffer_push_key(buf, rng, id++);
+		if(bench_random_range(rng, 0, 7) == 0) bench_buffer_push_str(buf, "#20Extra#2F#41");
+		bench_buffer_push_char(buf, bench_random_range(rng, 0, 15) == 0 ? '\n' : ' ');
+	}
+}
+
+// One large array of integers and reals
+void bench_generate_flat_array(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	bench_buffer_push_char(buf, '[');
+	bench_buffer_push_number(buf, rng);
+	while(buf->length < size)
+	{
+		bench_buffer_push_char(buf, ' ');
+		bench_buffer_push_number(buf, rng);
+	}
+	bench_buffer_push_str(buf, "]\n");
+}
+
+void bench_generate_nested_dictionary_level(BenchBuffer* buf, BenchRandom* rng,
+											size_t depth, size_t entries_per_level, size_t* key_id)
+{
+	bench_buffer_push_str(buf, "<< ");
+	for(size_t i = 0; i < entries_per_level; ++i)
+	{
+		bench_buffer_push_key(buf, rng, (*key_id)++);
+		bench_buffer_push_char(buf, ' ');
+		switch(bench_random_range(rng, 0, 3))
+		{
+		case 0: bench_buffer_push_number(buf, rng); break;
+		case 1: bench_buffer_push_str(buf, "(nested value)"); break;
+		case 2: bench_buffer_push_str(buf, "/SomeName"); break;
+		default: bench_buffer_push_str(buf, "true"); break;
+		}
+		bench_buffer_push_char(buf, ' ');
+	}
+	if(depth > 1)
+	{
+		bench_buffer_push_str(buf, "/Child ");
+		bench_generate_nested_dictionary_level(buf, rng, depth - 1, entries_per_level, key_id);
+		bench_buffer_push_char(buf, ' ');
+	}
+	bench_buffer_push_str(buf, ">>");
+}
+
+// A single dictionary nested 'depth' times, each level being widened
+// so that the whole thing reaches roughly 'size' bytes.
+void bench_generate_nested_dictionary(BenchBuffer* buf, BenchRandom* rng, size_t size, size_t depth)
+{
+	const size_t average_entry_size = 20;
+	size_t entries_per_level = size / (depth*average_entry_size);
+	if(entries_per_level == 0) entries_per_level = 1;
+	size_t key_id = 0;
+	bench_generate_nested_dictionary_level(buf, rng, depth, entries_per_level, &key_id);
+	bench_buffer_push_char(buf, '\n');
+}
+
+// One flat dictionary with a lot of name keys and name values
+void bench_generate_names_dictionary(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	size_t id = 0;
+	bench_buffer_push_str(buf, "<<");
+	while(buf->length < size)
+	{
+		bench_buffer_push_char(buf, '\n');
+		bench_buffer_push_key(buf, rng, id);
+		bench_buffer_push_char(buf, ' ');
+		bench_buffer_push_key(buf, rng, id + 1000000);
+		++id;
+	}
+	bench_buffer_push_str(buf, "\n>>\n");
+}
+
+// Something which looks like a page content stream: mostly numbers
+// with path construction, matrix and color operators in between.
+void bench_generate_content_stream(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	static const struct { const char* op; int operands; } ops[] = {
+		{"m", 2}, {"l", 2}, {"c", 6}, {"re", 4}, {"cm", 6}, {"rg", 3},
+		{"RG", 3}, {"w", 1}, {"Td", 2}, {"Tf", 1}, {"S", 0}, {"f", 0},
+	};
+	while(buf->length < size)
+	{
+		uint32_t op = bench_random_range(rng, 0, sizeof(ops)/sizeof(ops[0]) - 1);
+		for(int i = 0; i < ops[op].operands; ++i)
+		{
+			bench_buffer_push_number(buf, rng);
+			bench_buffer_push_char(buf, ' ');
+		}
+		bench_buffer_push_str(buf, ops[op].op);
+		bench_buffer_push_char(buf, '\n');
+	}
+}
+
+// A content stream drawing inline images between a few operators: half of
+// them uncompressed, their length known from the dimensions, the others
+// "compressed" (random bytes) so that their 'EI' has to be searched.
+void bench_generate_content_inline_images(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	while(buf->length < size)
+	{
+		uint32_t width = bench_random_range(rng, 8, 128);
+		uint32_t height = bench_random_range(rng, 8, 128);
+		bool is_compressed = bench_random_range(rng, 0, 1) == 1;
+		size_t length = is_compressed ? bench_random_range(rng, 64, width*height) : (size_t)width*height*3;
+		char tmp[128];
+		snprintf(tmp, sizeof(tmp), "q %u 0 0 %u 72 72 cm\nBI /W %u /H %u /BPC 8 /CS /RGB%s ID\n",
+				 width, height, width, height, is_compressed ? " /F /DCT" : "");
+		bench_buffer_push_str(buf, tmp);
+		for(size_t i = 0; i < length; ++i)
+		{
+			// No 'I' so that the data never contains an 'EI'
+			char c = (char)bench_random_range(rng, 0, 255);
+			bench_buffer_push_char(buf, c == 'I' ? 'i' : c);
+		}
+		bench_buffer_push_str(buf, "\nEI Q\n");
+	}
+}
+
+// Text strings as found in /Info or outlines: hex strings in UTF-16BE
+// (FE FF first), mostly ASCII with some accents, CJK and surrogate pairs.
+void bench_generate_text_strings_utf16(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	while(buf->length < size)
+	{
+		uint32_t count = bench_random_range(rng, 8, 256);
+		bench_buffer_push_str(buf, "<FEFF");
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			char tmp[16];
+			uint32_t kind = bench_random_range(rng, 0, 19);
+			if(kind < 16) snprintf(tmp, sizeof(tmp), "%04X", bench_random_range(rng, ' ', '~'));
+			else if(kind < 18) snprintf(tmp, sizeof(tmp), "%04X", bench_random_range(rng, 0xC0, 0xFF));
+			else if(kind < 19) snprintf(tmp, sizeof(tmp), "%04X", bench_random_range(rng, 0x4E00, 0x9FFF));
+			else snprintf(tmp, sizeof(tmp), "D83D%04X", bench_random_range(rng, 0xDE00, 0xDE4F));
+			bench_buffer_push_str(buf, tmp);
+		}
+		bench_buffer_push_str(buf, ">\n");
+	}
+}
+
+// Text strings in PDFDocEncoding: printable ASCII with some accented
+// letters and typographic quotes given as octal escapes.
+void bench_generate_text_strings_pdfdoc(BenchBuffer* buf, BenchRandom* rng, size_t size)
+{
+	while(buf->length < size)
+	{
+		uint32_t count = bench_random_range(rng, 8, 256);
+		bench_buffer_push_char(buf, '(');
+		for(uint32_t i = 0; i < count; ++i)
+		{
+			if(bench_random_range(rng, 0, 15) == 0)
+			{
+				char tmp[8];
+				snprintf(tmp, sizeof(tmp), "\\%03o", bench_random_range(rng, 0x80, 0xFF));
+				bench_buffer_push_str(buf, tmp);
+				continue;
+			}
+			char c = (char)bench_random_range(rng, ' ', '~');
+			if(c == '(' || c == ')' || c == '\\') c = ' ';
+			bench_buffer_push_char(buf, c);
+		}
+		bench_buffer_push_str(buf, ")\n");
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Harness
+// ----------------------------------------------------------------------------
+
+typedef struct {
+	const uint8_t* buffer;
+	size_t buffer_len;
+	PdfToken* tokens;	// Only used by the number case
+	size_t tokens_count;
+	PdfObject* strings;	// Only used by the text string cases
+	size_t strings_count;
+} BenchInput;
+
+size_t bench_count_objects(PdfObject* obj)
+{
+	size_t count = 1;
+	if(obj->type == PDF_OBJECT_TYPE_ARRAY)
+	{
+		for(size_t i = 0; i < obj->array_value.length; ++i)
+			count += bench_count_objects(&obj->array_value.start[i]);
+	}
+	else if(obj->type == PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		for(size_t i = 0; i < obj->dictionary_value.slots_counts; ++i)
+		{
+			PdfDictionaryBucket* bucket = &obj->dictionary_value.buckets[i];
+			if(!bucket->is_used) continue;
+			for(; bucket != NULL; bucket = bucket->next_bucket)
+				count += 1 + bench_count_objects(&bucket->object); // + 1 for the key
+		}
+	}
+	return count;
+}
+
+typedef bool (*BenchParseFunction)(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+								   PdfObject* inout_obj);
+
+// Calls 'parse' on every object of the input, one after the other.
+// Returns the number of objects parsed (recursively if 'count_children').
+size_t bench_run_sequence(BenchParseFunction parse, BenchInput* input, bool count_children)
+{
+	size_t objects = 0;
+	size_t pos = 0;
+	while(true)
+	{
+		pdf_byte_is_white_space(input->buffer, &pos);
+		if(pos >= input->buffer_len) break;
+
+		PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+		if(!parse(input->buffer, &pos, input->buffer_len, &obj))
+		{
+			printf("ERROR: Parsing failed at byte %zu\n", pos);
+			exit(1);
+		}
+		objects += count_children ? bench_count_objects(&obj) : 1;
+		pdf_object_free(&obj);
+	}
+	return objects;
+}
+
+size_t bench_run_literal_string(BenchInput* input, bool count)
+{
+	return bench_run_sequence(pdf_parse_literal_string, input, count);
+}
+
+size_t bench_run_hexadecimal_string(BenchInput* input, bool count)
+{
+	return bench_run_sequence(pdf_parse_hexadecimal_string, input, count);
+}
+
+size_t bench_run_name(BenchInput* input, bool count)
+{
+	return bench_run_sequence(pdf_parse_name, input, count);
+}
+
+size_t bench_run_array(BenchInput* input, bool count)
+{
+	return bench_run_sequence(pdf_parse_array, input, count);
+}
+
+size_t bench_run_dictionary(BenchInput* input, bool count)
+{
+	return bench_run_sequence(pdf_parse_dictionary, input, count);
+}
+
+size_t bench_run_number(BenchInput* input, bool count)
+{
+	(void)count;
+	size_t objects = 0;
+	for(size_t i = 0; i < input->tokens_count; ++i)
+	{
+		PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+		if(pdf_try_to_consume_number(input->buffer, input->tokens[i], &obj))
+			++objects;
+	}
+	return objects;
+}
+
+size_t bench_run_content_operators(BenchInput* input, bool count)
+{
+	(void)count;
+	size_t objects = 0;
+	size_t pos = 0;
+	PdfContentOperator op = {0};
+	while(pdf_content_next_operator(input->buffer, &pos, input->buffer_len, &op)) ++objects;
+	pdf_content_operator_free(&op);
+	return objects;
+}
+
+size_t bench_run_text_string(BenchInput* input, bool count)
+{
+	(void)count;
+	for(size_t i = 0; i < input->strings_count; ++i)
+	{
+		PdfString text;
+		if(!pdf_string_decode_text(&input->strings[i].string_value, &text))
+		{
+			printf("ERROR: Not enough memory...\n");
+			exit(1);
+		}
+		pdf_free(text.start);
+	}
+	return input->strings_count;
+}
+
+typedef enum {
+	BENCH_GENERATOR_LITERAL_ESCAPED,
+	BENCH_GENERATOR_LITERAL_PLAIN,
+	BENCH_GENERATOR_HEX_STRINGS,
+	BENCH_GENERATOR_NAMES,
+	BENCH_GENERATOR_FLAT_ARRAY,
+	BENCH_GENERATOR_NESTED_DICTIONARY,
+	BENCH_GENERATOR_NAMES_DICTIONARY,
+	BENCH_GENERATOR_CONTENT_STREAM,
+	BENCH_GENERATOR_TEXT_UTF16,
+	BENCH_GENERATOR_TEXT_PDFDOC,
+	BENCH_GENERATOR_CONTENT_INLINE_IMAGES,
+} BenchGenerator;
+
+typedef struct {
+	const char* name;
+	const char* entry_point;
+	BenchGenerator generator;
+	size_t (*run)(BenchInput* input, bool count);
+} BenchCase;
+
+static const BenchCase bench_cases[] = {
+	{"literal_string_escaped", "pdf_parse_literal_string", BENCH_GENERATOR_LITERAL_ESCAPED, bench_run_literal_string},
+	{"literal_string_plain", "pdf_parse_literal_string", BENCH_GENERATOR_LITERAL_PLAIN, bench_run_literal_string},
+	{"hex_string", "pdf_parse_hexadecimal_string", BENCH_GENERATOR_HEX_STRINGS, bench_run_hexadecimal_string},
+	{"names", "pdf_parse_name", BENCH_GENERATOR_NAMES, bench_run_name},
+	{"flat_array", "pdf_parse_array", BENCH_GENERATOR_FLAT_ARRAY, bench_run_array},
+	{"nested_dictionary", "pdf_parse_dictionary", BENCH_GENERATOR_NESTED_DICTIONARY, bench_run_dictionary},
+	{"names_dictionary", "pdf_parse_dictionary", BENCH_GENERATOR_NAMES_DICTIONARY, bench_run_dictionary},
+	{"content_stream_numbers", "pdf_try_to_consume_number", BENCH_GENERATOR_CONTENT_STREAM, bench_run_number},
+	{"text_string_utf16", "pdf_string_decode_text", BENCH_GENERATOR_TEXT_UTF16, bench_run_text_string},
+	{"text_string_pdfdoc", "pdf_string_decode_text", BENCH_GENERATOR_TEXT_PDFDOC, bench_run_text_string},
+	{"content_inline_images", "pdf_content_next_operator", BENCH_GENERATOR_CONTENT_INLINE_IMAGES, bench_run_content_operators},
+};
+#define BENCH_CASES_COUNT (sizeof(bench_cases)/sizeof(bench_cases[0]))
+
+typedef struct {
+	const char* format;
+	const char* only_case;
+	const char* dump_dir;
+	size_t size;
+	size_t iterations;
+	size_t depth;
+	uint64_t seed;
+} BenchOptions;
+
+typedef struct {
+	const BenchCase* bench_case;
+	size_t bytes;
+	size_t objects;
+	size_t iterations;
+	double seconds;
+	double best_seconds;
+} BenchResult;
+
+void bench_generate(const BenchCase* bench_case, BenchOptions* options, BenchBuffer* buf)
+{
+	// NOTE(Sam): Every case restarts from the same seed so that
+	//            running a single case produces the exact same input.
+	BenchRandom rng = {options->seed ? options->seed : 1};
+	switch(bench_case->generator)
+	{
+	case BENCH_GENERATOR_LITERAL_ESCAPED:   bench_generate_literal_strings_escaped(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_LITERAL_PLAIN:     bench_generate_literal_strings_plain(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_HEX_STRINGS:       bench_generate_hex_strings(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_NAMES:             bench_generate_names(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_FLAT_ARRAY:        bench_generate_flat_array(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_NESTED_DICTIONARY: bench_generate_nested_dictionary(buf, &rng, options->size, options->depth); break;
+	case BENCH_GENERATOR_NAMES_DICTIONARY:  bench_generate_names_dictionary(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_CONTENT_STREAM:    bench_generate_content_stream(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_TEXT_UTF16:        bench_generate_text_strings_utf16(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_TEXT_PDFDOC:       bench_generate_text_strings_pdfdoc(buf, &rng, options->size); break;
+	case BENCH_GENERATOR_CONTENT_INLINE_IMAGES: bench_generate_content_inline_images(buf, &rng, options->size); break;
+	}
+}
+
+// Content streams are not objects, we split them on white spaces once
+// so that only 'pdf_try_to_consume_number' is measured.
+size_t bench_tokenize(const uint8_t* buffer, size_t buffer_len, PdfToken** out_tokens)
+{
+	size_t capacity = 1024, count = 0;
+	PdfToken* tokens = (PdfToken*)malloc(capacity*sizeof(PdfToken));
+	size_t pos = 0;
+	while(tokens != NULL)
+	{
+		pdf_byte_is_white_space(buffer, &pos);
+		if(pos >= buffer_len) break;
+		PdfToken token = {0};
+		token.pos_start = pos;
+		while(pos < buffer_len)
+		{
+			size_t np = pos;
+			if(pdf_byte_is_white_space(buffer, &np)) break;
+			++pos;
+		}
+		token.pos_end = pos;
+		if(count == capacity)
+		{
+			capacity *= 2;
+			tokens = (PdfToken*)realloc(tokens, capacity*sizeof(PdfToken));
+			if(tokens == NULL) break;
+		}
+		tokens[count++] = token;
+	}
+	if(tokens == NULL)
+	{
+		printf("ERROR: Not enough memory...\n");
+		exit(1);
+	}
+	*out_tokens = tokens;
+	return count;
+}
+
+// Text strings are parsed once so that only the decoding is measured,
+// the returned size is the one of their bytes.
+size_t bench_parse_strings(const uint8_t* buffer, size_t buffer_len, PdfObject** out_strings, size_t* out_count)
+{
+	size_t capacity = 1024, count = 0, bytes = 0;
+	PdfObject* strings = (PdfObject*)malloc(capacity*sizeof(PdfObject));
+	size_t pos = 0;
+	while(strings != NULL)
+	{
+		pdf_byte_is_white_space(buffer, &pos);
+		if(pos >= buffer_len) break;
+		PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+		if(!pdf_parse_object(buffer, &pos, buffer_len, &obj) || obj.type != PDF_OBJECT_TYPE_STRING)
+		{
+			printf("ERROR: Parsing failed at byte %zu\n", pos);
+			exit(1);
+		}
+		if(count == capacity)
+		{
+			capacity *= 2;
+			strings = (PdfObject*)realloc(strings, capacity*sizeof(PdfObject));
+			if(strings == NULL) break;
+		}
+		bytes += obj.string_value.length;
+		strings[count++] = obj;
+	}
+	if(strings == NULL)
+	{
+		printf("ERROR: Not enough memory...\n");
+		exit(1);
+	}
+	*out_strings = strings;
+	*out_count = count;
+	return bytes;
+}
+
+void bench_dump(const BenchCase* bench_case, BenchOptions* options, BenchBuffer* buf)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%s.txt", options->dump_dir, bench_case->name);
+	#pragma warning (disable : 4996)
+	FILE* file = fopen(path, "wb");
+	if(file == NULL)
+	{
+		printf("ERROR: Could not open file '%s'\n", path);
+		exit(1);
+	}
+	fwrite(buf->data, 1, buf->length, file);
+	fclose(file);
+}
+
+BenchResult bench_run_case(const BenchCase* bench_case, BenchOptions* options)
+{
+	BenchBuffer buf = {0};
+	bench_generate(bench_case, options, &buf);
+	if(options->dump_dir) bench_dump(bench_case, options, &buf);
+
+	BenchInput input = {0};
+	input.buffer = buf.data;
+	input.buffer_len = buf.length;
+	if(bench_case->generator == BENCH_GENERATOR_CONTENT_STREAM)
+		input.tokens_count = bench_tokenize(buf.data, buf.length, &input.tokens);
+
+	BenchResult result = {0};
+	result.bench_case = bench_case;
+	result.bytes = buf.length;
+	if(bench_case->generator == BENCH_GENERATOR_TEXT_UTF16 || bench_case->generator == BENCH_GENERATOR_TEXT_PDFDOC)
+		result.bytes = bench_parse_strings(buf.data, buf.length, &input.strings, &input.strings_count);
+	result.iterations = options->iterations;
+
+	// Warm up and count objects, the count is not part of the measure
+	result.objects = bench_case->run(&input, true);
+
+	for(size_t i = 0; i < options->iterations; ++i)
+	{
+		double start = pdf_time_seconds();
+		bench_case->run(&input, false);
+		double elapsed = pdf_time_seconds() - start;
+		result.seconds += elapsed;
+		if(i == 0 || elapsed < result.best_seconds) result.best_seconds = elapsed;
+	}
+
+	free(input.tokens);
+	for(size_t i = 0; i < input.strings_count; ++i) pdf_object_free(&input.strings[i]);
+	free(input.strings);
+	free(buf.data);
+	return result;
+}
+
+double bench_mb_per_s(BenchResult* result)
+{
+	if(result->seconds <= 0.0) return 0.0;
+	return (double)result->bytes*(double)result->iterations / result->seconds / 1e6;
+}
+
+double bench_objects_per_s(BenchResult* result)
+{
+	if(result->seconds <= 0.0) return 0.0;
+	return (double)result->objects*(double)result->iterations / result->seconds;
+}
+
+void bench_print_results(BenchOptions* options, BenchResult* results, size_t count)
+{
+	if(strcmp(options->format, "json") == 0)
+	{
+		printf("{\n  \"seed\": %llu,\n  \"size\": %zu,\n  \"iterations\": %zu,\n  \"depth\": %zu,\n  \"results\": [\n",
+			   (unsigned long long)options->seed, options->size, options->iterations, options->depth);
+		for(size_t i = 0; i < count; ++i)
+		{
+			BenchResult* r = &results[i];
+			printf("    {\"case\": \"%s\", \"entry_point\": \"%s\", \"bytes\": %zu, \"objects\": %zu, "
+				   "\"iterations\": %zu, \"seconds\": %.6f, \"best_seconds\": %.6f, "
+				   "\"mb_per_s\": %.3f, \"objects_per_s\": %.1f}%s\n",
+				   r->bench_case->name, r->bench_case->entry_point, r->bytes, r->objects,
+				   r->iterations, r->seconds, r->best_seconds,
+				   bench_mb_per_s(r), bench_objects_per_s(r), i + 1 < count ? "," : "");
+		}
+		printf("  ]\n}\n");
+	}
+	else if(strcmp(options->format, "csv") == 0)
+	{
+		printf("case,entry_point,bytes,objects,iterations,seconds,best_seconds,mb_per_s,objects_per_s\n");
+		for(size_t i = 0; i < count; ++i)
+		{
+			BenchResult* r = &results[i];
+			printf("%s,%s,%zu,%zu,%zu,%.6f,%.6f,%.3f,%.1f\n",
+				   r->bench_case->name, r->bench_case->entry_point, r->bytes, r->objects,
+				   r->iterations, r->seconds, r->best_seconds,
+				   bench_mb_per_s(r), bench_objects_per_s(r));
+		}
+	}
+	else
+	{
+		printf("%-24s %-30s %12s %12s %10s %14s\n", "case", "entry point", "bytes", "objects", "MB/s", "objects/s");
+		for(size_t i = 0; i < count; ++i)
+		{
+			BenchResult* r = &results[i];
+			printf("%-24s %-30s %12zu %12zu %10.1f %14.0f\n",
+				   r->bench_case->name, r->bench_case->entry_point, r->bytes, r->objects,
+				   bench_mb_per_s(r), bench_objects_per_s(r));
+		}
+	}
+}
+
+void bench_usage(void)
+{
+	printf("Usage: bench [--size BYTES] [--iterations N] [--seed N] [--depth N]\n"
+		   "             [--case NAME] [--format text|json|csv] [--dump DIR]\n"
+		   "Cases:\n");
+	for(size_t i = 0; i < BENCH_CASES_COUNT; ++i)
+		printf("  %-24s %s\n", bench_cases[i].name, bench_cases[i].entry_point);
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options = {0};
+	options.format = "text";
+	options.size = 1 << 20;
+	options.iterations = 5;
+	options.depth = 64;
+	options.seed = 0x5EED;
+
+	for(int i = 1; i < argc; ++i)
+	{
+		bool has_value = i + 1 < argc;
+		if(strcmp(argv[i], "--size") == 0 && has_value)              options.size = strtoull(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "--iterations") == 0 && has_value)   options.iterations = strtoull(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "--seed") == 0 && has_value)         options.seed = strtoull(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "--depth") == 0 && has_value)        options.depth = strtoull(argv[++i], NULL, 10);
+		else if(strcmp(argv[i], "--case") == 0 && has_value)         options.only_case = argv[++i];
+		else if(strcmp(argv[i], "--format") == 0 && has_value)       options.format = argv[++i];
+		else if(strcmp(argv[i], "--dump") == 0 && has_value)         options.dump_dir = argv[++i];
+		else
+		{
+			bench_usage();
+			return 1;
+		}
+	}
+	if(options.iterations == 0) options.iterations = 1;
+	if(options.depth == 0) options.depth = 1;
+
+	BenchResult results[BENCH_CASES_COUNT];
+	size_t results_count = 0;
+	for(size_t i = 0; i < BENCH_CASES_COUNT; ++i)
+	{
+		if(options.only_case && strcmp(options.only_case, bench_cases[i].name) != 0) continue;
+		results[results_count++] = bench_run_case(&bench_cases[i], &options);
+	}
+	if(results_count == 0)
+	{
+		bench_usage();
+		return 1;
+	}
+
+	bench_print_results(&options, results, results_count);
+	return 0;
+}
@@ -1,8 +1,17 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // copy_file_range, implies the POSIX functions below
+#endif
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
 
 #include "pdf.h"
 
@@ -27,6 +36,343 @@
 
 #include <assert.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <intrin.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PDF_USE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PDF_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AES-NI is always compiled in on x86-64 but only used when the CPU has it
+#if defined(__x86_64__) || defined(_M_X64)
+#define PDF_USE_AES_NI 1
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#define PDF_TARGET_AES
+#else
+#include <cpuid.h>
+#define PDF_TARGET_AES __attribute__((target("aes,sse2")))
+#endif
+#endif
+
+#ifdef _MSC_VER
+#define PDF_THREAD_LOCAL __declspec(thread)
+#else
+#define PDF_THREAD_LOCAL _Thread_local
+#endif
+
+// Index of the lowest bit set, 'value' must not be 0
+uint32_t pdf_count_trailing_zeros(uint32_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, value);
+	return (uint32_t)index;
+#else
+	return (uint32_t)__builtin_ctz(value);
+#endif
+}
+
+// Pointers shared between threads, used to publish data built lazily:
+// the first thread to store its pointer wins, the others free theirs.
+void* pdf_atomic_load_pointer(void* volatile* target)
+{
+#ifdef _MSC_VER
+	return InterlockedCompareExchangePointer(target, NULL, NULL);
+#else
+	return __atomic_load_n(target, __ATOMIC_ACQUIRE);
+#endif
+}
+
+bool pdf_atomic_compare_exchange_pointer(void* volatile* target, void* expected, void* desired)
+{
+#ifdef _MSC_VER
+	return InterlockedCompareExchangePointer(target, desired, expected) == expected;
+#else
+	return __atomic_compare_exchange_n(target, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Adds 'value' to a counter shared between threads, returns the new value
+int64_t pdf_atomic_add(volatile int64_t* target, int64_t value)
+{
+#ifdef _MSC_VER
+	return InterlockedExchangeAdd64(target, value) + value;
+#else
+	return __atomic_add_fetch(target, value, __ATOMIC_RELAXED);
+#endif
+}
+
+// Index of the highest bit set, 'value' must not be 0
+uint32_t pdf_highest_bit(uint64_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	if(_BitScanReverse(&index, (unsigned long)(value >> 32))) return (uint32_t)index + 32;
+	_BitScanReverse(&index, (unsigned long)value);
+	return (uint32_t)index;
+#else
+	return 63 - (uint32_t)__builtin_clzll(value);
+#endif
+}
+
+size_t pdf_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (size_t)info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (size_t)count : 1;
+#endif
+}
+
+bool pdf_cpu_has_aes(void)
+{
+#if defined(PDF_USE_AES_NI) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 25)) != 0;
+#elif defined(PDF_USE_AES_NI)
+	unsigned int eax, ebx, ecx, edx;
+	return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES) != 0;
+#else
+	return false;
+#endif
+}
+
+typedef void (*PdfThreadProc)(void* data);
+
+typedef struct {
+	PdfThreadProc proc;
+	void* data;
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+} PdfThread;
+
+#ifdef _WIN32
+static DWORD WINAPI pdf_thread_trampoline(LPVOID param)
+{
+	PdfThread* thread = (PdfThread*)param;
+	thread->proc(thread->data);
+	return 0;
+}
+#else
+static void* pdf_thread_trampoline(void* param)
+{
+	PdfThread* thread = (PdfThread*)param;
+	thread->proc(thread->data);
+	return NULL;
+}
+#endif
+
+// NOTE(Sam): 'thread' must stay at the same address until joined
+bool pdf_thread_start(PdfThread* thread, PdfThreadProc proc, void* data)
+{
+	thread->proc = proc;
+	thread->data = data;
+#ifdef _WIN32
+	thread->handle = CreateThread(NULL, 0, pdf_thread_trampoline, thread, 0, NULL);
+	return thread->handle != NULL;
+#else
+	return pthread_create(&thread->handle, NULL, pdf_thread_trampoline, thread) == 0;
+#endif
+}
+
+void pdf_thread_join(PdfThread* thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+#else
+	pthread_join(thread->handle, NULL);
+#endif
+}
+
+// Monotonic time in seconds, only meaningful as a difference
+double pdf_time_seconds(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+#endif
+}
+
+typedef struct {
+#ifdef _WIN32
+	CRITICAL_SECTION handle;
+#else
+	pthread_mutex_t handle;
+#endif
+} PdfMutex;
+
+void pdf_mutex_init(PdfMutex* mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(&mutex->handle);
+#else
+	pthread_mutex_init(&mutex->handle, NULL);
+#endif
+}
+
+void pdf_mutex_destroy(PdfMutex* mutex)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(&mutex->handle);
+#else
+	pthread_mutex_destroy(&mutex->handle);
+#endif
+}
+
+void pdf_mutex_lock(PdfMutex* mutex)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&mutex->handle);
+#else
+	pthread_mutex_lock(&mutex->handle);
+#endif
+}
+
+void pdf_mutex_unlock(PdfMutex* mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&mutex->handle);
+#else
+	pthread_mutex_unlock(&mutex->handle);
+#endif
+}
+
+// Peak resident memory of the process in bytes, 0 if unknown
+uint64_t pdf_peak_memory_usage(void)
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return (uint64_t)counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return (uint64_t)usage.ru_maxrss; // Already in bytes
+#else
+	return (uint64_t)usage.ru_maxrss*1024;
+#endif
+#endif
+}
+
+// 64-bit hash of 'length' bytes (XXH64), fast but not cryptographic
+#define PDF_HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define PDF_HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PDF_HASH_PRIME3 0x165667B19E3779F9ULL
+#define PDF_HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define PDF_HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t pdf_hash_rotate(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t pdf_hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input*PDF_HASH_PRIME2;
+	return pdf_hash_rotate(acc, 31)*PDF_HASH_PRIME1;
+}
+
+static uint64_t pdf_hash_merge(uint64_t acc, uint64_t value)
+{
+	acc ^= pdf_hash_round(0, value);
+	return acc*PDF_HASH_PRIME1 + PDF_HASH_PRIME4;
+}
+
+uint64_t pdf_hash_bytes(const void* data, size_t length, uint64_t seed)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	const uint8_t* end = bytes + length;
+	uint64_t hash, word;
+	if(length >= 32)
+	{
+		uint64_t lanes[4] = {seed + PDF_HASH_PRIME1 + PDF_HASH_PRIME2, seed + PDF_HASH_PRIME2, seed,
+							 seed - PDF_HASH_PRIME1};
+		for(; end - bytes >= 32; bytes += 32)
+		{
+			for(int i = 0; i < 4; ++i)
+			{
+				memcpy(&word, bytes + 8*i, 8);
+				lanes[i] = pdf_hash_round(lanes[i], word);
+			}
+		}
+		hash = pdf_hash_rotate(lanes[0], 1) + pdf_hash_rotate(lanes[1], 7)
+			+ pdf_hash_rotate(lanes[2], 12) + pdf_hash_rotate(lanes[3], 18);
+		for(int i = 0; i < 4; ++i) hash = pdf_hash_merge(hash, lanes[i]);
+	}
+	else hash = seed + PDF_HASH_PRIME5;
+
+	hash += (uint64_t)length;
+	for(; end - bytes >= 8; bytes += 8)
+	{
+		memcpy(&word, bytes, 8);
+		hash ^= pdf_hash_round(0, word);
+		hash = pdf_hash_rotate(hash, 27)*PDF_HASH_PRIME1 + PDF_HASH_PRIME4;
+	}
+	if(end - bytes >= 4)
+	{
+		uint32_t half;
+		memcpy(&half, bytes, 4);
+		hash ^= (uint64_t)half*PDF_HASH_PRIME1;
+		hash = pdf_hash_rotate(hash, 23)*PDF_HASH_PRIME2 + PDF_HASH_PRIME3;
+		bytes += 4;
+	}
+	for(; bytes < end; ++bytes)
+	{
+		hash ^= (uint64_t)*bytes*PDF_HASH_PRIME5;
+		hash = pdf_hash_rotate(hash, 11)*PDF_HASH_PRIME1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= PDF_HASH_PRIME2;
+	hash ^= hash >> 29;
+	hash *= PDF_HASH_PRIME3;
+	hash ^= hash >> 32;
+	return hash;
+}
+
 enum PDF_BYTE_TYPES_WHITE_SPACE {
 	PDF_BYTE_TYPE_WHITE_SPACE_NULL			  = 0x00,
 	PDF_BYTE_TYPE_WHITE_SPACE_HORIZONTAL_TAB  = 0x09,
@@ -154,6 +500,54 @@ bool pdf_byte_is_comment(const uint8_t* buffer, size_t* inout_pos)
 	return false;
 }
 
+// Single byte versions of the tests above, they never look at
+// the following bytes so they are safe at the end of a buffer.
+bool pdf_char_is_white_space(uint8_t c)
+{
+	switch(c) {
+	case PDF_BYTE_TYPE_WHITE_SPACE_NULL:
+	case PDF_BYTE_TYPE_WHITE_SPACE_HORIZONTAL_TAB:
+	case PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED:
+	case PDF_BYTE_TYPE_WHITE_SPACE_FORM_FEED:
+	case PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN:
+	case PDF_BYTE_TYPE_WHITE_SPACE_SPACE:
+		return true;
+	};
+	return false;
+}
+
+bool pdf_char_is_delimiter(uint8_t c)
+{
+	size_t pos = 0;
+	return pdf_byte_is_delimiter(&c, &pos);
+}
+
+bool pdf_char_is_regular(uint8_t c)
+{
+	return !pdf_char_is_white_space(c) && !pdf_char_is_delimiter(c);
+}
+
+// Skip any white spaces and comments, never going further than 'buffer_len'
+void pdf_skip_white_spaces_and_comments(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len)
+{
+	size_t pos = *inout_pos;
+	while(pos < buffer_len)
+	{
+		if(pdf_char_is_white_space(buffer[pos]))
+		{
+			++pos;
+		}
+		else if(buffer[pos] == PDF_BYTE_TYPE_DELIMITER_PERCENT_SIGN)
+		{
+			while(pos < buffer_len
+				  && buffer[pos] != PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED
+				  && buffer[pos] != PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN) ++pos;
+		}
+		else break;
+	}
+	*inout_pos = pos;
+}
+
 enum PDF_OBJECT_TYPES {
 	// The special NONE keyword is not a keyword but is used as
 	// a falsy return value.
@@ -168,6 +562,10 @@ enum PDF_OBJECT_TYPES {
 	PDF_OBJECT_TYPE_ARRAY,
 	PDF_OBJECT_TYPE_DICTIONARY,
 	PDF_OBJECT_TYPE_STREAM,
+	// Indirect reference 'N G R' to an object of the document
+	PDF_OBJECT_TYPE_REFERENCE,
+	// Number of types, not a type
+	PDF_OBJECT_TYPE_COUNT,
 };
 
 enum PDF_KEYWORDS {
@@ -219,9 +617,27 @@ typedef struct {
 
 typedef struct {
 	PdfDictionaryBucket* buckets;
-	size_t slots_counts;
+	uint32_t slots_counts;
+	// Bit i is set once a slot of the i-th 32th of 'buckets' is used, so
+	// iterations jump over the empty parts of the table
+	uint32_t used_ranges;
 } PdfDictionary;
 
+#define PDF_DICTIONARY_RANGES 32
+
+typedef struct {
+	PdfDictionary dictionary;
+	// NOTE(Sam): The raw (still encoded) bytes, they point into the
+	//            document buffer and are not owned by the object.
+	const uint8_t* data;
+	size_t length;
+} PdfStream;
+
+typedef struct {
+	uint32_t number;
+	uint32_t generation;
+} PdfReference;
+
 typedef struct PdfObject {
 	int type;
 	union {
@@ -232,6 +648,8 @@ typedef struct PdfObject {
 		PdfName name_value;
 		PdfArray array_value;
 		PdfDictionary dictionary_value;
+		PdfStream stream_value;
+		PdfReference reference_value;
 	};
 } PdfObject;
 
@@ -242,117 +660,903 @@ typedef struct PdfDictionaryBucket {
 	bool is_used;
 } PdfDictionaryBucket;
 
+/*
+  INSTRUMENTATION:
+  Compile with PDF_ENABLE_STATS defined to collect counters about what the
+  parser is doing (bytes scanned, objects per type, allocations, dictionary
+  collisions, nesting depth and time spent per parser function).
+  Without it every PDF_STATS_* macro expands to nothing and neither the
+  counters nor the pdf_stats_* functions exist, but pdf_stats_enabled.
+
+  Stats are per thread: read them with 'pdf_stats_get', combine the ones
+  from several threads with 'pdf_stats_merge'. Opening a document resets
+  those of the calling thread and closing it hands them to the close hook
+  (pdf_stats_set_close_hook), which writes them as JSON to stderr unless
+  replaced. Worker threads count in their own stats and give them back to
+  the thread which started them once joined (PDF_STATS_WORKER_DONE and
+  PDF_STATS_WORKER_JOINED), so the counters of a document include the
+  work done on it in parallel.
+ */
+
+static const char* pdf_stats_object_type_names[PDF_OBJECT_TYPE_COUNT] = {
+	"none", "null", "boolean", "integer", "real", "string", "name", "array", "dictionary", "stream", "reference",
+};
 
-void pdf_dictionary_reserve(PdfDictionary *dictionary, size_t slots_counts)
+bool pdf_stats_enabled(void)
 {
-	dictionary->buckets = (PdfDictionaryBucket*)malloc(slots_counts*sizeof(PdfDictionaryBucket));
-	if(dictionary->buckets == NULL)
-	{
-		PDF_ASSERT(false && "TODO: Handle memory errors...");
-	}
-	memset(dictionary->buckets, 0, slots_counts*sizeof(PdfDictionaryBucket));
-	dictionary->slots_counts = slots_counts;
+#ifdef PDF_ENABLE_STATS
+	return true;
+#else
+	return false;
+#endif
 }
 
-void pdf_dictionary_insert(PdfDictionary *dictionary, PdfName key, PdfObject value)
+#ifdef PDF_ENABLE_STATS
+
+enum PDF_STATS_TIMERS {
+	PDF_STATS_TIMER_PARSE_OBJECT,
+	PDF_STATS_TIMER_PARSE_LITERAL_STRING,
+	PDF_STATS_TIMER_PARSE_HEXADECIMAL_STRING,
+	PDF_STATS_TIMER_PARSE_NAME,
+	PDF_STATS_TIMER_PARSE_ARRAY,
+	PDF_STATS_TIMER_PARSE_DICTIONARY,
+	PDF_STATS_TIMER_CONSUME_NUMBER,
+	// Number of timers, not a timer
+	PDF_STATS_TIMER_COUNT,
+};
+
+typedef struct {
+	uint64_t bytes_scanned;
+	uint64_t objects_by_type[PDF_OBJECT_TYPE_COUNT];
+
+	uint64_t allocations;
+	uint64_t bytes_allocated;
+	uint64_t frees;
+
+	uint64_t dictionary_inserts;
+	uint64_t dictionary_collisions; // Inserts in an already used slot
+	uint64_t dictionary_chain_steps; // Buckets visited by inserts and lookups
+	uint64_t dictionary_max_chain_length;
+
+	uint64_t max_nesting_depth;
+
+	// NOTE(Sam): Times are inclusive, parsing an array also counts
+	//            in the time of the objects it contains.
+	uint64_t calls[PDF_STATS_TIMER_COUNT];
+	double seconds[PDF_STATS_TIMER_COUNT];
+
+	// Internal state, not merged
+	uint64_t nesting_depth;
+	uint64_t timed_calls_depth;
+} PdfStats;
+
+static const char* pdf_stats_timer_names[PDF_STATS_TIMER_COUNT] = {
+	"pdf_parse_object",
+	"pdf_parse_literal_string",
+	"pdf_parse_hexadecimal_string",
+	"pdf_parse_name",
+	"pdf_parse_array",
+	"pdf_parse_dictionary",
+	"pdf_try_to_consume_number",
+};
+
+static PDF_THREAD_LOCAL PdfStats pdf_stats;
+
+#define PDF_STATS_OBJECT(type) (pdf_stats.objects_by_type[(type)] += 1)
+#define PDF_STATS_ALLOCATION(size) (pdf_stats.allocations += 1, pdf_stats.bytes_allocated += (size))
+#define PDF_STATS_FREE() (pdf_stats.frees += 1)
+#define PDF_STATS_DICTIONARY_INSERT(collision, chain_length) pdf_stats_dictionary_chain(true, (collision), (chain_length))
+#define PDF_STATS_DICTIONARY_LOOKUP(chain_length) pdf_stats_dictionary_chain(false, false, (chain_length))
+#define PDF_STATS_NESTING_ENTER()										\
+	do { if(++pdf_stats.nesting_depth > pdf_stats.max_nesting_depth)	\
+			pdf_stats.max_nesting_depth = pdf_stats.nesting_depth; } while(0)
+#define PDF_STATS_NESTING_EXIT() (pdf_stats.nesting_depth -= 1)
+// Only the outermost timed call adds its bytes, nested calls would
+// otherwise count the same bytes several times.
+#define PDF_STATS_TIMER_BEGIN(timer)						\
+	double pdf_stats_timer_start_ = pdf_time_seconds();	\
+	pdf_stats.timed_calls_depth += 1
+#define PDF_STATS_TIMER_END(timer, bytes)										\
+	do {																		\
+		pdf_stats.timed_calls_depth -= 1;										\
+		pdf_stats.calls[(timer)] += 1;											\
+		pdf_stats.seconds[(timer)] += pdf_time_seconds() - pdf_stats_timer_start_; \
+		if(pdf_stats.timed_calls_depth == 0) pdf_stats.bytes_scanned += (bytes); \
+	} while(0)
+
+void pdf_stats_dictionary_chain(bool is_insert, bool collision, uint64_t chain_length)
 {
-	PDF_ASSERT(dictionary->slots_counts > 0 && "Tries to insert in an empty dictionary");
-	size_t id = key.hash % dictionary->slots_counts;
-	PdfDictionaryBucket* bucket_list = &dictionary->buckets[id];
+	if(is_insert) pdf_stats.dictionary_inserts += 1;
+	if(collision) pdf_stats.dictionary_collisions += 1;
+	pdf_stats.dictionary_chain_steps += chain_length;
+	if(chain_length > pdf_stats.dictionary_max_chain_length)
+		pdf_stats.dictionary_max_chain_length = chain_length;
+}
 
-	if(!bucket_list->is_used)
+// Stats collected so far by the calling thread
+PdfStats pdf_stats_get(void)
+{
+	return pdf_stats;
+}
+
+void pdf_stats_reset(void)
+{
+	memset(&pdf_stats, 0, sizeof(pdf_stats));
+}
+
+void pdf_stats_merge(PdfStats* into, const PdfStats* from)
+{
+	into->bytes_scanned += from->bytes_scanned;
+	for(size_t i = 0; i < PDF_OBJECT_TYPE_COUNT; ++i)
+		into->objects_by_type[i] += from->objects_by_type[i];
+	into->allocations += from->allocations;
+	into->bytes_allocated += from->bytes_allocated;
+	into->frees += from->frees;
+	into->dictionary_inserts += from->dictionary_inserts;
+	into->dictionary_collisions += from->dictionary_collisions;
+	into->dictionary_chain_steps += from->dictionary_chain_steps;
+	if(from->dictionary_max_chain_length > into->dictionary_max_chain_length)
+		into->dictionary_max_chain_length = from->dictionary_max_chain_length;
+	if(from->max_nesting_depth > into->max_nesting_depth)
+		into->max_nesting_depth = from->max_nesting_depth;
+	for(size_t i = 0; i < PDF_STATS_TIMER_COUNT; ++i)
 	{
-		dictionary->buckets[id].is_used = true;
-		dictionary->buckets[id].key = key;
-		dictionary->buckets[id].object = value;
-		dictionary->buckets[id].next_bucket = NULL;
-		return;
+		into->calls[i] += from->calls[i];
+		into->seconds[i] += from->seconds[i];
 	}
-	
-	do
+}
+
+typedef void (*PdfStatsHook)(const char* filename, const PdfStats* stats, void* user);
+
+// Appends to 'out' (of 'capacity' bytes, 'length' used) what fits of the
+// formatted string
+static void pdf_stats_append(char* out, size_t capacity, size_t* length, const char* format, ...)
+{
+	if(*length >= capacity) return;
+	va_list args;
+	va_start(args, format);
+	int written = vsnprintf(out + *length, capacity - *length, format, args);
+	va_end(args);
+	if(written > 0) *length += (size_t)written < capacity - *length ? (size_t)written : capacity - *length - 1;
+}
+
+// Writes 'stats' as JSON, with the name of their document if 'filename'
+// is not NULL. The text is formatted first and written in one fwrite, so
+// that the dumps of documents closed by several threads don't mix.
+void pdf_stats_dump_document_json(FILE* file, const char* filename, const PdfStats* stats)
+{
+	char out[8192];
+	size_t length = 0;
+	size_t capacity = sizeof(out);
+	pdf_stats_append(out, capacity, &length, "{\n");
+	if(filename != NULL)
 	{
-		if(pdf_names_are_equals(key, bucket_list->key))
+		pdf_stats_append(out, capacity, &length, "  \"file\": \"");
+		for(const char* c = filename; *c != '\0'; ++c)
 		{
-			bucket_list->object = value;
-			return;
+			if(*c == '"' || *c == '\\') pdf_stats_append(out, capacity, &length, "\\%c", *c);
+			else if((uint8_t)*c < 0x20) pdf_stats_append(out, capacity, &length, "\\u%04x", (uint8_t)*c);
+			else pdf_stats_append(out, capacity, &length, "%c", *c);
 		}
-
-		// NOTE: we go to next bucket_list only if it is not the last 
-	} while(bucket_list->next_bucket != NULL && (bucket_list = bucket_list->next_bucket));
-	PdfDictionaryBucket* bucket = (PdfDictionaryBucket*)malloc(sizeof(PdfDictionaryBucket));
-	if(bucket == NULL)
+		pdf_stats_append(out, capacity, &length, "\",\n");
+	}
+	pdf_stats_append(out, capacity, &length, "  \"enabled\": %s,\n", pdf_stats_enabled() ? "true" : "false");
+	pdf_stats_append(out, capacity, &length, "  \"bytes_scanned\": %llu,\n", (unsigned long long)stats->bytes_scanned);
+	pdf_stats_append(out, capacity, &length, "  \"objects\": {");
+	for(size_t i = 1; i < PDF_OBJECT_TYPE_COUNT; ++i)
 	{
-		PDF_ASSERT(false && "TODO: Handle memory errors...");
+		pdf_stats_append(out, capacity, &length, "%s\"%s\": %llu", i > 1 ? ", " : "",
+						 pdf_stats_object_type_names[i], (unsigned long long)stats->objects_by_type[i]);
 	}
-	bucket->is_used = true;
-	bucket->key = key;
-	bucket->object = value;
-	bucket->next_bucket = NULL;
-	bucket_list->next_bucket = bucket;
-	return;
+	pdf_stats_append(out, capacity, &length, "},\n");
+	pdf_stats_append(out, capacity, &length, "  \"allocations\": %llu,\n  \"bytes_allocated\": %llu,\n  \"frees\": %llu,\n",
+					 (unsigned long long)stats->allocations, (unsigned long long)stats->bytes_allocated,
+					 (unsigned long long)stats->frees);
+	pdf_stats_append(out, capacity, &length,
+					 "  \"dictionary\": {\"inserts\": %llu, \"collisions\": %llu, \"chain_steps\": %llu, \"max_chain_length\": %llu},\n",
+					 (unsigned long long)stats->dictionary_inserts, (unsigned long long)stats->dictionary_collisions,
+					 (unsigned long long)stats->dictionary_chain_steps, (unsigned long long)stats->dictionary_max_chain_length);
+	pdf_stats_append(out, capacity, &length, "  \"max_nesting_depth\": %llu,\n", (unsigned long long)stats->max_nesting_depth);
+	pdf_stats_append(out, capacity, &length, "  \"functions\": {\n");
+	for(size_t i = 0; i < PDF_STATS_TIMER_COUNT; ++i)
+	{
+		pdf_stats_append(out, capacity, &length, "    \"%s\": {\"calls\": %llu, \"seconds\": %.6f}%s\n",
+						 pdf_stats_timer_names[i], (unsigned long long)stats->calls[i], stats->seconds[i],
+						 i + 1 < PDF_STATS_TIMER_COUNT ? "," : "");
+	}
+	pdf_stats_append(out, capacity, &length, "  }\n}\n");
+	fwrite(out, 1, length, file);
 }
 
-PdfObject pdf_dictionary_get(PdfDictionary* dictionary, PdfName key)
+void pdf_stats_dump_json(FILE* file, const PdfStats* stats)
 {
-	PdfObject object = {0};
-	object.type = PDF_OBJECT_TYPE_NONE;
+	pdf_stats_dump_document_json(file, NULL, stats);
+}
 
-	size_t id = key.hash % dictionary->slots_counts;
-	PdfDictionaryBucket* bucket_list = &dictionary->buckets[id];
+// The default close hook
+static void pdf_stats_dump_on_close(const char* filename, const PdfStats* stats, void* user)
+{
+	(void)user;
+	pdf_stats_dump_document_json(stderr, filename, stats);
+}
 
-	if(!bucket_list->is_used) return object;
+static PdfStatsHook pdf_stats_close_hook = pdf_stats_dump_on_close;
+static void* pdf_stats_close_hook_user;
 
-	do
-	{
-		if(pdf_names_are_equals(key, bucket_list->key))
-		{
-			object = bucket_list->object;
-			return object;
-		}
+// Replaces the function called with the stats of the calling thread when it
+// closes a document ('filename' is NULL for documents opened from memory).
+// NULL disables it. Not thread safe, set it before opening documents.
+void pdf_stats_set_close_hook(PdfStatsHook hook, void* user)
+{
+	pdf_stats_close_hook = hook;
+	pdf_stats_close_hook_user = user;
+}
 
-		// NOTE: we go to next bucket_list only if it is not the last 
-	} while(bucket_list->next_bucket != NULL && (bucket_list = bucket_list->next_bucket));
-	
-	return object;
+// Called when a document is opened and closed, see pdf_document_close
+void pdf_stats_document_opened(void)
+{
+	pdf_stats_reset();
 }
 
-bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj);
+void pdf_stats_document_closed(const char* filename)
+{
+	if(pdf_stats_close_hook != NULL) pdf_stats_close_hook(filename, &pdf_stats, pdf_stats_close_hook_user);
+}
+
+#define PDF_STATS_DOCUMENT_OPENED() pdf_stats_document_opened()
+#define PDF_STATS_DOCUMENT_CLOSED(filename) pdf_stats_document_closed(filename)
+// A worker copies its counters to 'stats' when done, the thread which
+// started it adds them to its own after joining it. Workers run by the
+// calling thread itself must not be added, they counted there already.
+#define PDF_STATS_WORKER_DONE(stats) (*(stats) = pdf_stats)
+#define PDF_STATS_WORKER_JOINED(stats) pdf_stats_merge(&pdf_stats, (stats))
+#else
+#define PDF_STATS_OBJECT(type) ((void)0)
+#define PDF_STATS_ALLOCATION(size)
+#define PDF_STATS_FREE()
+#define PDF_STATS_DICTIONARY_INSERT(collision, chain_length) ((void)(chain_length))
+#define PDF_STATS_DICTIONARY_LOOKUP(chain_length) ((void)(chain_length))
+#define PDF_STATS_NESTING_ENTER()
+#define PDF_STATS_NESTING_EXIT()
+#define PDF_STATS_TIMER_BEGIN(timer)
+#define PDF_STATS_TIMER_END(timer, bytes) ((void)(bytes))
+#define PDF_STATS_DOCUMENT_OPENED()
+#define PDF_STATS_DOCUMENT_CLOSED(filename)
+#define PDF_STATS_WORKER_DONE(stats)
+#define PDF_STATS_WORKER_JOINED(stats)
+#endif
+
+/*
+  ARENAS:
+  - A thread working on one document at a time can route its allocations
+    to an arena with pdf_arena_use: blocks are carved from large chunks
+    and everything is released at once by pdf_arena_reset once the
+    document is closed, instead of thousands of malloc/free pairs.
+  - Block sizes are rounded up to size classes (powers of two split in 4
+    steps, so at most 25% is lost) and freed blocks are reused for the
+    next allocation of their class.
+  - Big blocks (decoded streams, the xref) still go to the heap, they are
+    often resized and would waste the arena.
+  - NOTE(Sam): Arena memory must be freed by the thread which allocated it,
+    other threads would hand it to free(). Data meant to outlive the
+    document must be allocated with no arena in use, and so are the caches
+    a document shares between its readers (see CONCURRENT READS).
+ */
+
+#define PDF_ARENA_CHUNK_SIZE (1 << 20)
+#define PDF_ARENA_MAX_BLOCK_SIZE (64*1024)
+#define PDF_ARENA_MIN_BLOCK_SIZE 64
+#define PDF_ARENA_CLASSES_COUNT 48
+
+typedef struct PdfArenaChunk {
+	struct PdfArenaChunk* next; // Previous (smaller) chunk
+	size_t size;				// Usable bytes after the header
+	size_t used;
+} PdfArenaChunk;
 
 typedef struct {
-	size_t chunk_id, pos_start;
-	size_t pos_end; // One after last element
-} PdfToken;
+	PdfArenaChunk* chunks; // Newest first
+	void* free_blocks[PDF_ARENA_CLASSES_COUNT];
+} PdfArena;
 
-// Tries to consume a keyword.
-// If it succeed it returns it and update 'inout_pos' to point to the next byte
-// If don't succeed returns PDF_KEYWORD_NONE
-int pdf_try_to_consume_keyword(const uint8_t* buffer, PdfToken token)
+typedef struct PdfMemoryBudget PdfMemoryBudget;
+
+// Every block starts with its class, which keeps the data 16 bytes aligned
+typedef struct {
+	size_t class_index;
+	PdfMemoryBudget* budget; // Charged with the class size, see MEMORY BUDGET
+} PdfArenaBlock;
+
+static PDF_THREAD_LOCAL PdfArena* pdf_thread_arena;
+
+// Routes the allocations of the calling thread to 'arena', NULL for the heap
+void pdf_arena_use(PdfArena* arena)
 {
-	size_t token_len = token.pos_end - token.pos_start;
-	char* str = (char*)(&buffer[token.pos_start]);	
+	pdf_thread_arena = arena;
+}
+
+// Arena the allocations of the calling thread go to, NULL for the heap
+PdfArena* pdf_arena_current(void)
+{
+	return pdf_thread_arena;
+}
+
+static uint8_t* pdf_arena_chunk_data(PdfArenaChunk* chunk)
+{
+	return (uint8_t*)chunk + ((sizeof(PdfArenaChunk) + 15) & ~(size_t)15);
+}
+
+// Index of the smallest class holding 'size' bytes, and its size
+static size_t pdf_arena_class(size_t size, size_t* out_class_size)
+{
+	if(size < PDF_ARENA_MIN_BLOCK_SIZE) size = PDF_ARENA_MIN_BLOCK_SIZE;
+	uint32_t bits = pdf_highest_bit((uint64_t)size - 1);
+	size_t step = (size_t)1 << (bits - 2);
+	size_t steps = ((size - 1) >> (bits - 2)) + 1; // 5 to 8
+	*out_class_size = steps*step;
+	return (bits - 5)*4 + (steps - 5);
+}
+
+static size_t pdf_arena_class_size(size_t class_index)
+{
+	return ((class_index % 4) + 5) << (class_index/4 + 3);
+}
 
-	if(strncmp(str, "true", token_len) == 0)
+void* pdf_arena_allocate(PdfArena* arena, size_t size)
+{
+	size_t class_size;
+	size_t class_index = pdf_arena_class(size, &class_size);
+	void* reused = arena->free_blocks[class_index];
+	if(reused != NULL)
 	{
-		return PDF_KEYWORD_TRUE;
+		arena->free_blocks[class_index] = *(void**)reused;
+		return reused;
 	}
-	if(strncmp(str, "false", token_len) == 0)
+
+	size_t needed = sizeof(PdfArenaBlock) + class_size;
+	PdfArenaChunk* chunk = arena->chunks;
+	if(chunk == NULL || chunk->size - chunk->used < needed)
 	{
-		return PDF_KEYWORD_FALSE;
+		// Each chunk is twice the previous one, so there are few of them
+		size_t chunk_size = chunk != NULL ? 2*chunk->size : PDF_ARENA_CHUNK_SIZE;
+		PdfArenaChunk* fresh = (PdfArenaChunk*)malloc(((sizeof(PdfArenaChunk) + 15) & ~(size_t)15) + chunk_size);
+		if(fresh == NULL) return NULL;
+		fresh->next = chunk;
+		fresh->size = chunk_size;
+		fresh->used = 0;
+		arena->chunks = chunk = fresh;
 	}
-	if(strncmp(str, "null", token_len) == 0)
+	PdfArenaBlock* block = (PdfArenaBlock*)(pdf_arena_chunk_data(chunk) + chunk->used);
+	block->class_index = class_index;
+	chunk->used += needed;
+	return block + 1;
+}
+
+bool pdf_arena_owns(const PdfArena* arena, const void* ptr)
+{
+	for(PdfArenaChunk* chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
 	{
-		return PDF_KEYWORD_NULL;
+		const uint8_t* data = pdf_arena_chunk_data(chunk);
+		if((const uint8_t*)ptr >= data && (const uint8_t*)ptr < data + chunk->used) return true;
 	}
-
-	return PDF_KEYWORD_NONE;
+	return false;
 }
 
-// Tries to consume a number (int or real) and update inout_obj if it succeed.
-// Return true or false if succeeded or not.
-bool pdf_try_to_consume_number(const uint8_t* buffer, PdfToken token, PdfObject* inout_obj)
+// Releases everything allocated in the arena, only its biggest chunk is
+// kept for the next document.
+void pdf_arena_reset(PdfArena* arena)
 {
-	int sign = 1;
-	size_t start = token.pos_start;
+	memset(arena->free_blocks, 0, sizeof(arena->free_blocks));
+	PdfArenaChunk* chunk = arena->chunks;
+	if(chunk == NULL) return;
+	PdfArenaChunk* next = chunk->next;
+	while(next != NULL)
+	{
+		PdfArenaChunk* to_free = next;
+		next = next->next;
+		free(to_free);
+	}
+	chunk->next = NULL;
+	chunk->used = 0;
+}
+
+void pdf_arena_free(PdfArena* arena)
+{
+	pdf_arena_reset(arena);
+	free(arena->chunks);
+	memset(arena, 0, sizeof(PdfArena));
+}
+
+/*
+  MEMORY BUDGET:
+  - A PdfMemoryBudget caps what the allocations of the threads using it
+    may hold at once. Like an arena it is set per thread with
+    pdf_memory_budget_use, usually for the time one document is worked on.
+  - An allocation past the limit fails: the parser returns false and
+    pdf_document_open PDF_ERROR_MEMORY instead of growing until the
+    process is killed, the budget counts these failures.
+  - Heap blocks start with a header giving their size and the budget they
+    were charged to, arena blocks keep their budget in their own header.
+    Either way they are given back to the right budget whichever thread
+    frees them.
+  - The worker threads a document starts (repair scan, page index, stream
+    decoding and hashing) charge the budget of the thread starting them.
+    They use no arena, what they give back is freed on the heap.
+  - Caches give way before parsing fails: past 3/4 of the limit decoded
+    object streams are not kept by the document any more, and when the
+    open of a document is refused an allocation, what it kept is freed
+    with pdf_document_trim_caches and the xref read once more.
+ */
+
+struct PdfMemoryBudget {
+	int64_t limit; // 0 for no limit, only counting
+	volatile int64_t used;
+	volatile int64_t failures; // Allocations refused
+};
+
+typedef struct {
+	size_t size;
+	PdfMemoryBudget* budget;
+} PdfHeapBlock;
+
+static PDF_THREAD_LOCAL PdfMemoryBudget* pdf_thread_budget;
+
+void pdf_memory_budget_init(PdfMemoryBudget* budget, size_t limit)
+{
+	budget->limit = (int64_t)limit;
+	budget->used = 0;
+	budget->failures = 0;
+}
+
+// Charges the allocations of the calling thread to 'budget', NULL for none.
+// NOTE(Sam): The budget must outlive every block charged to it.
+void pdf_memory_budget_use(PdfMemoryBudget* budget)
+{
+	pdf_thread_budget = budget;
+}
+
+PdfMemoryBudget* pdf_memory_budget_current(void)
+{
+	return pdf_thread_budget;
+}
+
+// Allocations refused so far by the budget of the calling thread
+int64_t pdf_memory_budget_failures(void)
+{
+	PdfMemoryBudget* budget = pdf_thread_budget;
+	return budget != NULL ? pdf_atomic_add(&budget->failures, 0) : 0;
+}
+
+// Whether caches should stop growing to leave the rest of the budget to
+// the parser
+bool pdf_memory_budget_is_tight(void)
+{
+	PdfMemoryBudget* budget = pdf_thread_budget;
+	return budget != NULL && budget->limit > 0 && pdf_atomic_add(&budget->used, 0) > budget->limit/4*3;
+}
+
+static bool pdf_memory_budget_charge(PdfMemoryBudget* budget, int64_t size)
+{
+	if(budget == NULL) return true;
+	int64_t used = pdf_atomic_add(&budget->used, size);
+	if(size <= 0 || budget->limit == 0 || used <= budget->limit) return true;
+	pdf_atomic_add(&budget->used, -size);
+	pdf_atomic_add(&budget->failures, 1);
+	return false;
+}
+
+void* pdf_malloc(size_t size)
+{
+	PDF_STATS_ALLOCATION(size);
+	PdfMemoryBudget* budget = pdf_thread_budget;
+	PdfArena* arena = pdf_thread_arena;
+	if(arena != NULL && size <= PDF_ARENA_MAX_BLOCK_SIZE)
+	{
+		size_t class_size;
+		pdf_arena_class(size, &class_size);
+		if(!pdf_memory_budget_charge(budget, (int64_t)class_size)) return NULL;
+		void* ptr = pdf_arena_allocate(arena, size);
+		if(ptr == NULL)
+		{
+			pdf_memory_budget_charge(budget, -(int64_t)class_size);
+			return NULL;
+		}
+		((PdfArenaBlock*)ptr - 1)->budget = budget;
+		return ptr;
+	}
+
+	if(size >= SIZE_MAX/2 || !pdf_memory_budget_charge(budget, (int64_t)size)) return NULL;
+	PdfHeapBlock* block = (PdfHeapBlock*)malloc(sizeof(PdfHeapBlock) + size);
+	if(block == NULL)
+	{
+		pdf_memory_budget_charge(budget, -(int64_t)size);
+		return NULL;
+	}
+	block->size = size;
+	block->budget = budget;
+	return block + 1;
+}
+
+void pdf_free(void* ptr)
+{
+	if(ptr == NULL) return;
+	PDF_STATS_FREE();
+	PdfArena* arena = pdf_thread_arena;
+	if(arena != NULL && pdf_arena_owns(arena, ptr))
+	{
+		PdfArenaBlock* block = (PdfArenaBlock*)ptr - 1;
+		pdf_memory_budget_charge(block->budget, -(int64_t)pdf_arena_class_size(block->class_index));
+		*(void**)ptr = arena->free_blocks[block->class_index];
+		arena->free_blocks[block->class_index] = ptr;
+		return;
+	}
+	PdfHeapBlock* block = (PdfHeapBlock*)ptr - 1;
+	pdf_memory_budget_charge(block->budget, -(int64_t)block->size);
+	free(block);
+}
+
+void* pdf_realloc(void* ptr, size_t size)
+{
+	PdfArena* arena = pdf_thread_arena;
+	if(ptr == NULL) return pdf_malloc(size);
+	if(arena == NULL || !pdf_arena_owns(arena, ptr))
+	{
+		PDF_STATS_ALLOCATION(size);
+		// The block stays charged to the budget it was allocated with
+		PdfHeapBlock* block = (PdfHeapBlock*)ptr - 1;
+		PdfMemoryBudget* budget = block->budget;
+		int64_t growth = (int64_t)size - (int64_t)block->size;
+		if(size >= SIZE_MAX/2 || !pdf_memory_budget_charge(budget, growth)) return NULL;
+		PdfHeapBlock* grown = (PdfHeapBlock*)realloc(block, sizeof(PdfHeapBlock) + size);
+		if(grown == NULL)
+		{
+			pdf_memory_budget_charge(budget, -growth);
+			return NULL;
+		}
+		grown->size = size;
+		return grown + 1;
+	}
+
+	// Blocks have room up to the size of their class
+	size_t class_size = pdf_arena_class_size(((PdfArenaBlock*)ptr - 1)->class_index);
+	if(size <= class_size) return ptr;
+	void* result = pdf_malloc(size);
+	if(result == NULL) return NULL;
+	memcpy(result, ptr, class_size);
+	pdf_free(ptr);
+	return result;
+}
+
+void pdf_object_free(PdfObject* obj);
+
+// Allocates the slots of an empty dictionary, false if out of memory (the
+// dictionary is then left empty and can still be freed).
+bool pdf_dictionary_reserve(PdfDictionary *dictionary, size_t slots_counts)
+{
+	PDF_ASSERT(slots_counts <= UINT32_MAX && "Too many dictionary slots");
+	dictionary->slots_counts = 0;
+	dictionary->used_ranges = 0;
+	dictionary->buckets = (PdfDictionaryBucket*)pdf_malloc(slots_counts*sizeof(PdfDictionaryBucket));
+	if(dictionary->buckets == NULL) return false;
+	memset(dictionary->buckets, 0, slots_counts*sizeof(PdfDictionaryBucket));
+	dictionary->slots_counts = (uint32_t)slots_counts;
+	return true;
+}
+
+// Slots for a dictionary of 'count' entries: a power of two keeping the
+// table at most half full
+size_t pdf_dictionary_slots_for(size_t count)
+{
+	size_t slots = 8;
+	while(slots < 2*count) slots *= 2;
+	return slots;
+}
+
+// Number of slots covered by each bit of 'used_ranges'
+static size_t pdf_dictionary_range_size(const PdfDictionary* dictionary)
+{
+	return (dictionary->slots_counts + PDF_DICTIONARY_RANGES - 1) / PDF_DICTIONARY_RANGES;
+}
+
+// First slot from 'slot' in a used range, 'slots_counts' if there is none
+static size_t pdf_dictionary_skip_empty_ranges(const PdfDictionary* dictionary, size_t slot)
+{
+	if(slot >= dictionary->slots_counts) return dictionary->slots_counts;
+	size_t range_size = pdf_dictionary_range_size(dictionary);
+	size_t range = slot / range_size;
+	uint32_t ranges = dictionary->used_ranges >> range;
+	if(ranges & 1) return slot;
+	if(ranges == 0) return dictionary->slots_counts;
+	size_t next = (range + pdf_count_trailing_zeros(ranges)) * range_size;
+	return next < dictionary->slots_counts ? next : dictionary->slots_counts;
+}
+
+// Adds or replaces the entry 'key', the dictionary takes ownership of 'key'
+// and 'value'. If out of memory it doesn't and returns false.
+bool pdf_dictionary_insert(PdfDictionary *dictionary, PdfName key, PdfObject value)
+{
+	PDF_ASSERT(dictionary->slots_counts > 0 && "Tries to insert in an empty dictionary");
+	size_t id = key.hash % dictionary->slots_counts;
+	PdfDictionaryBucket* bucket_list = &dictionary->buckets[id];
+
+	if(!bucket_list->is_used)
+	{
+		PDF_STATS_DICTIONARY_INSERT(false, 1);
+		dictionary->used_ranges |= 1u << (id / pdf_dictionary_range_size(dictionary));
+		dictionary->buckets[id].is_used = true;
+		dictionary->buckets[id].key = key;
+		dictionary->buckets[id].object = value;
+		dictionary->buckets[id].next_bucket = NULL;
+		return true;
+	}
+	
+	size_t chain_length = 0;
+	do
+	{
+		++chain_length;
+		if(pdf_names_are_equals(key, bucket_list->key))
+		{
+			// NOTE(Sam): The dictionary owns its keys and values, we keep
+			//            the key we already have and drop the old value.
+			PDF_STATS_DICTIONARY_INSERT(true, chain_length);
+			pdf_free(key.start);
+			pdf_object_free(&bucket_list->object);
+			bucket_list->object = value;
+			return true;
+		}
+
+		// NOTE: we go to next bucket_list only if it is not the last 
+	} while(bucket_list->next_bucket != NULL && (bucket_list = bucket_list->next_bucket));
+	PDF_STATS_DICTIONARY_INSERT(true, chain_length + 1);
+	PdfDictionaryBucket* bucket = (PdfDictionaryBucket*)pdf_malloc(sizeof(PdfDictionaryBucket));
+	if(bucket == NULL) return false;
+	bucket->is_used = true;
+	bucket->key = key;
+	bucket->object = value;
+	bucket->next_bucket = NULL;
+	bucket_list->next_bucket = bucket;
+	return true;
+}
+
+PdfObject pdf_dictionary_get(const PdfDictionary* dictionary, PdfName key)
+{
+	PdfObject object = {0};
+	object.type = PDF_OBJECT_TYPE_NONE;
+	if(dictionary->slots_counts == 0) return object;
+
+	size_t id = key.hash % dictionary->slots_counts;
+	const PdfDictionaryBucket* bucket_list = &dictionary->buckets[id];
+
+	if(!bucket_list->is_used) return object;
+
+	size_t chain_length = 0;
+	do
+	{
+		++chain_length;
+		if(pdf_names_are_equals(key, bucket_list->key))
+		{
+			PDF_STATS_DICTIONARY_LOOKUP(chain_length);
+			object = bucket_list->object;
+			return object;
+		}
+
+		// NOTE: we go to next bucket_list only if it is not the last 
+	} while(bucket_list->next_bucket != NULL && (bucket_list = bucket_list->next_bucket));
+	
+	PDF_STATS_DICTIONARY_LOOKUP(chain_length);
+	return object;
+}
+
+// Release every allocation owned by 'obj' (recursively for arrays and
+// dictionaries). The object itself is not freed since it usually lives
+// on the stack or inside its parent, its type is reset to NONE.
+void pdf_object_free(PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_STRING:
+	{
+		pdf_free(obj->string_value.start);
+	} break;
+	case PDF_OBJECT_TYPE_NAME:
+	{
+		pdf_free(obj->name_value.start);
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		for(size_t i = 0; i < obj->array_value.length; ++i)
+			pdf_object_free(&obj->array_value.start[i]);
+		pdf_free(obj->array_value.start);
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	{
+		const PdfDictionary* dictionary = &obj->dictionary_value;
+		for(size_t i = pdf_dictionary_skip_empty_ranges(dictionary, 0); i < dictionary->slots_counts;
+			i = pdf_dictionary_skip_empty_ranges(dictionary, i + 1))
+		{
+			PdfDictionaryBucket* bucket = &dictionary->buckets[i];
+			if(!bucket->is_used) continue;
+			pdf_free(bucket->key.start);
+			pdf_object_free(&bucket->object);
+
+			// NOTE(Sam): Only the first bucket of each slot lives in the
+			//            'buckets' array, the chained ones are malloc'ed
+			PdfDictionaryBucket* next = bucket->next_bucket;
+			while(next != NULL)
+			{
+				PdfDictionaryBucket* to_free = next;
+				next = next->next_bucket;
+				pdf_free(to_free->key.start);
+				pdf_object_free(&to_free->object);
+				pdf_free(to_free);
+			}
+		}
+		pdf_free(obj->dictionary_value.buckets);
+	} break;
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		PdfObject dictionary = {.type = PDF_OBJECT_TYPE_DICTIONARY};
+		dictionary.dictionary_value = obj->stream_value.dictionary;
+		pdf_object_free(&dictionary);
+	} break;
+	}
+	obj->type = PDF_OBJECT_TYPE_NONE;
+}
+
+// Iterates over the entries of a dictionary, start with '*inout_slot' = 0
+// and 'bucket' = NULL then pass the previous result. Returns NULL at the end.
+PdfDictionaryBucket* pdf_dictionary_next(const PdfDictionary* dictionary, size_t* inout_slot,
+										 PdfDictionaryBucket* bucket)
+{
+	if(bucket != NULL)
+	{
+		if(bucket->next_bucket != NULL) return bucket->next_bucket;
+		*inout_slot += 1;
+	}
+	for(*inout_slot = pdf_dictionary_skip_empty_ranges(dictionary, *inout_slot); *inout_slot < dictionary->slots_counts;
+		*inout_slot = pdf_dictionary_skip_empty_ranges(dictionary, *inout_slot + 1))
+	{
+		if(dictionary->buckets[*inout_slot].is_used) return &dictionary->buckets[*inout_slot];
+	}
+	return NULL;
+}
+
+bool pdf_name_copy(PdfName name, PdfName* out_name)
+{
+	*out_name = name;
+	if(name.length == 0) return true;
+	out_name->start = (char*)pdf_malloc(name.length);
+	if(out_name->start == NULL) return false;
+	memcpy(out_name->start, name.start, name.length);
+	return true;
+}
+
+// Deep copy of 'src' in 'out_obj', to be released with pdf_object_free.
+// NOTE(Sam): Stream data is not owned by objects and stays shared.
+bool pdf_object_copy(const PdfObject* src, PdfObject* out_obj)
+{
+	*out_obj = *src;
+	switch(src->type)
+	{
+	case PDF_OBJECT_TYPE_STRING:
+	{
+		if(src->string_value.length == 0) break;
+		out_obj->string_value.start = (char*)pdf_malloc(src->string_value.length);
+		if(out_obj->string_value.start == NULL)
+		{
+			out_obj->type = PDF_OBJECT_TYPE_NONE;
+			return false;
+		}
+		memcpy(out_obj->string_value.start, src->string_value.start, src->string_value.length);
+	} break;
+	case PDF_OBJECT_TYPE_NAME:
+	{
+		if(!pdf_name_copy(src->name_value, &out_obj->name_value))
+		{
+			out_obj->type = PDF_OBJECT_TYPE_NONE;
+			return false;
+		}
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		out_obj->array_value.length = 0;
+		if(src->array_value.length == 0) break;
+		out_obj->array_value.start = (PdfObject*)pdf_malloc(src->array_value.length*sizeof(PdfObject));
+		if(out_obj->array_value.start == NULL)
+		{
+			out_obj->type = PDF_OBJECT_TYPE_NONE;
+			return false;
+		}
+		for(size_t i = 0; i < src->array_value.length; ++i)
+		{
+			if(!pdf_object_copy(&src->array_value.start[i], &out_obj->array_value.start[i]))
+			{
+				pdf_object_free(out_obj);
+				return false;
+			}
+			out_obj->array_value.length += 1;
+		}
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		const PdfDictionary* src_dictionary = src->type == PDF_OBJECT_TYPE_DICTIONARY
+			? &src->dictionary_value : &src->stream_value.dictionary;
+		PdfDictionary* dictionary = src->type == PDF_OBJECT_TYPE_DICTIONARY
+			? &out_obj->dictionary_value : &out_obj->stream_value.dictionary;
+		if(!pdf_dictionary_reserve(dictionary, src_dictionary->slots_counts))
+		{
+			pdf_object_free(out_obj);
+			return false;
+		}
+		size_t slot = 0;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(src_dictionary, &slot, NULL);
+			bucket != NULL; bucket = pdf_dictionary_next(src_dictionary, &slot, bucket))
+		{
+			PdfName key;
+			PdfObject value;
+			if(!pdf_name_copy(bucket->key, &key))
+			{
+				pdf_object_free(out_obj);
+				return false;
+			}
+			if(!pdf_object_copy(&bucket->object, &value))
+			{
+				pdf_free(key.start);
+				pdf_object_free(out_obj);
+				return false;
+			}
+			if(!pdf_dictionary_insert(dictionary, key, value))
+			{
+				pdf_free(key.start);
+				pdf_object_free(&value);
+				pdf_object_free(out_obj);
+				return false;
+			}
+		}
+	} break;
+	}
+	return true;
+}
+
+bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj);
+
+typedef struct {
+	size_t chunk_id, pos_start;
+	size_t pos_end; // One after last element
+} PdfToken;
+
+// Tries to consume a keyword.
+// If it succeed it returns it and update 'inout_pos' to point to the next byte
+// If don't succeed returns PDF_KEYWORD_NONE
+int pdf_try_to_consume_keyword(const uint8_t* buffer, PdfToken token)
+{
+	size_t token_len = token.pos_end - token.pos_start;
+	char* str = (char*)(&buffer[token.pos_start]);	
+
+	// NOTE(Sam): Lengths must match, otherwise 't' would be 'true'
+	if(token_len == 4 && strncmp(str, "true", token_len) == 0)
+	{
+		return PDF_KEYWORD_TRUE;
+	}
+	if(token_len == 5 && strncmp(str, "false", token_len) == 0)
+	{
+		return PDF_KEYWORD_FALSE;
+	}
+	if(token_len == 4 && strncmp(str, "null", token_len) == 0)
+	{
+		return PDF_KEYWORD_NULL;
+	}
+
+	return PDF_KEYWORD_NONE;
+}
+
+// Tries to consume a number (int or real) and update inout_obj if it succeed.
+// Return true or false if succeeded or not.
+static bool pdf_try_to_consume_number_internal(const uint8_t* buffer, PdfToken token, PdfObject* inout_obj)
+{
+	int sign = 1;
+	size_t start = token.pos_start;
 	size_t end = token.pos_end;
 	if(buffer[start] == '+')
 		++start;
@@ -372,13 +1576,13 @@ bool pdf_try_to_consume_number(const uint8_t* buffer, PdfToken token, PdfObject*
 	}
 	
 	// TODO(Sam): Overflow check?
-	PDF_INTEGER_TYPE tens = 1;
+	// NOTE(Sam): We read digits from left to right, going backward from
+	//            the last digit underflows 'j' when the token starts at 0.
 	PDF_INTEGER_TYPE int_value = 0;
-	for(size_t j = start + nb_of_tens - 1; start <= j; --j)
+	for(size_t j = start; j < start + nb_of_tens; ++j)
 	{
 		PDF_ASSERT(buffer[j] >= '0' && buffer[j] <= '9' && "Try to read a non digit character as a number");
-		int_value += tens*(buffer[j]-'0');
-		tens *= 10;
+		int_value = 10*int_value + (buffer[j]-'0');
 	}
 
 	if(is_real_number)
@@ -403,6 +1607,15 @@ bool pdf_try_to_consume_number(const uint8_t* buffer, PdfToken token, PdfObject*
 	return true;
 }
 
+bool pdf_try_to_consume_number(const uint8_t* buffer, PdfToken token, PdfObject* inout_obj)
+{
+	PDF_STATS_TIMER_BEGIN(PDF_STATS_TIMER_CONSUME_NUMBER);
+	bool result = pdf_try_to_consume_number_internal(buffer, token, inout_obj);
+	if(result) PDF_STATS_OBJECT(inout_obj->type);
+	PDF_STATS_TIMER_END(PDF_STATS_TIMER_CONSUME_NUMBER, token.pos_end - token.pos_start);
+	return result;
+}
+
 void debug_pdf_print_object(PdfObject* obj, size_t offset)
 {
 #define PRINT_OFFSET() for(size_t jj = 0; jj < offset; ++jj) printf("  ")
@@ -477,6 +1690,17 @@ void debug_pdf_print_object(PdfObject* obj, size_t offset)
 		PRINT_OFFSET();
 		printf("----\n");
 	} break;
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		printf("Stream of %zu bytes with ", obj->stream_value.length);
+		PdfObject dictionary = {.type = PDF_OBJECT_TYPE_DICTIONARY};
+		dictionary.dictionary_value = obj->stream_value.dictionary;
+		debug_pdf_print_object(&dictionary, offset);
+	} break;
+	case PDF_OBJECT_TYPE_REFERENCE:
+	{
+		printf("Reference: %u %u R\n", obj->reference_value.number, obj->reference_value.generation);
+	} break;
 	case PDF_OBJECT_TYPE_NULL:
 	{
 		printf("NULL\n");
@@ -489,8 +1713,8 @@ void debug_pdf_print_object(PdfObject* obj, size_t offset)
 #undef PRINT_OFFSET
 }
 
-bool pdf_parse_literal_string(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
-							  PdfObject* inout_obj)
+static bool pdf_parse_literal_string_internal(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+											  PdfObject* inout_obj)
 {
 	inout_obj->type = PDF_OBJECT_TYPE_STRING;
 	inout_obj->string_value.start = NULL;
@@ -511,9 +1735,9 @@ bool pdf_parse_literal_string(const uint8_t* buffer, size_t* inout_pos, size_t b
 		//            this buffer system at some point so
 		//            I won't spend time now fixing it...
 		
-		// We must escape \( and \) sequences
-		if(buffer[pos] == '\\' && buffer[pos+1] == '(') ++pos;
-		if(buffer[pos] == '\\' && buffer[pos+1] == ')') ++pos;
+		// We must escape \( and \) sequences, and \\ too otherwise
+		// a string ending with an escaped backslash never terminates
+		if(buffer[pos] == '\\') ++pos;
 
 		++pos;
 	}
@@ -528,10 +1752,11 @@ bool pdf_parse_literal_string(const uint8_t* buffer, size_t* inout_pos, size_t b
 	//            final string length. This is okay, memory is cheap nowdays
 	//            and we will correct for it at the end.
 	if(inout_obj->string_value.length == 0) return true;
-	inout_obj->string_value.start = (char*)malloc(inout_obj->string_value.length*sizeof(char));
+	inout_obj->string_value.start = (char*)pdf_malloc(inout_obj->string_value.length*sizeof(char));
 	if(inout_obj->string_value.start == NULL)
 	{
-		PDF_ASSERT(false && "TODO: Repport memory allocation error!");
+		inout_obj->type = PDF_OBJECT_TYPE_NONE;
+		return false;
 	}
 
 	size_t next_i = 0;
@@ -602,8 +1827,18 @@ bool pdf_parse_literal_string(const uint8_t* buffer, size_t* inout_pos, size_t b
 	return true;
 }
 
-bool pdf_parse_hexadecimal_string(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
-								  PdfObject* inout_obj)
+bool pdf_parse_literal_string(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj)
+{
+	PDF_STATS_TIMER_BEGIN(PDF_STATS_TIMER_PARSE_LITERAL_STRING);
+	size_t start = *inout_pos;
+	bool result = pdf_parse_literal_string_internal(buffer, inout_pos, buffer_len, inout_obj);
+	if(result) PDF_STATS_OBJECT(inout_obj->type);
+	PDF_STATS_TIMER_END(PDF_STATS_TIMER_PARSE_LITERAL_STRING, *inout_pos - start);
+	return result;
+}
+
+static bool pdf_parse_hexadecimal_string_internal(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+												  PdfObject* inout_obj)
 {
 	inout_obj->type = PDF_OBJECT_TYPE_STRING;
 	inout_obj->string_value.start = NULL;
@@ -616,13 +1851,12 @@ bool pdf_parse_hexadecimal_string(const uint8_t* buffer, size_t* inout_pos, size
 	while(pos < buffer_len) {
 		if(buffer[pos] == '>') break;
 
-		size_t np = pos;
 		if( !(
 			(buffer[pos] >= '0' && buffer[pos] <= '9') ||
 			(buffer[pos] >= 'a' && buffer[pos] <= 'f') ||
 			(buffer[pos] >= 'A' && buffer[pos] <= 'F')
 				)
-			&& !pdf_byte_is_white_space(buffer, &np))
+			&& !pdf_char_is_white_space(buffer[pos]))
 		{
 			// NOTE(Sam): Error if not 0-9A-F
 			return false;
@@ -635,6 +1869,7 @@ bool pdf_parse_hexadecimal_string(const uint8_t* buffer, size_t* inout_pos, size
 		
 		++pos;
 	}
+	if(pos >= buffer_len) return false; // Unterminated string
 	size_t tmp_pos = *inout_pos + 1;
 	inout_obj->string_value.length = pos - *inout_pos - 1;	// - 1 for removing first '<'
 	*inout_pos	   = pos + 1;	// + 1 for removing last '>'
@@ -645,10 +1880,11 @@ bool pdf_parse_hexadecimal_string(const uint8_t* buffer, size_t* inout_pos, size
 	//            final string length. Moreover, two characters make one byte
 	//            so the final string will be len/2 + 1 (+1 for odd len)
 	if(inout_obj->string_value.length == 0) return true;
-	inout_obj->string_value.start = (char*)malloc((inout_obj->string_value.length/2+1)*sizeof(char));
+	inout_obj->string_value.start = (char*)pdf_malloc((inout_obj->string_value.length/2+1)*sizeof(char));
 	if(inout_obj->string_value.start == NULL)
 	{
-		PDF_ASSERT(false && "TODO: Repport memory allocation error!");
+		inout_obj->type = PDF_OBJECT_TYPE_NONE;
+		return false;
 	}
 
 	uint8_t dig_id = 0;
@@ -692,8 +1928,18 @@ bool pdf_parse_hexadecimal_string(const uint8_t* buffer, size_t* inout_pos, size
 	return true;
 }
 
-bool pdf_parse_name(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
-					PdfObject* inout_obj)
+bool pdf_parse_hexadecimal_string(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj)
+{
+	PDF_STATS_TIMER_BEGIN(PDF_STATS_TIMER_PARSE_HEXADECIMAL_STRING);
+	size_t start = *inout_pos;
+	bool result = pdf_parse_hexadecimal_string_internal(buffer, inout_pos, buffer_len, inout_obj);
+	if(result) PDF_STATS_OBJECT(inout_obj->type);
+	PDF_STATS_TIMER_END(PDF_STATS_TIMER_PARSE_HEXADECIMAL_STRING, *inout_pos - start);
+	return result;
+}
+
+static bool pdf_parse_name_internal(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+									PdfObject* inout_obj)
 {
 	// TODO(Sam): Check for pdf version, the following code is conform with
 	//            pdf 1.2 and above. It classify as valid some names that
@@ -710,10 +1956,7 @@ bool pdf_parse_name(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
 	++pos;
 	while(pos < buffer_len) {
 
-		size_t np = pos;
-		if(pdf_byte_is_white_space(buffer, &np)) break;
-		if(pdf_byte_is_delimiter(buffer, &np)) break;
-		if(buffer[pos] == '\0') break;
+		if(!pdf_char_is_regular(buffer[pos])) break;
 		if(buffer[pos] == '#')
 		{
 			if(pos + 2 >= buffer_len) break;
@@ -738,12 +1981,14 @@ bool pdf_parse_name(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
 
 	// Note(Sam): At this point, we did not processed delimiters yet
 	//            so the reserved memory may be slightly larger than the
-	//            final name length.
+	//            final name length. A name without any '#' sequence
+	//            keeps its full length, so we cannot reserve less.
 	if(inout_obj->name_value.length == 0) return true;
-	inout_obj->name_value.start = (char*)malloc((inout_obj->name_value.length/2+1)*sizeof(char));
+	inout_obj->name_value.start = (char*)pdf_malloc(inout_obj->name_value.length*sizeof(char));
 	if(inout_obj->name_value.start == NULL)
 	{
-		PDF_ASSERT(false && "TODO: Repport memory allocation error!");
+		inout_obj->type = PDF_OBJECT_TYPE_NONE;
+		return false;
 	}
 
 	size_t next_id = 0;
@@ -754,12 +1999,12 @@ bool pdf_parse_name(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
 			uint8_t high = 0;
 			uint8_t low = 0;
 			if(buffer[pos+i+1] >= '0' && buffer[pos+i+1] <= '9') high = buffer[pos+i+1] - '0';
-			if(buffer[pos+i+1] >= 'a' && buffer[pos+i+1] <= 'f') high = buffer[pos+i+1] - 'a';
-			if(buffer[pos+i+1] >= 'A' && buffer[pos+i+1] <= 'F') high = buffer[pos+i+1] - 'A';
+			if(buffer[pos+i+1] >= 'a' && buffer[pos+i+1] <= 'f') high = buffer[pos+i+1] - 'a' + 10;
+			if(buffer[pos+i+1] >= 'A' && buffer[pos+i+1] <= 'F') high = buffer[pos+i+1] - 'A' + 10;
 
 			if(buffer[pos+i+2] >= '0' && buffer[pos+i+2] <= '9') low = buffer[pos+i+2] - '0';
-			if(buffer[pos+i+2] >= 'a' && buffer[pos+i+2] <= 'f') low = buffer[pos+i+2] - 'a';
-			if(buffer[pos+i+2] >= 'A' && buffer[pos+i+2] <= 'F') low = buffer[pos+i+2] - 'A';
+			if(buffer[pos+i+2] >= 'a' && buffer[pos+i+2] <= 'f') low = buffer[pos+i+2] - 'a' + 10;
+			if(buffer[pos+i+2] >= 'A' && buffer[pos+i+2] <= 'F') low = buffer[pos+i+2] - 'A' + 10;
 
 			inout_obj->name_value.start[next_id] = 16*high + low;
 			
@@ -785,8 +2030,18 @@ bool pdf_parse_name(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
 	return true;
 }
 
-bool pdf_parse_array(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
-					 PdfObject* inout_obj)
+bool pdf_parse_name(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj)
+{
+	PDF_STATS_TIMER_BEGIN(PDF_STATS_TIMER_PARSE_NAME);
+	size_t start = *inout_pos;
+	bool result = pdf_parse_name_internal(buffer, inout_pos, buffer_len, inout_obj);
+	if(result) PDF_STATS_OBJECT(inout_obj->type);
+	PDF_STATS_TIMER_END(PDF_STATS_TIMER_PARSE_NAME, *inout_pos - start);
+	return result;
+}
+
+static bool pdf_parse_array_internal(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+									 PdfObject* inout_obj)
 {
 	inout_obj->type = PDF_OBJECT_TYPE_ARRAY;
 	inout_obj->array_value.start = NULL;
@@ -794,84 +2049,183 @@ bool pdf_parse_array(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len
 
 	size_t pos = *inout_pos;
 	if(buffer[pos] != '[') return false;
+	++pos;
 
-	++pos; // We start by estimating the array length for memory allocation
-	int items_count = 0;
-	int parenthesis_count = 1;
-	while(pos < buffer_len)
+	// NOTE(Sam): We used to count the items before parsing them, but
+	//            items can't be counted without parsing them (nested
+	//            dictionaries, references 'N G R', etc.) so we grow.
+	size_t capacity = 0;
+	while(true)
 	{
-		bool begining_of_item = pdf_byte_is_white_space(buffer, &pos) || pos == *inout_pos + 1;
-		int this_level_parenthesis_count = parenthesis_count;
-		
-		if(buffer[pos] == '[') ++parenthesis_count;
-		if(buffer[pos] == ']') --parenthesis_count;
-		if(parenthesis_count <= 0) break; // End of array
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+		if(pos >= buffer_len)
+		{
+			pdf_object_free(inout_obj); // Unterminated array
+			return false;
+		}
+		if(buffer[pos] == ']') break;
 
-		if(begining_of_item && this_level_parenthesis_count == 1)
-			++items_count;
-		
-		++pos;
-	}
-	if(parenthesis_count != 0) return false;
-	size_t tmp_pos = *inout_pos+1;
-	inout_obj->array_value.length = items_count;
-	*inout_pos = pos + 1; // + 1 for removing last ']'
-	pos = tmp_pos;
+		if(inout_obj->array_value.length == capacity)
+		{
+			capacity = capacity ? 2*capacity : 8;
+			PdfObject* start = (PdfObject*)pdf_realloc(inout_obj->array_value.start, capacity*sizeof(PdfObject));
+			if(start == NULL)
+			{
+				pdf_object_free(inout_obj);
+				return false;
+			}
+			inout_obj->array_value.start = start;
+		}
 
-	if(inout_obj->array_value.length == 0) return true;
-	inout_obj->array_value.start  = (PdfObject*)malloc(inout_obj->array_value.length*sizeof(PdfObject));
-	if(inout_obj->array_value.start == NULL)
-	{
-		PDF_ASSERT(false && "TODO: Report memory allocation error!");
-	}
-	
-	for(size_t i = 0; i < inout_obj->array_value.length; ++i)
-	{
 		PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
-		pdf_byte_is_white_space(buffer, &pos);
 		if(!pdf_parse_object(buffer, &pos, buffer_len, &obj))
 		{
-			PDF_ASSERT(false && "ERROR: Could not parse object in array");
+			pdf_object_free(inout_obj);
+			return false;
 		}
-		inout_obj->array_value.start[i] = obj;
+		inout_obj->array_value.start[inout_obj->array_value.length++] = obj;
 	}
+	*inout_pos = pos + 1; // + 1 for removing last ']'
 	
 	return true;
 }
 
-bool pdf_parse_dictionary(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
-					 PdfObject* inout_obj)
+// Arrays and dictionaries nested deeper than this are refused, each level
+// costs stack in the recursive descent
+#define PDF_MAX_NESTING_DEPTH 256
+
+static PDF_THREAD_LOCAL size_t pdf_parse_depth;
+
+bool pdf_parse_array(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj)
 {
-	// TODO(Sam): Make a tmp object and modify inout_obj only when commiting
-	//            this pattern should be enforced also in other methods
-	inout_obj->type = PDF_OBJECT_TYPE_DICTIONARY;
-	pdf_dictionary_reserve(&inout_obj->dictionary_value, PDF_DICTIONARY_NB_SLOTS);
+	if(pdf_parse_depth >= PDF_MAX_NESTING_DEPTH) return false;
+	pdf_parse_depth += 1;
+	PDF_STATS_TIMER_BEGIN(PDF_STATS_TIMER_PARSE_ARRAY);
+	PDF_STATS_NESTING_ENTER();
+	size_t start = *inout_pos;
+	bool result = pdf_parse_array_internal(buffer, inout_pos, buffer_len, inout_obj);
+	if(result) PDF_STATS_OBJECT(inout_obj->type);
+	PDF_STATS_NESTING_EXIT();
+	PDF_STATS_TIMER_END(PDF_STATS_TIMER_PARSE_ARRAY, *inout_pos - start);
+	pdf_parse_depth -= 1;
+	return result;
+}
+
+// Entries of a dictionary being parsed, kept on the stack while there are few
+#define PDF_DICTIONARY_PARSE_ENTRIES 16
 
+typedef struct {
+	PdfName key;
+	PdfObject value;
+} PdfDictionaryEntry;
+
+static bool pdf_parse_dictionary_internal(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+										  PdfObject* inout_obj)
+{
 	size_t pos = *inout_pos;
 	if(buffer[pos] != '<' || buffer[pos+1] != '<') return false;
 
+	// NOTE(Sam): Entries are parsed first and the table is sized for them,
+	//            reserving PDF_DICTIONARY_NB_SLOTS every time made each
+	//            dictionary cost 20 KB, whatever its size.
+	PdfDictionaryEntry local_entries[PDF_DICTIONARY_PARSE_ENTRIES];
+	PdfDictionaryEntry* entries = local_entries;
+	size_t count = 0, capacity = PDF_DICTIONARY_PARSE_ENTRIES;
+	bool success = true;
 	pos += 2; // We have a double character to remove
-	while(pos < buffer_len - 1)
+	while(true)
 	{
-		pdf_byte_is_white_space(buffer, &pos);
-		if(buffer[pos] == '>' && buffer[pos] == '>') break;
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+		if(pos + 1 >= buffer_len)
+		{
+			success = false; // Unterminated dictionary
+			break;
+		}
+		if(buffer[pos] == '>' && buffer[pos+1] == '>') break;
+
+		PdfObject key = {.type = PDF_OBJECT_TYPE_NONE};
+		PdfObject value = {.type = PDF_OBJECT_TYPE_NONE};
+
+		if(!pdf_parse_name(buffer, &pos, buffer_len, &key))
+		{
+			success = false;
+			break;
+		}
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
 
-		PdfObject key, value;
+		if(pos >= buffer_len || !pdf_parse_object(buffer, &pos, buffer_len, &value))
+		{
+			pdf_object_free(&key);
+			success = false;
+			break;
+		}
 
-		if(!pdf_parse_name(buffer, &pos, buffer_len, &key)) return false;
-		pdf_byte_is_white_space(buffer, &pos);
+		if(value.type == PDF_OBJECT_TYPE_NULL) // Spec specifies that null should be considered as nonexisting entry
+		{
+			pdf_object_free(&key);
+			continue;
+		}
 
-		if(!pdf_parse_object(buffer, &pos, buffer_len, &value)) return false;
+		if(count == capacity)
+		{
+			capacity *= 2;
+			PdfDictionaryEntry* grown = (PdfDictionaryEntry*)pdf_malloc(capacity*sizeof(PdfDictionaryEntry));
+			if(grown == NULL)
+			{
+				pdf_object_free(&key);
+				pdf_object_free(&value);
+				success = false;
+				break;
+			}
+			memcpy(grown, entries, count*sizeof(PdfDictionaryEntry));
+			if(entries != local_entries) pdf_free(entries);
+			entries = grown;
+		}
+		entries[count].key = key.name_value;
+		entries[count].value = value;
+		count += 1;
+	}
 
-		if(value.type == PDF_OBJECT_TYPE_NULL) continue; // Spec specifies that null should be considered as nonexisting entry
-		pdf_dictionary_insert(&inout_obj->dictionary_value, key.name_value, value);
+	inout_obj->type = PDF_OBJECT_TYPE_DICTIONARY;
+	memset(&inout_obj->dictionary_value, 0, sizeof(PdfDictionary));
+	success = success && pdf_dictionary_reserve(&inout_obj->dictionary_value, pdf_dictionary_slots_for(count));
+	size_t inserted = 0;
+	// Later duplicates replace the first ones, as when inserted one by one
+	while(success && inserted < count)
+	{
+		success = pdf_dictionary_insert(&inout_obj->dictionary_value, entries[inserted].key, entries[inserted].value);
+		if(success) inserted += 1;
 	}
-	pos += 2;
-	*inout_pos = pos;
-		
+	for(size_t i = inserted; i < count; ++i)
+	{
+		pdf_free(entries[i].key.start);
+		pdf_object_free(&entries[i].value);
+	}
+	if(entries != local_entries) pdf_free(entries);
+	if(!success)
+	{
+		pdf_object_free(inout_obj);
+		return false;
+	}
+	*inout_pos = pos + 2;
 	return true;
 }
 
+bool pdf_parse_dictionary(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj)
+{
+	if(pdf_parse_depth >= PDF_MAX_NESTING_DEPTH) return false;
+	pdf_parse_depth += 1;
+	PDF_STATS_TIMER_BEGIN(PDF_STATS_TIMER_PARSE_DICTIONARY);
+	PDF_STATS_NESTING_ENTER();
+	size_t start = *inout_pos;
+	bool result = pdf_parse_dictionary_internal(buffer, inout_pos, buffer_len, inout_obj);
+	if(result) PDF_STATS_OBJECT(inout_obj->type);
+	PDF_STATS_NESTING_EXIT();
+	PDF_STATS_TIMER_END(PDF_STATS_TIMER_PARSE_DICTIONARY, *inout_pos - start);
+	pdf_parse_depth -= 1;
+	return result;
+}
+
 void pdf_parse_token(const uint8_t* buffer, PdfToken token, PdfToken* tokens, size_t* next_token_id)
 {
 	if(token.pos_start >= token.pos_end) return;
@@ -920,10 +2274,8 @@ bool pdf_parse_object_token(const uint8_t* buffer, size_t* inout_pos, size_t buf
 	token.pos_start = pos;
 	while(pos < buffer_len)
 	{
-		size_t np = pos;
-		if(pdf_byte_is_white_space(buffer, &np)) break;
-		if(pdf_byte_is_delimiter(buffer, &np)) break;
-		if(pdf_byte_is_comment(buffer, &np)) break; // TODO(Sam): This may be optimized out since coments starts with delimiter
+		// NOTE(Sam): Comments start with a delimiter so they end the token too
+		if(!pdf_char_is_regular(buffer[pos])) break;
 		++pos;
 	}
 	token.pos_end = pos;
@@ -940,6 +2292,7 @@ bool pdf_parse_object_token(const uint8_t* buffer, size_t* inout_pos, size_t buf
 		{
 			inout_obj->type = PDF_OBJECT_TYPE_BOOLEAN;
 			inout_obj->bool_value = true;
+			PDF_STATS_OBJECT(inout_obj->type);
 			*inout_pos = pos;
 			return true;
 		} break;
@@ -947,12 +2300,14 @@ bool pdf_parse_object_token(const uint8_t* buffer, size_t* inout_pos, size_t buf
 		{
 			inout_obj->type = PDF_OBJECT_TYPE_BOOLEAN;
 			inout_obj->bool_value = false;
+			PDF_STATS_OBJECT(inout_obj->type);
 			*inout_pos = pos;
 			return true;
 		} break;
 		case PDF_KEYWORD_NULL:
 		{
 			inout_obj->type = PDF_OBJECT_TYPE_NULL;
+			PDF_STATS_OBJECT(inout_obj->type);
 			*inout_pos = pos;
 			return true;
 		} break;
@@ -962,8 +2317,52 @@ bool pdf_parse_object_token(const uint8_t* buffer, size_t* inout_pos, size_t buf
 	return false;
 }
 
-bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
-					  PdfObject* inout_obj)
+// Reads an unsigned integer made only of digits, used for the syntax
+// of the file structure (object headers, xref tables, ...)
+bool pdf_read_unsigned(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, uint64_t* out_value)
+{
+	size_t pos = *inout_pos;
+	uint64_t value = 0;
+	while(pos < buffer_len && buffer[pos] >= '0' && buffer[pos] <= '9' && pos - *inout_pos < 19)
+	{
+		value = 10*value + (buffer[pos] - '0');
+		++pos;
+	}
+	if(pos == *inout_pos) return false;
+	*inout_pos = pos;
+	*out_value = value;
+	return true;
+}
+
+// Once we parsed an integer 'N' at 'inout_pos', checks if it is followed by
+// 'G R' which makes it an indirect reference. If so 'inout_obj' becomes a
+// reference and 'inout_pos' is moved after the 'R'.
+bool pdf_try_to_consume_reference(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+								  PdfObject* inout_obj)
+{
+	if(inout_obj->int_value < 0 || inout_obj->int_value > UINT32_MAX) return false;
+
+	size_t pos = *inout_pos;
+	uint64_t generation;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(pos == *inout_pos) return false;
+	if(!pdf_read_unsigned(buffer, &pos, buffer_len, &generation)) return false;
+	if(pos >= buffer_len || !pdf_char_is_white_space(buffer[pos])) return false;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(pos >= buffer_len || buffer[pos] != 'R') return false;
+	if(pos + 1 < buffer_len && pdf_char_is_regular(buffer[pos+1])) return false;
+	if(generation > UINT32_MAX) return false;
+
+	uint32_t number = (uint32_t)inout_obj->int_value;
+	inout_obj->type = PDF_OBJECT_TYPE_REFERENCE;
+	inout_obj->reference_value.number = number;
+	inout_obj->reference_value.generation = (uint32_t)generation;
+	*inout_pos = pos + 1;
+	return true;
+}
+
+static bool pdf_parse_object_internal(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len,
+									  PdfObject* inout_obj)
 {
 	size_t pos = *inout_pos;
 	size_t next_pos = pos;
@@ -976,7 +2375,7 @@ bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_le
 			size_t np = pos;
 			if(!pdf_parse_literal_string(buffer, &np, buffer_len, inout_obj))
 			{
-				PDF_ASSERT(false && "TODO: Repport parsing error!");
+				return false; // TODO(Sam): Report parsing errors with more details
 			}
 			*inout_pos = np;
 			return true;
@@ -988,12 +2387,12 @@ bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_le
 			{
 				if(!pdf_parse_dictionary(buffer, &np, buffer_len, inout_obj))
 				{
-					PDF_ASSERT(false && "TODO: Report parsing error!");
+					return false; // TODO(Sam): Report parsing errors with more details
 				}
 			}
 			else if(!pdf_parse_hexadecimal_string(buffer, &np, buffer_len, inout_obj))
 			{
-				PDF_ASSERT(false && "TODO: Report parsing error!");
+				return false; // TODO(Sam): Report parsing errors with more details
 			}
 			*inout_pos = np;
 			return true;
@@ -1003,7 +2402,7 @@ bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_le
 			size_t np = pos;
 			if(!pdf_parse_name(buffer, &np, buffer_len, inout_obj))
 			{
-				PDF_ASSERT(false && "TODO: Repport parsing error!");
+				return false; // TODO(Sam): Report parsing errors with more details
 			}
 			*inout_pos = np;
 			return true;
@@ -1013,20 +2412,21 @@ bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_le
 			size_t np = pos;
 			if(!pdf_parse_array(buffer, &np, buffer_len, inout_obj))
 			{
-				PDF_ASSERT(false && "TODO: Repport parsing error!");
+				return false; // TODO(Sam): Report parsing errors with more details
 			}
 			*inout_pos = np;
 			return true;
 		} break;
 		}
 
-		// We were not able to parse an object
-		// The only case is when we have a comment
-		PDF_ASSERT(buffer[pos] == '%' && "Found a non-object delimiter that is not a comment.");		
+		// We were not able to parse an object, either we have a
+		// comment or a delimiter which does not start an object
 		return false;
 	}
 	else if(pdf_parse_object_token(buffer, &pos, buffer_len, inout_obj))
 	{
+		if(inout_obj->type == PDF_OBJECT_TYPE_INTEGER)
+			pdf_try_to_consume_reference(buffer, &pos, buffer_len, inout_obj);
 		*inout_pos = pos;
 		return true;
 	}
@@ -1034,103 +2434,10460 @@ bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_le
 	return false;
 }
 
+bool pdf_parse_object(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfObject* inout_obj)
+{
+	PDF_STATS_TIMER_BEGIN(PDF_STATS_TIMER_PARSE_OBJECT);
+	size_t start = *inout_pos;
+	bool result = pdf_parse_object_internal(buffer, inout_pos, buffer_len, inout_obj);
+	PDF_STATS_TIMER_END(PDF_STATS_TIMER_PARSE_OBJECT, *inout_pos - start);
+	return result;
+}
 
-int main( void ) {
+/*
+  ABOUT THE FILE STRUCTURE:
+  - A pdf file is a header, a body made of indirect objects 'N G obj ... endobj',
+    a cross reference table (xref) giving the byte offset of every object and a
+    trailer dictionary pointing to the document catalog (/Root).
+  - The last bytes of the file give the offset of the last xref section with
+    'startxref', and each trailer may point to the previous section with /Prev.
+  - Damaged files often have wrong offsets or truncated xref sections, we
+    can rebuild the xref by scanning the whole file for 'N G obj' headers.
+ */
 
-	//char* filename = "test01.pdf";
-	char* filename = "test02.pdf";
-	//char* filename = "example.pdf";
+enum PDF_ERRORS {
+	// The special NONE error is used as a falsy return value.
+	PDF_ERROR_NONE = false,
+	PDF_ERROR_FILE,		// Could not open, read or map the file
+	PDF_ERROR_MEMORY,	// An allocation failed or the memory budget was exceeded
+	PDF_ERROR_XREF,		// No usable cross reference table, even after repairing
+	PDF_ERROR_WRITE,	// Could not write the output file
+	PDF_ERROR_ENCRYPTED,// Needs a password, or a security handler we don't support
+};
 
-	FILE *file = NULL;
-	#pragma warning (disable : 4996)
-	file = fopen(filename, "rb");
-	if(file == NULL)
+enum PDF_OPEN_FLAGS {
+	PDF_OPEN_FORCE_REPAIR = 1 << 0, // Don't trust the xref, always rebuild it
+	PDF_OPEN_NO_REPAIR	  = 1 << 1, // Fail instead of rebuilding a broken xref
+	PDF_OPEN_FIRST_PAGE	  = 1 << 2, // For linearized files, only read the first page xref section
+	PDF_OPEN_METADATA	  = 1 << 3, // Only read the xref entries of the objects loaded, see METADATA
+};
+
+enum PDF_XREF_ENTRY_TYPES {
+	// Entry not defined by any xref section
+	PDF_XREF_ENTRY_NONE = false,
+	PDF_XREF_ENTRY_FREE,
+	PDF_XREF_ENTRY_IN_USE,
+	// Object stored in an object stream (PDF 1.5)
+	PDF_XREF_ENTRY_COMPRESSED,
+};
+
+// From the spec limits (Annex C), also bounds the size of the xref we build
+#define PDF_MAX_OBJECT_NUMBER 8388607
+
+// Bytes that can be read past the end of the data without faulting
+#define PDF_BUFFER_PADDING 16
+
+// NOTE(Sam): For compressed entries 'offset' is the number of the object
+//            stream and 'generation' the index of the object in it.
+typedef struct {
+	uint64_t offset; // Offset of the 'N G obj' header
+	uint32_t generation;
+	uint8_t type;
+} PdfXrefEntry;
+
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+	bool is_mapped;
+	bool is_owned;
+	int64_t mtime; // Last modification, in nanoseconds since the epoch
+#ifdef _WIN32
+	HANDLE file_handle;
+	HANDLE mapping_handle;
+#endif
+} PdfFile;
+
+// One incremental update of the file: the original document is the first
+// revision, each update appends objects, an xref section and a trailer.
+typedef struct {
+	uint64_t xref_offset;	// Offset of its 'xref' section or xref stream
+	uint64_t end_offset;	// One after its '%%EOF', the file size at that revision
+	PdfObject trailer;		// The xref stream dictionary for xref streams
+	bool is_xref_stream;
+	// Entries given by this revision xref section only
+	uint32_t* numbers;
+	PdfXrefEntry* entries;
+	size_t entries_count;
+} PdfRevision;
+
+// Entry of the page offset hint table of a linearized file
+typedef struct {
+	uint64_t offset;	// Of the first object of the page
+	uint64_t length;
+	uint32_t objects_count;
+} PdfPageHint;
+
+// From the linearization dictionary, the first object of the file
+typedef struct {
+	uint64_t file_length;		// /L, the file is not linearized anymore if it changed
+	uint64_t first_page_end;	// /E, end of the first page section
+	uint64_t main_xref_offset;	// /T
+	uint64_t first_xref_offset; // First page xref section, right after the dictionary
+	uint64_t hint_offset;		// /H, the primary hint stream
+	uint64_t hint_length;
+	uint32_t first_page_number; // /O
+	uint32_t pages_count;		// /N
+	PdfPageHint* pages;			// NULL if the hint table could not be read
+} PdfLinearization;
+
+enum PDF_CRYPT_METHODS {
+	// Identity, the data is not encrypted
+	PDF_CRYPT_NONE = false,
+	PDF_CRYPT_RC4,
+	// AES-128 or AES-256 depending on the key, in CBC mode with the IV first
+	PDF_CRYPT_AES,
+};
+
+// Standard security handler of an encrypted document, only documents whose
+// user password is empty can be read (which is most of them).
+typedef struct {
+	uint32_t number;		// Of the /Encrypt dictionary, its strings are not encrypted
+	int revision;			// /R, revisions 5 and 6 use the file key for every object
+	int string_method;		// PDF_CRYPT_*, /StrF for crypt filters
+	int stream_method;		// /StmF
+	bool encrypt_metadata;	// The /Metadata streams are encrypted too
+	uint8_t key[32];		// File key, the key of each object is derived from it
+	size_t key_length;
+} PdfEncryption;
+
+// Entry of the page index, inherited attributes are already resolved
+typedef struct {
+	uint32_t number;		// The page object
+	uint32_t generation;
+	PdfObject resources;	// Usually a reference, shared with other pages
+	PdfObject media_box;	// Arrays, NONE if not given
+	PdfObject crop_box;		// The media box if not given
+	int32_t rotate;			// 0, 90, 180 or 270
+} PdfPage;
+
+// Sidecar index, see pdf_document_save_index. It is written in the byte
+// order of the machine with every section aligned on 8 bytes, so it is
+// used as mapped without parsing anything but the trailers.
+typedef struct {
+	uint64_t offset; // From the start of the index
+	uint64_t count;  // Of items, or bytes for PDF syntax
+} PdfIndexSection;
+
+typedef struct {
+	char magic[8];			// PDF_INDEX_MAGIC
+	uint32_t version;
+	uint32_t byte_order;	// PDF_INDEX_BYTE_ORDER on the machine that wrote it
+	uint64_t checksum;		// Of everything after this field
+	uint64_t size;			// Of the whole index
+	// The document the index describes
+	uint64_t file_size;
+	int64_t file_mtime;
+	uint64_t file_hash;		// See pdf_document_content_hash
+	uint64_t next_object_number;
+	uint32_t was_repaired;
+	uint32_t unused;
+	PdfIndexSection xref;			// PdfIndexXrefEntry
+	PdfIndexSection trailer;		// PDF syntax
+	PdfIndexSection revisions;		// PdfIndexRevision, oldest first
+	PdfIndexSection object_streams; // PdfIndexObjectStream, sorted by number
+	PdfIndexSection pages;			// PdfIndexPage
+} PdfIndexHeader;
+
+typedef struct {
+	uint64_t offset;
+	uint32_t generation;
+	uint32_t type;
+} PdfIndexXrefEntry;
+
+typedef struct {
+	uint64_t xref_offset;
+	uint64_t end_offset;
+	PdfIndexSection trailer;	// PDF syntax
+	PdfIndexSection entries;	// PdfIndexXrefEntry followed by their uint32_t numbers
+	uint32_t is_xref_stream;
+	uint32_t unused;
+} PdfIndexRevision;
+
+typedef struct {
+	uint32_t number;
+	uint32_t count;
+	uint64_t offset;	// 'count' + 1 uint64_t offsets then 'count' uint32_t numbers
+} PdfIndexObjectStream;
+
+typedef struct {
+	uint32_t number;
+	uint32_t generation;
+	int32_t rotate;
+	uint32_t unused;
+	PdfIndexSection attributes; // Resources, media box and crop box in PDF syntax
+} PdfIndexPage;
+
+// An object changed since the document was opened, to be written by
+// the next save. A NONE object means the object is deleted.
+typedef struct {
+	uint32_t number;
+	uint32_t generation;
+	PdfObject object;
+} PdfModifiedObject;
+
+typedef struct {
+	PdfFile file;
+	char* filename; // NULL when opened from memory
+	const uint8_t* data;
+	size_t size;
+
+	// Merged view of every revision, the newest entry wins
+	PdfXrefEntry* xref;
+	size_t xref_count;
+	PdfObject trailer;
+
+	// Oldest first, empty when the xref was repaired
+	PdfRevision* revisions;
+	size_t revisions_count;
+
+	// Sorted by object number
+	PdfModifiedObject* modified;
+	size_t modified_count;
+	size_t modified_capacity;
+	uint32_t next_object_number;
+
+	bool was_repaired;
+	int open_flags;
+
+	// Strings are decrypted when their object is parsed, streams when they
+	// are decoded with pdf_document_decode_stream
+	bool is_encrypted;
+	PdfEncryption encryption;
+
+	bool is_linearized;
+	PdfLinearization linearization;
+	// Only the first page xref section was read (PDF_OPEN_FIRST_PAGE), the
+	// rest is read the first time an object is not found in it.
+	bool has_partial_xref;
+	// The entries of classic xref tables were not read (PDF_OPEN_METADATA),
+	// they are looked up one at a time by pdf_document_find_xref_entry.
+	bool has_lazy_xref;
+
+	// Decoded object streams indexed by object number, 'xref_count'
+	// entries allocated on first use. Filled concurrently by readers.
+	void* volatile* object_streams;
+	// Sorted offsets of the objects, built by the first prefetch
+	void* volatile object_offsets;
+	// Decoder of the font objects indexed by object number, see FONTS.
+	// Allocated on first use like 'object_streams'.
+	void* volatile* fonts;
+	// Objects parsed once for every reader, see CONCURRENT READS
+	void* volatile* objects;
+
+	// Built on demand, see pdf_document_build_page_index
+	PdfPage* pages;
+	size_t pages_count;
+	bool has_page_index;
+
+	// Mapped sidecar index the document was opened with, if any. Its pages
+	// are stale once the document is modified.
+	PdfFile index_file;
+	const PdfIndexHeader* index;
+	bool has_index_pages;
+} PdfDocument;
+
+// Map the whole file in memory. When the data ends too close to the end
+// of a page we read it in a padded buffer instead since the parser may
+// look at a few bytes after the last one.
+bool pdf_file_open(const char* filename, PdfFile* out_file)
+{
+	memset(out_file, 0, sizeof(PdfFile));
+#ifdef _WIN32
+	// NOTE(Sam): Sharing writes allows incremental updates to be appended
+	//            to the file while we are still reading it.
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+							  FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file, &size) || size.QuadPart == 0)
 	{
-		printf("ERROR: Could not open file '%s'\n", filename);
-		exit(1);
+		CloseHandle(file);
+		return false;
 	}
+	FILETIME mtime;
+	if(GetFileTime(file, NULL, NULL, &mtime))
+		out_file->mtime = (int64_t)(((uint64_t)mtime.dwHighDateTime << 32) | mtime.dwLowDateTime)*100;
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size_t page_size = info.dwPageSize;
+	out_file->size = (size_t)size.QuadPart;
+	if(out_file->size % page_size != 0 && page_size - out_file->size % page_size >= PDF_BUFFER_PADDING)
+	{
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+		if(view != NULL)
+		{
+			out_file->data = (const uint8_t*)view;
+			out_file->is_mapped = true;
+			out_file->file_handle = file;
+			out_file->mapping_handle = mapping;
+			return true;
+		}
+		if(mapping) CloseHandle(mapping);
+	}
+	uint8_t* data = (uint8_t*)pdf_malloc(out_file->size + PDF_BUFFER_PADDING);
+	DWORD readed = 0;
+	size_t total = 0;
+	while(data != NULL && total < out_file->size)
+	{
+		DWORD to_read = (DWORD)((out_file->size - total) > 0x40000000 ? 0x40000000 : (out_file->size - total));
+		if(!ReadFile(file, data + total, to_read, &readed, NULL) || readed == 0) break;
+		total += readed;
+	}
+	CloseHandle(file);
+#else
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) return false;
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size <= 0)
+	{
+		close(fd);
+		return false;
+	}
+#ifdef __APPLE__
+	out_file->mtime = (int64_t)st.st_mtimespec.tv_sec*1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	out_file->mtime = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+#endif
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	out_file->size = (size_t)st.st_size;
+	if(out_file->size % page_size != 0 && page_size - out_file->size % page_size >= PDF_BUFFER_PADDING)
+	{
+		void* view = mmap(NULL, out_file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(view != MAP_FAILED)
+		{
+			close(fd);
+			out_file->data = (const uint8_t*)view;
+			out_file->is_mapped = true;
+			return true;
+		}
+	}
+	uint8_t* data = (uint8_t*)pdf_malloc(out_file->size + PDF_BUFFER_PADDING);
+	size_t total = 0;
+	while(data != NULL && total < out_file->size)
+	{
+		ssize_t readed = read(fd, data + total, out_file->size - total);
+		if(readed <= 0) break;
+		total += (size_t)readed;
+	}
+	close(fd);
+#endif
+	if(data == NULL || total != out_file->size)
+	{
+		pdf_free(data);
+		return false;
+	}
+	memset(data + out_file->size, 0, PDF_BUFFER_PADDING);
+	out_file->data = data;
+	out_file->is_owned = true;
+	return true;
+}
 
-	const size_t CHUNK_SIZE = 4096;
-	size_t pos = 0; // Absolute pos is chunk_id*CHUNK_SIZE + pos
-	size_t prev_pos, next_pos;
-	size_t nb_bytes_readed = 0;
-
-	uint8_t* buffer  = (uint8_t*)malloc(CHUNK_SIZE*sizeof(uint8_t));
-	if(buffer == NULL)
+void pdf_file_close(PdfFile* file)
+{
+	if(file->is_mapped)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(file->data);
+		CloseHandle(file->mapping_handle);
+		CloseHandle(file->file_handle);
+#else
+		munmap((void*)file->data, file->size);
+#endif
+	}
+	else if(file->is_owned)
 	{
-		printf("ERROR: Not enough memory...\n");
-		fclose(file);
-		exit(1);
+		pdf_free((void*)file->data);
 	}
+	memset(file, 0, sizeof(PdfFile));
+}
 
-	size_t next_token_id = 0;
-	PdfToken tokens[2048] = {0};
-	PdfToken current_token = {0};
-	bool chopped_a_token = false;
-	
-	// TODO(Sam): At some point we will need a better way to go trough
-	//            file and to request specific chunks.
-	// TODO(Sam): This will crash if multi bytes character are at the end
-	//            of the buffer...
-	if((nb_bytes_readed = fread(buffer, 1, CHUNK_SIZE, file)) > 0 )
+// Tells the system we are about to read this range of the file so that
+// it is read ahead in one go instead of one page fault at a time.
+void pdf_file_prefetch(const PdfFile* file, uint64_t offset, uint64_t length)
+{
+	if(!file->is_mapped || offset >= file->size) return;
+	if(length > file->size - offset) length = file->size - offset;
+#ifndef _WIN32
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = (size_t)offset & ~(page_size - 1);
+	posix_madvise((void*)(file->data + start), (size_t)(offset + length) - start, POSIX_MADV_WILLNEED);
+#endif
+}
+
+// Name pointing to a C string, meant for lookups only (it must never be freed)
+PdfName pdf_name(const char* str)
+{
+	PdfName name;
+	name.start = (char*)str;
+	name.length = strlen(str);
+	// NOTE(Sam): Must be the same djb2 hash as in pdf_parse_name
+	name.hash = 5381;
+	for(size_t i = 0; i < name.length; ++i)
+		name.hash = ((name.hash << 5) + name.hash) + (uint8_t)str[i];
+	return name;
+}
+
+// Same as pdf_name but the name owns a copy of 'str', so that it can be
+// inserted in a dictionary and freed with it. False if out of memory.
+bool pdf_name_allocate(const char* str, PdfName* out_name)
+{
+	return pdf_name_copy(pdf_name(str), out_name);
+}
+
+// Returns the position of 'needle' in 'haystack' or 'haystack_len' if not found
+size_t pdf_find(const uint8_t* haystack, size_t haystack_len, const char* needle)
+{
+	size_t needle_len = strlen(needle);
+	if(needle_len == 0 || haystack_len < needle_len) return haystack_len;
+	size_t pos = 0;
+#ifdef PDF_USE_SSE2
+	// Compare the first and the last byte of the needle at 16 positions at
+	// once, so that binary data (stream payloads, inline images) where the
+	// first byte alone is frequent only stops on real candidates
+	if(needle_len >= 2)
 	{
-		printf("Readed %zu bytes in buffer!\n", nb_bytes_readed);
-		current_token.chunk_id = 0;
-		for(pos = 0; pos < nb_bytes_readed; )
+		const __m128i first = _mm_set1_epi8(needle[0]);
+		const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+		while(pos + needle_len - 1 + 16 <= haystack_len)
 		{
-			chopped_a_token = false;
-			prev_pos = pos;
-			next_pos = pos;
-
-			PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
-			
-			current_token.pos_end = pos;
-			if(pdf_byte_is_comment(buffer, &next_pos)) {
-				//printf("Comment from byte %zu to %zu!\n", pos, next_pos);
-				chopped_a_token = true;
-				pos = next_pos;
-			}
-			else if(pdf_byte_is_white_space(buffer, &next_pos)) {
-				//printf("Byte %zu: %u is a white space of len %zu.\n", pos, buffer[pos], next_pos - pos);
-				chopped_a_token = true;
-				pos = next_pos;
-			}
-			else if(pdf_parse_object(buffer, &next_pos, nb_bytes_readed, &obj))
+			__m128i x0 = _mm_loadu_si128((const __m128i*)(haystack + pos));
+			__m128i x1 = _mm_loadu_si128((const __m128i*)(haystack + pos + needle_len - 1));
+			uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x0, first), _mm_cmpeq_epi8(x1, last)));
+			while(mask != 0)
 			{
-				debug_pdf_print_object(&obj, 0);
-				chopped_a_token = true;
-				pos = next_pos;
-			}
-			else {
-				//printf("Just a standard character: %c\n", (char)buffer[pos]);
-				pos += 1;
+				size_t hit = pos + pdf_count_trailing_zeros(mask);
+				if(memcmp(haystack + hit + 1, needle + 1, needle_len - 2) == 0) return hit;
+				mask &= mask - 1;
 			}
+			pos += 16;
+		}
+	}
+#endif
+	while(pos + needle_len <= haystack_len)
+	{
+		const uint8_t* first = (const uint8_t*)memchr(haystack + pos, needle[0], haystack_len - needle_len + 1 - pos);
+		if(first == NULL) break;
+		pos = (size_t)(first - haystack);
+		if(memcmp(first, needle, needle_len) == 0) return pos;
+		++pos;
+	}
+	return haystack_len;
+}
 
-			if(pos == nb_bytes_readed) chopped_a_token = true;
-			
-			if(chopped_a_token)
-			{
-				pdf_parse_token(buffer, current_token, tokens, &next_token_id);
-				current_token.pos_start = pos;
-			}
-			PDF_ASSERT(pos != prev_pos && "ERROR: We did not move forward. Forgot to set 'pos' or increment it?");
+// True if 'keyword' is at 'pos' and is not the start of a longer token
+bool pdf_is_keyword_at(const uint8_t* buffer, size_t pos, size_t buffer_len, const char* keyword)
+{
+	size_t len = strlen(keyword);
+	if(pos + len > buffer_len) return false;
+	if(memcmp(buffer + pos, keyword, len) != 0) return false;
+	return pos + len == buffer_len || !pdf_char_is_regular(buffer[pos + len]);
+}
+
+/*
+  CRYPTOGRAPHY:
+  - What the standard security handler needs to read encrypted documents:
+    MD5 and RC4 for revisions 2 to 4, SHA-256/384/512 and AES for revisions
+    5 and 6, AES-128 and AES-256 in CBC mode for the strings and streams.
+  - AES runs on AES-NI when the CPU has it. CBC decryption has no
+    dependency between blocks so 4 of them go through the rounds at once.
+    The portable version works on bytes, it is only a fallback.
+  - We only decrypt with keys derived from an empty password, none of this
+    tries to resist side channels.
+ */
+
+static const uint32_t pdf_md5_constants[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const uint32_t pdf_sha256_constants[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+static const uint64_t pdf_sha512_constants[80] = {
+	0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full, 0xe9b5dba58189dbbcull,
+	0x3956c25bf348b538ull, 0x59f111f1b605d019ull, 0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull,
+	0xd807aa98a3030242ull, 0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+	0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull, 0xc19bf174cf692694ull,
+	0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull, 0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull,
+	0x2de92c6f592b0275ull, 0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+	0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full, 0xbf597fc7beef0ee4ull,
+	0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull, 0x06ca6351e003826full, 0x142929670a0e6e70ull,
+	0x27b70a8546d22ffcull, 0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+	0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull, 0x92722c851482353bull,
+	0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull, 0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull,
+	0xd192e819d6ef5218ull, 0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+	0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull, 0x34b0bcb5e19b48a8ull,
+	0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull, 0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull,
+	0x748f82ee5defb2fcull, 0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+	0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull, 0xc67178f2e372532bull,
+	0xca273eceea26619cull, 0xd186b8c721c0c207ull, 0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull,
+	0x06f067aa72176fbaull, 0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+	0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull, 0x431d67c49c100d4cull,
+	0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull, 0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull,
+};
+static const uint32_t pdf_sha256_initial[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+static const uint64_t pdf_sha384_initial[8] = {
+	0xcbbb9d5dc1059ed8ull, 0x629a292a367cd507ull, 0x9159015a3070dd17ull, 0x152fecd8f70e5939ull,
+	0x67332667ffc00b31ull, 0x8eb44a8768581511ull, 0xdb0c2e0d64f98fa7ull, 0x47b5481dbefa4fa4ull,
+};
+static const uint64_t pdf_sha512_initial[8] = {
+	0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+	0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull,
+};
+static const uint8_t pdf_aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+static const uint8_t pdf_aes_inverse_sbox[256] = {
+	0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d,
+};
+// Inverse S-box and InvMixColumns of a byte in row 0, as a big endian
+// column, the other rows are rotations of it
+static const uint32_t pdf_aes_inverse_table[256] = {
+	0x51f4a750, 0x7e416553, 0x1a17a4c3, 0x3a275e96, 0x3bab6bcb, 0x1f9d45f1, 0xacfa58ab, 0x4be30393,
+	0x2030fa55, 0xad766df6, 0x88cc7691, 0xf5024c25, 0x4fe5d7fc, 0xc52acbd7, 0x26354480, 0xb562a38f,
+	0xdeb15a49, 0x25ba1b67, 0x45ea0e98, 0x5dfec0e1, 0xc32f7502, 0x814cf012, 0x8d4697a3, 0x6bd3f9c6,
+	0x038f5fe7, 0x15929c95, 0xbf6d7aeb, 0x955259da, 0xd4be832d, 0x587421d3, 0x49e06929, 0x8ec9c844,
+	0x75c2896a, 0xf48e7978, 0x99583e6b, 0x27b971dd, 0xbee14fb6, 0xf088ad17, 0xc920ac66, 0x7dce3ab4,
+	0x63df4a18, 0xe51a3182, 0x97513360, 0x62537f45, 0xb16477e0, 0xbb6bae84, 0xfe81a01c, 0xf9082b94,
+	0x70486858, 0x8f45fd19, 0x94de6c87, 0x527bf8b7, 0xab73d323, 0x724b02e2, 0xe31f8f57, 0x6655ab2a,
+	0xb2eb2807, 0x2fb5c203, 0x86c57b9a, 0xd33708a5, 0x302887f2, 0x23bfa5b2, 0x02036aba, 0xed16825c,
+	0x8acf1c2b, 0xa779b492, 0xf307f2f0, 0x4e69e2a1, 0x65daf4cd, 0x0605bed5, 0xd134621f, 0xc4a6fe8a,
+	0x342e539d, 0xa2f355a0, 0x058ae132, 0xa4f6eb75, 0x0b83ec39, 0x4060efaa, 0x5e719f06, 0xbd6e1051,
+	0x3e218af9, 0x96dd063d, 0xdd3e05ae, 0x4de6bd46, 0x91548db5, 0x71c45d05, 0x0406d46f, 0x605015ff,
+	0x1998fb24, 0xd6bde997, 0x894043cc, 0x67d99e77, 0xb0e842bd, 0x07898b88, 0xe7195b38, 0x79c8eedb,
+	0xa17c0a47, 0x7c420fe9, 0xf8841ec9, 0x00000000, 0x09808683, 0x322bed48, 0x1e1170ac, 0x6c5a724e,
+	0xfd0efffb, 0x0f853856, 0x3daed51e, 0x362d3927, 0x0a0fd964, 0x685ca621, 0x9b5b54d1, 0x24362e3a,
+	0x0c0a67b1, 0x9357e70f, 0xb4ee96d2, 0x1b9b919e, 0x80c0c54f, 0x61dc20a2, 0x5a774b69, 0x1c121a16,
+	0xe293ba0a, 0xc0a02ae5, 0x3c22e043, 0x121b171d, 0x0e090d0b, 0xf28bc7ad, 0x2db6a8b9, 0x141ea9c8,
+	0x57f11985, 0xaf75074c, 0xee99ddbb, 0xa37f60fd, 0xf701269f, 0x5c72f5bc, 0x44663bc5, 0x5bfb7e34,
+	0x8b432976, 0xcb23c6dc, 0xb6edfc68, 0xb8e4f163, 0xd731dcca, 0x42638510, 0x13972240, 0x84c61120,
+	0x854a247d, 0xd2bb3df8, 0xaef93211, 0xc729a16d, 0x1d9e2f4b, 0xdcb230f3, 0x0d8652ec, 0x77c1e3d0,
+	0x2bb3166c, 0xa970b999, 0x119448fa, 0x47e96422, 0xa8fc8cc4, 0xa0f03f1a, 0x567d2cd8, 0x223390ef,
+	0x87494ec7, 0xd938d1c1, 0x8ccaa2fe, 0x98d40b36, 0xa6f581cf, 0xa57ade28, 0xdab78e26, 0x3fadbfa4,
+	0x2c3a9de4, 0x5078920d, 0x6a5fcc9b, 0x547e4662, 0xf68d13c2, 0x90d8b8e8, 0x2e39f75e, 0x82c3aff5,
+	0x9f5d80be, 0x69d0937c, 0x6fd52da9, 0xcf2512b3, 0xc8ac993b, 0x10187da7, 0xe89c636e, 0xdb3bbb7b,
+	0xcd267809, 0x6e5918f4, 0xec9ab701, 0x834f9aa8, 0xe6956e65, 0xaaffe67e, 0x21bccf08, 0xef15e8e6,
+	0xbae79bd9, 0x4a6f36ce, 0xea9f09d4, 0x29b07cd6, 0x31a4b2af, 0x2a3f2331, 0xc6a59430, 0x35a266c0,
+	0x744ebc37, 0xfc82caa6, 0xe090d0b0, 0x33a7d815, 0xf104984a, 0x41ecdaf7, 0x7fcd500e, 0x1791f62f,
+	0x764dd68d, 0x43efb04d, 0xccaa4d54, 0xe49604df, 0x9ed1b5e3, 0x4c6a881b, 0xc12c1fb8, 0x4665517f,
+	0x9d5eea04, 0x018c355d, 0xfa877473, 0xfb0b412e, 0xb3671d5a, 0x92dbd252, 0xe9105633, 0x6dd64713,
+	0x9ad7618c, 0x37a10c7a, 0x59f8148e, 0xeb133c89, 0xcea927ee, 0xb761c935, 0xe11ce5ed, 0x7a47b13c,
+	0x9cd2df59, 0x55f2733f, 0x1814ce79, 0x73c737bf, 0x53f7cdea, 0x5ffdaa5b, 0xdf3d6f14, 0x7844db86,
+	0xcaaff381, 0xb968c43e, 0x3824342c, 0xc2a3405f, 0x161dc372, 0xbce2250c, 0x283c498b, 0xff0d9541,
+	0x39a80171, 0x080cb3de, 0xd8b4e49c, 0x6456c190, 0x7bcb8461, 0xd532b670, 0x486c5c74, 0xd0b85742,
+};
+
+static const uint8_t pdf_md5_shifts[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+uint32_t pdf_load_le32(const uint8_t* data)
+{
+	return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+void pdf_store_le32(uint8_t* data, uint32_t value)
+{
+	for(int i = 0; i < 4; ++i) data[i] = (uint8_t)(value >> 8*i);
+}
+
+uint32_t pdf_load_be32(const uint8_t* data)
+{
+	return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+}
+
+void pdf_store_be32(uint8_t* data, uint32_t value)
+{
+	for(int i = 0; i < 4; ++i) data[i] = (uint8_t)(value >> (24 - 8*i));
+}
+
+uint64_t pdf_load_be64(const uint8_t* data)
+{
+	uint64_t value = 0;
+	for(int i = 0; i < 8; ++i) value = (value << 8) | data[i];
+	return value;
+}
+
+void pdf_store_be64(uint8_t* data, uint64_t value)
+{
+	for(int i = 0; i < 8; ++i) data[i] = (uint8_t)(value >> (56 - 8*i));
+}
+
+uint32_t pdf_rotate_left32(uint32_t value, uint32_t count)
+{
+	return (value << count) | (value >> (32 - count));
+}
+
+uint32_t pdf_rotate_right32(uint32_t value, uint32_t count)
+{
+	return (value >> count) | (value << (32 - count));
+}
+
+uint64_t pdf_rotate_right64(uint64_t value, uint32_t count)
+{
+	return (value >> count) | (value << (64 - count));
+}
+
+typedef struct {
+	uint32_t state[4];
+	uint64_t length;
+	uint8_t buffer[64];
+} PdfMd5;
+
+void pdf_md5_block(uint32_t state[4], const uint8_t* block)
+{
+	uint32_t m[16];
+	for(int i = 0; i < 16; ++i) m[i] = pdf_load_le32(block + 4*i);
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	for(uint32_t i = 0; i < 64; ++i)
+	{
+		uint32_t f, g;
+		if(i < 16)		{ f = (b & c) | (~b & d); g = i; }
+		else if(i < 32) { f = (d & b) | (~d & c); g = (5*i + 1) & 15; }
+		else if(i < 48) { f = b ^ c ^ d; g = (3*i + 5) & 15; }
+		else			{ f = c ^ (b | ~d); g = (7*i) & 15; }
+		f += a + pdf_md5_constants[i] + m[g];
+		a = d;
+		d = c;
+		c = b;
+		b += pdf_rotate_left32(f, pdf_md5_shifts[i]);
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+}
+
+void pdf_md5_begin(PdfMd5* md5)
+{
+	md5->state[0] = 0x67452301;
+	md5->state[1] = 0xefcdab89;
+	md5->state[2] = 0x98badcfe;
+	md5->state[3] = 0x10325476;
+	md5->length = 0;
+}
+
+void pdf_md5_update(PdfMd5* md5, const void* data, size_t length)
+{
+	if(length == 0) return;
+	const uint8_t* bytes = (const uint8_t*)data;
+	size_t used = (size_t)(md5->length % 64);
+	md5->length += length;
+	if(used > 0)
+	{
+		size_t fill = 64 - used;
+		if(length < fill)
+		{
+			memcpy(md5->buffer + used, bytes, length);
+			return;
 		}
+		memcpy(md5->buffer + used, bytes, fill);
+		pdf_md5_block(md5->state, md5->buffer);
+		bytes += fill;
+		length -= fill;
 	}
+	for(; length >= 64; bytes += 64, length -= 64) pdf_md5_block(md5->state, bytes);
+	memcpy(md5->buffer, bytes, length);
+}
 
-	/* printf("Tokens:\n"); */
-	/* for(size_t i = 0; i < next_token_id; ++i) */
-	/* { */
-	/* 	printf("Token %zu: ", i); */
-	/* 	for(size_t j = tokens[i].pos_start; j < tokens[i].pos_end; ++j) */
-	/* 	{ */
-	/* 		printf("%c", buffer[j]); */
-	/* 	} */
-	/* 	printf("\n"); */
-	/* } */
-	
-	
-	free(buffer);
-	fclose(file);
-	return 0;
-	
+void pdf_md5_end(PdfMd5* md5, uint8_t out[16])
+{
+	static const uint8_t padding[64] = {0x80};
+	uint64_t bits = md5->length*8;
+	size_t used = (size_t)(md5->length % 64);
+	pdf_md5_update(md5, padding, used < 56 ? 56 - used : 120 - used);
+	uint8_t size[8];
+	pdf_store_le32(size, (uint32_t)bits);
+	pdf_store_le32(size + 4, (uint32_t)(bits >> 32));
+	pdf_md5_update(md5, size, 8);
+	for(int i = 0; i < 4; ++i) pdf_store_le32(out + 4*i, md5->state[i]);
+}
+
+void pdf_md5(const void* data, size_t length, uint8_t out[16])
+{
+	PdfMd5 md5;
+	pdf_md5_begin(&md5);
+	pdf_md5_update(&md5, data, length);
+	pdf_md5_end(&md5, out);
+}
+
+void pdf_sha256_block(uint32_t state[8], const uint8_t* block)
+{
+	uint32_t w[64];
+	for(int i = 0; i < 16; ++i) w[i] = pdf_load_be32(block + 4*i);
+	for(int i = 16; i < 64; ++i)
+	{
+		uint32_t s0 = pdf_rotate_right32(w[i-15], 7) ^ pdf_rotate_right32(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = pdf_rotate_right32(w[i-2], 17) ^ pdf_rotate_right32(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	uint32_t v[8];
+	memcpy(v, state, sizeof(v));
+	for(int i = 0; i < 64; ++i)
+	{
+		uint32_t s1 = pdf_rotate_right32(v[4], 6) ^ pdf_rotate_right32(v[4], 11) ^ pdf_rotate_right32(v[4], 25);
+		uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+		uint32_t t1 = v[7] + s1 + choice + pdf_sha256_constants[i] + w[i];
+		uint32_t s0 = pdf_rotate_right32(v[0], 2) ^ pdf_rotate_right32(v[0], 13) ^ pdf_rotate_right32(v[0], 22);
+		uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+		memmove(v + 1, v, 7*sizeof(uint32_t));
+		v[4] += t1;
+		v[0] = t1 + s0 + majority;
+	}
+	for(int i = 0; i < 8; ++i) state[i] += v[i];
+}
+
+void pdf_sha512_block(uint64_t state[8], const uint8_t* block)
+{
+	uint64_t w[80];
+	for(int i = 0; i < 16; ++i) w[i] = pdf_load_be64(block + 8*i);
+	for(int i = 16; i < 80; ++i)
+	{
+		uint64_t s0 = pdf_rotate_right64(w[i-15], 1) ^ pdf_rotate_right64(w[i-15], 8) ^ (w[i-15] >> 7);
+		uint64_t s1 = pdf_rotate_right64(w[i-2], 19) ^ pdf_rotate_right64(w[i-2], 61) ^ (w[i-2] >> 6);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	uint64_t v[8];
+	memcpy(v, state, sizeof(v));
+	for(int i = 0; i < 80; ++i)
+	{
+		uint64_t s1 = pdf_rotate_right64(v[4], 14) ^ pdf_rotate_right64(v[4], 18) ^ pdf_rotate_right64(v[4], 41);
+		uint64_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+		uint64_t t1 = v[7] + s1 + choice + pdf_sha512_constants[i] + w[i];
+		uint64_t s0 = pdf_rotate_right64(v[0], 28) ^ pdf_rotate_right64(v[0], 34) ^ pdf_rotate_right64(v[0], 39);
+		uint64_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+		memmove(v + 1, v, 7*sizeof(uint64_t));
+		v[4] += t1;
+		v[0] = t1 + s0 + majority;
+	}
+	for(int i = 0; i < 8; ++i) state[i] += v[i];
+}
+
+// The inputs we hash are small and in one piece, no need to stream them
+void pdf_sha256(const void* data, size_t length, uint8_t out[32])
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint32_t state[8];
+	memcpy(state, pdf_sha256_initial, sizeof(state));
+	size_t full = length & ~(size_t)63;
+	for(size_t i = 0; i < full; i += 64) pdf_sha256_block(state, bytes + i);
+	uint8_t tail[128] = {0};
+	size_t rest = length - full;
+	memcpy(tail, bytes + full, rest);
+	tail[rest] = 0x80;
+	size_t tail_length = rest < 56 ? 64 : 128;
+	pdf_store_be64(tail + tail_length - 8, (uint64_t)length*8);
+	for(size_t i = 0; i < tail_length; i += 64) pdf_sha256_block(state, tail + i);
+	for(int i = 0; i < 8; ++i) pdf_store_be32(out + 4*i, state[i]);
+}
+
+// SHA-512, or SHA-384 with its initial values and an output of 48 bytes
+void pdf_sha512(const void* data, size_t length, const uint64_t initial[8], uint8_t* out, size_t out_length)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	uint64_t state[8];
+	memcpy(state, initial, sizeof(state));
+	size_t full = length & ~(size_t)127;
+	for(size_t i = 0; i < full; i += 128) pdf_sha512_block(state, bytes + i);
+	uint8_t tail[256] = {0};
+	size_t rest = length - full;
+	memcpy(tail, bytes + full, rest);
+	tail[rest] = 0x80;
+	size_t tail_length = rest < 112 ? 128 : 256;
+	pdf_store_be64(tail + tail_length - 8, (uint64_t)length*8);
+	for(size_t i = 0; i < tail_length; i += 128) pdf_sha512_block(state, tail + i);
+	for(size_t i = 0; i < out_length/8; ++i) pdf_store_be64(out + 8*i, state[i]);
+}
+
+typedef struct {
+	uint8_t s[256];
+	uint8_t i, j;
+} PdfRc4;
+
+void pdf_rc4_init(PdfRc4* rc4, const uint8_t* key, size_t key_length)
+{
+	for(int i = 0; i < 256; ++i) rc4->s[i] = (uint8_t)i;
+	uint8_t j = 0;
+	for(int i = 0; i < 256; ++i)
+	{
+		j = (uint8_t)(j + rc4->s[i] + key[i % key_length]);
+		uint8_t swap = rc4->s[i];
+		rc4->s[i] = rc4->s[j];
+		rc4->s[j] = swap;
+	}
+	rc4->i = 0;
+	rc4->j = 0;
+}
+
+// Encrypts or decrypts, 'out' may be 'in'
+void pdf_rc4_apply(PdfRc4* rc4, const uint8_t* in, uint8_t* out, size_t length)
+{
+	uint8_t i = rc4->i, j = rc4->j;
+	for(size_t k = 0; k < length; ++k)
+	{
+		i = (uint8_t)(i + 1);
+		j = (uint8_t)(j + rc4->s[i]);
+		uint8_t swap = rc4->s[i];
+		rc4->s[i] = rc4->s[j];
+		rc4->s[j] = swap;
+		out[k] = in[k] ^ rc4->s[(uint8_t)(rc4->s[i] + rc4->s[j])];
+	}
+	rc4->i = i;
+	rc4->j = j;
+}
+
+typedef struct {
+	uint8_t round_keys[15][16]; // Of the encryption, in the byte order of FIPS-197
+	uint32_t decrypt_keys[15][4]; // Of the equivalent inverse cipher, as big endian columns
+	uint32_t rounds;			// 10 for AES-128, 14 for AES-256
+	bool has_aes_ni;
+} PdfAes;
+
+uint8_t pdf_aes_xtime(uint8_t value)
+{
+	return (uint8_t)((value << 1) ^ ((value >> 7)*0x1b));
+}
+
+// 'key_length' is 16 or 32 bytes
+void pdf_aes_init(PdfAes* aes, const uint8_t* key, size_t key_length)
+{
+	size_t words = key_length/4;
+	aes->rounds = (uint32_t)words + 6;
+	aes->has_aes_ni = pdf_cpu_has_aes();
+	uint8_t* w = &aes->round_keys[0][0];
+	memcpy(w, key, key_length);
+	uint8_t rcon = 1;
+	for(size_t i = words; i < 4*((size_t)aes->rounds + 1); ++i)
+	{
+		uint8_t t[4];
+		memcpy(t, w + 4*(i - 1), 4);
+		if(i % words == 0)
+		{
+			uint8_t first = t[0];
+			t[0] = pdf_aes_sbox[t[1]] ^ rcon;
+			t[1] = pdf_aes_sbox[t[2]];
+			t[2] = pdf_aes_sbox[t[3]];
+			t[3] = pdf_aes_sbox[first];
+			rcon = pdf_aes_xtime(rcon);
+		}
+		else if(words > 6 && i % words == 4)
+		{
+			for(int k = 0; k < 4; ++k) t[k] = pdf_aes_sbox[t[k]];
+		}
+		for(int k = 0; k < 4; ++k) w[4*i + k] = w[4*(i - words) + k] ^ t[k];
+	}
+
+	// The inner keys of the equivalent inverse cipher go through InvMixColumns, the
+	// table gives it for free once the S-box of the table is undone
+	for(uint32_t round = 0; round <= aes->rounds; ++round)
+	{
+		for(int c = 0; c < 4; ++c)
+		{
+			uint32_t column = pdf_load_be32(aes->round_keys[aes->rounds - round] + 4*c);
+			if(round > 0 && round < aes->rounds)
+			{
+				column = pdf_aes_inverse_table[pdf_aes_sbox[column >> 24]]
+					^ pdf_rotate_right32(pdf_aes_inverse_table[pdf_aes_sbox[(column >> 16) & 0xff]], 8)
+					^ pdf_rotate_right32(pdf_aes_inverse_table[pdf_aes_sbox[(column >> 8) & 0xff]], 16)
+					^ pdf_rotate_right32(pdf_aes_inverse_table[pdf_aes_sbox[column & 0xff]], 24);
+			}
+			aes->decrypt_keys[round][c] = column;
+		}
+	}
+}
+
+// The state is stored column by column, row 'r' of column 'c' is at 4*c + r
+void pdf_aes_mix_columns(uint8_t* state)
+{
+	for(int c = 0; c < 4; ++c)
+	{
+		uint8_t* column = state + 4*c;
+		uint8_t a0 = column[0], a1 = column[1], a2 = column[2], a3 = column[3];
+		uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+		column[0] = a0 ^ all ^ pdf_aes_xtime(a0 ^ a1);
+		column[1] = a1 ^ all ^ pdf_aes_xtime(a1 ^ a2);
+		column[2] = a2 ^ all ^ pdf_aes_xtime(a2 ^ a3);
+		column[3] = a3 ^ all ^ pdf_aes_xtime(a3 ^ a0);
+	}
+}
+
+void pdf_aes_encrypt_block(const PdfAes* aes, const uint8_t* in, uint8_t* out)
+{
+	uint8_t state[16], shifted[16];
+	for(int k = 0; k < 16; ++k) state[k] = in[k] ^ aes->round_keys[0][k];
+	for(uint32_t round = 1; round <= aes->rounds; ++round)
+	{
+		// SubBytes and ShiftRows, row 'r' moves 'r' columns to the left
+		for(int c = 0; c < 4; ++c)
+			for(int r = 0; r < 4; ++r) shifted[4*c + r] = pdf_aes_sbox[state[4*((c + r) & 3) + r]];
+		if(round < aes->rounds) pdf_aes_mix_columns(shifted);
+		for(int k = 0; k < 16; ++k) state[k] = shifted[k] ^ aes->round_keys[round][k];
+	}
+	memcpy(out, state, 16);
+}
+
+// NOTE(Sam): Decryption is the hot path of the portable fallback, it works on 32 bits
+// columns with the table instead of bytes
+void pdf_aes_decrypt_block(const PdfAes* aes, const uint8_t* in, uint8_t* out)
+{
+	const uint32_t* key = aes->decrypt_keys[0];
+	uint32_t s0 = pdf_load_be32(in) ^ key[0];
+	uint32_t s1 = pdf_load_be32(in + 4) ^ key[1];
+	uint32_t s2 = pdf_load_be32(in + 8) ^ key[2];
+	uint32_t s3 = pdf_load_be32(in + 12) ^ key[3];
+#define PDF_AES_INVERSE_COLUMN(a, b, c, d) \
+	(pdf_aes_inverse_table[(a) >> 24] \
+	 ^ pdf_rotate_right32(pdf_aes_inverse_table[((b) >> 16) & 0xff], 8) \
+	 ^ pdf_rotate_right32(pdf_aes_inverse_table[((c) >> 8) & 0xff], 16) \
+	 ^ pdf_rotate_right32(pdf_aes_inverse_table[(d) & 0xff], 24))
+	for(uint32_t round = 1; round < aes->rounds; ++round)
+	{
+		key = aes->decrypt_keys[round];
+		uint32_t t0 = PDF_AES_INVERSE_COLUMN(s0, s3, s2, s1) ^ key[0];
+		uint32_t t1 = PDF_AES_INVERSE_COLUMN(s1, s0, s3, s2) ^ key[1];
+		uint32_t t2 = PDF_AES_INVERSE_COLUMN(s2, s1, s0, s3) ^ key[2];
+		uint32_t t3 = PDF_AES_INVERSE_COLUMN(s3, s2, s1, s0) ^ key[3];
+		s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+	}
+#undef PDF_AES_INVERSE_COLUMN
+#define PDF_AES_INVERSE_LAST(a, b, c, d) \
+	(((uint32_t)pdf_aes_inverse_sbox[(a) >> 24] << 24) \
+	 | ((uint32_t)pdf_aes_inverse_sbox[((b) >> 16) & 0xff] << 16) \
+	 | ((uint32_t)pdf_aes_inverse_sbox[((c) >> 8) & 0xff] << 8) \
+	 | (uint32_t)pdf_aes_inverse_sbox[(d) & 0xff])
+	key = aes->decrypt_keys[aes->rounds];
+	pdf_store_be32(out, PDF_AES_INVERSE_LAST(s0, s3, s2, s1) ^ key[0]);
+	pdf_store_be32(out + 4, PDF_AES_INVERSE_LAST(s1, s0, s3, s2) ^ key[1]);
+	pdf_store_be32(out + 8, PDF_AES_INVERSE_LAST(s2, s1, s0, s3) ^ key[2]);
+	pdf_store_be32(out + 12, PDF_AES_INVERSE_LAST(s3, s2, s1, s0) ^ key[3]);
+#undef PDF_AES_INVERSE_LAST
+}
+
+#ifdef PDF_USE_AES_NI
+PDF_TARGET_AES
+void pdf_aes_ni_encrypt_cbc(const PdfAes* aes, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t length)
+{
+	__m128i keys[15];
+	for(uint32_t i = 0; i <= aes->rounds; ++i) keys[i] = _mm_loadu_si128((const __m128i*)aes->round_keys[i]);
+	__m128i block = _mm_loadu_si128((const __m128i*)iv);
+	for(size_t pos = 0; pos < length; pos += 16)
+	{
+		block = _mm_xor_si128(block, _mm_loadu_si128((const __m128i*)(in + pos)));
+		block = _mm_xor_si128(block, keys[0]);
+		for(uint32_t i = 1; i < aes->rounds; ++i) block = _mm_aesenc_si128(block, keys[i]);
+		block = _mm_aesenclast_si128(block, keys[aes->rounds]);
+		_mm_storeu_si128((__m128i*)(out + pos), block);
+	}
+}
+
+PDF_TARGET_AES
+void pdf_aes_ni_decrypt_cbc(const PdfAes* aes, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t length)
+{
+	// Keys of the equivalent inverse cipher, in reverse order
+	uint32_t rounds = aes->rounds;
+	__m128i keys[15];
+	keys[0] = _mm_loadu_si128((const __m128i*)aes->round_keys[rounds]);
+	for(uint32_t i = 1; i < rounds; ++i) keys[i] = _mm_aesimc_si128(_mm_loadu_si128((const __m128i*)aes->round_keys[rounds - i]));
+	keys[rounds] = _mm_loadu_si128((const __m128i*)aes->round_keys[0]);
+
+	__m128i previous = _mm_loadu_si128((const __m128i*)iv);
+	size_t pos = 0;
+	for(; pos + 64 <= length; pos += 64)
+	{
+		__m128i c0 = _mm_loadu_si128((const __m128i*)(in + pos));
+		__m128i c1 = _mm_loadu_si128((const __m128i*)(in + pos + 16));
+		__m128i c2 = _mm_loadu_si128((const __m128i*)(in + pos + 32));
+		__m128i c3 = _mm_loadu_si128((const __m128i*)(in + pos + 48));
+		__m128i x0 = _mm_xor_si128(c0, keys[0]);
+		__m128i x1 = _mm_xor_si128(c1, keys[0]);
+		__m128i x2 = _mm_xor_si128(c2, keys[0]);
+		__m128i x3 = _mm_xor_si128(c3, keys[0]);
+		for(uint32_t i = 1; i < rounds; ++i)
+		{
+			x0 = _mm_aesdec_si128(x0, keys[i]);
+			x1 = _mm_aesdec_si128(x1, keys[i]);
+			x2 = _mm_aesdec_si128(x2, keys[i]);
+			x3 = _mm_aesdec_si128(x3, keys[i]);
+		}
+		x0 = _mm_aesdeclast_si128(x0, keys[rounds]);
+		x1 = _mm_aesdeclast_si128(x1, keys[rounds]);
+		x2 = _mm_aesdeclast_si128(x2, keys[rounds]);
+		x3 = _mm_aesdeclast_si128(x3, keys[rounds]);
+		_mm_storeu_si128((__m128i*)(out + pos), _mm_xor_si128(x0, previous));
+		_mm_storeu_si128((__m128i*)(out + pos + 16), _mm_xor_si128(x1, c0));
+		_mm_storeu_si128((__m128i*)(out + pos + 32), _mm_xor_si128(x2, c1));
+		_mm_storeu_si128((__m128i*)(out + pos + 48), _mm_xor_si128(x3, c2));
+		previous = c3;
+	}
+	for(; pos < length; pos += 16)
+	{
+		__m128i c = _mm_loadu_si128((const __m128i*)(in + pos));
+		__m128i x = _mm_xor_si128(c, keys[0]);
+		for(uint32_t i = 1; i < rounds; ++i) x = _mm_aesdec_si128(x, keys[i]);
+		x = _mm_aesdeclast_si128(x, keys[rounds]);
+		_mm_storeu_si128((__m128i*)(out + pos), _mm_xor_si128(x, previous));
+		previous = c;
+	}
+}
+#endif
+
+// 'length' must be a multiple of 16, 'out' may be 'in'
+void pdf_aes_encrypt_cbc(const PdfAes* aes, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t length)
+{
+#ifdef PDF_USE_AES_NI
+	if(aes->has_aes_ni)
+	{
+		pdf_aes_ni_encrypt_cbc(aes, iv, in, out, length);
+		return;
+	}
+#endif
+	uint8_t block[16];
+	memcpy(block, iv, 16);
+	for(size_t pos = 0; pos < length; pos += 16)
+	{
+		for(int k = 0; k < 16; ++k) block[k] ^= in[pos + k];
+		pdf_aes_encrypt_block(aes, block, block);
+		memcpy(out + pos, block, 16);
+	}
+}
+
+// 'length' must be a multiple of 16, 'out' may be 'in' or any address
+// before it, the blocks are read before their plaintext is written.
+void pdf_aes_decrypt_cbc(const PdfAes* aes, const uint8_t iv[16], const uint8_t* in, uint8_t* out, size_t length)
+{
+#ifdef PDF_USE_AES_NI
+	if(aes->has_aes_ni)
+	{
+		pdf_aes_ni_decrypt_cbc(aes, iv, in, out, length);
+		return;
+	}
+#endif
+	uint8_t previous[16], cipher[16], plain[16];
+	memcpy(previous, iv, 16);
+	for(size_t pos = 0; pos < length; pos += 16)
+	{
+		memcpy(cipher, in + pos, 16);
+		pdf_aes_decrypt_block(aes, cipher, plain);
+		for(int k = 0; k < 16; ++k) out[pos + k] = plain[k] ^ previous[k];
+		memcpy(previous, cipher, 16);
+	}
+}
+
+// The key of one object, see pdf_encryption_object_key
+typedef struct {
+	int method; // PDF_CRYPT_*
+	uint8_t key[32];
+	size_t length;
+} PdfCryptKey;
+
+// Decrypts 'length' bytes of 'in' in 'out', which may be 'in'. Returns the
+// length of the plain data, AES removes its IV and padding.
+// NOTE(Sam): A broken AES padding is kept as data, and a trailing partial
+//            block is dropped, rather than failing on sloppy writers.
+size_t pdf_crypt_decrypt(const PdfCryptKey* key, const uint8_t* in, size_t length, uint8_t* out)
+{
+	if(key->method == PDF_CRYPT_RC4)
+	{
+		PdfRc4 rc4;
+		pdf_rc4_init(&rc4, key->key, key->length);
+		pdf_rc4_apply(&rc4, in, out, length);
+		return length;
+	}
+	if(key->method == PDF_CRYPT_AES)
+	{
+		// The IV is the first block
+		if(length < 32) return 0;
+		size_t plain_length = (length - 16) & ~(size_t)15;
+		uint8_t iv[16];
+		memcpy(iv, in, 16);
+		PdfAes aes;
+		pdf_aes_init(&aes, key->key, key->length);
+		pdf_aes_decrypt_cbc(&aes, iv, in + 16, out, plain_length);
+		uint8_t padding = out[plain_length - 1];
+		bool is_padded = padding >= 1 && padding <= 16;
+		for(size_t i = 1; is_padded && i < padding; ++i) is_padded = out[plain_length - 1 - i] == padding;
+		return is_padded ? plain_length - padding : plain_length;
+	}
+	if(out != in) memmove(out, in, length);
+	return length;
+}
+
+/*
+  FILTERS:
+  - Stream data is decoded through its /Filter chain in a new buffer,
+    only /FlateDecode (zlib) and its PNG/TIFF predictors for now, which
+    is what xref and object streams use.
+  - The encoder is an LZ77 with hash chains and one step of lazy matching.
+    Each block of tokens is written with whichever of the fixed Huffman
+    codes, codes built for the block or stored bytes is the smallest.
+    It compresses a bit less than zlib, with much shorter chains.
+ */
+
+static const uint16_t pdf_flate_length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t pdf_flate_length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t pdf_flate_distance_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t pdf_flate_distance_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+typedef struct {
+	const uint8_t* data;
+	size_t length;
+	size_t pos;
+	uint32_t bit_buffer;
+	uint32_t bit_count;
+	uint8_t* out;
+	size_t out_length;
+	size_t out_capacity;
+	bool failed;
+} PdfInflate;
+
+// Canonical Huffman code, decoded one bit at a time from the count of
+// codes of each length (see zlib's puff.c)
+typedef struct {
+	uint16_t counts[16];
+	uint16_t symbols[288];
+} PdfHuffman;
+
+uint32_t pdf_inflate_bits(PdfInflate* state, uint32_t count)
+{
+	while(state->bit_count < count)
+	{
+		if(state->pos >= state->length)
+		{
+			state->failed = true;
+			return 0;
+		}
+		state->bit_buffer |= (uint32_t)state->data[state->pos++] << state->bit_count;
+		state->bit_count += 8;
+	}
+	uint32_t value = state->bit_buffer & ((1u << count) - 1);
+	state->bit_buffer >>= count;
+	state->bit_count -= count;
+	return value;
+}
+
+bool pdf_inflate_reserve(PdfInflate* state, size_t count)
+{
+	if(state->out_capacity - state->out_length >= count) return true;
+	size_t capacity = 2*state->out_capacity;
+	if(capacity < state->out_length + count) capacity = state->out_length + count;
+	// The padding is always kept after the decoded data
+	uint8_t* out = (uint8_t*)pdf_realloc(state->out, capacity + PDF_BUFFER_PADDING);
+	if(out == NULL)
+	{
+		state->failed = true;
+		return false;
+	}
+	state->out = out;
+	state->out_capacity = capacity;
+	return true;
+}
+
+void pdf_huffman_build(PdfHuffman* huffman, const uint8_t* lengths, size_t count)
+{
+	uint16_t offsets[16];
+	memset(huffman->counts, 0, sizeof(huffman->counts));
+	for(size_t i = 0; i < count; ++i) huffman->counts[lengths[i]] += 1;
+	huffman->counts[0] = 0;
+	offsets[1] = 0;
+	for(size_t len = 1; len < 15; ++len) offsets[len + 1] = offsets[len] + huffman->counts[len];
+	for(size_t i = 0; i < count; ++i)
+		if(lengths[i] != 0) huffman->symbols[offsets[lengths[i]]++] = (uint16_t)i;
+}
+
+int pdf_huffman_decode(PdfInflate* state, const PdfHuffman* huffman)
+{
+	int code = 0, first = 0, index = 0;
+	for(int len = 1; len < 16; ++len)
+	{
+		code |= (int)pdf_inflate_bits(state, 1);
+		int count = huffman->counts[len];
+		if(code - count < first) return huffman->symbols[index + (code - first)];
+		index += count;
+		first = (first + count) << 1;
+		code <<= 1;
+		if(state->failed) return -1;
+	}
+	return -1;
+}
+
+bool pdf_inflate_codes(PdfInflate* state, const PdfHuffman* lengths, const PdfHuffman* distances)
+{
+	while(true)
+	{
+		int symbol = pdf_huffman_decode(state, lengths);
+		if(symbol < 0) return false;
+		if(symbol < 256)
+		{
+			if(!pdf_inflate_reserve(state, 1)) return false;
+			state->out[state->out_length++] = (uint8_t)symbol;
+			continue;
+		}
+		if(symbol == 256) return true;
+
+		symbol -= 257;
+		if(symbol >= 29) return false;
+		size_t length = pdf_flate_length_base[symbol] + pdf_inflate_bits(state, pdf_flate_length_extra[symbol]);
+		int distance_symbol = pdf_huffman_decode(state, distances);
+		if(distance_symbol < 0 || distance_symbol >= 30) return false;
+		size_t distance = pdf_flate_distance_base[distance_symbol]
+			+ pdf_inflate_bits(state, pdf_flate_distance_extra[distance_symbol]);
+		if(state->failed || distance > state->out_length) return false;
+		if(!pdf_inflate_reserve(state, length)) return false;
+		// NOTE(Sam): The copy may overlap itself, it must go byte per byte
+		uint8_t* out = state->out + state->out_length;
+		const uint8_t* from = out - distance;
+		for(size_t i = 0; i < length; ++i) out[i] = from[i];
+		state->out_length += length;
+	}
+}
+
+bool pdf_inflate_dynamic(PdfInflate* state)
+{
+	static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	uint8_t lengths[320] = {0};
+	size_t lengths_count = pdf_inflate_bits(state, 5) + 257;
+	size_t distances_count = pdf_inflate_bits(state, 5) + 1;
+	size_t codes_count = pdf_inflate_bits(state, 4) + 4;
+	if(state->failed || lengths_count > 286 || distances_count > 30) return false;
+
+	for(size_t i = 0; i < codes_count; ++i) lengths[order[i]] = (uint8_t)pdf_inflate_bits(state, 3);
+	PdfHuffman codes, lengths_code, distances_code;
+	pdf_huffman_build(&codes, lengths, 19);
+
+	memset(lengths, 0, sizeof(lengths));
+	size_t i = 0;
+	while(i < lengths_count + distances_count)
+	{
+		int symbol = pdf_huffman_decode(state, &codes);
+		if(symbol < 0) return false;
+		if(symbol < 16)
+		{
+			lengths[i++] = (uint8_t)symbol;
+			continue;
+		}
+		uint8_t repeated = 0;
+		size_t repeat;
+		if(symbol == 16)
+		{
+			if(i == 0) return false;
+			repeated = lengths[i - 1];
+			repeat = 3 + pdf_inflate_bits(state, 2);
+		}
+		else if(symbol == 17) repeat = 3 + pdf_inflate_bits(state, 3);
+		else repeat = 11 + pdf_inflate_bits(state, 7);
+		if(i + repeat > lengths_count + distances_count) return false;
+		while(repeat--) lengths[i++] = repeated;
+	}
+	if(state->failed || lengths[256] == 0) return false;
+
+	pdf_huffman_build(&lengths_code, lengths, lengths_count);
+	pdf_huffman_build(&distances_code, lengths + lengths_count, distances_count);
+	return pdf_inflate_codes(state, &lengths_code, &distances_code);
+}
+
+bool pdf_inflate_fixed(PdfInflate* state)
+{
+	// NOTE(Sam): Built once per call, it is cheap compared to a block
+	uint8_t lengths[288];
+	size_t i = 0;
+	for(; i < 144; ++i) lengths[i] = 8;
+	for(; i < 256; ++i) lengths[i] = 9;
+	for(; i < 280; ++i) lengths[i] = 7;
+	for(; i < 288; ++i) lengths[i] = 8;
+	PdfHuffman lengths_code, distances_code;
+	pdf_huffman_build(&lengths_code, lengths, 288);
+	for(i = 0; i < 30; ++i) lengths[i] = 5;
+	pdf_huffman_build(&distances_code, lengths, 30);
+	return pdf_inflate_codes(state, &lengths_code, &distances_code);
+}
+
+bool pdf_inflate_stored(PdfInflate* state)
+{
+	// Skip to the next byte, less than 8 bits are ever left in the buffer
+	state->bit_buffer = 0;
+	state->bit_count = 0;
+	if(state->pos + 4 > state->length) return false;
+	size_t length = state->data[state->pos] | (size_t)state->data[state->pos + 1] << 8;
+	state->pos += 4;
+	if(length > state->length - state->pos) return false;
+	if(!pdf_inflate_reserve(state, length)) return false;
+	memcpy(state->out + state->out_length, state->data + state->pos, length);
+	state->out_length += length;
+	state->pos += length;
+	return true;
+}
+
+// Decodes zlib (or raw deflate) data in a new buffer followed by
+// PDF_BUFFER_PADDING zeros, the caller must free it with pdf_free.
+// NOTE(Sam): Damaged streams are common, whatever could be decoded before
+//            an error is returned as long as it is not empty.
+bool pdf_flate_decode(const uint8_t* data, size_t length, uint8_t** out_data, size_t* out_length)
+{
+	PdfInflate state = {0};
+	state.data = data;
+	state.length = length;
+	*out_data = NULL;
+	*out_length = 0;
+
+	// The zlib header is 'CMF FLG' where CMF is 0x?8 and the pair a multiple of 31
+	if(length >= 2 && (data[0] & 0x0F) == 8 && ((data[0] << 8) | data[1]) % 31 == 0)
+	{
+		if(data[1] & 0x20) return false; // Preset dictionary, never used in PDF
+		state.pos = 2;
+	}
+
+	size_t capacity = length < 1024 ? 4096 : length < (1 << 24) ? 4*length : length;
+	if(!pdf_inflate_reserve(&state, capacity)) return false;
+	bool is_last = false;
+	while(!is_last)
+	{
+		is_last = pdf_inflate_bits(&state, 1);
+		uint32_t type = pdf_inflate_bits(&state, 2);
+		bool success = false;
+		if(state.failed) success = false;
+		else if(type == 0) success = pdf_inflate_stored(&state);
+		else if(type == 1) success = pdf_inflate_fixed(&state);
+		else if(type == 2) success = pdf_inflate_dynamic(&state);
+		if(!success)
+		{
+			state.failed = true;
+			break;
+		}
+	}
+
+	if(state.failed && state.out_length == 0)
+	{
+		pdf_free(state.out);
+		return false;
+	}
+	memset(state.out + state.out_length, 0, PDF_BUFFER_PADDING);
+	*out_data = state.out;
+	*out_length = state.out_length;
+	return true;
+}
+
+typedef struct {
+	uint8_t* out;
+	size_t out_length;
+	size_t out_capacity;
+	uint64_t bit_buffer;
+	uint32_t bit_count;
+	bool failed;
+} PdfDeflate;
+
+// Moves the complete bytes of the bit buffer to the output
+void pdf_deflate_emit(PdfDeflate* state)
+{
+	if(state->out_capacity - state->out_length < 8)
+	{
+		size_t capacity = 2*state->out_capacity + 64;
+		uint8_t* out = (uint8_t*)pdf_realloc(state->out, capacity);
+		if(out == NULL)
+		{
+			state->failed = true;
+			state->bit_count = 0;
+			return;
+		}
+		state->out = out;
+		state->out_capacity = capacity;
+	}
+	while(state->bit_count >= 8)
+	{
+		state->out[state->out_length++] = (uint8_t)state->bit_buffer;
+		state->bit_buffer >>= 8;
+		state->bit_count -= 8;
+	}
+}
+
+void pdf_deflate_bits(PdfDeflate* state, uint32_t value, uint32_t count)
+{
+	state->bit_buffer |= (uint64_t)value << state->bit_count;
+	state->bit_count += count;
+	if(state->bit_count >= 32) pdf_deflate_emit(state);
+}
+
+// Writes bytes as they are, the bit buffer must be at a byte boundary
+void pdf_deflate_write_bytes(PdfDeflate* state, const uint8_t* data, size_t length)
+{
+	pdf_deflate_emit(state);
+	if(state->failed) return;
+	if(state->out_capacity - state->out_length < length + 8)
+	{
+		size_t capacity = 2*state->out_capacity + length + 64;
+		uint8_t* out = (uint8_t*)pdf_realloc(state->out, capacity);
+		if(out == NULL)
+		{
+			state->failed = true;
+			return;
+		}
+		state->out = out;
+		state->out_capacity = capacity;
+	}
+	memcpy(state->out + state->out_length, data, length);
+	state->out_length += length;
+}
+
+// Huffman codes are written most significant bit first
+uint32_t pdf_reverse_bits(uint32_t code, uint32_t count)
+{
+	uint32_t reversed = 0;
+	for(uint32_t i = 0; i < count; ++i)
+	{
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+	return reversed;
+}
+
+uint32_t pdf_deflate_length_code(size_t length)
+{
+	uint32_t code = 28;
+	while(pdf_flate_length_base[code] > length) --code;
+	return code;
+}
+
+uint32_t pdf_deflate_distance_code(size_t distance)
+{
+	uint32_t code = 29;
+	while(pdf_flate_distance_base[code] > distance) --code;
+	return code;
+}
+
+typedef struct {
+	uint32_t weight;
+	uint16_t symbol;
+} PdfHuffmanLeaf;
+
+static int pdf_compare_huffman_leaves(const void* a, const void* b)
+{
+	const PdfHuffmanLeaf* leaf_a = (const PdfHuffmanLeaf*)a;
+	const PdfHuffmanLeaf* leaf_b = (const PdfHuffmanLeaf*)b;
+	if(leaf_a->weight != leaf_b->weight) return leaf_a->weight < leaf_b->weight ? -1 : 1;
+	return (int)leaf_a->symbol - (int)leaf_b->symbol;
+}
+
+// Lengths of a Huffman code of the 'count' (at most 288) symbols of
+// 'frequencies', none longer than 'max_length' bits. Unused symbols get 0.
+// At least two symbols must be used.
+// NOTE(Sam): Codes too long are rare, frequencies are then flattened and
+//            the code built again instead of limiting lengths exactly.
+void pdf_huffman_lengths(const uint32_t* frequencies, size_t count, uint32_t max_length, uint8_t* out_lengths)
+{
+	PdfHuffmanLeaf leaves[288];
+	uint32_t weights[2*288];	// Leaves in order of weight, then the nodes merged
+	uint16_t parents[2*288];
+	uint8_t depths[2*288];
+	memset(out_lengths, 0, count);
+	for(uint32_t divisor = 1; ; divisor *= 2)
+	{
+		size_t leaves_count = 0;
+		for(size_t i = 0; i < count; ++i)
+		{
+			if(frequencies[i] == 0) continue;
+			leaves[leaves_count].weight = frequencies[i]/divisor + 1;
+			leaves[leaves_count++].symbol = (uint16_t)i;
+		}
+		qsort(leaves, leaves_count, sizeof(PdfHuffmanLeaf), pdf_compare_huffman_leaves);
+		for(size_t i = 0; i < leaves_count; ++i) weights[i] = leaves[i].weight;
+
+		// Merged nodes come in increasing weights, so the two lightest are
+		// always at the front of the leaves or of the merged nodes
+		size_t next_leaf = 0, next_node = leaves_count, nodes = leaves_count;
+		while(nodes < 2*leaves_count - 1)
+		{
+			size_t pair[2];
+			for(size_t j = 0; j < 2; ++j)
+			{
+				if(next_leaf < leaves_count && (next_node == nodes || weights[next_leaf] <= weights[next_node]))
+					pair[j] = next_leaf++;
+				else pair[j] = next_node++;
+			}
+			weights[nodes] = weights[pair[0]] + weights[pair[1]];
+			parents[pair[0]] = parents[pair[1]] = (uint16_t)nodes;
+			++nodes;
+		}
+		// Parents are always after their children, depths are found backwards
+		uint32_t longest = 0;
+		depths[nodes - 1] = 0;
+		for(size_t i = nodes - 1; i-- > 0; )
+		{
+			depths[i] = depths[parents[i]] + 1;
+			if(depths[i] > longest) longest = depths[i];
+		}
+		if(longest <= max_length)
+		{
+			for(size_t i = 0; i < leaves_count; ++i) out_lengths[leaves[i].symbol] = depths[i];
+			return;
+		}
+	}
+}
+
+// Canonical codes (bits reversed, ready to write) of the code 'lengths'
+void pdf_huffman_codes(const uint8_t* lengths, size_t count, uint16_t* out_codes)
+{
+	uint32_t counts[16] = {0};
+	uint32_t next[16];
+	for(size_t i = 0; i < count; ++i) counts[lengths[i]] += 1;
+	counts[0] = 0;
+	uint32_t code = 0;
+	for(size_t len = 1; len < 16; ++len)
+	{
+		code = (code + counts[len - 1]) << 1;
+		next[len] = code;
+	}
+	for(size_t i = 0; i < count; ++i)
+		out_codes[i] = lengths[i] == 0 ? 0 : (uint16_t)pdf_reverse_bits(next[lengths[i]]++, lengths[i]);
+}
+
+// LZ77 output, a literal byte (distance 0) or a match
+typedef struct {
+	uint16_t value;
+	uint16_t distance;
+} PdfDeflateToken;
+
+// Tokens written in each block, each block has its own Huffman codes
+#define PDF_DEFLATE_BLOCK_TOKENS (1 << 15)
+
+// Writes the 'count' tokens of 'tokens' with the codes of 'lengths' (288
+// literal/length symbols then 30 distance symbols)
+void pdf_deflate_tokens(PdfDeflate* state, const PdfDeflateToken* tokens, size_t count, const uint8_t* lengths)
+{
+	uint16_t codes[288 + 30];
+	pdf_huffman_codes(lengths, 288, codes);
+	pdf_huffman_codes(lengths + 288, 30, codes + 288);
+	for(size_t i = 0; i < count; ++i)
+	{
+		if(tokens[i].distance == 0)
+		{
+			pdf_deflate_bits(state, codes[tokens[i].value], lengths[tokens[i].value]);
+			continue;
+		}
+		uint32_t code = pdf_deflate_length_code(tokens[i].value);
+		pdf_deflate_bits(state, codes[257 + code], lengths[257 + code]);
+		pdf_deflate_bits(state, tokens[i].value - pdf_flate_length_base[code], pdf_flate_length_extra[code]);
+		code = pdf_deflate_distance_code(tokens[i].distance);
+		pdf_deflate_bits(state, codes[288 + code], lengths[288 + code]);
+		pdf_deflate_bits(state, tokens[i].distance - pdf_flate_distance_base[code], pdf_flate_distance_extra[code]);
+	}
+	pdf_deflate_bits(state, codes[256], lengths[256]);
+}
+
+// Bits taken by the 'count' tokens with the codes of 'lengths'
+uint64_t pdf_deflate_tokens_cost(const uint32_t* frequencies, const uint8_t* lengths)
+{
+	uint64_t bits = 0;
+	for(size_t i = 0; i < 288; ++i) bits += (uint64_t)frequencies[i]*lengths[i];
+	for(size_t i = 0; i < 29; ++i) bits += (uint64_t)frequencies[257 + i]*pdf_flate_length_extra[i];
+	for(size_t i = 0; i < 30; ++i)
+		bits += (uint64_t)frequencies[288 + i]*(lengths[288 + i] + pdf_flate_distance_extra[i]);
+	return bits;
+}
+
+// Writes a block of 'count' tokens encoding the bytes 'data' of 'length',
+// in whichever of the fixed codes, codes of its own or stored bytes is
+// the smallest.
+void pdf_deflate_block(PdfDeflate* state, const PdfDeflateToken* tokens, size_t count,
+					   const uint8_t* data, size_t length, bool is_last)
+{
+	static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	uint32_t frequencies[288 + 30] = {0};
+	for(size_t i = 0; i < count; ++i)
+	{
+		if(tokens[i].distance == 0) frequencies[tokens[i].value] += 1;
+		else
+		{
+			frequencies[257 + pdf_deflate_length_code(tokens[i].value)] += 1;
+			frequencies[288 + pdf_deflate_distance_code(tokens[i].distance)] += 1;
+		}
+	}
+	frequencies[256] = 1;
+
+	uint8_t fixed[288 + 30];
+	size_t i = 0;
+	for(; i < 144; ++i) fixed[i] = 8;
+	for(; i < 256; ++i) fixed[i] = 9;
+	for(; i < 280; ++i) fixed[i] = 7;
+	for(; i < 288; ++i) fixed[i] = 8;
+	for(; i < 288 + 30; ++i) fixed[i] = 5;
+	uint64_t fixed_cost = 3 + pdf_deflate_tokens_cost(frequencies, fixed);
+
+	// Codes need two symbols, unused ones cost nothing but a length
+	if(count == 0) frequencies[0] = 1;
+	size_t distances_used = 0;
+	for(i = 0; i < 30; ++i) distances_used += frequencies[288 + i] != 0;
+	for(i = 0; distances_used < 2; ++i)
+	{
+		if(frequencies[288 + i] == 0)
+		{
+			frequencies[288 + i] = 1;
+			++distances_used;
+		}
+	}
+	// Symbols 286 and 287 only exist in the fixed code
+	uint8_t lengths[288 + 30] = {0};
+	pdf_huffman_lengths(frequencies, 286, 15, lengths);
+	pdf_huffman_lengths(frequencies + 288, 30, 15, lengths + 288);
+	size_t lengths_count = 286, distances_count = 30;
+	while(lengths[lengths_count - 1] == 0) --lengths_count;
+	while(lengths[288 + distances_count - 1] == 0) --distances_count;
+
+	// The code lengths are themselves run length and Huffman coded
+	uint8_t all[288 + 30];
+	memcpy(all, lengths, lengths_count);
+	memcpy(all + lengths_count, lengths + 288, distances_count);
+	size_t all_count = lengths_count + distances_count;
+	uint8_t runs[288 + 30];
+	uint8_t runs_extra[288 + 30];
+	size_t runs_count = 0;
+	uint32_t code_frequencies[19] = {0};
+	for(i = 0; i < all_count; )
+	{
+		size_t run = 1;
+		while(i + run < all_count && all[i + run] == all[i]) ++run;
+		if(all[i] == 0 && run >= 3)
+		{
+			if(run > 138) run = 138;
+			runs[runs_count] = run >= 11 ? 18 : 17;
+			runs_extra[runs_count++] = (uint8_t)(run - (run >= 11 ? 11 : 3));
+		}
+		else if(all[i] != 0 && run >= 4)
+		{
+			if(run > 7) run = 7;
+			runs[runs_count] = all[i];
+			runs_extra[runs_count++] = 0;
+			runs[runs_count] = 16;
+			runs_extra[runs_count++] = (uint8_t)(run - 4);
+		}
+		else
+		{
+			run = 1;
+			runs[runs_count] = all[i];
+			runs_extra[runs_count++] = 0;
+		}
+		i += run;
+	}
+	for(i = 0; i < runs_count; ++i) code_frequencies[runs[i]] += 1;
+	size_t codes_used = 0;
+	for(i = 0; i < 19; ++i) codes_used += code_frequencies[i] != 0;
+	for(i = 0; codes_used < 2; ++i)
+	{
+		if(code_frequencies[i] == 0)
+		{
+			code_frequencies[i] = 1;
+			++codes_used;
+		}
+	}
+	uint8_t code_lengths[19];
+	uint16_t code_codes[19];
+	pdf_huffman_lengths(code_frequencies, 19, 7, code_lengths);
+	pdf_huffman_codes(code_lengths, 19, code_codes);
+	size_t codes_count = 19;
+	while(codes_count > 4 && code_lengths[order[codes_count - 1]] == 0) --codes_count;
+	uint64_t dynamic_cost = 3 + 14 + 3*codes_count;
+	for(i = 0; i < runs_count; ++i)
+	{
+		dynamic_cost += code_lengths[runs[i]];
+		if(runs[i] >= 16) dynamic_cost += runs[i] == 16 ? 2 : runs[i] == 17 ? 3 : 7;
+	}
+	dynamic_cost += pdf_deflate_tokens_cost(frequencies, lengths);
+
+	// Stored blocks hold at most 65535 bytes, after padding to a byte
+	uint64_t stored_cost = (length/65535 + 1)*(3 + 7 + 32) + 8*(uint64_t)length;
+	if(stored_cost < fixed_cost && stored_cost < dynamic_cost)
+	{
+		size_t pos = 0;
+		do
+		{
+			size_t size = length - pos < 65535 ? length - pos : 65535;
+			pdf_deflate_bits(state, is_last && pos + size == length, 1);
+			pdf_deflate_bits(state, 0, 2);
+			pdf_deflate_bits(state, 0, (8 - state->bit_count % 8) % 8);
+			pdf_deflate_bits(state, (uint32_t)size, 16);
+			pdf_deflate_bits(state, (uint32_t)size ^ 0xFFFF, 16);
+			pdf_deflate_write_bytes(state, data + pos, size);
+			pos += size;
+		} while(pos < length);
+	}
+	else if(fixed_cost <= dynamic_cost)
+	{
+		pdf_deflate_bits(state, is_last, 1);
+		pdf_deflate_bits(state, 1, 2);
+		pdf_deflate_tokens(state, tokens, count, fixed);
+	}
+	else
+	{
+		pdf_deflate_bits(state, is_last, 1);
+		pdf_deflate_bits(state, 2, 2);
+		pdf_deflate_bits(state, (uint32_t)(lengths_count - 257), 5);
+		pdf_deflate_bits(state, (uint32_t)(distances_count - 1), 5);
+		pdf_deflate_bits(state, (uint32_t)(codes_count - 4), 4);
+		for(i = 0; i < codes_count; ++i) pdf_deflate_bits(state, code_lengths[order[i]], 3);
+		for(i = 0; i < runs_count; ++i)
+		{
+			pdf_deflate_bits(state, code_codes[runs[i]], code_lengths[runs[i]]);
+			if(runs[i] >= 16) pdf_deflate_bits(state, runs_extra[i], runs[i] == 16 ? 2 : runs[i] == 17 ? 3 : 7);
+		}
+		pdf_deflate_tokens(state, tokens, count, lengths);
+	}
+}
+
+#define PDF_DEFLATE_WINDOW_SIZE (1 << 15)
+#define PDF_DEFLATE_HASH_BITS 15
+#define PDF_DEFLATE_MAX_CHAIN 32
+#define PDF_DEFLATE_MAX_MATCH 258
+// Matches shorter than this are checked against the one at the next byte,
+// looking at fewer positions than for the first one
+#define PDF_DEFLATE_LAZY_LENGTH 32
+#define PDF_DEFLATE_LAZY_CHAIN 4
+
+uint32_t pdf_deflate_hash(const uint8_t* data)
+{
+	uint32_t value = (uint32_t)data[0] << 16 | (uint32_t)data[1] << 8 | data[2];
+	return (value * 2654435761u) >> (32 - PDF_DEFLATE_HASH_BITS);
+}
+
+// Hash chains of the positions seen so far
+typedef struct {
+	const uint8_t* data;
+	size_t length;
+	int32_t* head;	// Last position by hash
+	int32_t* prev;	// Previous position of the same hash, by position in the window
+	size_t inserted; // Positions below are in the chains
+} PdfDeflateMatcher;
+
+void pdf_deflate_insert_until(PdfDeflateMatcher* matcher, size_t pos)
+{
+	for(; matcher->inserted < pos; ++matcher->inserted)
+	{
+		if(matcher->inserted + 3 > matcher->length) continue;
+		uint32_t hash = pdf_deflate_hash(matcher->data + matcher->inserted);
+		matcher->prev[matcher->inserted & (PDF_DEFLATE_WINDOW_SIZE - 1)] = matcher->head[hash];
+		matcher->head[hash] = (int32_t)matcher->inserted;
+	}
+}
+
+// Length of the longest match at 'pos' with an earlier position ('out_distance'
+// bytes before) among the 'max_chain' last ones of the same hash, 0 if less
+// than 3 bytes. 'pos' is added to the chains.
+size_t pdf_deflate_longest_match(PdfDeflateMatcher* matcher, size_t pos, size_t* out_distance, int max_chain)
+{
+	pdf_deflate_insert_until(matcher, pos);
+	size_t best_length = 0;
+	*out_distance = 0;
+	if(pos + 3 <= matcher->length)
+	{
+		const uint8_t* data = matcher->data;
+		size_t max_length = matcher->length - pos < PDF_DEFLATE_MAX_MATCH ? matcher->length - pos : PDF_DEFLATE_MAX_MATCH;
+		int32_t candidate = matcher->head[pdf_deflate_hash(data + pos)];
+		for(int chain = 0; candidate >= 0 && chain < max_chain; ++chain)
+		{
+			size_t distance = pos - (size_t)candidate;
+			if(distance > PDF_DEFLATE_WINDOW_SIZE) break;
+			const uint8_t* a = data + candidate;
+			const uint8_t* b = data + pos;
+			if(a[best_length] == b[best_length])
+			{
+				size_t match = 0;
+				while(match < max_length && a[match] == b[match]) ++match;
+				if(match > best_length)
+				{
+					best_length = match;
+					*out_distance = distance;
+					if(match == max_length) break;
+				}
+			}
+			// Slots are reused once out of the window, older entries only
+			int32_t next = matcher->prev[candidate & (PDF_DEFLATE_WINDOW_SIZE - 1)];
+			if(next >= candidate) break;
+			candidate = next;
+		}
+	}
+	pdf_deflate_insert_until(matcher, pos + 1);
+	return best_length >= 3 ? best_length : 0;
+}
+
+// Encodes 'data' as a zlib stream in a new buffer, the caller must free
+// it with pdf_free.
+bool pdf_flate_encode(const uint8_t* data, size_t length, uint8_t** out_data, size_t* out_length)
+{
+	PdfDeflate state = {0};
+	*out_data = NULL;
+	*out_length = 0;
+	PdfDeflateMatcher matcher = {0};
+	matcher.data = data;
+	matcher.length = length;
+	matcher.head = (int32_t*)pdf_malloc(((size_t)1 << PDF_DEFLATE_HASH_BITS)*sizeof(int32_t));
+	matcher.prev = (int32_t*)pdf_malloc(PDF_DEFLATE_WINDOW_SIZE*sizeof(int32_t));
+	size_t tokens_capacity = length < PDF_DEFLATE_BLOCK_TOKENS ? length + 1 : PDF_DEFLATE_BLOCK_TOKENS;
+	PdfDeflateToken* tokens = (PdfDeflateToken*)pdf_malloc(tokens_capacity*sizeof(PdfDeflateToken));
+	state.out_capacity = length/2 + 64;
+	state.out = (uint8_t*)pdf_malloc(state.out_capacity);
+	// NOTE(Sam): Positions are stored on 32 bits, bigger buffers (which we
+	//            never produce) are refused.
+	if(matcher.head == NULL || matcher.prev == NULL || tokens == NULL || state.out == NULL || length > INT32_MAX)
+	{
+		pdf_free(matcher.head);
+		pdf_free(matcher.prev);
+		pdf_free(tokens);
+		pdf_free(state.out);
+		return false;
+	}
+	memset(matcher.head, 0xFF, ((size_t)1 << PDF_DEFLATE_HASH_BITS)*sizeof(int32_t));
+
+	state.out[0] = 0x78; // Deflate with a 32K window
+	state.out[1] = 0x9C; // Default compression level, no dictionary
+	state.out_length = 2;
+
+	size_t pos = 0;
+	size_t block_start = 0;
+	size_t count = 0;
+	while(pos < length)
+	{
+		// Room for a literal and a match
+		if(count + 2 > tokens_capacity)
+		{
+			pdf_deflate_block(&state, tokens, count, data + block_start, pos - block_start, false);
+			block_start = pos;
+			count = 0;
+		}
+		size_t distance;
+		size_t match = pdf_deflate_longest_match(&matcher, pos, &distance, PDF_DEFLATE_MAX_CHAIN);
+		// Lazy matching: a literal followed by a longer match is better
+		if(match > 0 && match < PDF_DEFLATE_LAZY_LENGTH && pos + 1 < length)
+		{
+			size_t next_distance;
+			size_t next = pdf_deflate_longest_match(&matcher, pos + 1, &next_distance, PDF_DEFLATE_LAZY_CHAIN);
+			if(next > match)
+			{
+				tokens[count].value = data[pos];
+				tokens[count++].distance = 0;
+				++pos;
+				match = next;
+				distance = next_distance;
+			}
+		}
+		if(match > 0)
+		{
+			tokens[count].value = (uint16_t)match;
+			tokens[count++].distance = (uint16_t)distance;
+			pos += match;
+		}
+		else
+		{
+			tokens[count].value = data[pos];
+			tokens[count++].distance = 0;
+			++pos;
+		}
+	}
+	pdf_deflate_block(&state, tokens, count, data + block_start, length - block_start, true);
+
+	// Adler-32 of the uncompressed data, 5552 is the biggest run before the sums overflow
+	uint32_t a = 1, b = 0;
+	for(size_t i = 0; i < length; )
+	{
+		size_t run_end = length - i < 5552 ? length : i + 5552;
+		for(; i < run_end; ++i)
+		{
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	pdf_deflate_bits(&state, 0, (8 - state.bit_count % 8) % 8);
+	uint32_t adler = b << 16 | a;
+	for(int i = 0; i < 4; ++i) pdf_deflate_bits(&state, (adler >> (24 - 8*i)) & 0xFF, 8);
+	pdf_deflate_emit(&state);
+
+	pdf_free(matcher.head);
+	pdf_free(matcher.prev);
+	pdf_free(tokens);
+	if(state.failed)
+	{
+		pdf_free(state.out);
+		return false;
+	}
+	*out_data = state.out;
+	*out_length = state.out_length;
+	return true;
+}
+
+int pdf_paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = p > a ? p - a : a - p;
+	int pb = p > b ? p - b : b - p;
+	int pc = p > c ? p - c : c - p;
+	if(pa <= pb && pa <= pc) return a;
+	return pb <= pc ? b : c;
+}
+
+// Undoes the predictor given in the /DecodeParms of a Flate stream, in
+// place since the output is never longer than the input.
+bool pdf_predictor_decode(uint8_t* data, size_t* inout_length, const PdfDictionary* params)
+{
+	if(params == NULL) return true;
+	PdfObject predictor = pdf_dictionary_get(params, pdf_name("Predictor"));
+	if(predictor.type != PDF_OBJECT_TYPE_INTEGER || predictor.int_value <= 1) return true;
+
+	PDF_INTEGER_TYPE colors = 1, bits = 8, columns = 1;
+	PdfObject value = pdf_dictionary_get(params, pdf_name("Colors"));
+	if(value.type == PDF_OBJECT_TYPE_INTEGER) colors = value.int_value;
+	value = pdf_dictionary_get(params, pdf_name("BitsPerComponent"));
+	if(value.type == PDF_OBJECT_TYPE_INTEGER) bits = value.int_value;
+	value = pdf_dictionary_get(params, pdf_name("Columns"));
+	if(value.type == PDF_OBJECT_TYPE_INTEGER) columns = value.int_value;
+	if(colors < 1 || colors > 32 || bits < 1 || bits > 16 || columns < 1 || columns > (1 << 24)) return false;
+
+	size_t length = *inout_length;
+	size_t pixel_size = (size_t)(colors*bits + 7)/8;
+	size_t row_size = (size_t)(colors*bits*columns + 7)/8;
+
+	if(predictor.int_value == 2) // TIFF, only the usual 8 bits per component
+	{
+		if(bits != 8) return false;
+		for(size_t row = 0; row + row_size <= length; row += row_size)
+			for(size_t i = pixel_size; i < row_size; ++i) data[row + i] += data[row + i - pixel_size];
+		return true;
+	}
+
+	// PNG, each row starts with its own filter type
+	size_t out = 0;
+	for(size_t in = 0; in + 1 + row_size <= length; in += 1 + row_size)
+	{
+		uint8_t type = data[in];
+		const uint8_t* src = data + in + 1;
+		uint8_t* dst = data + out;
+		const uint8_t* up = out >= row_size ? dst - row_size : NULL;
+		for(size_t i = 0; i < row_size; ++i)
+		{
+			int left = i >= pixel_size ? dst[i - pixel_size] : 0;
+			int above = up ? up[i] : 0;
+			int corner = up && i >= pixel_size ? up[i - pixel_size] : 0;
+			switch(type)
+			{
+			case 0: dst[i] = src[i]; break;
+			case 1: dst[i] = (uint8_t)(src[i] + left); break;
+			case 2: dst[i] = (uint8_t)(src[i] + above); break;
+			case 3: dst[i] = (uint8_t)(src[i] + (left + above)/2); break;
+			case 4: dst[i] = (uint8_t)(src[i] + pdf_paeth(left, above, corner)); break;
+			default: return false;
+			}
+		}
+		out += row_size;
+	}
+	*inout_length = out;
+	return true;
+}
+
+// Decodes the data of 'stream' through all its filters in a new buffer
+// followed by PDF_BUFFER_PADDING zeros, the caller must free it with pdf_free.
+// With a 'key' the data is decrypted while it is copied in the first buffer,
+// see pdf_document_decode_stream. Returns false for the filters we don't
+// support yet.
+bool pdf_stream_decode_with_key(const PdfStream* stream, const PdfCryptKey* key, uint8_t** out_data,
+								size_t* out_length)
+{
+	*out_data = NULL;
+	*out_length = 0;
+	PdfObject filter = pdf_dictionary_get(&stream->dictionary, pdf_name("Filter"));
+	PdfObject params = pdf_dictionary_get(&stream->dictionary, pdf_name("DecodeParms"));
+	size_t filters_count = 0;
+	if(filter.type == PDF_OBJECT_TYPE_NAME) filters_count = 1;
+	else if(filter.type == PDF_OBJECT_TYPE_ARRAY) filters_count = filter.array_value.length;
+	else if(filter.type != PDF_OBJECT_TYPE_NONE && filter.type != PDF_OBJECT_TYPE_NULL) return false;
+
+	uint8_t* data = (uint8_t*)pdf_malloc(stream->length + PDF_BUFFER_PADDING);
+	if(data == NULL) return false;
+	size_t length = stream->length;
+	if(key != NULL) length = pdf_crypt_decrypt(key, stream->data, stream->length, data);
+	else memcpy(data, stream->data, stream->length);
+
+	for(size_t i = 0; i < filters_count; ++i)
+	{
+		PdfObject name = filter.type == PDF_OBJECT_TYPE_ARRAY ? filter.array_value.start[i] : filter;
+		PdfObject param = params.type == PDF_OBJECT_TYPE_ARRAY
+			? (i < params.array_value.length ? params.array_value.start[i] : (PdfObject){.type = PDF_OBJECT_TYPE_NONE})
+			: params;
+		bool is_flate = name.type == PDF_OBJECT_TYPE_NAME
+			&& (pdf_names_are_equals(name.name_value, pdf_name("FlateDecode"))
+				|| pdf_names_are_equals(name.name_value, pdf_name("Fl")));
+		// The key already accounts for a /Crypt filter, it must come first
+		if(i == 0 && name.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(name.name_value, pdf_name("Crypt")))
+			continue;
+
+		uint8_t* decoded = NULL;
+		size_t decoded_length = 0;
+		bool success = is_flate && pdf_flate_decode(data, length, &decoded, &decoded_length);
+		if(success && param.type == PDF_OBJECT_TYPE_DICTIONARY)
+			success = pdf_predictor_decode(decoded, &decoded_length, &param.dictionary_value);
+		pdf_free(data);
+		if(!success)
+		{
+			pdf_free(decoded);
+			return false;
+		}
+		data = decoded;
+		length = decoded_length;
+	}
+
+	memset(data + length, 0, PDF_BUFFER_PADDING);
+	*out_data = data;
+	*out_length = length;
+	return true;
+}
+
+bool pdf_stream_decode(const PdfStream* stream, uint8_t** out_data, size_t* out_length)
+{
+	return pdf_stream_decode_with_key(stream, NULL, out_data, out_length);
+}
+
+bool pdf_document_reserve_xref(PdfDocument* doc, size_t count)
+{
+	if(count <= doc->xref_count) return true;
+	if(count > PDF_MAX_OBJECT_NUMBER + 1) return false;
+	PdfXrefEntry* xref = (PdfXrefEntry*)pdf_realloc(doc->xref, count*sizeof(PdfXrefEntry));
+	if(xref == NULL) return false;
+	memset(xref + doc->xref_count, 0, (count - doc->xref_count)*sizeof(PdfXrefEntry));
+	doc->xref = xref;
+	doc->xref_count = count;
+	return true;
+}
+
+bool pdf_document_load_object(PdfDocument* doc, uint32_t number, PdfObject* out_obj, bool resolve_length);
+bool pdf_document_complete_xref(PdfDocument* doc);
+bool pdf_document_find_xref_entry(PdfDocument* doc, uint32_t number);
+void pdf_document_free_page_index(PdfDocument* doc);
+const PdfIndexObjectStream* pdf_document_find_indexed_object_stream(const PdfDocument* doc, uint32_t number);
+bool pdf_document_read_indexed_pages(PdfDocument* doc);
+bool pdf_document_get_object(PdfDocument* doc, uint32_t number, PdfObject* out_obj);
+void pdf_document_free_fonts(PdfDocument* doc);
+void pdf_document_free_shared_objects(PdfDocument* doc);
+void pdf_document_forget_shared_object(PdfDocument* doc, uint32_t number);
+
+/*
+  ENCRYPTION:
+  - With /Encrypt in the trailer every string and stream of the document is
+    encrypted, with a key derived from the file key and the number of its
+    object (RC4 and AES-128) or with the file key itself (AES-256).
+  - We support the standard security handler with an empty user password,
+    revisions 2 to 6. Anything else fails with PDF_ERROR_ENCRYPTED.
+  - Strings are decrypted in place right after their object is parsed.
+    Streams are decrypted by the first step of their decoding, in the
+    buffer the raw data was copied to anyway, so the only extra cost is
+    the cipher itself.
+  - The objects of an object stream are not encrypted on their own (the
+    stream is), nor are xref streams and the /Encrypt dictionary.
+ */
+
+static const uint8_t pdf_password_padding[32] = {
+	0x28, 0xbf, 0x4e, 0x5e, 0x4e, 0x75, 0x8a, 0x41, 0x64, 0x00, 0x4e, 0x56, 0xff, 0xfa, 0x01, 0x08,
+	0x2e, 0x2e, 0x00, 0xb6, 0xd0, 0x68, 0x3e, 0x80, 0x2f, 0x0c, 0xa9, 0xfe, 0x64, 0x53, 0x69, 0x7a
+};
+
+// Algorithm 1: the key of the object 'number' for 'method'
+void pdf_encryption_object_key(const PdfEncryption* encryption, int method, uint32_t number, uint32_t generation,
+							   PdfCryptKey* out_key)
+{
+	out_key->method = method;
+	out_key->length = encryption->key_length;
+	memcpy(out_key->key, encryption->key, encryption->key_length);
+	if(method == PDF_CRYPT_NONE || encryption->revision >= 5) return;
+
+	uint8_t salt[9] = {
+		(uint8_t)number, (uint8_t)(number >> 8), (uint8_t)(number >> 16),
+		(uint8_t)generation, (uint8_t)(generation >> 8), 's', 'A', 'l', 'T'
+	};
+	uint8_t hash[16];
+	PdfMd5 md5;
+	pdf_md5_begin(&md5);
+	pdf_md5_update(&md5, encryption->key, encryption->key_length);
+	pdf_md5_update(&md5, salt, method == PDF_CRYPT_AES ? 9 : 5);
+	pdf_md5_end(&md5, hash);
+	out_key->length = encryption->key_length + 5 < 16 ? encryption->key_length + 5 : 16;
+	memcpy(out_key->key, hash, out_key->length);
+}
+
+// Decrypts in place every string of 'obj'
+void pdf_crypt_decrypt_strings(const PdfCryptKey* key, PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_STRING:
+	{
+		PdfString* string = &obj->string_value;
+		if(string->length > 0)
+			string->length = pdf_crypt_decrypt(key, (const uint8_t*)string->start, string->length, (uint8_t*)string->start);
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		for(size_t i = 0; i < obj->array_value.length; ++i) pdf_crypt_decrypt_strings(key, &obj->array_value.start[i]);
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		const PdfDictionary* dictionary = obj->type == PDF_OBJECT_TYPE_STREAM
+			? &obj->stream_value.dictionary : &obj->dictionary_value;
+		size_t slot = 0;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(dictionary, &slot, NULL); bucket != NULL;
+			bucket = pdf_dictionary_next(dictionary, &slot, bucket))
+			pdf_crypt_decrypt_strings(key, &bucket->object);
+	} break;
+	}
+}
+
+// Key of the stream of the object 'number'. Its method is NONE for the
+// streams left in clear: xref streams, the metadata when /EncryptMetadata
+// is false and the streams with an /Identity crypt filter.
+void pdf_document_stream_key(const PdfDocument* doc, uint32_t number, uint32_t generation, const PdfStream* stream,
+							 PdfCryptKey* out_key)
+{
+	int method = doc->is_encrypted ? doc->encryption.stream_method : PDF_CRYPT_NONE;
+	PdfObject type = pdf_dictionary_get(&stream->dictionary, pdf_name("Type"));
+	if(type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("XRef")))
+		method = PDF_CRYPT_NONE;
+	if(type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("Metadata"))
+	   && !doc->encryption.encrypt_metadata)
+		method = PDF_CRYPT_NONE;
+
+	PdfObject filter = pdf_dictionary_get(&stream->dictionary, pdf_name("Filter"));
+	PdfObject params = pdf_dictionary_get(&stream->dictionary, pdf_name("DecodeParms"));
+	if(filter.type == PDF_OBJECT_TYPE_ARRAY)
+	{
+		filter = filter.array_value.length > 0 ? filter.array_value.start[0] : (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+		if(params.type == PDF_OBJECT_TYPE_ARRAY)
+			params = params.array_value.length > 0 ? params.array_value.start[0] : (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+	}
+	// NOTE(Sam): /Identity is the only crypt filter we know by name, any
+	//            other one falls back to the default of the document.
+	if(filter.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(filter.name_value, pdf_name("Crypt")))
+	{
+		PdfObject name = params.type == PDF_OBJECT_TYPE_DICTIONARY
+			? pdf_dictionary_get(&params.dictionary_value, pdf_name("Name")) : params;
+		if(name.type != PDF_OBJECT_TYPE_NAME || pdf_names_are_equals(name.name_value, pdf_name("Identity")))
+			method = PDF_CRYPT_NONE;
+	}
+	pdf_encryption_object_key(&doc->encryption, method, number, generation, out_key);
+}
+
+// Decodes the stream of the object 'number' like pdf_stream_decode, and
+// decrypts it on the way when the document is encrypted.
+bool pdf_document_decode_stream(const PdfDocument* doc, uint32_t number, uint32_t generation, const PdfStream* stream,
+								uint8_t** out_data, size_t* out_length)
+{
+	if(!doc->is_encrypted) return pdf_stream_decode(stream, out_data, out_length);
+	PdfCryptKey key;
+	pdf_document_stream_key(doc, number, generation, stream, &key);
+	return pdf_stream_decode_with_key(stream, &key, out_data, out_length);
+}
+
+// Algorithms 2, 4 and 5: the file key of revisions 2 to 4 for the empty
+// user password, which is right if it gives /U back.
+bool pdf_encryption_compute_key(PdfEncryption* encryption, PdfString owner, PdfString user, uint32_t permissions,
+								PdfString id)
+{
+	if(owner.length < 32 || user.length < 32) return false;
+	size_t key_length = encryption->key_length;
+	uint8_t hash[16];
+	uint8_t p[4];
+	pdf_store_le32(p, permissions);
+	PdfMd5 md5;
+	pdf_md5_begin(&md5);
+	pdf_md5_update(&md5, pdf_password_padding, 32);
+	pdf_md5_update(&md5, owner.start, 32);
+	pdf_md5_update(&md5, p, 4);
+	pdf_md5_update(&md5, id.start, id.length);
+	if(encryption->revision >= 4 && !encryption->encrypt_metadata) pdf_md5_update(&md5, "\xff\xff\xff\xff", 4);
+	pdf_md5_end(&md5, hash);
+	for(int i = 0; encryption->revision >= 3 && i < 50; ++i) pdf_md5(hash, key_length, hash);
+	memcpy(encryption->key, hash, key_length);
+
+	uint8_t check[32];
+	PdfRc4 rc4;
+	if(encryption->revision == 2)
+	{
+		pdf_rc4_init(&rc4, encryption->key, key_length);
+		pdf_rc4_apply(&rc4, pdf_password_padding, check, 32);
+		return memcmp(check, user.start, 32) == 0;
+	}
+	pdf_md5_begin(&md5);
+	pdf_md5_update(&md5, pdf_password_padding, 32);
+	pdf_md5_update(&md5, id.start, id.length);
+	pdf_md5_end(&md5, check);
+	for(uint8_t i = 0; i < 20; ++i)
+	{
+		uint8_t key[16];
+		for(size_t k = 0; k < key_length; ++k) key[k] = encryption->key[k] ^ i;
+		pdf_rc4_init(&rc4, key, key_length);
+		pdf_rc4_apply(&rc4, check, check, 16);
+	}
+	return memcmp(check, user.start, 16) == 0;
+}
+
+// Algorithm 2.B, the hash of revision 6 (revision 5 is a plain SHA-256)
+// of the empty password followed by the 8 bytes of 'salt'.
+void pdf_encryption_hash(int revision, const uint8_t* salt, uint8_t out[32])
+{
+	uint8_t k[64];
+	size_t k_length = 32;
+	pdf_sha256(salt, 8, k);
+	// Each round encrypts 64 copies of the password, K and the user key,
+	// only K is left here
+	uint8_t block[64*64];
+	for(uint32_t round = 0; revision >= 6; ++round)
+	{
+		size_t block_length = 64*k_length;
+		for(size_t i = 0; i < 64; ++i) memcpy(block + i*k_length, k, k_length);
+		PdfAes aes;
+		pdf_aes_init(&aes, k, 16);
+		pdf_aes_encrypt_cbc(&aes, k + 16, block, block, block_length);
+		// The first 16 bytes as a big number modulo 3, 256 is 1 modulo 3
+		uint32_t sum = 0;
+		for(int i = 0; i < 16; ++i) sum += block[i];
+		k_length = 32 + 16*(sum % 3);
+		if(k_length == 32) pdf_sha256(block, block_length, k);
+		else pdf_sha512(block, block_length, k_length == 48 ? pdf_sha384_initial : pdf_sha512_initial, k, k_length);
+		if(round >= 63 && block[block_length - 1] <= round - 31) break;
+	}
+	memcpy(out, k, 32);
+}
+
+// Algorithm 2.A: the file key of revisions 5 and 6 for the empty user
+// password, /U holds its hash then the validation and key salts.
+bool pdf_encryption_compute_aes_256_key(PdfEncryption* encryption, PdfString user, PdfString user_key)
+{
+	if(user.length < 48 || user_key.length < 32) return false;
+	const uint8_t* u = (const uint8_t*)user.start;
+	uint8_t hash[32];
+	pdf_encryption_hash(encryption->revision, u + 32, hash);
+	if(memcmp(hash, u, 32) != 0) return false;
+	pdf_encryption_hash(encryption->revision, u + 40, hash);
+	static const uint8_t zero_iv[16] = {0};
+	PdfAes aes;
+	pdf_aes_init(&aes, hash, 32);
+	pdf_aes_decrypt_cbc(&aes, zero_iv, (const uint8_t*)user_key.start, encryption->key, 32);
+	encryption->key_length = 32;
+	return true;
+}
+
+// Method of the crypt filter named by 'key' (/StmF or /StrF) in the /CF
+// of a version 4 or 5 handler, -1 if we don't know it.
+int pdf_encryption_filter_method(const PdfDictionary* encrypt, const char* key)
+{
+	PdfObject name = pdf_dictionary_get(encrypt, pdf_name(key));
+	if(name.type != PDF_OBJECT_TYPE_NAME || pdf_names_are_equals(name.name_value, pdf_name("Identity")))
+		return PDF_CRYPT_NONE;
+	PdfObject filters = pdf_dictionary_get(encrypt, pdf_name("CF"));
+	PdfObject filter = filters.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&filters.dictionary_value, name.name_value) : filters;
+	PdfObject method = filter.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&filter.dictionary_value, pdf_name("CFM")) : filter;
+	if(method.type != PDF_OBJECT_TYPE_NAME) return -1;
+	if(pdf_names_are_equals(method.name_value, pdf_name("None"))) return PDF_CRYPT_NONE;
+	if(pdf_names_are_equals(method.name_value, pdf_name("V2"))) return PDF_CRYPT_RC4;
+	if(pdf_names_are_equals(method.name_value, pdf_name("AESV2"))
+	   || pdf_names_are_equals(method.name_value, pdf_name("AESV3"))) return PDF_CRYPT_AES;
+	return -1;
+}
+
+// Reads the /Encrypt dictionary of the trailer, if any, and computes the
+// file key. Must be called once the xref is read and before any object
+// with strings is parsed.
+int pdf_document_read_encryption(PdfDocument* doc)
+{
+	PdfObject encrypt_ref = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Encrypt"));
+	if(encrypt_ref.type == PDF_OBJECT_TYPE_NONE || encrypt_ref.type == PDF_OBJECT_TYPE_NULL) return PDF_ERROR_NONE;
+
+	PdfEncryption* encryption = &doc->encryption;
+	memset(encryption, 0, sizeof(PdfEncryption));
+	doc->is_encrypted = false;
+	PdfObject encrypt = {.type = PDF_OBJECT_TYPE_NONE};
+	if(encrypt_ref.type == PDF_OBJECT_TYPE_REFERENCE)
+	{
+		encryption->number = encrypt_ref.reference_value.number;
+		pdf_document_load_object(doc, encryption->number, &encrypt, true);
+	}
+	else if(!pdf_object_copy(&encrypt_ref, &encrypt)) return PDF_ERROR_MEMORY;
+
+	// The key depends on the first file identifier
+	PdfObject ids = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("ID"));
+	PdfString id = {0};
+	if(ids.type == PDF_OBJECT_TYPE_ARRAY && ids.array_value.length > 0
+	   && ids.array_value.start[0].type == PDF_OBJECT_TYPE_STRING)
+		id = ids.array_value.start[0].string_value;
+
+	bool success = encrypt.type == PDF_OBJECT_TYPE_DICTIONARY;
+	PdfDictionary* dictionary = &encrypt.dictionary_value;
+	PdfObject none = {.type = PDF_OBJECT_TYPE_NONE};
+	PdfObject filter = success ? pdf_dictionary_get(dictionary, pdf_name("Filter")) : none;
+	PdfObject version = success ? pdf_dictionary_get(dictionary, pdf_name("V")) : none;
+	PdfObject revision = success ? pdf_dictionary_get(dictionary, pdf_name("R")) : none;
+	PdfObject length = success ? pdf_dictionary_get(dictionary, pdf_name("Length")) : none;
+	PdfObject owner = success ? pdf_dictionary_get(dictionary, pdf_name("O")) : none;
+	PdfObject user = success ? pdf_dictionary_get(dictionary, pdf_name("U")) : none;
+	PdfObject user_key = success ? pdf_dictionary_get(dictionary, pdf_name("UE")) : none;
+	PdfObject permissions = success ? pdf_dictionary_get(dictionary, pdf_name("P")) : none;
+	PdfObject metadata = success ? pdf_dictionary_get(dictionary, pdf_name("EncryptMetadata")) : none;
+	success = filter.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(filter.name_value, pdf_name("Standard"))
+		&& revision.type == PDF_OBJECT_TYPE_INTEGER && revision.int_value >= 2 && revision.int_value <= 6
+		&& owner.type == PDF_OBJECT_TYPE_STRING && user.type == PDF_OBJECT_TYPE_STRING
+		&& permissions.type == PDF_OBJECT_TYPE_INTEGER;
+
+	if(success)
+	{
+		encryption->revision = (int)revision.int_value;
+		encryption->encrypt_metadata = metadata.type != PDF_OBJECT_TYPE_BOOLEAN || metadata.bool_value;
+		if(version.type == PDF_OBJECT_TYPE_INTEGER && version.int_value >= 4)
+		{
+			encryption->string_method = pdf_encryption_filter_method(dictionary, "StrF");
+			encryption->stream_method = pdf_encryption_filter_method(dictionary, "StmF");
+			success = encryption->string_method >= 0 && encryption->stream_method >= 0;
+		}
+		else
+		{
+			encryption->string_method = PDF_CRYPT_RC4;
+			encryption->stream_method = PDF_CRYPT_RC4;
+		}
+	}
+	if(success && encryption->revision >= 5)
+	{
+		success = user_key.type == PDF_OBJECT_TYPE_STRING
+			&& pdf_encryption_compute_aes_256_key(encryption, user.string_value, user_key.string_value);
+	}
+	else if(success)
+	{
+		// /Length is in bits, revision 2 is always 40 bits and 4 is 128 bits
+		encryption->key_length = 5;
+		if(encryption->revision == 3 && length.type == PDF_OBJECT_TYPE_INTEGER && length.int_value >= 40
+		   && length.int_value <= 128 && length.int_value % 8 == 0)
+			encryption->key_length = (size_t)length.int_value/8;
+		if(encryption->revision == 4) encryption->key_length = 16;
+		success = pdf_encryption_compute_key(encryption, owner.string_value, user.string_value,
+											 (uint32_t)permissions.int_value, id);
+	}
+	pdf_object_free(&encrypt);
+	doc->is_encrypted = success;
+	return success ? PDF_ERROR_NONE : PDF_ERROR_ENCRYPTED;
+}
+
+// A decoded stream of pdf_document_decode_streams, 'data' is NULL if the
+// object is not a stream or could not be decoded
+typedef struct {
+	uint8_t* data;
+	size_t length;
+} PdfDecodedStream;
+
+typedef struct {
+	PdfDocument* doc;
+	const uint32_t* numbers;
+	PdfDecodedStream* streams;
+	size_t count;
+	size_t first; // Worker i decodes the streams i, i + step, i + 2*step...
+	size_t step;
+	PdfMemoryBudget* budget; // Of the calling thread
+#ifdef PDF_ENABLE_STATS
+	PdfStats stats;
+#endif
+} PdfDecodeWorker;
+
+void pdf_decode_worker_run(void* param)
+{
+	PdfDecodeWorker* worker = (PdfDecodeWorker*)param;
+	PdfDocument* doc = worker->doc;
+	pdf_memory_budget_use(worker->budget);
+	for(size_t i = worker->first; i < worker->count; i += worker->step)
+	{
+		uint32_t number = worker->numbers[i];
+		PdfDecodedStream* stream = &worker->streams[i];
+		stream->data = NULL;
+		stream->length = 0;
+		PdfObject obj;
+		if(!pdf_document_get_object(doc, number, &obj)) continue;
+		uint32_t generation = number < doc->xref_count ? doc->xref[number].generation : 0;
+		if(obj.type == PDF_OBJECT_TYPE_STREAM)
+			pdf_document_decode_stream(doc, number, generation, &obj.stream_value, &stream->data, &stream->length);
+		pdf_object_free(&obj);
+	}
+	PDF_STATS_WORKER_DONE(&worker->stats);
+}
+
+// Decodes (and decrypts) the streams of the objects 'numbers' on
+// 'threads_count' threads, 0 meaning one per core. Each decoded stream
+// must be freed with pdf_free. Returns a PDF_ERROR, PDF_ERROR_MEMORY if
+// the memory budget refused some of the streams.
+int pdf_document_decode_streams(PdfDocument* doc, const uint32_t* numbers, size_t count, PdfDecodedStream* out_streams,
+								size_t threads_count)
+{
+	memset(out_streams, 0, count*sizeof(PdfDecodedStream));
+	// Workers read the xref concurrently, it must not change under them
+	if(!pdf_document_complete_xref(doc)) return PDF_ERROR_XREF;
+	if(threads_count == 0) threads_count = pdf_cpu_count();
+	if(threads_count > count) threads_count = count;
+	if(threads_count == 0) return PDF_ERROR_NONE;
+
+	int64_t failures = pdf_memory_budget_failures();
+
+	PdfDecodeWorker* workers = (PdfDecodeWorker*)pdf_malloc(threads_count*sizeof(PdfDecodeWorker));
+	PdfThread* threads = (PdfThread*)pdf_malloc(threads_count*sizeof(PdfThread));
+	bool* started = (bool*)pdf_malloc(threads_count*sizeof(bool));
+	bool success = workers != NULL && threads != NULL && started != NULL;
+	for(size_t i = 0; success && i < threads_count; ++i)
+	{
+		workers[i].doc = doc;
+		workers[i].numbers = numbers;
+		workers[i].streams = out_streams;
+		workers[i].count = count;
+		workers[i].first = i;
+		workers[i].step = threads_count;
+		workers[i].budget = pdf_memory_budget_current();
+	}
+	// The calling thread takes the first share
+	for(size_t i = 1; success && i < threads_count; ++i)
+		started[i] = pdf_thread_start(&threads[i], pdf_decode_worker_run, &workers[i]);
+	if(success) pdf_decode_worker_run(&workers[0]);
+	for(size_t i = 1; success && i < threads_count; ++i)
+	{
+		if(started[i])
+		{
+			pdf_thread_join(&threads[i]);
+			PDF_STATS_WORKER_JOINED(&workers[i].stats);
+		}
+		else pdf_decode_worker_run(&workers[i]);
+	}
+	pdf_free(workers);
+	pdf_free(threads);
+	pdf_free(started);
+	return success && pdf_memory_budget_failures() == failures ? PDF_ERROR_NONE : PDF_ERROR_MEMORY;
+}
+
+
+// Parses the indirect object 'N G obj ... endobj' starting at 'offset'.
+// Streams keep pointing to the document data, nothing is decoded.
+// NOTE(Sam): An indirect /Length is only resolved one level deep, a
+//            stream length pointing to another stream would loop forever.
+bool pdf_document_parse_indirect_object(PdfDocument* doc, size_t offset, PdfObject* out_obj,
+										bool resolve_length)
+{
+	out_obj->type = PDF_OBJECT_TYPE_NONE;
+	const uint8_t* buffer = doc->data;
+	size_t buffer_len = doc->size;
+	size_t pos = offset;
+	uint64_t number, generation;
+
+	if(!pdf_read_unsigned(buffer, &pos, buffer_len, &number)) return false;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(!pdf_read_unsigned(buffer, &pos, buffer_len, &generation)) return false;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(!pdf_is_keyword_at(buffer, pos, buffer_len, "obj")) return false;
+	pos += 3;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+
+	PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+	if(pos >= buffer_len || !pdf_parse_object(buffer, &pos, buffer_len, &obj)) return false;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+
+	if(obj.type == PDF_OBJECT_TYPE_DICTIONARY && pdf_is_keyword_at(buffer, pos, buffer_len, "stream"))
+	{
+		pos += 6;
+		// The keyword is followed by CRLF or LF (we also accept a lonely CR)
+		if(pos < buffer_len && buffer[pos] == PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN) ++pos;
+		if(pos < buffer_len && buffer[pos] == PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED) ++pos;
+		size_t data_start = pos;
+
+		PdfObject length = pdf_dictionary_get(&obj.dictionary_value, pdf_name("Length"));
+		if(length.type == PDF_OBJECT_TYPE_REFERENCE && resolve_length)
+		{
+			PdfObject resolved;
+			if(pdf_document_load_object(doc, length.reference_value.number, &resolved, false))
+			{
+				length = resolved;
+				if(resolved.type != PDF_OBJECT_TYPE_INTEGER) pdf_object_free(&resolved);
+			}
+		}
+
+		// NOTE(Sam): /Length is often wrong in damaged files, we trust it only
+		//            if it lands on 'endstream', otherwise we search for it.
+		size_t data_length = buffer_len;
+		if(length.type == PDF_OBJECT_TYPE_INTEGER && length.int_value >= 0
+		   && (uint64_t)length.int_value <= buffer_len - data_start)
+		{
+			size_t end = data_start + (size_t)length.int_value;
+			pdf_skip_white_spaces_and_comments(buffer, &end, buffer_len);
+			if(pdf_is_keyword_at(buffer, end, buffer_len, "endstream"))
+				data_length = (size_t)length.int_value;
+		}
+		if(data_length == buffer_len)
+		{
+			data_length = pdf_find(buffer + data_start, buffer_len - data_start, "endstream");
+			// Remove the EOL which precedes 'endstream'
+			if(data_length > 0 && buffer[data_start + data_length - 1] == PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED) --data_length;
+			if(data_length > 0 && buffer[data_start + data_length - 1] == PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN) --data_length;
+		}
+
+		PdfDictionary dictionary = obj.dictionary_value;
+		obj.type = PDF_OBJECT_TYPE_STREAM;
+		obj.stream_value.dictionary = dictionary;
+		obj.stream_value.data = buffer + data_start;
+		obj.stream_value.length = data_length;
+	}
+
+	// Strings are encrypted with the key of their object, but those of the
+	// /Encrypt dictionary and of the xref streams
+	if(doc->is_encrypted && doc->encryption.string_method != PDF_CRYPT_NONE && number != doc->encryption.number)
+	{
+		PdfObject type = obj.type == PDF_OBJECT_TYPE_STREAM
+			? pdf_dictionary_get(&obj.stream_value.dictionary, pdf_name("Type")) : obj;
+		if(type.type != PDF_OBJECT_TYPE_NAME || !pdf_names_are_equals(type.name_value, pdf_name("XRef")))
+		{
+			PdfCryptKey key;
+			pdf_encryption_object_key(&doc->encryption, doc->encryption.string_method, (uint32_t)number,
+									  (uint32_t)generation, &key);
+			pdf_crypt_decrypt_strings(&key, &obj);
+		}
+	}
+
+	*out_obj = obj;
+	return true;
+}
+
+// An object stream decoded once and kept for the following lookups
+typedef struct {
+	uint8_t* data;			// Decoded, padded with PDF_BUFFER_PADDING zeros
+	size_t length;
+	uint32_t count;
+	uint32_t* numbers;
+	size_t* offsets;		// Start of each object in 'data', 'count' + 1 values
+} PdfObjectStream;
+
+void pdf_object_stream_free(PdfObjectStream* stream)
+{
+	if(stream == NULL) return;
+	pdf_free(stream->data);
+	pdf_free(stream->numbers);
+	pdf_free(stream->offsets);
+	pdf_free(stream);
+}
+
+void pdf_document_free_object_streams(PdfDocument* doc)
+{
+	if(doc->object_streams == NULL) return;
+	for(size_t i = 0; i < doc->xref_count; ++i) pdf_object_stream_free((PdfObjectStream*)doc->object_streams[i]);
+	pdf_free((void*)doc->object_streams);
+	doc->object_streams = NULL;
+}
+
+// Decodes the object stream 'stream_number' and reads the 'N' pairs of
+// 'number offset' at its start, offsets being relative to /First.
+PdfObjectStream* pdf_document_decode_object_stream(PdfDocument* doc, uint32_t stream_number)
+{
+	PdfObject stream;
+	if(!pdf_document_load_object(doc, stream_number, &stream, true)) return NULL;
+
+	PdfObjectStream* result = NULL;
+	uint8_t* data = NULL;
+	size_t data_len = 0;
+	PdfDictionary* dictionary = &stream.stream_value.dictionary;
+	PdfObject type = stream.type == PDF_OBJECT_TYPE_STREAM ? pdf_dictionary_get(dictionary, pdf_name("Type")) : stream;
+	PdfObject count = stream.type == PDF_OBJECT_TYPE_STREAM ? pdf_dictionary_get(dictionary, pdf_name("N")) : stream;
+	PdfObject first = stream.type == PDF_OBJECT_TYPE_STREAM ? pdf_dictionary_get(dictionary, pdf_name("First")) : stream;
+	if(type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("ObjStm"))
+	   && count.type == PDF_OBJECT_TYPE_INTEGER && first.type == PDF_OBJECT_TYPE_INTEGER
+	   && count.int_value > 0 && count.int_value <= PDF_MAX_OBJECT_NUMBER && first.int_value >= 0
+	   && pdf_document_decode_stream(doc, stream_number, doc->xref[stream_number].generation, &stream.stream_value,
+									 &data, &data_len)
+	   && (uint64_t)first.int_value <= data_len
+	   && (uint64_t)count.int_value <= (uint64_t)first.int_value)
+	{
+		// NOTE(Sam): Each pair takes at least 4 bytes, so the header bounds
+		//            'count' and a bogus /N can't make us allocate much.
+		result = (PdfObjectStream*)pdf_malloc(sizeof(PdfObjectStream));
+		uint32_t n = (uint32_t)count.int_value;
+		if(result != NULL)
+		{
+			memset(result, 0, sizeof(PdfObjectStream));
+			result->numbers = (uint32_t*)pdf_malloc(n * sizeof(uint32_t));
+			result->offsets = (size_t*)pdf_malloc((n + 1) * sizeof(size_t));
+		}
+
+		bool has_pairs = result != NULL && result->numbers != NULL && result->offsets != NULL;
+		// The sidecar index already has the header, we only check it fits
+		const PdfIndexObjectStream* indexed = pdf_document_find_indexed_object_stream(doc, stream_number);
+		bool is_indexed = has_pairs && indexed != NULL && indexed->count == n;
+		if(is_indexed)
+		{
+			const uint64_t* offsets = (const uint64_t*)(doc->index_file.data + indexed->offset);
+			for(uint32_t i = 0; i < n && is_indexed; ++i)
+			{
+				is_indexed = offsets[i] <= data_len;
+				result->offsets[i] = (size_t)offsets[i];
+			}
+			memcpy(result->numbers, offsets + n + 1, n*sizeof(uint32_t));
+		}
+		size_t pos = 0;
+		for(uint32_t i = 0; i < n && has_pairs && !is_indexed; ++i)
+		{
+			uint64_t pair[2];
+			pdf_skip_white_spaces_and_comments(data, &pos, data_len);
+			has_pairs = pdf_read_unsigned(data, &pos, data_len, &pair[0]);
+			pdf_skip_white_spaces_and_comments(data, &pos, data_len);
+			has_pairs = has_pairs && pdf_read_unsigned(data, &pos, data_len, &pair[1])
+				&& pair[0] <= PDF_MAX_OBJECT_NUMBER && pair[1] <= data_len - (size_t)first.int_value;
+			if(!has_pairs) break;
+			result->numbers[i] = (uint32_t)pair[0];
+			result->offsets[i] = (size_t)first.int_value + (size_t)pair[1];
+		}
+		if(has_pairs)
+		{
+			result->offsets[n] = data_len;
+			result->data = data;
+			result->length = data_len;
+			result->count = n;
+			data = NULL;
+		}
+		else
+		{
+			pdf_object_stream_free(result);
+			result = NULL;
+		}
+	}
+	pdf_free(data);
+	pdf_object_free(&stream);
+	return result;
+}
+
+// Array of 'xref_count' pointers stored in 'slot', allocated by the first
+// thread to need it. It is shared by the readers of the document, so it is
+// never allocated in the arena of the calling thread.
+void* volatile* pdf_document_shared_array(PdfDocument* doc, void* volatile** slot)
+{
+	void* volatile* array = (void* volatile*)pdf_atomic_load_pointer((void* volatile*)slot);
+	if(array != NULL) return array;
+
+	PdfArena* arena = pdf_arena_current();
+	pdf_arena_use(NULL);
+	void** fresh = (void**)pdf_malloc(doc->xref_count * sizeof(void*));
+	pdf_arena_use(arena);
+	if(fresh == NULL) return NULL;
+	memset(fresh, 0, doc->xref_count * sizeof(void*));
+	if(pdf_atomic_compare_exchange_pointer((void* volatile*)slot, NULL, fresh)) return (void* volatile*)fresh;
+	// Another thread was first, use its array
+	pdf_free(fresh);
+	return (void* volatile*)pdf_atomic_load_pointer((void* volatile*)slot);
+}
+
+// Decoded object stream 'stream_number', decoded on the first call only.
+// Safe to call from several threads reading the same document. When the
+// memory budget is tight the stream is decoded but not kept, '*out_must_free'
+// then tells the caller to free it with pdf_object_stream_free.
+PdfObjectStream* pdf_document_get_object_stream(PdfDocument* doc, uint32_t stream_number, bool* out_must_free)
+{
+	*out_must_free = false;
+	// Object streams can't be compressed themselves
+	if(doc->has_lazy_xref) pdf_document_find_xref_entry(doc, stream_number);
+	if(stream_number >= doc->xref_count || doc->xref[stream_number].type != PDF_XREF_ENTRY_IN_USE) return NULL;
+
+	void* volatile* cache = pdf_document_shared_array(doc, &doc->object_streams);
+	if(cache == NULL) return NULL;
+
+	PdfObjectStream* stream = (PdfObjectStream*)pdf_atomic_load_pointer(&cache[stream_number]);
+	if(stream != NULL) return stream;
+	if(pdf_memory_budget_is_tight())
+	{
+		*out_must_free = true;
+		return pdf_document_decode_object_stream(doc, stream_number);
+	}
+	// Other threads will read it, it can't live in the arena of this one
+	PdfArena* arena = pdf_arena_current();
+	pdf_arena_use(NULL);
+	stream = pdf_document_decode_object_stream(doc, stream_number);
+	pdf_arena_use(arena);
+	if(stream == NULL) return NULL;
+	// Another thread may have decoded it meanwhile, keep the first one
+	if(!pdf_atomic_compare_exchange_pointer(&cache[stream_number], NULL, stream))
+	{
+		pdf_object_stream_free(stream);
+		stream = (PdfObjectStream*)pdf_atomic_load_pointer(&cache[stream_number]);
+	}
+	return stream;
+}
+
+// Parses the object 'number' stored at 'index' in the object stream
+// 'stream_number'.
+bool pdf_document_parse_compressed_object(PdfDocument* doc, uint32_t number, uint32_t stream_number,
+										  uint32_t index, PdfObject* out_obj)
+{
+	out_obj->type = PDF_OBJECT_TYPE_NONE;
+	bool must_free;
+	PdfObjectStream* stream = pdf_document_get_object_stream(doc, stream_number, &must_free);
+	bool success = stream != NULL && index < stream->count && stream->numbers[index] == number;
+	if(success)
+	{
+		// The object ends where the next one starts
+		size_t pos = stream->offsets[index];
+		size_t end = stream->offsets[index + 1] > pos ? stream->offsets[index + 1] : stream->length;
+		pdf_skip_white_spaces_and_comments(stream->data, &pos, end);
+		success = pos < end && pdf_parse_object(stream->data, &pos, end, out_obj);
+	}
+	if(must_free) pdf_object_stream_free(stream);
+	return success;
+}
+
+// Frees the decoded object streams kept by the document, they are decoded
+// again when needed. Not safe while other threads read the document.
+void pdf_document_trim_caches(PdfDocument* doc)
+{
+	pdf_document_free_object_streams(doc);
+}
+
+bool pdf_document_load_entry(PdfDocument* doc, uint32_t number, const PdfXrefEntry* entry, PdfObject* out_obj,
+							 bool resolve_length)
+{
+	out_obj->type = PDF_OBJECT_TYPE_NONE;
+	if(entry->type == PDF_XREF_ENTRY_COMPRESSED)
+	{
+		if(entry->offset > PDF_MAX_OBJECT_NUMBER) return false;
+		return pdf_document_parse_compressed_object(doc, number, (uint32_t)entry->offset, entry->generation, out_obj);
+	}
+	if(entry->type != PDF_XREF_ENTRY_IN_USE) return false;
+	if(entry->offset >= doc->size) return false;
+	return pdf_document_parse_indirect_object(doc, (size_t)entry->offset, out_obj, resolve_length);
+}
+
+bool pdf_document_load_object(PdfDocument* doc, uint32_t number, PdfObject* out_obj, bool resolve_length)
+{
+	out_obj->type = PDF_OBJECT_TYPE_NONE;
+	// PDF_OPEN_METADATA: an entry we can't find may be damaged, the whole
+	// xref tells (repaired if needed)
+	if(doc->has_lazy_xref && !pdf_document_find_xref_entry(doc, number) && !pdf_document_complete_xref(doc))
+		return false;
+	// Objects of the other pages are in the main xref we did not read yet
+	if(doc->has_partial_xref && (number >= doc->xref_count || doc->xref[number].type == PDF_XREF_ENTRY_NONE)
+	   && !pdf_document_complete_xref(doc)) return false;
+	if(number >= doc->xref_count) return false;
+	return pdf_document_load_entry(doc, number, &doc->xref[number], out_obj, resolve_length);
+}
+
+// Binary search in the modified objects, 'out_index' is where 'number'
+// is or should be inserted.
+bool pdf_document_find_modified(PdfDocument* doc, uint32_t number, size_t* out_index)
+{
+	size_t low = 0, high = doc->modified_count;
+	while(low < high)
+	{
+		size_t middle = low + (high - low)/2;
+		if(doc->modified[middle].number < number) low = middle + 1;
+		else high = middle;
+	}
+	*out_index = low;
+	return low < doc->modified_count && doc->modified[low].number == number;
+}
+
+// Loads the indirect object 'number' from the document, including the
+// modifications not saved yet. The caller owns the returned object and
+// must release it with pdf_object_free.
+bool pdf_document_get_object(PdfDocument* doc, uint32_t number, PdfObject* out_obj)
+{
+	size_t index;
+	if(pdf_document_find_modified(doc, number, &index))
+	{
+		out_obj->type = PDF_OBJECT_TYPE_NONE;
+		if(doc->modified[index].object.type == PDF_OBJECT_TYPE_NONE) return false; // Deleted
+		return pdf_object_copy(&doc->modified[index].object, out_obj);
+	}
+	return pdf_document_load_object(doc, number, out_obj, true);
+}
+
+// Loads the object 'number' as it was in 'revision' (0 is the original
+// document), ignoring newer revisions and unsaved modifications.
+bool pdf_document_get_object_at_revision(PdfDocument* doc, uint32_t number, size_t revision,
+										 PdfObject* out_obj)
+{
+	out_obj->type = PDF_OBJECT_TYPE_NONE;
+	if(!pdf_document_complete_xref(doc)) return false;
+	if(revision >= doc->revisions_count) return false;
+	for(size_t r = revision + 1; r-- > 0; )
+	{
+		PdfRevision* rev = &doc->revisions[r];
+		// NOTE(Sam): Backward since the /XRefStm entries of hybrid files
+		//            come after the table ones and must win.
+		for(size_t i = rev->entries_count; i-- > 0; )
+		{
+			if(rev->numbers[i] != number) continue;
+			return pdf_document_load_entry(doc, number, &rev->entries[i], out_obj, true);
+		}
+	}
+	return false;
+}
+
+// Replaces (or creates) the object 'number', the document takes ownership
+// of 'obj'. Passing a NONE object deletes it. Nothing is written before
+// the document is saved.
+// NOTE(Sam): Streams data is not copied, it must stay valid until saved.
+bool pdf_document_set_object(PdfDocument* doc, uint32_t number, PdfObject obj)
+{
+	if(number == 0 || number > PDF_MAX_OBJECT_NUMBER) return false;
+	pdf_document_free_page_index(doc);
+	doc->has_index_pages = false;
+	pdf_document_forget_shared_object(doc, number);
+
+	size_t index;
+	if(pdf_document_find_modified(doc, number, &index))
+	{
+		pdf_object_free(&doc->modified[index].object);
+		doc->modified[index].object = obj;
+		return true;
+	}
+
+	if(doc->modified_count == doc->modified_capacity)
+	{
+		size_t capacity = doc->modified_capacity ? 2*doc->modified_capacity : 16;
+		PdfModifiedObject* modified = (PdfModifiedObject*)pdf_realloc(doc->modified, capacity*sizeof(PdfModifiedObject));
+		if(modified == NULL) return false;
+		doc->modified = modified;
+		doc->modified_capacity = capacity;
+	}
+	memmove(&doc->modified[index + 1], &doc->modified[index], (doc->modified_count - index)*sizeof(PdfModifiedObject));
+	doc->modified_count += 1;
+
+	PdfModifiedObject* modified = &doc->modified[index];
+	modified->number = number;
+	modified->generation = number < doc->xref_count ? doc->xref[number].generation : 0;
+	modified->object = obj;
+	if(number >= doc->next_object_number) doc->next_object_number = number + 1;
+	return true;
+}
+
+// Adds a new object to the document (taking ownership of 'obj') and
+// returns its number, or 0 if it failed.
+uint32_t pdf_document_add_object(PdfDocument* doc, PdfObject obj)
+{
+	uint32_t number = doc->next_object_number;
+	if(!pdf_document_set_object(doc, number, obj)) return 0;
+	return number;
+}
+
+bool pdf_document_delete_object(PdfDocument* doc, uint32_t number)
+{
+	PdfObject none = {.type = PDF_OBJECT_TYPE_NONE};
+	return pdf_document_set_object(doc, number, none);
+}
+
+// If 'inout_obj' is a reference, replace it by the object it points to.
+// Returns false if the reference can't be resolved.
+bool pdf_document_resolve(PdfDocument* doc, PdfObject* inout_obj)
+{
+	if(inout_obj->type != PDF_OBJECT_TYPE_REFERENCE) return true;
+	return pdf_document_get_object(doc, inout_obj->reference_value.number, inout_obj);
+}
+
+// Checks that the xref entry of 'number' really points to its header,
+// for a compressed object we only check the object stream header.
+bool pdf_document_check_xref_entry(PdfDocument* doc, uint32_t number)
+{
+	if(doc->has_lazy_xref) pdf_document_find_xref_entry(doc, number);
+	if(number < doc->xref_count && doc->xref[number].type == PDF_XREF_ENTRY_COMPRESSED)
+	{
+		uint64_t stream_number = doc->xref[number].offset;
+		if(doc->has_lazy_xref && stream_number <= PDF_MAX_OBJECT_NUMBER)
+			pdf_document_find_xref_entry(doc, (uint32_t)stream_number);
+		if(stream_number >= doc->xref_count || doc->xref[stream_number].type != PDF_XREF_ENTRY_IN_USE) return false;
+		number = (uint32_t)stream_number;
+	}
+	if(number >= doc->xref_count || doc->xref[number].type != PDF_XREF_ENTRY_IN_USE) return false;
+	size_t pos = (size_t)doc->xref[number].offset;
+	uint64_t header_number;
+	if(pos >= doc->size) return false;
+	if(!pdf_read_unsigned(doc->data, &pos, doc->size, &header_number)) return false;
+	return header_number == number;
+}
+
+bool pdf_revision_push_entry(PdfRevision* revision, uint32_t number, PdfXrefEntry entry)
+{
+	// NOTE(Sam): Sections are small compared to the whole xref, growing
+	//            one power of two at a time is good enough.
+	size_t count = revision->entries_count;
+	if((count & (count - 1)) == 0)
+	{
+		size_t capacity = count ? 2*count : 16;
+		uint32_t* numbers = (uint32_t*)pdf_realloc(revision->numbers, capacity*sizeof(uint32_t));
+		if(numbers == NULL) return false;
+		revision->numbers = numbers;
+		PdfXrefEntry* entries = (PdfXrefEntry*)pdf_realloc(revision->entries, capacity*sizeof(PdfXrefEntry));
+		if(entries == NULL) return false;
+		revision->entries = entries;
+	}
+	revision->numbers[count] = number;
+	revision->entries[count] = entry;
+	revision->entries_count += 1;
+	return true;
+}
+
+void pdf_revision_free(PdfRevision* revision)
+{
+	pdf_object_free(&revision->trailer);
+	pdf_free(revision->numbers);
+	pdf_free(revision->entries);
+	memset(revision, 0, sizeof(PdfRevision));
+}
+
+// The revision ends after the '%%EOF' following its xref section
+uint64_t pdf_document_find_revision_end(PdfDocument* doc, size_t pos)
+{
+	const uint8_t* buffer = doc->data;
+	size_t buffer_len = doc->size;
+	size_t search_len = buffer_len - pos < 1024 ? buffer_len - pos : 1024;
+	size_t eof = pos + pdf_find(buffer + pos, search_len, "%%EOF");
+	if(eof == pos + search_len) return buffer_len;
+	eof += 5;
+	if(eof < buffer_len && buffer[eof] == PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN) ++eof;
+	if(eof < buffer_len && buffer[eof] == PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED) ++eof;
+	return eof;
+}
+
+// Reads a big endian field of 'width' bytes, as in xref streams
+uint64_t pdf_read_field(const uint8_t* data, size_t width)
+{
+	uint64_t value = 0;
+	for(size_t i = 0; i < width; ++i) value = value << 8 | data[i];
+	return value;
+}
+
+// Parses a cross reference stream (PDF 1.5) at 'offset' in 'out_revision',
+// its dictionary is also the trailer. With 'entries_only' the trailer is
+// not kept, that's for the /XRefStm of hybrid files whose trailer is the
+// classic one.
+bool pdf_document_parse_xref_stream(PdfDocument* doc, size_t offset, PdfRevision* out_revision, bool entries_only)
+{
+	// NOTE(Sam): The /Length of an xref stream must be direct, we can't
+	//            resolve anything before having read the xref anyway.
+	PdfObject obj;
+	if(!pdf_document_parse_indirect_object(doc, offset, &obj, false)) return false;
+	if(obj.type != PDF_OBJECT_TYPE_STREAM)
+	{
+		pdf_object_free(&obj);
+		return false;
+	}
+
+	PdfDictionary* dictionary = &obj.stream_value.dictionary;
+	PdfObject type = pdf_dictionary_get(dictionary, pdf_name("Type"));
+	PdfObject widths = pdf_dictionary_get(dictionary, pdf_name("W"));
+	PdfObject size = pdf_dictionary_get(dictionary, pdf_name("Size"));
+	PdfObject index = pdf_dictionary_get(dictionary, pdf_name("Index"));
+
+	size_t w[3] = {0};
+	bool success = type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("XRef"))
+		&& size.type == PDF_OBJECT_TYPE_INTEGER && size.int_value >= 0 && size.int_value <= PDF_MAX_OBJECT_NUMBER + 1
+		&& widths.type == PDF_OBJECT_TYPE_ARRAY && widths.array_value.length == 3;
+	for(size_t i = 0; success && i < 3; ++i)
+	{
+		PdfObject width = widths.array_value.start[i];
+		success = width.type == PDF_OBJECT_TYPE_INTEGER && width.int_value >= 0 && width.int_value <= 8;
+		if(success) w[i] = (size_t)width.int_value;
+	}
+	// Subsections are '/Index [first count ...]', by default [0 /Size]
+	size_t sections_count = 1;
+	if(success && index.type == PDF_OBJECT_TYPE_ARRAY)
+	{
+		sections_count = index.array_value.length/2;
+		for(size_t i = 0; success && i < 2*sections_count; ++i)
+			success = index.array_value.start[i].type == PDF_OBJECT_TYPE_INTEGER
+				&& index.array_value.start[i].int_value >= 0
+				&& index.array_value.start[i].int_value <= PDF_MAX_OBJECT_NUMBER + 1;
+	}
+
+	uint8_t* data = NULL;
+	size_t data_len = 0;
+	success = success && pdf_stream_decode(&obj.stream_value, &data, &data_len);
+
+	size_t row_size = w[0] + w[1] + w[2];
+	size_t pos = 0;
+	for(size_t section = 0; success && section < sections_count && row_size > 0; ++section)
+	{
+		uint64_t first = 0, count = (uint64_t)size.int_value;
+		if(index.type == PDF_OBJECT_TYPE_ARRAY)
+		{
+			first = (uint64_t)index.array_value.start[2*section].int_value;
+			count = (uint64_t)index.array_value.start[2*section + 1].int_value;
+		}
+		// A truncated stream gives what it has
+		if(count > (data_len - pos)/row_size) count = (data_len - pos)/row_size;
+		if(first + count > PDF_MAX_OBJECT_NUMBER + 1 || !pdf_document_reserve_xref(doc, (size_t)(first + count)))
+		{
+			success = false;
+			break;
+		}
+
+		for(uint64_t i = 0; i < count; ++i, pos += row_size)
+		{
+			// The type is 1 when its field is absent
+			uint64_t entry_type = w[0] ? pdf_read_field(data + pos, w[0]) : 1;
+			uint64_t field2 = pdf_read_field(data + pos + w[0], w[1]);
+			uint64_t field3 = pdf_read_field(data + pos + w[0] + w[1], w[2]);
+
+			PdfXrefEntry section_entry;
+			section_entry.offset = field2;
+			section_entry.generation = (uint32_t)field3;
+			switch(entry_type) {
+			case 0: section_entry.type = PDF_XREF_ENTRY_FREE; section_entry.offset = 0; break;
+			case 1: section_entry.type = PDF_XREF_ENTRY_IN_USE; break;
+			case 2: section_entry.type = PDF_XREF_ENTRY_COMPRESSED; break;
+			default: continue; // Unknown types are null references
+			}
+			if(!pdf_revision_push_entry(out_revision, (uint32_t)(first + i), section_entry))
+			{
+				success = false;
+				break;
+			}
+			// PDF_OPEN_METADATA: the merged xref is filled lazily, newest section first
+			PdfXrefEntry* entry = &doc->xref[first + i];
+			if(entry->type == PDF_XREF_ENTRY_NONE && !doc->has_lazy_xref) *entry = section_entry;
+		}
+	}
+	pdf_free(data);
+
+	if(!success || entries_only)
+	{
+		pdf_object_free(&obj);
+		return success;
+	}
+
+	size_t stream_end = (size_t)(obj.stream_value.data - doc->data) + obj.stream_value.length;
+	out_revision->xref_offset = offset;
+	out_revision->end_offset = pdf_document_find_revision_end(doc, stream_end);
+	out_revision->is_xref_stream = true;
+	// The stream dictionary becomes the trailer
+	PdfDictionary trailer = obj.stream_value.dictionary;
+	out_revision->trailer.type = PDF_OBJECT_TYPE_DICTIONARY;
+	out_revision->trailer.dictionary_value = trailer;
+	return true;
+}
+
+// Reads the classic xref table entry at 'inout_pos', 'offset generation n|f'
+bool pdf_read_xref_table_entry(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, PdfXrefEntry* out_entry)
+{
+	size_t pos = *inout_pos;
+	uint64_t entry_offset, generation;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(!pdf_read_unsigned(buffer, &pos, buffer_len, &entry_offset)) return false;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(!pdf_read_unsigned(buffer, &pos, buffer_len, &generation)) return false;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(pos >= buffer_len || (buffer[pos] != 'n' && buffer[pos] != 'f')) return false;
+
+	out_entry->type = buffer[pos] == 'n' ? PDF_XREF_ENTRY_IN_USE : PDF_XREF_ENTRY_FREE;
+	out_entry->offset = entry_offset;
+	out_entry->generation = (uint32_t)generation;
+	*inout_pos = pos + 1;
+	return true;
+}
+
+// True if the 20 bytes at 'entry' are an entry as the spec writes them,
+// 'oooooooooo ggggg n' and a two bytes end of line.
+static bool pdf_is_xref_table_entry(const uint8_t* entry)
+{
+	for(size_t i = 0; i < 18; ++i)
+	{
+		bool is_valid;
+		if(i == 10 || i == 16) is_valid = entry[i] == ' ';
+		else if(i == 17) is_valid = entry[i] == 'n' || entry[i] == 'f';
+		else is_valid = entry[i] >= '0' && entry[i] <= '9';
+		if(!is_valid) return false;
+	}
+	return pdf_char_is_white_space(entry[18]) && pdf_char_is_white_space(entry[19]);
+}
+
+// Checks that the 'count' entries of the subsection starting at 'pos' are
+// all 20 bytes long, looking at the last one and what follows it only.
+static bool pdf_xref_subsection_is_regular(const uint8_t* buffer, size_t pos, size_t buffer_len, uint64_t count)
+{
+	if(count == 0 || count > (buffer_len - pos)/20) return false;
+	size_t end = pos + 20*(size_t)count;
+	if(!pdf_is_xref_table_entry(buffer + pos) || !pdf_is_xref_table_entry(buffer + end - 20)) return false;
+	// Then the next subsection or the trailer
+	pdf_skip_white_spaces_and_comments(buffer, &end, buffer_len);
+	return end < buffer_len && ((buffer[end] >= '0' && buffer[end] <= '9') || buffer[end] == 't');
+}
+
+// Moves 'inout_pos' after the 'count' entries of a subsection, in one jump
+// when they are regular and one entry at a time otherwise.
+static bool pdf_skip_xref_table_entries(const uint8_t* buffer, size_t* inout_pos, size_t buffer_len, uint64_t count)
+{
+	pdf_skip_white_spaces_and_comments(buffer, inout_pos, buffer_len);
+	if(pdf_xref_subsection_is_regular(buffer, *inout_pos, buffer_len, count))
+	{
+		*inout_pos += 20*(size_t)count;
+		return true;
+	}
+	PdfXrefEntry entry;
+	for(uint64_t i = 0; i < count; ++i)
+		if(!pdf_read_xref_table_entry(buffer, inout_pos, buffer_len, &entry)) return false;
+	return true;
+}
+
+// Parses the xref section at 'offset' in 'out_revision', either a classic
+// 'xref' table and its trailer or an xref stream. Entries already defined
+// by a newer section are kept in the document merged xref.
+bool pdf_document_parse_xref_section(PdfDocument* doc, size_t offset, PdfRevision* out_revision)
+{
+	out_revision->xref_offset = offset;
+	const uint8_t* buffer = doc->data;
+	size_t buffer_len = doc->size;
+	size_t pos = offset;
+
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(pos < buffer_len && buffer[pos] >= '0' && buffer[pos] <= '9')
+		return pdf_document_parse_xref_stream(doc, pos, out_revision, false);
+	if(!pdf_is_keyword_at(buffer, pos, buffer_len, "xref")) return false;
+	pos += 4;
+
+	while(true)
+	{
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+		if(pdf_is_keyword_at(buffer, pos, buffer_len, "trailer")) break;
+
+		uint64_t first, count;
+		if(!pdf_read_unsigned(buffer, &pos, buffer_len, &first)) return false;
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+		if(!pdf_read_unsigned(buffer, &pos, buffer_len, &count)) return false;
+
+		// Each entry is 20 bytes, we accept slightly shorter ones but a
+		// count which can't fit in the file is garbage.
+		if(count > (buffer_len - pos) / 18) return false;
+		if(first + count > PDF_MAX_OBJECT_NUMBER + 1) return false;
+		if(!pdf_document_reserve_xref(doc, (size_t)(first + count))) return false;
+
+		// PDF_OPEN_METADATA: entries are read when their object is needed
+		if(doc->has_lazy_xref)
+		{
+			if(!pdf_skip_xref_table_entries(buffer, &pos, buffer_len, count)) return false;
+			continue;
+		}
+		for(uint64_t i = 0; i < count; ++i)
+		{
+			PdfXrefEntry section_entry;
+			if(!pdf_read_xref_table_entry(buffer, &pos, buffer_len, &section_entry)) return false;
+			if(!pdf_revision_push_entry(out_revision, (uint32_t)(first + i), section_entry)) return false;
+		}
+	}
+
+	pos += 7; // 'trailer'
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(pos + 1 >= buffer_len) return false;
+	if(!pdf_parse_dictionary(buffer, &pos, buffer_len, &out_revision->trailer)) return false;
+	out_revision->end_offset = pdf_document_find_revision_end(doc, pos);
+
+	// Hybrid files list their compressed objects in an xref stream given
+	// by /XRefStm (and as free in the table for older readers), its entries
+	// come before the table ones.
+	size_t table_count = out_revision->entries_count;
+	PdfObject stream_offset = pdf_dictionary_get(&out_revision->trailer.dictionary_value, pdf_name("XRefStm"));
+	if(stream_offset.type == PDF_OBJECT_TYPE_INTEGER && stream_offset.int_value >= 0
+	   && (uint64_t)stream_offset.int_value < buffer_len)
+		pdf_document_parse_xref_stream(doc, (size_t)stream_offset.int_value, out_revision, true);
+
+	for(size_t i = 0; i < table_count; ++i)
+	{
+		PdfXrefEntry* entry = &doc->xref[out_revision->numbers[i]];
+		if(entry->type == PDF_XREF_ENTRY_NONE) *entry = out_revision->entries[i];
+	}
+	return true;
+}
+
+// Reads the entry of 'number' in the classic xref table at 'offset',
+// jumping to it in the subsection when the entries are regular.
+static bool pdf_document_find_table_entry(PdfDocument* doc, size_t offset, uint32_t number, PdfXrefEntry* out_entry)
+{
+	const uint8_t* buffer = doc->data;
+	size_t buffer_len = doc->size;
+	size_t pos = offset;
+	pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+	if(!pdf_is_keyword_at(buffer, pos, buffer_len, "xref")) return false;
+	pos += 4;
+
+	while(true)
+	{
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+		if(pdf_is_keyword_at(buffer, pos, buffer_len, "trailer")) return false;
+
+		uint64_t first, count;
+		if(!pdf_read_unsigned(buffer, &pos, buffer_len, &first)) return false;
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+		if(!pdf_read_unsigned(buffer, &pos, buffer_len, &count)) return false;
+		if(count > (buffer_len - pos) / 18) return false;
+
+		if(number < first || number - first >= count)
+		{
+			if(!pdf_skip_xref_table_entries(buffer, &pos, buffer_len, count)) return false;
+			continue;
+		}
+		pdf_skip_white_spaces_and_comments(buffer, &pos, buffer_len);
+		uint64_t index = number - first;
+		if(pdf_xref_subsection_is_regular(buffer, pos, buffer_len, count))
+		{
+			pos += 20*(size_t)index;
+			return pdf_read_xref_table_entry(buffer, &pos, buffer_len, out_entry);
+		}
+		for(uint64_t i = 0; i <= index; ++i)
+			if(!pdf_read_xref_table_entry(buffer, &pos, buffer_len, out_entry)) return false;
+		return true;
+	}
+}
+
+// PDF_OPEN_METADATA: finds the entry of 'number' in the xref sections,
+// newest first, and keeps it in the merged xref. Entries from xref streams
+// were read with their section, the ones of classic tables are read now.
+bool pdf_document_find_xref_entry(PdfDocument* doc, uint32_t number)
+{
+	if(number >= doc->xref_count) return false;
+	if(doc->xref[number].type != PDF_XREF_ENTRY_NONE) return true;
+	for(size_t r = doc->revisions_count; r-- > 0; )
+	{
+		PdfRevision* rev = &doc->revisions[r];
+		PdfXrefEntry entry;
+		bool is_found = false;
+		// The /XRefStm entries of hybrid files win over the table ones
+		for(size_t i = 0; i < rev->entries_count; ++i)
+		{
+			if(rev->numbers[i] != number) continue;
+			entry = rev->entries[i];
+			is_found = true;
+			break;
+		}
+		if(!is_found && !rev->is_xref_stream)
+			is_found = pdf_document_find_table_entry(doc, (size_t)rev->xref_offset, number, &entry);
+		if(is_found)
+		{
+			doc->xref[number] = entry;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Forgets everything read from the xref sections
+void pdf_document_reset_xref(PdfDocument* doc)
+{
+	pdf_document_free_object_streams(doc);
+	pdf_document_free_fonts(doc);
+	pdf_document_free_shared_objects(doc);
+	pdf_free(doc->object_offsets);
+	doc->object_offsets = NULL;
+	pdf_free(doc->xref);
+	doc->xref = NULL;
+	doc->xref_count = 0;
+	pdf_object_free(&doc->trailer);
+	for(size_t i = 0; i < doc->revisions_count; ++i) pdf_revision_free(&doc->revisions[i]);
+	pdf_free(doc->revisions);
+	doc->revisions = NULL;
+	doc->revisions_count = 0;
+	doc->has_partial_xref = false;
+	doc->has_lazy_xref = false;
+}
+
+// Reads the xref chain starting from 'startxref', the usual way.
+bool pdf_document_read_xref(PdfDocument* doc)
+{
+	const size_t tail_len = 1024;
+	size_t tail_start = doc->size > tail_len ? doc->size - tail_len : 0;
+	size_t startxref = tail_start + pdf_find(doc->data + tail_start, doc->size - tail_start, "startxref");
+	if(startxref == doc->size) return false;
+	// NOTE(Sam): There may be several 'startxref' in the tail, we want the last
+	while(true)
+	{
+		size_t next = startxref + 1 + pdf_find(doc->data + startxref + 1, doc->size - startxref - 1, "startxref");
+		if(next >= doc->size) break;
+		startxref = next;
+	}
+
+	size_t pos = startxref + 9;
+	uint64_t offset;
+	pdf_skip_white_spaces_and_comments(doc->data, &pos, doc->size);
+	if(!pdf_read_unsigned(doc->data, &pos, doc->size, &offset)) return false;
+
+	// Follow the /Prev chain, newest section first
+	size_t revisions_capacity = 0;
+	while(true)
+	{
+		if(offset >= doc->size || doc->revisions_count >= 1024) return false;
+
+		if(doc->revisions_count == revisions_capacity)
+		{
+			revisions_capacity = revisions_capacity ? 2*revisions_capacity : 4;
+			PdfRevision* revisions = (PdfRevision*)pdf_realloc(doc->revisions, revisions_capacity*sizeof(PdfRevision));
+			if(revisions == NULL) return false;
+			doc->revisions = revisions;
+		}
+		PdfRevision* revision = &doc->revisions[doc->revisions_count++];
+		memset(revision, 0, sizeof(PdfRevision));
+		if(!pdf_document_parse_xref_section(doc, (size_t)offset, revision)) return false;
+
+		PdfObject prev = pdf_dictionary_get(&revision->trailer.dictionary_value, pdf_name("Prev"));
+		if(prev.type != PDF_OBJECT_TYPE_INTEGER || prev.int_value < 0) break;
+		bool is_loop = false;
+		for(size_t i = 0; i < doc->revisions_count; ++i)
+			is_loop |= doc->revisions[i].xref_offset == (uint64_t)prev.int_value;
+		if(is_loop) break;
+		offset = (uint64_t)prev.int_value;
+	}
+
+	// We read them newest first, revision 0 is the original document
+	for(size_t i = 0; i < doc->revisions_count/2; ++i)
+	{
+		PdfRevision tmp = doc->revisions[i];
+		doc->revisions[i] = doc->revisions[doc->revisions_count - 1 - i];
+		doc->revisions[doc->revisions_count - 1 - i] = tmp;
+	}
+	if(!pdf_object_copy(&doc->revisions[doc->revisions_count - 1].trailer, &doc->trailer)) return false;
+
+	// PDF_OPEN_METADATA: the entries found later go up to /Size, the arrays
+	// indexed by object number must not grow once allocated.
+	if(doc->has_lazy_xref)
+	{
+		PdfObject size = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Size"));
+		if(size.type != PDF_OBJECT_TYPE_INTEGER || size.int_value <= 0 || size.int_value > PDF_MAX_OBJECT_NUMBER + 1
+		   || !pdf_document_reserve_xref(doc, (size_t)size.int_value)) return false;
+	}
+
+	// NOTE(Sam): Broken offsets are the most common damage, checking that
+	//            the catalog is where the xref says is a cheap sanity check.
+	PdfObject root = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Root"));
+	if(root.type != PDF_OBJECT_TYPE_REFERENCE) return false;
+	return pdf_document_check_xref_entry(doc, root.reference_value.number);
+}
+
+/*
+  XREF REPAIR:
+  The file is split in ranges scanned in parallel for the keywords 'obj',
+  'endobj', 'stream', 'endstream' and 'trailer'. A keyword belongs to the
+  range where it starts, but scanning may read past the range end (or
+  before its start for the 'N G' of a header) so nothing is missed at
+  the boundaries. The ranges results are then merged in file order, which
+  allows us to drop the headers found inside stream data.
+ */
+
+enum PDF_SCAN_HIT_TYPES {
+	PDF_SCAN_HIT_OBJ,
+	PDF_SCAN_HIT_ENDOBJ,
+	PDF_SCAN_HIT_STREAM,
+	PDF_SCAN_HIT_ENDSTREAM,
+	PDF_SCAN_HIT_TRAILER,
+};
+
+typedef struct {
+	uint64_t offset;	// Start of the header for objects, of the keyword otherwise
+	uint32_t number;
+	uint32_t generation;
+	uint8_t type;
+} PdfScanHit;
+
+typedef struct {
+	const uint8_t* data;
+	size_t size;
+	size_t range_start, range_end;
+	PdfScanHit* hits;
+	size_t hits_count, hits_capacity;
+	bool out_of_memory;
+	PdfMemoryBudget* budget; // Of the thread repairing the document
+#ifdef PDF_ENABLE_STATS
+	PdfStats stats;
+#endif
+} PdfScanRange;
+
+// Minimum amount of bytes a repair thread is given
+#define PDF_REPAIR_MIN_RANGE_SIZE (1 << 20)
+
+void pdf_scan_range_push(PdfScanRange* range, PdfScanHit hit)
+{
+	if(range->hits_count == range->hits_capacity)
+	{
+		size_t capacity = range->hits_capacity ? 2*range->hits_capacity : 256;
+		PdfScanHit* hits = (PdfScanHit*)pdf_realloc(range->hits, capacity*sizeof(PdfScanHit));
+		if(hits == NULL)
+		{
+			range->out_of_memory = true;
+			return;
+		}
+		range->hits = hits;
+		range->hits_capacity = capacity;
+	}
+	range->hits[range->hits_count++] = hit;
+}
+
+// Reads the 'N G' going backward from the 'obj' keyword at 'pos'
+bool pdf_scan_object_header(const uint8_t* data, size_t pos, PdfScanHit* out_hit)
+{
+	size_t p = pos;
+	size_t digits_end, digits_count;
+	uint64_t values[2] = {0};
+	for(int k = 1; k >= 0; --k)
+	{
+		// At least one white space before each part
+		size_t ws_count = 0;
+		while(p > 0 && pdf_char_is_white_space(data[p-1]) && ws_count < 64) { --p; ++ws_count; }
+		if(ws_count == 0) return false;
+		digits_end = p;
+		while(p > 0 && data[p-1] >= '0' && data[p-1] <= '9' && digits_end - p < 10) --p;
+		digits_count = digits_end - p;
+		if(digits_count == 0) return false;
+		for(size_t i = p; i < digits_end; ++i) values[k] = 10*values[k] + (data[i] - '0');
+	}
+	if(p > 0 && pdf_char_is_regular(data[p-1])) return false;
+	if(values[0] > PDF_MAX_OBJECT_NUMBER || values[1] > 65535) return false;
+
+	out_hit->offset = p;
+	out_hit->number = (uint32_t)values[0];
+	out_hit->generation = (uint32_t)values[1];
+	out_hit->type = PDF_SCAN_HIT_OBJ;
+	return true;
+}
+
+// Called for each position where 'obj', 'str' or 'tra' has been found
+void pdf_scan_classify(PdfScanRange* range, size_t pos)
+{
+	const uint8_t* data = range->data;
+	size_t size = range->size;
+	bool after_end = pos >= 3 && memcmp(data + pos - 3, "end", 3) == 0;
+	PdfScanHit hit = {0};
+	hit.offset = pos;
+
+	if(data[pos] == 'o')
+	{
+		if(pos + 3 < size && pdf_char_is_regular(data[pos + 3])) return;
+		if(after_end)
+		{
+			hit.offset = pos - 3;
+			hit.type = PDF_SCAN_HIT_ENDOBJ;
+			pdf_scan_range_push(range, hit);
+		}
+		else if(pdf_scan_object_header(data, pos, &hit))
+		{
+			pdf_scan_range_push(range, hit);
+		}
+	}
+	else if(data[pos] == 's')
+	{
+		if(pos + 6 > size || memcmp(data + pos, "stream", 6) != 0) return;
+		if(pos + 6 < size && pdf_char_is_regular(data[pos + 6])) return;
+		hit.type = after_end ? PDF_SCAN_HIT_ENDSTREAM : PDF_SCAN_HIT_STREAM;
+		if(after_end) hit.offset = pos - 3;
+		pdf_scan_range_push(range, hit);
+	}
+	else
+	{
+		if(!pdf_is_keyword_at(data, pos, size, "trailer")) return;
+		if(pos > 0 && pdf_char_is_regular(data[pos - 1])) return;
+		hit.type = PDF_SCAN_HIT_TRAILER;
+		pdf_scan_range_push(range, hit);
+	}
+}
+
+void pdf_scan_range(void* param)
+{
+	PdfScanRange* range = (PdfScanRange*)param;
+	const uint8_t* data = range->data;
+	size_t pos = range->range_start;
+	pdf_memory_budget_use(range->budget);
+	size_t end = range->range_end;
+
+#ifdef PDF_USE_SSE2
+	// Look for the 3 bytes prefixes of every keyword, 16 positions at once.
+	// We need pos+2+16 bytes to be readable for the shifted loads.
+	const __m128i o = _mm_set1_epi8('o'), b = _mm_set1_epi8('b'), j = _mm_set1_epi8('j');
+	const __m128i s = _mm_set1_epi8('s'), t = _mm_set1_epi8('t'), r = _mm_set1_epi8('r');
+	const __m128i a = _mm_set1_epi8('a');
+	while(pos < end && pos + 18 <= range->size)
+	{
+		__m128i x0 = _mm_loadu_si128((const __m128i*)(data + pos));
+		__m128i x1 = _mm_loadu_si128((const __m128i*)(data + pos + 1));
+		__m128i x2 = _mm_loadu_si128((const __m128i*)(data + pos + 2));
+		__m128i is_obj = _mm_and_si128(_mm_cmpeq_epi8(x0, o), _mm_and_si128(_mm_cmpeq_epi8(x1, b), _mm_cmpeq_epi8(x2, j)));
+		__m128i is_str = _mm_and_si128(_mm_cmpeq_epi8(x0, s), _mm_and_si128(_mm_cmpeq_epi8(x1, t), _mm_cmpeq_epi8(x2, r)));
+		__m128i is_tra = _mm_and_si128(_mm_cmpeq_epi8(x0, t), _mm_and_si128(_mm_cmpeq_epi8(x1, r), _mm_cmpeq_epi8(x2, a)));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(is_obj, _mm_or_si128(is_str, is_tra)));
+		while(mask != 0)
+		{
+			size_t hit_pos = pos + pdf_count_trailing_zeros(mask);
+			if(hit_pos < end) pdf_scan_classify(range, hit_pos);
+			mask &= mask - 1;
+		}
+		pos += 16;
+	}
+#endif
+	for(; pos < end && pos + 3 <= range->size; ++pos)
+	{
+		if((data[pos] == 'o' && data[pos+1] == 'b' && data[pos+2] == 'j') ||
+		   (data[pos] == 's' && data[pos+1] == 't' && data[pos+2] == 'r') ||
+		   (data[pos] == 't' && data[pos+1] == 'r' && data[pos+2] == 'a'))
+		{
+			pdf_scan_classify(range, pos);
+		}
+	}
+	PDF_STATS_WORKER_DONE(&range->stats);
+}
+
+// Rebuilds the xref (and trailer) from a full scan of the file.
+// 'threads_count' of 0 means one thread per core.
+bool pdf_document_repair_xref(PdfDocument* doc, size_t threads_count)
+{
+	pdf_document_reset_xref(doc);
+
+	if(threads_count == 0) threads_count = pdf_cpu_count();
+	size_t max_ranges = (doc->size + PDF_REPAIR_MIN_RANGE_SIZE - 1) / PDF_REPAIR_MIN_RANGE_SIZE;
+	if(threads_count > max_ranges) threads_count = max_ranges;
+	if(threads_count == 0) threads_count = 1;
+
+	PdfScanRange* ranges = (PdfScanRange*)pdf_malloc(threads_count*sizeof(PdfScanRange));
+	PdfThread* threads = (PdfThread*)pdf_malloc(threads_count*sizeof(PdfThread));
+	bool* started = (bool*)pdf_malloc(threads_count*sizeof(bool));
+	if(ranges == NULL || threads == NULL || started == NULL)
+	{
+		pdf_free(ranges);
+		pdf_free(threads);
+		pdf_free(started);
+		return false;
+	}
+
+	size_t range_size = doc->size / threads_count;
+	for(size_t i = 0; i < threads_count; ++i)
+	{
+		memset(&ranges[i], 0, sizeof(PdfScanRange));
+		ranges[i].data = doc->data;
+		ranges[i].size = doc->size;
+		ranges[i].range_start = i*range_size;
+		ranges[i].range_end = i + 1 == threads_count ? doc->size : (i + 1)*range_size;
+		ranges[i].budget = pdf_memory_budget_current();
+	}
+	// The calling thread takes the first range, if a thread can't be
+	// started we also scan its range here.
+	for(size_t i = 1; i < threads_count; ++i)
+		started[i] = pdf_thread_start(&threads[i], pdf_scan_range, &ranges[i]);
+	pdf_scan_range(&ranges[0]);
+	for(size_t i = 1; i < threads_count; ++i)
+	{
+		if(started[i])
+		{
+			pdf_thread_join(&threads[i]);
+			PDF_STATS_WORKER_JOINED(&ranges[i].stats);
+		}
+		else pdf_scan_range(&ranges[i]);
+	}
+
+	bool success = true;
+	size_t hits_count = 0;
+	for(size_t i = 0; i < threads_count; ++i)
+	{
+		if(ranges[i].out_of_memory) success = false;
+		hits_count += ranges[i].hits_count;
+	}
+
+	// Merge the ranges, they are already sorted by offset
+	PdfScanHit* hits = success && hits_count ? (PdfScanHit*)pdf_malloc(hits_count*sizeof(PdfScanHit)) : NULL;
+	if(hits_count && hits == NULL) success = false;
+	size_t next = 0;
+	for(size_t i = 0; i < threads_count; ++i)
+	{
+		if(hits != NULL) memcpy(hits + next, ranges[i].hits, ranges[i].hits_count*sizeof(PdfScanHit));
+		next += ranges[i].hits_count;
+		pdf_free(ranges[i].hits);
+	}
+	pdf_free(ranges);
+	pdf_free(threads);
+	pdf_free(started);
+
+	// A 'stream' without any following 'endstream' is a truncated one,
+	// we must not ignore everything after it.
+	size_t last_endstream = hits_count;
+	for(size_t i = hits_count; success && i-- > 0; )
+	{
+		if(hits[i].type == PDF_SCAN_HIT_ENDSTREAM && last_endstream == hits_count) last_endstream = i;
+	}
+
+	// Headers of the objects which are streams, they may be object streams
+	// or xref streams which we read once the xref is built.
+	PdfScanHit* streams = success && hits_count ? (PdfScanHit*)pdf_malloc(hits_count*sizeof(PdfScanHit)) : NULL;
+	size_t streams_count = 0;
+	if(hits_count && streams == NULL) success = false;
+	PdfScanHit* last_header = NULL;
+
+	// Newer objects come later in the file (incremental updates) and
+	// override older ones with the same number.
+	bool in_stream = false;
+	for(size_t i = 0; success && i < hits_count; ++i)
+	{
+		PdfScanHit* hit = &hits[i];
+		switch(hit->type)
+		{
+		case PDF_SCAN_HIT_STREAM:
+		{
+			if(in_stream) break;
+			if(last_endstream != hits_count && i < last_endstream) in_stream = true;
+			if(last_header != NULL) streams[streams_count++] = *last_header;
+			last_header = NULL;
+		} break;
+		case PDF_SCAN_HIT_ENDSTREAM:
+		{
+			in_stream = false;
+		} break;
+		case PDF_SCAN_HIT_OBJ:
+		{
+			if(in_stream) break; // Looks like a header but is stream data
+			if(!pdf_document_reserve_xref(doc, (size_t)hit->number + 1))
+			{
+				success = false;
+				break;
+			}
+			doc->xref[hit->number].type = PDF_XREF_ENTRY_IN_USE;
+			doc->xref[hit->number].offset = hit->offset;
+			doc->xref[hit->number].generation = hit->generation;
+			last_header = hit;
+		} break;
+		}
+	}
+
+	// Objects in object streams are invisible to the scan, we list them from
+	// the object streams. A direct object wins over a compressed one, and a
+	// later object stream over an earlier one. The newest xref stream can
+	// give the trailer of files without any 'trailer' keyword.
+	PdfObject stream_trailer = {.type = PDF_OBJECT_TYPE_NONE};
+	uint64_t stream_trailer_offset = 0;
+	for(size_t i = 0; success && i < streams_count; ++i)
+	{
+		PdfScanHit* header = &streams[i];
+		if(doc->xref[header->number].offset != header->offset) continue; // Overridden by a newer one
+		PdfObject obj;
+		if(!pdf_document_parse_indirect_object(doc, (size_t)header->offset, &obj, true)) continue;
+		PdfObject type = obj.type == PDF_OBJECT_TYPE_STREAM
+			? pdf_dictionary_get(&obj.stream_value.dictionary, pdf_name("Type")) : obj;
+		if(type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("XRef")))
+		{
+			pdf_object_free(&stream_trailer);
+			PdfDictionary dictionary = obj.stream_value.dictionary;
+			stream_trailer.type = PDF_OBJECT_TYPE_DICTIONARY;
+			stream_trailer.dictionary_value = dictionary;
+			stream_trailer_offset = header->offset;
+			continue;
+		}
+
+		PdfObject count = pdf_dictionary_get(&obj.stream_value.dictionary, pdf_name("N"));
+		uint8_t* data = NULL;
+		size_t data_len = 0;
+		if(type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("ObjStm"))
+		   && count.type == PDF_OBJECT_TYPE_INTEGER
+		   && pdf_stream_decode(&obj.stream_value, &data, &data_len))
+		{
+			size_t pos = 0;
+			for(PDF_INTEGER_TYPE index = 0; index < count.int_value; ++index)
+			{
+				uint64_t number, offset;
+				pdf_skip_white_spaces_and_comments(data, &pos, data_len);
+				if(!pdf_read_unsigned(data, &pos, data_len, &number)) break;
+				pdf_skip_white_spaces_and_comments(data, &pos, data_len);
+				if(!pdf_read_unsigned(data, &pos, data_len, &offset)) break;
+				if(number == 0 || number > PDF_MAX_OBJECT_NUMBER) continue;
+				if(!pdf_document_reserve_xref(doc, (size_t)number + 1))
+				{
+					success = false;
+					break;
+				}
+				PdfXrefEntry* entry = &doc->xref[number];
+				if(entry->type == PDF_XREF_ENTRY_IN_USE) continue;
+				entry->type = PDF_XREF_ENTRY_COMPRESSED;
+				entry->offset = header->number;
+				entry->generation = (uint32_t)index;
+			}
+		}
+		pdf_free(data);
+		pdf_object_free(&obj);
+	}
+	pdf_free(streams);
+	if(stream_trailer.type == PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		PdfObject root = pdf_dictionary_get(&stream_trailer.dictionary_value, pdf_name("Root"));
+		if(root.type != PDF_OBJECT_TYPE_REFERENCE || !pdf_document_check_xref_entry(doc, root.reference_value.number))
+			pdf_object_free(&stream_trailer);
+	}
+
+	// Use the newest trailer which gives a catalog
+	for(size_t i = hits_count; success && i-- > 0; )
+	{
+		if(hits[i].type != PDF_SCAN_HIT_TRAILER) continue;
+		if(hits[i].offset < stream_trailer_offset) break;
+		size_t pos = (size_t)hits[i].offset + 7;
+		pdf_skip_white_spaces_and_comments(doc->data, &pos, doc->size);
+		PdfObject trailer = {.type = PDF_OBJECT_TYPE_NONE};
+		if(pos + 1 >= doc->size || !pdf_parse_dictionary(doc->data, &pos, doc->size, &trailer)) continue;
+		PdfObject root = pdf_dictionary_get(&trailer.dictionary_value, pdf_name("Root"));
+		if(root.type == PDF_OBJECT_TYPE_REFERENCE && pdf_document_check_xref_entry(doc, root.reference_value.number))
+		{
+			doc->trailer = trailer;
+			break;
+		}
+		pdf_object_free(&trailer);
+	}
+	pdf_free(hits);
+	if(doc->trailer.type == PDF_OBJECT_TYPE_NONE) doc->trailer = stream_trailer;
+	else pdf_object_free(&stream_trailer);
+
+	// No usable trailer, look for the catalog ourself
+	for(size_t i = 0; success && doc->trailer.type == PDF_OBJECT_TYPE_NONE && i < doc->xref_count; ++i)
+	{
+		PdfObject obj;
+		if(!pdf_document_get_object(doc, (uint32_t)i, &obj)) continue;
+		bool is_catalog = false;
+		if(obj.type == PDF_OBJECT_TYPE_DICTIONARY)
+		{
+			PdfObject type = pdf_dictionary_get(&obj.dictionary_value, pdf_name("Type"));
+			is_catalog = type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("Catalog"));
+		}
+		pdf_object_free(&obj);
+		if(!is_catalog) continue;
+
+		PdfObject root = {.type = PDF_OBJECT_TYPE_REFERENCE};
+		root.reference_value.number = (uint32_t)i;
+		root.reference_value.generation = doc->xref[i].generation;
+		PdfObject size = {.type = PDF_OBJECT_TYPE_INTEGER};
+		size.int_value = (PDF_INTEGER_TYPE)doc->xref_count;
+		doc->trailer.type = PDF_OBJECT_TYPE_DICTIONARY;
+		PdfName root_key = {0}, size_key = {0};
+		bool is_built = pdf_dictionary_reserve(&doc->trailer.dictionary_value, PDF_DICTIONARY_NB_SLOTS)
+			&& pdf_name_allocate("Root", &root_key) && pdf_name_allocate("Size", &size_key)
+			&& pdf_dictionary_insert(&doc->trailer.dictionary_value, root_key, root);
+		if(!is_built) pdf_free(root_key.start);
+		if(!is_built || !pdf_dictionary_insert(&doc->trailer.dictionary_value, size_key, size))
+		{
+			pdf_free(size_key.start);
+			pdf_object_free(&doc->trailer);
+		}
+	}
+
+	doc->was_repaired = true;
+	return success && doc->trailer.type == PDF_OBJECT_TYPE_DICTIONARY;
+}
+
+/*
+  PUSH PARSER:
+  - For bytes arriving in pieces (an upload), the caller gives slices of any
+    size to pdf_push_parser_feed() and takes the events they complete with
+    pdf_push_parser_next(), until it returns false to ask for more bytes.
+  - A small lexer state machine follows the tokens, comments, strings, hex
+    strings and '<<' '>>' nesting across the slices. Only what is unfinished
+    is kept: the current token, or the value of the object (or trailer)
+    being read, given to pdf_parse_object once its 'endobj', 'stream' or
+    closing '>>' has arrived.
+  - Stream data with a direct /Length is not kept, it is given back in
+    slices of the fed bytes, /Length being trusted. With an indirect /Length
+    it is kept until its 'endstream' and given in one piece.
+  - Objects are read as they are in the file: the strings of encrypted files
+    stay encrypted and object streams are not looked into.
+ */
+
+enum PDF_PUSH_EVENT_TYPES {
+	PDF_PUSH_EVENT_NONE = false,
+	PDF_PUSH_EVENT_HEADER,		// 'data' is the version after '%PDF-'
+	// 'number', 'generation' and 'object', owned by the caller. For streams
+	// 'value' is the direct /Length, UINT64_MAX if it is not known yet.
+	PDF_PUSH_EVENT_OBJECT,
+	PDF_PUSH_EVENT_STREAM_DATA,	// 'data' is the next part of the data of the last object
+	PDF_PUSH_EVENT_STREAM_END,
+	PDF_PUSH_EVENT_XREF,		// An xref table, its entries are skipped
+	PDF_PUSH_EVENT_TRAILER,		// 'object' is the trailer dictionary, owned by the caller
+	PDF_PUSH_EVENT_STARTXREF,	// 'value' is the offset given after 'startxref'
+	PDF_PUSH_EVENT_END_OF_FILE,	// A '%%EOF' marker, an incremental update may follow
+	PDF_PUSH_EVENT_ERROR,		// What starts at 'offset' could not be parsed and was skipped
+};
+
+enum PDF_PUSH_STATES {
+	PDF_PUSH_STATE_TOP,				// Between objects
+	PDF_PUSH_STATE_XREF,			// In an xref table, until 'trailer' or 'startxref'
+	PDF_PUSH_STATE_STARTXREF,		// Waits for the offset after 'startxref'
+	PDF_PUSH_STATE_OBJECT,			// Keeps the value of an object until 'endobj' or 'stream'
+	PDF_PUSH_STATE_TRAILER,			// Keeps the trailer dictionary until its '>>'
+	PDF_PUSH_STATE_STREAM_EOL,		// Right after 'stream'
+	PDF_PUSH_STATE_STREAM_DATA,		// 'stream_remaining' bytes of data left
+	PDF_PUSH_STATE_STREAM_SEARCH,	// Keeps the data until 'endstream'
+	PDF_PUSH_STATE_ENDSTREAM,		// Waits for 'endstream'
+	PDF_PUSH_STATE_ENDOBJ,			// Waits for 'endobj' after a stream
+};
+
+enum PDF_PUSH_LEXER_STATES {
+	PDF_PUSH_LEX_DEFAULT,
+	PDF_PUSH_LEX_TOKEN,			// In a run of regular characters (or a name)
+	PDF_PUSH_LEX_COMMENT,
+	PDF_PUSH_LEX_STRING,		// In a literal string, 'paren_depth' deep
+	PDF_PUSH_LEX_STRING_ESCAPE,	// After a '\' in a literal string
+	PDF_PUSH_LEX_HEX_STRING,
+	PDF_PUSH_LEX_LESS,			// After a '<', either '<<' or a hex string
+	PDF_PUSH_LEX_GREATER,		// After a '>', waits for the second one
+};
+
+typedef struct {
+	uint8_t type;
+	uint64_t offset;		// Where it starts in the input
+	uint32_t number;
+	uint32_t generation;
+	PdfObject object;
+	// NOTE(Sam): Point into the fed slice or the parser, they are valid
+	//            until the next call to the parser.
+	const uint8_t* data;
+	size_t length;
+	uint64_t value;
+} PdfPushEvent;
+
+// Tokens longer than that are never keywords nor numbers we use
+#define PDF_PUSH_TOKEN_SIZE 32
+
+// Above that, the buffer of what is kept is freed once it is done with
+#define PDF_PUSH_KEPT_CAPACITY (1 << 20)
+
+typedef struct {
+	uint8_t state;
+	uint8_t lex;
+
+	// Slice being read, 'chunk_offset' is its offset in the input
+	const uint8_t* chunk;
+	size_t chunk_length;
+	size_t pos;
+	uint64_t chunk_offset;
+	bool is_finished;
+	bool has_ended;
+
+	// Current token or comment, only its first bytes are stored
+	char token[PDF_PUSH_TOKEN_SIZE];
+	size_t token_length;
+	uint64_t token_offset;
+	size_t token_kept;		// Where it starts in 'kept'
+
+	size_t paren_depth;
+	size_t depth;			// Of '<<' in the trailer
+
+	// Last integers between objects, for the 'N G' of an 'obj'
+	uint64_t integers[2];
+	uint64_t integers_offsets[2];
+	size_t integers_count;
+
+	// Unfinished object, trailer or stream data, padded with zeros
+	uint8_t* kept;
+	size_t kept_length;
+	size_t kept_capacity;
+	bool is_keeping;		// Bytes of the slice from 'keep_from' are kept too
+	bool keep_failed;
+	size_t keep_from;
+
+	uint64_t item_offset;
+	uint32_t number;
+	uint32_t generation;
+	uint64_t stream_remaining;
+	size_t stream_search_from;
+	bool saw_cr;
+	bool is_skipping_stream;	// Its object could not be parsed, no data events
+	bool has_stream_end;		// STREAM_END is given by the next call
+} PdfPushParser;
+
+void pdf_push_parser_init(PdfPushParser* parser)
+{
+	memset(parser, 0, sizeof(*parser));
+}
+
+void pdf_push_parser_free(PdfPushParser* parser)
+{
+	pdf_free(parser->kept);
+	memset(parser, 0, sizeof(*parser));
+}
+
+// Gives the next slice of the input, the previous one must have been
+// read entirely (pdf_push_parser_next returned false). The bytes must stay
+// valid until then, nothing is kept pointing to them afterwards.
+void pdf_push_parser_feed(PdfPushParser* parser, const uint8_t* data, size_t length)
+{
+	PDF_ASSERT(parser->pos == parser->chunk_length && "The previous slice is not read yet");
+	PDF_ASSERT(!parser->is_finished && "Fed after the end of the input");
+	parser->chunk_offset += parser->chunk_length;
+	parser->chunk = data;
+	parser->chunk_length = length;
+	parser->pos = 0;
+	parser->keep_from = 0;
+}
+
+// Tells the parser there are no more bytes, so the last token is complete
+// and anything unfinished is reported as an error.
+void pdf_push_parser_finish(PdfPushParser* parser)
+{
+	parser->is_finished = true;
+}
+
+static bool pdf_push_parser_keep(PdfPushParser* parser, const uint8_t* data, size_t length)
+{
+	size_t needed = parser->kept_length + length + PDF_BUFFER_PADDING;
+	if(needed > parser->kept_capacity)
+	{
+		size_t capacity = parser->kept_capacity ? parser->kept_capacity : 4096;
+		while(capacity < needed) capacity *= 2;
+		uint8_t* kept = (uint8_t*)pdf_realloc(parser->kept, capacity);
+		if(kept == NULL) return false;
+		parser->kept = kept;
+		parser->kept_capacity = capacity;
+	}
+	memcpy(parser->kept + parser->kept_length, data, length);
+	parser->kept_length += length;
+	memset(parser->kept + parser->kept_length, 0, PDF_BUFFER_PADDING);
+	return true;
+}
+
+// Keeps the bytes of the slice from 'pos' until the item is complete
+static void pdf_push_parser_start_keeping(PdfPushParser* parser, size_t pos)
+{
+	if(parser->kept_capacity > PDF_PUSH_KEPT_CAPACITY)
+	{
+		pdf_free(parser->kept);
+		parser->kept = NULL;
+		parser->kept_capacity = 0;
+	}
+	parser->kept_length = 0;
+	parser->is_keeping = true;
+	parser->keep_failed = false;
+	parser->keep_from = pos;
+}
+
+// Keeps the bytes of the slice up to 'pos', false if some could not be
+static bool pdf_push_parser_stop_keeping(PdfPushParser* parser)
+{
+	bool success = !parser->keep_failed
+		&& pdf_push_parser_keep(parser, parser->chunk + parser->keep_from, parser->pos - parser->keep_from);
+	parser->is_keeping = false;
+	return success;
+}
+
+static bool pdf_push_parser_parse_kept(PdfPushParser* parser, size_t length, PdfObject* out_obj)
+{
+	out_obj->type = PDF_OBJECT_TYPE_NONE;
+	size_t pos = 0;
+	pdf_skip_white_spaces_and_comments(parser->kept, &pos, length);
+	return pos < length && pdf_parse_object(parser->kept, &pos, length, out_obj);
+}
+
+static void pdf_push_parser_start_token(PdfPushParser* parser, size_t pos)
+{
+	parser->token_length = 0;
+	parser->token_offset = parser->chunk_offset + pos;
+	parser->token_kept = parser->kept_length + (pos - parser->keep_from);
+}
+
+static bool pdf_push_parser_token_is(const PdfPushParser* parser, const char* keyword)
+{
+	size_t length = strlen(keyword);
+	return parser->token_length == length && memcmp(parser->token, keyword, length) == 0;
+}
+
+static bool pdf_push_parser_token_integer(const PdfPushParser* parser, uint64_t* out_value)
+{
+	// 19 digits always fit
+	if(parser->token_length == 0 || parser->token_length > 19) return false;
+	uint64_t value = 0;
+	for(size_t i = 0; i < parser->token_length; ++i)
+	{
+		if(parser->token[i] < '0' || parser->token[i] > '9') return false;
+		value = 10*value + (uint64_t)(parser->token[i] - '0');
+	}
+	*out_value = value;
+	return true;
+}
+
+static bool pdf_push_parser_error(PdfPushParser* parser, uint64_t offset, PdfPushEvent* out_event)
+{
+	parser->state = PDF_PUSH_STATE_TOP;
+	parser->is_keeping = false;
+	parser->kept_length = 0;
+	out_event->type = PDF_PUSH_EVENT_ERROR;
+	out_event->offset = offset;
+	return true;
+}
+
+// At the 'endobj' or 'stream' which ends the value of an object
+static bool pdf_push_parser_end_object(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	bool is_stream = pdf_push_parser_token_is(parser, "stream");
+	PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+	bool is_parsed = pdf_push_parser_stop_keeping(parser)
+		&& pdf_push_parser_parse_kept(parser, parser->token_kept, &obj);
+	if(!is_parsed || (is_stream && obj.type != PDF_OBJECT_TYPE_DICTIONARY))
+	{
+		if(is_parsed) pdf_object_free(&obj);
+		pdf_push_parser_error(parser, parser->item_offset, out_event);
+		if(is_stream)
+		{
+			// Its data is still skipped, up to 'endstream'
+			parser->state = PDF_PUSH_STATE_STREAM_EOL;
+			parser->stream_remaining = UINT64_MAX;
+			parser->is_skipping_stream = true;
+			parser->saw_cr = false;
+		}
+		return true;
+	}
+	parser->kept_length = 0;
+	parser->state = PDF_PUSH_STATE_TOP;
+
+	if(is_stream)
+	{
+		PdfObject length = pdf_dictionary_get(&obj.dictionary_value, pdf_name("Length"));
+		bool has_length = length.type == PDF_OBJECT_TYPE_INTEGER && length.int_value >= 0;
+		PdfDictionary dictionary = obj.dictionary_value;
+		obj.type = PDF_OBJECT_TYPE_STREAM;
+		obj.stream_value.dictionary = dictionary;
+		// NOTE(Sam): The data comes with the following events, the stream
+		//            has none so that it can still be written or copied.
+		obj.stream_value.data = (const uint8_t*)"";
+		obj.stream_value.length = 0;
+		// UINT64_MAX stands for an unknown length
+		parser->stream_remaining = has_length ? (uint64_t)length.int_value : UINT64_MAX;
+		parser->is_skipping_stream = false;
+		parser->saw_cr = false;
+		parser->state = PDF_PUSH_STATE_STREAM_EOL;
+	}
+
+	out_event->type = PDF_PUSH_EVENT_OBJECT;
+	out_event->offset = parser->item_offset;
+	out_event->number = parser->number;
+	out_event->generation = parser->generation;
+	out_event->object = obj;
+	out_event->value = is_stream ? parser->stream_remaining : 0;
+	return true;
+}
+
+// At the '>>' which closes the trailer dictionary
+static bool pdf_push_parser_end_trailer(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+	bool is_parsed = pdf_push_parser_stop_keeping(parser)
+		&& pdf_push_parser_parse_kept(parser, parser->kept_length, &obj);
+	if(!is_parsed || obj.type != PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		if(is_parsed) pdf_object_free(&obj);
+		return pdf_push_parser_error(parser, parser->item_offset, out_event);
+	}
+	parser->kept_length = 0;
+	parser->state = PDF_PUSH_STATE_TOP;
+	out_event->type = PDF_PUSH_EVENT_TRAILER;
+	out_event->offset = parser->item_offset;
+	out_event->object = obj;
+	return true;
+}
+
+static bool pdf_push_parser_end_token(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	uint64_t value = 0;
+	bool is_integer = pdf_push_parser_token_integer(parser, &value);
+
+	switch(parser->state)
+	{
+	case PDF_PUSH_STATE_OBJECT:
+		// NOTE(Sam): Names start with '/', so these can only be the keywords
+		if(pdf_push_parser_token_is(parser, "endobj") || pdf_push_parser_token_is(parser, "stream"))
+			return pdf_push_parser_end_object(parser, out_event);
+		return false;
+	case PDF_PUSH_STATE_TRAILER:
+		if(parser->depth > 0) return false;
+		// A trailer without dictionary, read the token as if it was not there
+		parser->is_keeping = false;
+		parser->state = PDF_PUSH_STATE_TOP;
+		break;
+	case PDF_PUSH_STATE_XREF:
+		if(!pdf_push_parser_token_is(parser, "trailer") && !pdf_push_parser_token_is(parser, "startxref")) return false;
+		parser->state = PDF_PUSH_STATE_TOP;
+		break;
+	case PDF_PUSH_STATE_STARTXREF:
+		parser->state = PDF_PUSH_STATE_TOP;
+		if(!is_integer) break;
+		out_event->type = PDF_PUSH_EVENT_STARTXREF;
+		out_event->offset = parser->item_offset;
+		out_event->value = value;
+		return true;
+	case PDF_PUSH_STATE_ENDSTREAM:
+		if(!pdf_push_parser_token_is(parser, "endstream"))
+			return pdf_push_parser_error(parser, parser->token_offset, out_event);
+		parser->state = PDF_PUSH_STATE_ENDOBJ;
+		if(parser->is_skipping_stream) return false;
+		out_event->type = PDF_PUSH_EVENT_STREAM_END;
+		out_event->offset = parser->token_offset;
+		return true;
+	case PDF_PUSH_STATE_ENDOBJ:
+		parser->state = PDF_PUSH_STATE_TOP;
+		if(pdf_push_parser_token_is(parser, "endobj")) return false;
+		break;
+	}
+
+	// Between objects
+	if(is_integer)
+	{
+		parser->integers[0] = parser->integers[1];
+		parser->integers_offsets[0] = parser->integers_offsets[1];
+		parser->integers[1] = value;
+		parser->integers_offsets[1] = parser->token_offset;
+		if(parser->integers_count < 2) ++parser->integers_count;
+		return false;
+	}
+	size_t integers_count = parser->integers_count;
+	parser->integers_count = 0;
+	if(pdf_push_parser_token_is(parser, "obj"))
+	{
+		if(integers_count < 2 || parser->integers[0] > PDF_MAX_OBJECT_NUMBER || parser->integers[1] > UINT16_MAX)
+			return false;
+		parser->number = (uint32_t)parser->integers[0];
+		parser->generation = (uint32_t)parser->integers[1];
+		parser->item_offset = parser->integers_offsets[0];
+		parser->state = PDF_PUSH_STATE_OBJECT;
+		pdf_push_parser_start_keeping(parser, parser->pos);
+	}
+	else if(pdf_push_parser_token_is(parser, "xref"))
+	{
+		parser->state = PDF_PUSH_STATE_XREF;
+		out_event->type = PDF_PUSH_EVENT_XREF;
+		out_event->offset = parser->token_offset;
+		return true;
+	}
+	else if(pdf_push_parser_token_is(parser, "trailer"))
+	{
+		parser->item_offset = parser->token_offset;
+		parser->depth = 0;
+		parser->state = PDF_PUSH_STATE_TRAILER;
+		pdf_push_parser_start_keeping(parser, parser->pos);
+	}
+	else if(pdf_push_parser_token_is(parser, "startxref"))
+	{
+		parser->item_offset = parser->token_offset;
+		parser->state = PDF_PUSH_STATE_STARTXREF;
+	}
+	return false;
+}
+
+// 'token' holds the comment after its '%'
+static bool pdf_push_parser_end_comment(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	if(parser->state != PDF_PUSH_STATE_TOP) return false;
+	size_t length = parser->token_length < PDF_PUSH_TOKEN_SIZE ? parser->token_length : PDF_PUSH_TOKEN_SIZE;
+	if(length >= 4 && memcmp(parser->token, "PDF-", 4) == 0)
+	{
+		out_event->type = PDF_PUSH_EVENT_HEADER;
+		out_event->data = (const uint8_t*)parser->token + 4;
+		out_event->length = length - 4;
+	}
+	else if(length >= 4 && memcmp(parser->token, "%EOF", 4) == 0)
+	{
+		out_event->type = PDF_PUSH_EVENT_END_OF_FILE;
+	}
+	else return false;
+	out_event->offset = parser->token_offset;
+	return true;
+}
+
+// Reads from 'pos' up to the end of the current lexer state, true if
+// that completed an event.
+static bool pdf_push_parser_lex(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	const uint8_t* chunk = parser->chunk;
+	size_t length = parser->chunk_length;
+	size_t pos = parser->pos;
+
+	switch(parser->lex)
+	{
+	case PDF_PUSH_LEX_TOKEN:
+	case PDF_PUSH_LEX_COMMENT:
+	{
+		bool is_comment = parser->lex == PDF_PUSH_LEX_COMMENT;
+		while(pos < length && (is_comment ? chunk[pos] != PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED
+							   && chunk[pos] != PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN
+							   : pdf_char_is_regular(chunk[pos])))
+		{
+			if(parser->token_length < PDF_PUSH_TOKEN_SIZE) parser->token[parser->token_length] = (char)chunk[pos];
+			++parser->token_length;
+			++pos;
+		}
+		parser->pos = pos;
+		if(pos == length) return false;
+		// The byte which ends it is read again
+		parser->lex = PDF_PUSH_LEX_DEFAULT;
+		return is_comment ? pdf_push_parser_end_comment(parser, out_event)
+			: pdf_push_parser_end_token(parser, out_event);
+	}
+	case PDF_PUSH_LEX_STRING:
+		while(pos < length)
+		{
+			uint8_t c = chunk[pos++];
+			if(c == '\\')
+			{
+				if(pos == length)
+				{
+					parser->lex = PDF_PUSH_LEX_STRING_ESCAPE;
+					break;
+				}
+				++pos;
+			}
+			else if(c == '(') ++parser->paren_depth;
+			else if(c == ')' && --parser->paren_depth == 0)
+			{
+				parser->lex = PDF_PUSH_LEX_DEFAULT;
+				break;
+			}
+		}
+		parser->pos = pos;
+		return false;
+	case PDF_PUSH_LEX_STRING_ESCAPE:
+		parser->pos = pos + 1;
+		parser->lex = PDF_PUSH_LEX_STRING;
+		return false;
+	case PDF_PUSH_LEX_HEX_STRING:
+	{
+		const uint8_t* end = (const uint8_t*)memchr(chunk + pos, '>', length - pos);
+		if(end == NULL)
+		{
+			parser->pos = length;
+			return false;
+		}
+		parser->pos = (size_t)(end - chunk) + 1;
+		parser->lex = PDF_PUSH_LEX_DEFAULT;
+		return false;
+	}
+	case PDF_PUSH_LEX_LESS:
+		if(chunk[pos] == '<')
+		{
+			++parser->depth;
+			parser->pos = pos + 1;
+			parser->lex = PDF_PUSH_LEX_DEFAULT;
+		}
+		else parser->lex = PDF_PUSH_LEX_HEX_STRING;
+		return false;
+	case PDF_PUSH_LEX_GREATER:
+		parser->lex = PDF_PUSH_LEX_DEFAULT;
+		// A lonely '>', the byte is read again
+		if(chunk[pos] != '>') return false;
+		parser->pos = pos + 1;
+		if(parser->depth > 0) --parser->depth;
+		if(parser->state == PDF_PUSH_STATE_TRAILER && parser->depth == 0)
+			return pdf_push_parser_end_trailer(parser, out_event);
+		return false;
+	}
+
+	uint8_t c = chunk[pos];
+	if(pdf_char_is_white_space(c))
+	{
+		while(pos < length && pdf_char_is_white_space(chunk[pos])) ++pos;
+		parser->pos = pos;
+		return false;
+	}
+	if(c == '/' || pdf_char_is_regular(c))
+	{
+		pdf_push_parser_start_token(parser, pos);
+		parser->lex = PDF_PUSH_LEX_TOKEN;
+		if(c == '/')
+		{
+			parser->token[parser->token_length++] = '/';
+			parser->pos = pos + 1;
+		}
+		return false;
+	}
+
+	parser->pos = pos + 1;
+	switch(c)
+	{
+	case '%':
+		pdf_push_parser_start_token(parser, pos);
+		parser->lex = PDF_PUSH_LEX_COMMENT;
+		return false;
+	case '(':
+		parser->paren_depth = 1;
+		parser->lex = PDF_PUSH_LEX_STRING;
+		break;
+	case '<':
+		parser->lex = PDF_PUSH_LEX_LESS;
+		break;
+	case '>':
+		parser->lex = PDF_PUSH_LEX_GREATER;
+		break;
+	}
+	// An 'N G' followed by anything else than 'obj' is no header
+	if(parser->state == PDF_PUSH_STATE_TOP) parser->integers_count = 0;
+	return false;
+}
+
+// The stream states read the slice without the lexer
+static bool pdf_push_parser_read_stream(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	const uint8_t* chunk = parser->chunk;
+	size_t length = parser->chunk_length;
+	size_t pos = parser->pos;
+
+	switch(parser->state)
+	{
+	case PDF_PUSH_STATE_STREAM_EOL:
+		// The keyword is followed by CRLF or LF (we also accept a lonely CR)
+		if(chunk[pos] == PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN && !parser->saw_cr)
+		{
+			parser->saw_cr = true;
+			parser->pos = pos + 1;
+			return false;
+		}
+		if(chunk[pos] == PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED) parser->pos = pos + 1;
+		parser->lex = PDF_PUSH_LEX_DEFAULT;
+		if(parser->stream_remaining == UINT64_MAX)
+		{
+			parser->state = PDF_PUSH_STATE_STREAM_SEARCH;
+			parser->kept_length = 0;
+			parser->stream_search_from = 0;
+		}
+		else parser->state = PDF_PUSH_STATE_STREAM_DATA;
+		return false;
+	case PDF_PUSH_STATE_STREAM_DATA:
+	{
+		size_t count = length - pos;
+		if(parser->stream_remaining < count) count = (size_t)parser->stream_remaining;
+		parser->stream_remaining -= count;
+		parser->pos = pos + count;
+		if(parser->stream_remaining == 0) parser->state = PDF_PUSH_STATE_ENDSTREAM;
+		if(count == 0) return false;
+		out_event->type = PDF_PUSH_EVENT_STREAM_DATA;
+		out_event->offset = parser->chunk_offset + pos;
+		out_event->data = chunk + pos;
+		out_event->length = count;
+		return true;
+	}
+	case PDF_PUSH_STATE_STREAM_SEARCH:
+	{
+		size_t kept_before = parser->kept_length;
+		if(!pdf_push_parser_keep(parser, chunk + pos, length - pos))
+			return pdf_push_parser_error(parser, parser->item_offset, out_event);
+		size_t from = parser->stream_search_from;
+		size_t found = from + pdf_find(parser->kept + from, parser->kept_length - from, "endstream");
+		if(found == parser->kept_length)
+		{
+			// The keyword may be cut at the end of the slice
+			parser->stream_search_from = parser->kept_length > 8 ? parser->kept_length - 8 : 0;
+			parser->pos = length;
+			return false;
+		}
+		// NOTE(Sam): A match entirely in the previous slices would have been
+		//            found then, so what follows 'endstream' is in this one.
+		parser->pos = pos + (found + 9 - kept_before);
+		parser->state = PDF_PUSH_STATE_ENDOBJ;
+		if(parser->is_skipping_stream)
+		{
+			parser->kept_length = 0;
+			return false;
+		}
+		// Remove the EOL which precedes 'endstream'
+		size_t data_length = found;
+		if(data_length > 0 && parser->kept[data_length - 1] == PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED) --data_length;
+		if(data_length > 0 && parser->kept[data_length - 1] == PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN) --data_length;
+		out_event->type = PDF_PUSH_EVENT_STREAM_DATA;
+		out_event->offset = parser->chunk_offset + pos - kept_before;
+		out_event->data = parser->kept;
+		out_event->length = data_length;
+		parser->has_stream_end = true;
+		parser->token_offset = parser->chunk_offset + parser->pos - 9;
+		return true;
+	}
+	}
+	return false;
+}
+
+// The end of the input ends the last token or comment, what is left
+// unfinished is an error.
+static bool pdf_push_parser_end_input(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	if(parser->lex == PDF_PUSH_LEX_TOKEN || parser->lex == PDF_PUSH_LEX_COMMENT)
+	{
+		bool is_comment = parser->lex == PDF_PUSH_LEX_COMMENT;
+		parser->lex = PDF_PUSH_LEX_DEFAULT;
+		if(is_comment ? pdf_push_parser_end_comment(parser, out_event) : pdf_push_parser_end_token(parser, out_event))
+			return true;
+	}
+	if(parser->has_ended) return false;
+	parser->has_ended = true;
+	switch(parser->state)
+	{
+	case PDF_PUSH_STATE_TOP:
+	case PDF_PUSH_STATE_XREF:
+	case PDF_PUSH_STATE_STARTXREF:
+	case PDF_PUSH_STATE_ENDOBJ:
+		return false;
+	}
+	return pdf_push_parser_error(parser, parser->item_offset, out_event);
+}
+
+// Gives the next event of the bytes fed so far, false once they are all
+// read. The objects of the events are owned by the caller.
+bool pdf_push_parser_next(PdfPushParser* parser, PdfPushEvent* out_event)
+{
+	memset(out_event, 0, sizeof(*out_event));
+	if(parser->has_stream_end)
+	{
+		parser->has_stream_end = false;
+		parser->kept_length = 0;
+		out_event->type = PDF_PUSH_EVENT_STREAM_END;
+		out_event->offset = parser->token_offset;
+		return true;
+	}
+
+	while(true)
+	{
+		if(parser->pos == parser->chunk_length)
+		{
+			// Only the unfinished item is kept from the slice
+			if(parser->is_keeping && parser->keep_from < parser->chunk_length)
+			{
+				if(!parser->keep_failed)
+					parser->keep_failed = !pdf_push_parser_keep(parser, parser->chunk + parser->keep_from,
+																parser->chunk_length - parser->keep_from);
+				parser->keep_from = parser->chunk_length;
+			}
+			if(!parser->is_finished) return false;
+			return pdf_push_parser_end_input(parser, out_event);
+		}
+
+		bool has_event;
+		switch(parser->state)
+		{
+		case PDF_PUSH_STATE_STREAM_EOL:
+		case PDF_PUSH_STATE_STREAM_DATA:
+		case PDF_PUSH_STATE_STREAM_SEARCH:
+			has_event = pdf_push_parser_read_stream(parser, out_event);
+			break;
+		default:
+			has_event = pdf_push_parser_lex(parser, out_event);
+		}
+		if(has_event) return true;
+	}
+}
+
+/*
+  LINEARIZED FILES:
+  - A linearized ("Fast Web View") file starts with a linearization
+    dictionary, followed by an xref section for the objects of the first
+    page which come right after. The main xref for everything else is at
+    the end of the file, as usual.
+  - The primary hint stream gives, among other things, the byte range of
+    every page (page offset hint table, Annex F). Its offsets are given as
+    if the hint stream itself was not in the file.
+  - With PDF_OPEN_FIRST_PAGE we only read the first page section, so the
+    cost of showing the first page doesn't depend on the file size.
+ */
+
+// Reads the big endian bit fields of the hint tables
+typedef struct {
+	const uint8_t* data;
+	size_t length;
+	size_t bit_pos;
+	bool failed;
+} PdfBitReader;
+
+uint64_t pdf_bit_reader_read(PdfBitReader* reader, uint32_t bits)
+{
+	uint64_t value = 0;
+	if(bits > 32 || reader->bit_pos + bits > 8*(uint64_t)reader->length)
+	{
+		reader->failed = true;
+		return 0;
+	}
+	for(uint32_t i = 0; i < bits; ++i, ++reader->bit_pos)
+		value = value << 1 | ((reader->data[reader->bit_pos >> 3] >> (7 - (reader->bit_pos & 7))) & 1);
+	return value;
+}
+
+void pdf_bit_reader_align(PdfBitReader* reader)
+{
+	reader->bit_pos = (reader->bit_pos + 7) & ~(size_t)7;
+}
+
+// Reads the number of objects and the byte range of each page from the
+// page offset hint table, at the start of the primary hint stream.
+bool pdf_document_read_page_hints(PdfDocument* doc)
+{
+	PdfLinearization* linearization = &doc->linearization;
+	if(linearization->pages_count == 0 || linearization->hint_offset >= doc->size) return false;
+	PdfObject stream;
+	if(!pdf_document_parse_indirect_object(doc, (size_t)linearization->hint_offset, &stream, false)) return false;
+	// The key of an encrypted hint stream comes from its header
+	size_t pos = (size_t)linearization->hint_offset;
+	uint64_t number = 0, generation = 0;
+	pdf_read_unsigned(doc->data, &pos, doc->size, &number);
+	pdf_skip_white_spaces_and_comments(doc->data, &pos, doc->size);
+	pdf_read_unsigned(doc->data, &pos, doc->size, &generation);
+	uint8_t* data = NULL;
+	size_t data_len = 0;
+	bool success = stream.type == PDF_OBJECT_TYPE_STREAM
+		&& pdf_document_decode_stream(doc, (uint32_t)number, (uint32_t)generation, &stream.stream_value, &data, &data_len);
+	pdf_object_free(&stream);
+	if(!success) return false;
+
+	PdfBitReader reader = {data, data_len, 0, false};
+	uint64_t least_objects = pdf_bit_reader_read(&reader, 32);
+	uint64_t first_page_offset = pdf_bit_reader_read(&reader, 32);
+	uint32_t objects_bits = (uint32_t)pdf_bit_reader_read(&reader, 16);
+	uint64_t least_length = pdf_bit_reader_read(&reader, 32);
+	uint32_t length_bits = (uint32_t)pdf_bit_reader_read(&reader, 16);
+	// The content stream and shared objects fields are not used yet
+	reader.bit_pos += 32 + 16 + 32 + 16 + 16 + 16 + 16 + 16;
+
+	size_t pages_count = linearization->pages_count;
+	PdfPageHint* pages = (PdfPageHint*)pdf_malloc(pages_count*sizeof(PdfPageHint));
+	success = pages != NULL && !reader.failed && objects_bits <= 32 && length_bits <= 32;
+	// Each item is given for all the pages, starting on a byte boundary
+	for(size_t i = 0; success && i < pages_count; ++i)
+		pages[i].objects_count = (uint32_t)(least_objects + pdf_bit_reader_read(&reader, objects_bits));
+	pdf_bit_reader_align(&reader);
+	uint64_t offset = first_page_offset;
+	for(size_t i = 0; success && i < pages_count; ++i)
+	{
+		pages[i].length = least_length + pdf_bit_reader_read(&reader, length_bits);
+		pages[i].offset = offset >= linearization->hint_offset ? offset + linearization->hint_length : offset;
+		offset += pages[i].length;
+	}
+	success = success && !reader.failed;
+	pdf_free(data);
+	if(!success)
+	{
+		pdf_free(pages);
+		return false;
+	}
+	linearization->pages = pages;
+	return true;
+}
+
+// Checks if the first object of the file is a linearization dictionary
+// still valid for the file (an incremental update breaks it).
+bool pdf_document_read_linearization(PdfDocument* doc)
+{
+	// The dictionary must be in the first 1024 bytes, after the header line
+	// and the usual comment
+	size_t search_len = doc->size < 1024 ? doc->size : 1024;
+	size_t pos = pdf_find(doc->data, search_len, "%PDF-");
+	if(pos == search_len) return false;
+	while(pos < search_len && doc->data[pos] != PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED
+		  && doc->data[pos] != PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN) ++pos;
+	pdf_skip_white_spaces_and_comments(doc->data, &pos, search_len);
+	if(pos >= search_len) return false;
+
+	PdfObject obj;
+	if(!pdf_document_parse_indirect_object(doc, pos, &obj, false)) return false;
+	bool is_valid = false;
+	if(obj.type == PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		PdfDictionary* dictionary = &obj.dictionary_value;
+		PdfObject version = pdf_dictionary_get(dictionary, pdf_name("Linearized"));
+		PdfObject length = pdf_dictionary_get(dictionary, pdf_name("L"));
+		PdfObject hints = pdf_dictionary_get(dictionary, pdf_name("H"));
+		PdfObject first_page = pdf_dictionary_get(dictionary, pdf_name("O"));
+		PdfObject first_page_end = pdf_dictionary_get(dictionary, pdf_name("E"));
+		PdfObject pages_count = pdf_dictionary_get(dictionary, pdf_name("N"));
+		PdfObject main_xref = pdf_dictionary_get(dictionary, pdf_name("T"));
+		is_valid = (version.type == PDF_OBJECT_TYPE_INTEGER || version.type == PDF_OBJECT_TYPE_REAL)
+			&& length.type == PDF_OBJECT_TYPE_INTEGER && (uint64_t)length.int_value == doc->size
+			&& hints.type == PDF_OBJECT_TYPE_ARRAY && hints.array_value.length >= 2
+			&& hints.array_value.start[0].type == PDF_OBJECT_TYPE_INTEGER && hints.array_value.start[0].int_value >= 0
+			&& hints.array_value.start[1].type == PDF_OBJECT_TYPE_INTEGER && hints.array_value.start[1].int_value >= 0
+			&& first_page.type == PDF_OBJECT_TYPE_INTEGER && first_page.int_value > 0
+			&& first_page.int_value <= PDF_MAX_OBJECT_NUMBER
+			&& first_page_end.type == PDF_OBJECT_TYPE_INTEGER && first_page_end.int_value >= 0
+			&& pages_count.type == PDF_OBJECT_TYPE_INTEGER && pages_count.int_value > 0
+			&& pages_count.int_value <= PDF_MAX_OBJECT_NUMBER
+			&& main_xref.type == PDF_OBJECT_TYPE_INTEGER && main_xref.int_value >= 0;
+		if(is_valid)
+		{
+			PdfLinearization* linearization = &doc->linearization;
+			linearization->file_length = (uint64_t)length.int_value;
+			linearization->first_page_end = (uint64_t)first_page_end.int_value;
+			linearization->main_xref_offset = (uint64_t)main_xref.int_value;
+			linearization->hint_offset = (uint64_t)hints.array_value.start[0].int_value;
+			linearization->hint_length = (uint64_t)hints.array_value.start[1].int_value;
+			linearization->first_page_number = (uint32_t)first_page.int_value;
+			linearization->pages_count = (uint32_t)pages_count.int_value;
+		}
+	}
+
+	// The first page xref section comes right after the dictionary
+	if(is_valid)
+	{
+		const uint8_t* end = doc->data + pos;
+		size_t end_len = doc->size - pos < 4096 ? doc->size - pos : 4096;
+		size_t endobj = pdf_find(end, end_len, "endobj");
+		is_valid = endobj != end_len;
+		doc->linearization.first_xref_offset = pos + endobj + 6;
+	}
+	pdf_object_free(&obj);
+	doc->is_linearized = is_valid;
+	// NOTE(Sam): The hint table is optional for us, it only gives ranges
+	if(is_valid) pdf_document_read_page_hints(doc);
+	return is_valid;
+}
+
+// Reads only the first page xref section of a linearized file, without
+// following its /Prev to the main xref.
+bool pdf_document_read_first_page_xref(PdfDocument* doc)
+{
+	PdfRevision* revision = (PdfRevision*)pdf_malloc(sizeof(PdfRevision));
+	if(revision == NULL) return false;
+	memset(revision, 0, sizeof(PdfRevision));
+	doc->revisions = revision;
+	doc->revisions_count = 1;
+	if(!pdf_document_parse_xref_section(doc, (size_t)doc->linearization.first_xref_offset, revision)) return false;
+	if(!pdf_object_copy(&revision->trailer, &doc->trailer)) return false;
+
+	PdfObject root = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Root"));
+	uint32_t first_page = doc->linearization.first_page_number;
+	if(root.type != PDF_OBJECT_TYPE_REFERENCE || !pdf_document_check_xref_entry(doc, root.reference_value.number)
+	   || !pdf_document_check_xref_entry(doc, first_page)) return false;
+
+	doc->has_partial_xref = true;
+	pdf_file_prefetch(&doc->file, 0, doc->linearization.first_page_end);
+	return true;
+}
+
+/*
+  PAGE INDEX:
+  - Pages are the leaves of the tree starting at the catalog /Pages, and
+    some of their attributes (/Resources, /MediaBox, /CropBox, /Rotate)
+    may be given by any ancestor instead.
+  - The index walks the tree once and stores every page with these
+    attributes already resolved, a page is then found in O(1).
+  - Big trees are split in subtrees walked in parallel: the first levels
+    are expanded until there are enough subtrees for the threads, their
+    results are then concatenated in order.
+ */
+
+// Attributes a page inherits, they point in the objects of its ancestors
+typedef struct {
+	PdfObject resources;
+	PdfObject media_box;
+	PdfObject crop_box;
+	PdfObject rotate;
+} PdfPageAttributes;
+
+// Subtree of the page tree walked by one task
+typedef struct {
+	uint32_t number;
+	uint32_t generation;
+	PdfPageAttributes inherited;
+	PdfPage* pages;
+	size_t pages_count;
+	size_t pages_capacity;
+	bool failed;
+} PdfPageTask;
+
+typedef struct {
+	PdfDocument* doc;
+	PdfPageTask* tasks;
+	size_t tasks_count;
+	size_t first_task;
+	size_t step;
+	const uint8_t* visited; // Nodes already expanded, never walked again
+	PdfMemoryBudget* budget; // Of the thread building the index
+#ifdef PDF_ENABLE_STATS
+	PdfStats stats;
+#endif
+} PdfPageWorker;
+
+// Trees deeper than this are considered broken
+#define PDF_PAGE_TREE_MAX_DEPTH 256
+
+// Subtrees per thread, more balance the work better
+#define PDF_PAGE_TASKS_PER_THREAD 4
+
+// Under this many pages the tree is walked by the calling thread only
+#define PDF_PAGE_INDEX_MIN_PARALLEL_COUNT 256
+
+void pdf_page_free(PdfPage* page)
+{
+	pdf_object_free(&page->resources);
+	pdf_object_free(&page->media_box);
+	pdf_object_free(&page->crop_box);
+}
+
+void pdf_document_free_page_index(PdfDocument* doc)
+{
+	for(size_t i = 0; i < doc->pages_count; ++i) pdf_page_free(&doc->pages[i]);
+	pdf_free(doc->pages);
+	doc->pages = NULL;
+	doc->pages_count = 0;
+	doc->has_page_index = false;
+}
+
+// Updates the inherited attributes with those given by 'node'
+void pdf_page_attributes_merge(PdfPageAttributes* attributes, const PdfDictionary* node)
+{
+	PdfObject value = pdf_dictionary_get(node, pdf_name("Resources"));
+	if(value.type != PDF_OBJECT_TYPE_NONE) attributes->resources = value;
+	value = pdf_dictionary_get(node, pdf_name("MediaBox"));
+	if(value.type != PDF_OBJECT_TYPE_NONE) attributes->media_box = value;
+	value = pdf_dictionary_get(node, pdf_name("CropBox"));
+	if(value.type != PDF_OBJECT_TYPE_NONE) attributes->crop_box = value;
+	value = pdf_dictionary_get(node, pdf_name("Rotate"));
+	if(value.type != PDF_OBJECT_TYPE_NONE) attributes->rotate = value;
+}
+
+// True if 'node' is a /Pages node, as opposed to a /Page leaf
+bool pdf_page_node_is_tree(const PdfDictionary* node)
+{
+	PdfObject type = pdf_dictionary_get(node, pdf_name("Type"));
+	if(type.type == PDF_OBJECT_TYPE_NAME) return pdf_names_are_equals(type.name_value, pdf_name("Pages"));
+	// Some writers forget /Type
+	return pdf_dictionary_get(node, pdf_name("Kids")).type == PDF_OBJECT_TYPE_ARRAY;
+}
+
+// Copies an attribute in the page, arrays given by reference (boxes) are
+// loaded so that they are ready to use.
+bool pdf_page_copy_attribute(PdfDocument* doc, const PdfObject* value, bool resolve, PdfObject* out_value)
+{
+	out_value->type = PDF_OBJECT_TYPE_NONE;
+	if(value->type == PDF_OBJECT_TYPE_NONE) return true;
+	if(resolve && value->type == PDF_OBJECT_TYPE_REFERENCE)
+		return pdf_document_get_object(doc, value->reference_value.number, out_value);
+	return pdf_object_copy(value, out_value);
+}
+
+bool pdf_page_task_push(PdfDocument* doc, PdfPageTask* task, uint32_t number, uint32_t generation,
+						const PdfPageAttributes* attributes)
+{
+	if(task->pages_count == task->pages_capacity)
+	{
+		size_t capacity = task->pages_capacity ? 2*task->pages_capacity : 16;
+		PdfPage* pages = (PdfPage*)pdf_realloc(task->pages, capacity*sizeof(PdfPage));
+		if(pages == NULL) return false;
+		task->pages = pages;
+		task->pages_capacity = capacity;
+	}
+	PdfPage* page = &task->pages[task->pages_count];
+	memset(page, 0, sizeof(PdfPage));
+	page->number = number;
+	page->generation = generation;
+
+	// Resources are usually shared between pages, we keep the reference
+	bool success = pdf_page_copy_attribute(doc, &attributes->resources, false, &page->resources)
+		&& pdf_page_copy_attribute(doc, &attributes->media_box, true, &page->media_box)
+		&& pdf_page_copy_attribute(doc, &attributes->crop_box, true, &page->crop_box);
+	// The crop box defaults to the media box
+	if(success && page->crop_box.type == PDF_OBJECT_TYPE_NONE)
+		success = pdf_object_copy(&page->media_box, &page->crop_box);
+	if(attributes->rotate.type == PDF_OBJECT_TYPE_INTEGER)
+	{
+		int64_t rotate = (int64_t)(attributes->rotate.int_value % 360);
+		if(rotate < 0) rotate += 360;
+		page->rotate = rotate % 90 == 0 ? (int32_t)rotate : 0;
+	}
+	task->pages_count += 1;
+	if(!success) pdf_page_free(page);
+	return success;
+}
+
+// Walks the subtree 'number' depth first, 'visited' has one bit per object
+void pdf_page_task_walk(PdfDocument* doc, PdfPageTask* task, uint32_t number, uint32_t generation,
+						PdfPageAttributes attributes, uint8_t* visited, size_t depth)
+{
+	if(task->failed || depth > PDF_PAGE_TREE_MAX_DEPTH) return;
+	// A node reached twice is a loop in a broken tree
+	if(number < doc->xref_count)
+	{
+		if(visited[number >> 3] & (1 << (number & 7))) return;
+		visited[number >> 3] |= (uint8_t)(1 << (number & 7));
+	}
+
+	PdfObject node;
+	if(!pdf_document_get_object(doc, number, &node)) return;
+	if(node.type != PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		pdf_object_free(&node);
+		return;
+	}
+	pdf_page_attributes_merge(&attributes, &node.dictionary_value);
+
+	if(!pdf_page_node_is_tree(&node.dictionary_value))
+	{
+		if(!pdf_page_task_push(doc, task, number, generation, &attributes)) task->failed = true;
+		pdf_object_free(&node);
+		return;
+	}
+	PdfObject kids = pdf_dictionary_get(&node.dictionary_value, pdf_name("Kids"));
+	for(size_t i = 0; kids.type == PDF_OBJECT_TYPE_ARRAY && i < kids.array_value.length; ++i)
+	{
+		PdfObject kid = kids.array_value.start[i];
+		if(kid.type != PDF_OBJECT_TYPE_REFERENCE) continue;
+		pdf_page_task_walk(doc, task, kid.reference_value.number, kid.reference_value.generation,
+						   attributes, visited, depth + 1);
+	}
+	pdf_object_free(&node);
+}
+
+void pdf_page_worker_run(void* param)
+{
+	PdfPageWorker* worker = (PdfPageWorker*)param;
+	PdfDocument* doc = worker->doc;
+	pdf_memory_budget_use(worker->budget);
+	size_t visited_size = doc->xref_count/8 + 1;
+	uint8_t* visited = (uint8_t*)pdf_malloc(visited_size);
+	for(size_t i = worker->first_task; i < worker->tasks_count; i += worker->step)
+	{
+		PdfPageTask* task = &worker->tasks[i];
+		if(visited == NULL)
+		{
+			task->failed = true;
+			continue;
+		}
+		memcpy(visited, worker->visited, visited_size);
+		pdf_page_task_walk(doc, task, task->number, task->generation, task->inherited, visited, 0);
+	}
+	pdf_free(visited);
+	PDF_STATS_WORKER_DONE(&worker->stats);
+}
+
+// Builds the page index, 'threads_count' of 0 means one thread per core.
+// NOTE(Sam): The index reflects the document when it was built, changing
+//            an object drops it.
+bool pdf_document_build_page_index(PdfDocument* doc, size_t threads_count)
+{
+	if(doc->has_page_index) return true;
+	if(doc->has_index_pages && pdf_document_read_indexed_pages(doc)) return true;
+	// Workers read the xref concurrently, it must not change under them
+	if(!pdf_document_complete_xref(doc)) return false;
+
+	PdfObject root_ref = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Root"));
+	PdfObject root;
+	if(root_ref.type != PDF_OBJECT_TYPE_REFERENCE || !pdf_document_get_object(doc, root_ref.reference_value.number, &root))
+		return false;
+	PdfObject pages_ref = root.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&root.dictionary_value, pdf_name("Pages")) : root;
+	uint32_t pages_number = pages_ref.type == PDF_OBJECT_TYPE_REFERENCE ? pages_ref.reference_value.number : 0;
+	pdf_object_free(&root);
+	if(pages_number == 0) return false;
+
+	if(threads_count == 0) threads_count = pdf_cpu_count();
+	size_t visited_size = doc->xref_count/8 + 1;
+	uint8_t* visited = (uint8_t*)pdf_malloc(visited_size);
+	size_t tasks_capacity = 16;
+	PdfPageTask* tasks = (PdfPageTask*)pdf_malloc(tasks_capacity*sizeof(PdfPageTask));
+	// Expanded nodes are kept alive, the tasks attributes point in them
+	PdfObject* nodes = NULL;
+	size_t nodes_count = 0;
+	bool success = visited != NULL && tasks != NULL;
+	if(success)
+	{
+		memset(visited, 0, visited_size);
+		memset(tasks, 0, sizeof(PdfPageTask));
+		tasks[0].number = pages_number;
+	}
+	size_t tasks_count = success ? 1 : 0;
+
+	// Expand the first levels until there are enough subtrees, a page
+	// found there is a task of its own which only pushes itself.
+	PdfObject count = {.type = PDF_OBJECT_TYPE_NONE};
+	for(size_t level = 0; success && level < 8 && tasks_count < PDF_PAGE_TASKS_PER_THREAD*threads_count; ++level)
+	{
+		bool expanded = false;
+		size_t next_count = 0, next_capacity = 2*tasks_count;
+		PdfPageTask* next = (PdfPageTask*)pdf_malloc(next_capacity*sizeof(PdfPageTask));
+		success = next != NULL;
+		for(size_t i = 0; success && i < tasks_count; ++i)
+		{
+			PdfPageTask* task = &tasks[i];
+			PdfObject node = {.type = PDF_OBJECT_TYPE_NONE};
+			bool is_tree = task->number < doc->xref_count && !(visited[task->number >> 3] & (1 << (task->number & 7)))
+				&& pdf_document_get_object(doc, task->number, &node) && node.type == PDF_OBJECT_TYPE_DICTIONARY
+				&& pdf_page_node_is_tree(&node.dictionary_value);
+			if(level == 0 && is_tree) count = pdf_dictionary_get(&node.dictionary_value, pdf_name("Count"));
+			PdfObject kids = is_tree ? pdf_dictionary_get(&node.dictionary_value, pdf_name("Kids")) : node;
+			if(!is_tree || kids.type != PDF_OBJECT_TYPE_ARRAY)
+			{
+				pdf_object_free(&node);
+				if(next_count == next_capacity)
+				{
+					next_capacity *= 2;
+					PdfPageTask* grown = (PdfPageTask*)pdf_realloc(next, next_capacity*sizeof(PdfPageTask));
+					if(grown == NULL) { success = false; break; }
+					next = grown;
+				}
+				next[next_count++] = *task;
+				continue;
+			}
+
+			visited[task->number >> 3] |= (uint8_t)(1 << (task->number & 7));
+			PdfObject* grown_nodes = (PdfObject*)pdf_realloc(nodes, (nodes_count + 1)*sizeof(PdfObject));
+			if(grown_nodes == NULL)
+			{
+				pdf_object_free(&node);
+				success = false;
+				break;
+			}
+			nodes = grown_nodes;
+			nodes[nodes_count++] = node;
+			PdfPageAttributes attributes = task->inherited;
+			pdf_page_attributes_merge(&attributes, &node.dictionary_value);
+			for(size_t k = 0; k < kids.array_value.length; ++k)
+			{
+				PdfObject kid = kids.array_value.start[k];
+				if(kid.type != PDF_OBJECT_TYPE_REFERENCE) continue;
+				if(next_count == next_capacity)
+				{
+					next_capacity *= 2;
+					PdfPageTask* grown = (PdfPageTask*)pdf_realloc(next, next_capacity*sizeof(PdfPageTask));
+					if(grown == NULL) { success = false; break; }
+					next = grown;
+				}
+				memset(&next[next_count], 0, sizeof(PdfPageTask));
+				next[next_count].number = kid.reference_value.number;
+				next[next_count].generation = kid.reference_value.generation;
+				next[next_count].inherited = attributes;
+				next_count += 1;
+			}
+			expanded = true;
+		}
+		pdf_free(tasks);
+		tasks = next;
+		tasks_count = success ? next_count : 0;
+		if(!expanded) break;
+		// Small documents are not worth the threads
+		if(count.type == PDF_OBJECT_TYPE_INTEGER && count.int_value < PDF_PAGE_INDEX_MIN_PARALLEL_COUNT) threads_count = 1;
+	}
+
+	if(threads_count > tasks_count) threads_count = tasks_count;
+	if(threads_count == 0) threads_count = 1;
+	PdfPageWorker* workers = success ? (PdfPageWorker*)pdf_malloc(threads_count*sizeof(PdfPageWorker)) : NULL;
+	PdfThread* threads = success ? (PdfThread*)pdf_malloc(threads_count*sizeof(PdfThread)) : NULL;
+	bool* started = success ? (bool*)pdf_malloc(threads_count*sizeof(bool)) : NULL;
+	success = success && workers != NULL && threads != NULL && started != NULL;
+	for(size_t i = 0; success && i < threads_count; ++i)
+	{
+		workers[i].doc = doc;
+		workers[i].tasks = tasks;
+		workers[i].tasks_count = tasks_count;
+		workers[i].first_task = i;
+		workers[i].step = threads_count;
+		workers[i].visited = visited;
+		workers[i].budget = pdf_memory_budget_current();
+	}
+	// Same as the repair, the calling thread takes the first share
+	for(size_t i = 1; success && i < threads_count; ++i)
+		started[i] = pdf_thread_start(&threads[i], pdf_page_worker_run, &workers[i]);
+	if(success) pdf_page_worker_run(&workers[0]);
+	for(size_t i = 1; success && i < threads_count; ++i)
+	{
+		if(started[i])
+		{
+			pdf_thread_join(&threads[i]);
+			PDF_STATS_WORKER_JOINED(&workers[i].stats);
+		}
+		else pdf_page_worker_run(&workers[i]);
+	}
+	pdf_free(workers);
+	pdf_free(threads);
+	pdf_free(started);
+
+	size_t pages_count = 0;
+	for(size_t i = 0; i < tasks_count; ++i)
+	{
+		pages_count += tasks[i].pages_count;
+		if(tasks[i].failed) success = false;
+	}
+	PdfPage* pages = success && pages_count ? (PdfPage*)pdf_malloc(pages_count*sizeof(PdfPage)) : NULL;
+	if(pages_count && pages == NULL) success = false;
+	size_t next_page = 0;
+	for(size_t i = 0; i < tasks_count; ++i)
+	{
+		if(success && tasks[i].pages_count) memcpy(pages + next_page, tasks[i].pages, tasks[i].pages_count*sizeof(PdfPage));
+		else for(size_t p = 0; p < tasks[i].pages_count; ++p) pdf_page_free(&tasks[i].pages[p]);
+		next_page += tasks[i].pages_count;
+		pdf_free(tasks[i].pages);
+	}
+	pdf_free(tasks);
+	pdf_free(visited);
+	for(size_t i = 0; i < nodes_count; ++i) pdf_object_free(&nodes[i]);
+	pdf_free(nodes);
+	if(!success)
+	{
+		pdf_free(pages);
+		return false;
+	}
+
+	doc->pages = pages;
+	doc->pages_count = pages_count;
+	doc->has_page_index = true;
+	return true;
+}
+
+// Number of pages, building the page index if needed
+size_t pdf_document_page_count(PdfDocument* doc)
+{
+	if(!pdf_document_build_page_index(doc, 0)) return 0;
+	return doc->pages_count;
+}
+
+// Page 'index' (0 based) with its inherited attributes resolved, building
+// the page index if needed. NULL if there is no such page.
+const PdfPage* pdf_document_get_page(PdfDocument* doc, size_t index)
+{
+	if(!pdf_document_build_page_index(doc, 0) || index >= doc->pages_count) return NULL;
+	return &doc->pages[index];
+}
+
+/*
+  CONCURRENT READS:
+  - A document loaded once can be read by many threads at the same time
+    without any lock, as long as nobody modifies it meanwhile.
+  - What a reader builds lazily for the others (object streams, object
+    offsets, font decoders, shared objects) is published with a compare
+    and swap: threads racing on the same entry each build their own copy,
+    the first one stored wins and the others free theirs.
+  - These shared copies never come from the arena of the thread which
+    built them, while everything a reader only uses for itself (objects
+    from pdf_document_get_object, decoded streams) does. Each reader can
+    then use its own arena for its parse work.
+  - The xref of PDF_OPEN_FIRST_PAGE files and the page index are built in
+    place, pdf_document_prepare_shared does it before the readers start.
+ */
+
+// Marks the objects which could not be read, so they are not tried again
+static PdfObject pdf_shared_object_none;
+
+static void pdf_shared_object_free(PdfObject* obj)
+{
+	if(obj == NULL || obj == &pdf_shared_object_none) return;
+	pdf_object_free(obj);
+	pdf_free(obj);
+}
+
+void pdf_document_free_shared_objects(PdfDocument* doc)
+{
+	if(doc->objects == NULL) return;
+	for(size_t i = 0; i < doc->xref_count; ++i) pdf_shared_object_free((PdfObject*)doc->objects[i]);
+	pdf_free((void*)doc->objects);
+	doc->objects = NULL;
+}
+
+// Drops the shared copy of 'number' once it is modified
+void pdf_document_forget_shared_object(PdfDocument* doc, uint32_t number)
+{
+	if(doc->objects == NULL || number >= doc->xref_count) return;
+	pdf_shared_object_free((PdfObject*)doc->objects[number]);
+	doc->objects[number] = NULL;
+}
+
+// Object 'number' parsed once for all the threads reading the document,
+// NULL if it can't be read. It must not be changed nor freed and stays
+// valid until the document is closed or the object modified.
+// NOTE(Sam): Objects added after the document was opened are not shared,
+//            read them with pdf_document_get_object.
+const PdfObject* pdf_document_get_shared_object(PdfDocument* doc, uint32_t number)
+{
+	if(number >= doc->xref_count) return NULL;
+	void* volatile* objects = pdf_document_shared_array(doc, &doc->objects);
+	if(objects == NULL) return NULL;
+
+	PdfObject* obj = (PdfObject*)pdf_atomic_load_pointer(&objects[number]);
+	if(obj == NULL)
+	{
+		PdfArena* arena = pdf_arena_current();
+		pdf_arena_use(NULL);
+		obj = (PdfObject*)pdf_malloc(sizeof(PdfObject));
+		if(obj != NULL && !pdf_document_get_object(doc, number, obj))
+		{
+			pdf_free(obj);
+			obj = &pdf_shared_object_none;
+		}
+		pdf_arena_use(arena);
+		if(obj == NULL) return NULL;
+		// Another thread may have parsed it meanwhile, keep the first one
+		if(!pdf_atomic_compare_exchange_pointer(&objects[number], NULL, obj))
+		{
+			pdf_shared_object_free(obj);
+			obj = (PdfObject*)pdf_atomic_load_pointer(&objects[number]);
+		}
+	}
+	return obj != &pdf_shared_object_none ? obj : NULL;
+}
+
+// Does the lazy work which is not safe with several readers: reads the
+// rest of the xref of PDF_OPEN_FIRST_PAGE files and builds the page index
+// on 'threads_count' threads (0 for one per core). The document can then
+// be read from many threads at once.
+bool pdf_document_prepare_shared(PdfDocument* doc, size_t threads_count)
+{
+	// Like the shared copies, this outlives the arena of the caller
+	PdfArena* arena = pdf_arena_current();
+	pdf_arena_use(NULL);
+	bool success = pdf_document_complete_xref(doc) && pdf_document_build_page_index(doc, threads_count);
+	pdf_arena_use(arena);
+	return success;
+}
+
+/*
+  PREFETCH:
+  - Resolving objects scattered in a large mapped file costs one blocking
+    page fault per object. A prefetch takes the objects we are about to
+    read, finds their byte ranges from the xref (an object ends where the
+    next one in the file starts), merges the close ones and reads them in
+    the background so the faults find the pages in the page cache.
+  - Pages already resident (mincore) are not read again.
+  - Reads go through io_uring when the kernel has it, they are submitted
+    in batches and completed while the caller parses. Otherwise a few
+    threads read with pread. The data read is thrown away, every read
+    targets the same scratch buffer.
+  - Documents read in memory instead of mapped have nothing to prefetch.
+ */
+
+// Ranges closer than this are read as one
+#define PDF_PREFETCH_MERGE_GAP (64*1024)
+
+// Larger ranges are split in reads of this size
+#define PDF_PREFETCH_MAX_READ (1 << 20)
+
+// Reads in flight with io_uring
+#define PDF_PREFETCH_QUEUE_DEPTH 64
+
+// Threads of the pread fallback, reads are waiting for the disk not the CPU
+#define PDF_PREFETCH_THREADS 8
+
+typedef struct {
+	uint64_t offset;
+	uint64_t length;
+} PdfRange;
+
+typedef struct {
+	size_t count;
+	uint64_t offsets[];
+} PdfObjectOffsets;
+
+static bool pdf_prefetch_ring_is_disabled;
+
+// Makes the prefetches started from now on read with the pread threads
+// even when io_uring is there, to compare both. Not thread safe, set it
+// before starting prefetches.
+void pdf_prefetch_disable_ring(bool is_disabled)
+{
+	pdf_prefetch_ring_is_disabled = is_disabled;
+}
+
+#ifdef PDF_USE_IO_URING
+typedef struct {
+	int fd;
+	uint32_t entries;
+	uint32_t in_flight;
+	uint8_t* sq_ring;
+	size_t sq_ring_size;
+	uint8_t* cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	uint32_t* sq_head;
+	uint32_t* sq_tail;
+	uint32_t* sq_mask;
+	uint32_t* sq_array;
+	uint32_t* cq_head;
+	uint32_t* cq_tail;
+	uint32_t* cq_mask;
+	struct io_uring_cqe* cqes;
+} PdfRing;
+
+void pdf_ring_free(PdfRing* ring)
+{
+	if(ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+	if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+	if(ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_ring_size);
+	if(ring->fd >= 0) close(ring->fd);
+	memset(ring, 0, sizeof(PdfRing));
+	ring->fd = -1;
+}
+
+bool pdf_ring_init(PdfRing* ring, uint32_t entries)
+{
+	memset(ring, 0, sizeof(PdfRing));
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->fd < 0) return false;
+	// NOTE(Sam): Plain reads (IORING_OP_READ) came with the same kernel
+	//            version (5.6) as this feature flag.
+#ifdef IORING_FEAT_RW_CUR_POS
+	bool has_read = (params.features & IORING_FEAT_RW_CUR_POS) != 0;
+#else
+	bool has_read = false;
+#endif
+	ring->entries = params.sq_entries;
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(uint32_t);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if(single_mmap && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+	void* sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+						 IORING_OFF_SQ_RING);
+	ring->sq_ring = sq_ring != MAP_FAILED ? (uint8_t*)sq_ring : NULL;
+	if(!has_read || ring->sq_ring == NULL)
+	{
+		pdf_ring_free(ring);
+		return false;
+	}
+	if(single_mmap) ring->cq_ring = ring->sq_ring;
+	else
+	{
+		void* cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+							 IORING_OFF_CQ_RING);
+		ring->cq_ring = cq_ring != MAP_FAILED ? (uint8_t*)cq_ring : NULL;
+	}
+	ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+	void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+					  IORING_OFF_SQES);
+	ring->sqes = sqes != MAP_FAILED ? (struct io_uring_sqe*)sqes : NULL;
+	if(ring->cq_ring == NULL || ring->sqes == NULL)
+	{
+		pdf_ring_free(ring);
+		return false;
+	}
+
+	ring->sq_head = (uint32_t*)(ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (uint32_t*)(ring->sq_ring + params.sq_off.tail);
+	ring->sq_mask = (uint32_t*)(ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_array = (uint32_t*)(ring->sq_ring + params.sq_off.array);
+	ring->cq_head = (uint32_t*)(ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (uint32_t*)(ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = (uint32_t*)(ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(ring->cq_ring + params.cq_off.cqes);
+	return true;
+}
+
+// Queues a read, it is only sent to the kernel by pdf_ring_enter
+void pdf_ring_queue_read(PdfRing* ring, int fd, void* buffer, uint32_t length, uint64_t offset)
+{
+	uint32_t tail = *ring->sq_tail;
+	uint32_t index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = length;
+	sqe->off = offset;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->in_flight += 1;
+}
+
+// Submits 'to_submit' queued reads and waits for 'wait_count' completions
+bool pdf_ring_enter(PdfRing* ring, uint32_t to_submit, uint32_t wait_count)
+{
+	while(true)
+	{
+		long result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_count,
+							  wait_count > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if(result >= 0) return true;
+		if(errno != EINTR) return false;
+	}
+}
+
+// Consumes the completed reads, returns how many
+uint32_t pdf_ring_reap(PdfRing* ring)
+{
+	uint32_t head = *ring->cq_head;
+	uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	uint32_t count = tail - head;
+	// NOTE(Sam): Failed reads are ignored, the fault will read the page
+	__atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+	ring->in_flight -= count;
+	return count;
+}
+#endif
+
+typedef struct PdfPrefetch PdfPrefetch;
+
+typedef struct {
+	PdfPrefetch* prefetch;
+	size_t first;
+	size_t step;
+} PdfPrefetchWorker;
+
+// NOTE(Sam): Threads read from it, it must stay at the same address from
+//            pdf_document_prefetch_begin to pdf_prefetch_end.
+struct PdfPrefetch {
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int fd;
+#endif
+	PdfRange* reads;
+	size_t reads_count;
+	size_t next_read;	// Next read to send to the ring
+	uint8_t* scratch;	// Destination of every read, never looked at
+	uint64_t bytes;		// Total bytes to read
+	bool uses_ring;
+#ifdef PDF_USE_IO_URING
+	PdfRing ring;
+#endif
+	size_t threads_count;
+	PdfThread threads[PDF_PREFETCH_THREADS];
+	PdfPrefetchWorker workers[PDF_PREFETCH_THREADS];
+	bool started[PDF_PREFETCH_THREADS];
+};
+
+static int pdf_compare_offsets(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int pdf_compare_ranges(const void* a, const void* b)
+{
+	return pdf_compare_offsets(&((const PdfRange*)a)->offset, &((const PdfRange*)b)->offset);
+}
+
+// Sorted offsets of every object stored in the file, built once
+const PdfObjectOffsets* pdf_document_object_offsets(PdfDocument* doc)
+{
+	PdfObjectOffsets* offsets = (PdfObjectOffsets*)pdf_atomic_load_pointer(&doc->object_offsets);
+	if(offsets != NULL) return offsets;
+	PdfArena* arena = pdf_arena_current();
+	pdf_arena_use(NULL);
+	offsets = (PdfObjectOffsets*)pdf_malloc(sizeof(PdfObjectOffsets) + (doc->xref_count + 1)*sizeof(uint64_t));
+	pdf_arena_use(arena);
+	if(offsets == NULL) return NULL;
+	offsets->count = 0;
+	for(size_t i = 0; i < doc->xref_count; ++i)
+	{
+		if(doc->xref[i].type == PDF_XREF_ENTRY_IN_USE && doc->xref[i].offset < doc->size)
+			offsets->offsets[offsets->count++] = doc->xref[i].offset;
+	}
+	qsort(offsets->offsets, offsets->count, sizeof(uint64_t), pdf_compare_offsets);
+	if(!pdf_atomic_compare_exchange_pointer(&doc->object_offsets, NULL, offsets))
+	{
+		pdf_free(offsets);
+		offsets = (PdfObjectOffsets*)pdf_atomic_load_pointer(&doc->object_offsets);
+	}
+	return offsets;
+}
+
+// Byte range of the object 'number' in the file, the whole object stream
+// for compressed objects
+bool pdf_document_object_range(PdfDocument* doc, const PdfObjectOffsets* offsets, uint32_t number, PdfRange* out_range)
+{
+	if(number >= doc->xref_count) return false;
+	const PdfXrefEntry* entry = &doc->xref[number];
+	if(entry->type == PDF_XREF_ENTRY_COMPRESSED)
+	{
+		if(entry->offset >= doc->xref_count) return false;
+		entry = &doc->xref[entry->offset];
+	}
+	if(entry->type != PDF_XREF_ENTRY_IN_USE || entry->offset >= doc->size) return false;
+
+	size_t low = 0, high = offsets->count;
+	while(low < high)
+	{
+		size_t middle = low + (high - low)/2;
+		if(offsets->offsets[middle] <= entry->offset) low = middle + 1;
+		else high = middle;
+	}
+	out_range->offset = entry->offset;
+	out_range->length = (low < offsets->count ? offsets->offsets[low] : doc->size) - entry->offset;
+	return true;
+}
+
+// Adds the reads of [offset, offset + length) skipping the resident pages
+bool pdf_prefetch_add_range(PdfPrefetch* prefetch, const PdfFile* file, uint64_t offset, uint64_t length,
+							size_t* inout_capacity)
+{
+#ifdef _WIN32
+	uint8_t* resident = NULL;
+#else
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	uint64_t start = offset & ~(uint64_t)(page_size - 1);
+	size_t pages_count = (size_t)((offset + length - start + page_size - 1)/page_size);
+	uint8_t* resident = (uint8_t*)pdf_malloc(pages_count);
+	if(resident != NULL && mincore((void*)(file->data + start), (size_t)(offset + length - start),
+								   (void*)resident) != 0)
+	{
+		pdf_free(resident);
+		resident = NULL;
+	}
+#endif
+	uint64_t end = offset + length;
+	uint64_t pos = offset;
+	bool success = true;
+	while(pos < end && success)
+	{
+		uint64_t read_end = pos + PDF_PREFETCH_MAX_READ < end ? pos + PDF_PREFETCH_MAX_READ : end;
+#ifndef _WIN32
+		if(resident != NULL)
+		{
+			// Skip resident pages, then stop at the next resident one
+			while(pos < end && (resident[(pos - start)/page_size] & 1))
+				pos = (pos/page_size + 1)*page_size;
+			if(pos >= end) break;
+			read_end = pos + PDF_PREFETCH_MAX_READ < end ? pos + PDF_PREFETCH_MAX_READ : end;
+			uint64_t page = (pos/page_size + 1)*page_size;
+			while(page < read_end && !(resident[(page - start)/page_size] & 1)) page += page_size;
+			if(page < read_end) read_end = page;
+		}
+#endif
+		if(prefetch->reads_count == *inout_capacity)
+		{
+			size_t capacity = *inout_capacity ? 2*(*inout_capacity) : 64;
+			PdfRange* reads = (PdfRange*)pdf_realloc(prefetch->reads, capacity*sizeof(PdfRange));
+			success = reads != NULL;
+			if(!success) break;
+			prefetch->reads = reads;
+			*inout_capacity = capacity;
+		}
+		prefetch->reads[prefetch->reads_count].offset = pos;
+		prefetch->reads[prefetch->reads_count].length = read_end - pos;
+		prefetch->reads_count += 1;
+		prefetch->bytes += read_end - pos;
+		pos = read_end;
+	}
+	pdf_free(resident);
+	return success;
+}
+
+void pdf_prefetch_worker_run(void* param)
+{
+	PdfPrefetchWorker* worker = (PdfPrefetchWorker*)param;
+	PdfPrefetch* prefetch = worker->prefetch;
+	for(size_t i = worker->first; i < prefetch->reads_count; i += worker->step)
+	{
+		const PdfRange* read = &prefetch->reads[i];
+#ifdef _WIN32
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD)read->offset;
+		overlapped.OffsetHigh = (DWORD)(read->offset >> 32);
+		DWORD readed;
+		ReadFile(prefetch->file, prefetch->scratch, (DWORD)read->length, &readed, &overlapped);
+#else
+		// NOTE(Sam): Short reads only happen at the end of the file
+		ssize_t readed;
+		do readed = pread(prefetch->fd, prefetch->scratch, (size_t)read->length, (off_t)read->offset);
+		while(readed < 0 && errno == EINTR);
+#endif
+	}
+}
+
+#ifdef PDF_USE_IO_URING
+// Keeps the ring full until every read is done, one thread drives it
+void pdf_prefetch_ring_run(void* param)
+{
+	PdfPrefetch* prefetch = (PdfPrefetch*)param;
+	PdfRing* ring = &prefetch->ring;
+	do
+	{
+		uint32_t queued = 0;
+		while(prefetch->next_read < prefetch->reads_count && ring->in_flight < ring->entries)
+		{
+			const PdfRange* read = &prefetch->reads[prefetch->next_read++];
+			pdf_ring_queue_read(ring, prefetch->fd, prefetch->scratch, (uint32_t)read->length, read->offset);
+			++queued;
+		}
+		// Nothing can be waited for if that fails, the faults will read the pages
+		if(!pdf_ring_enter(ring, queued, 1)) break;
+		pdf_ring_reap(ring);
+	} while(ring->in_flight > 0 || prefetch->next_read < prefetch->reads_count);
+}
+#endif
+
+// Starts reading the objects 'numbers' in the background, see PREFETCH.
+// 'prefetch' must be ended with pdf_prefetch_end, even when this fails.
+bool pdf_document_prefetch_begin(PdfDocument* doc, const uint32_t* numbers, size_t count, PdfPrefetch* out_prefetch)
+{
+	PdfPrefetch* prefetch = out_prefetch;
+	memset(prefetch, 0, sizeof(PdfPrefetch));
+#ifdef _WIN32
+	prefetch->file = INVALID_HANDLE_VALUE;
+#else
+	prefetch->fd = -1;
+#endif
+#ifdef PDF_USE_IO_URING
+	prefetch->ring.fd = -1;
+#endif
+	if(!doc->file.is_mapped || doc->filename == NULL || count == 0) return true;
+	const PdfObjectOffsets* offsets = pdf_document_object_offsets(doc);
+	PdfRange* ranges = (PdfRange*)pdf_malloc(count*sizeof(PdfRange));
+	if(offsets == NULL || ranges == NULL)
+	{
+		pdf_free(ranges);
+		return false;
+	}
+
+	size_t ranges_count = 0;
+	for(size_t i = 0; i < count; ++i)
+		ranges_count += pdf_document_object_range(doc, offsets, numbers[i], &ranges[ranges_count]);
+	qsort(ranges, ranges_count, sizeof(PdfRange), pdf_compare_ranges);
+
+	// Merges the ranges which overlap or are close enough
+	size_t capacity = 0;
+	bool success = true;
+	for(size_t i = 0; i < ranges_count && success;)
+	{
+		uint64_t start = ranges[i].offset;
+		uint64_t end = start + ranges[i].length;
+		for(++i; i < ranges_count && ranges[i].offset <= end + PDF_PREFETCH_MERGE_GAP; ++i)
+			if(ranges[i].offset + ranges[i].length > end) end = ranges[i].offset + ranges[i].length;
+		success = pdf_prefetch_add_range(prefetch, &doc->file, start, end - start, &capacity);
+	}
+	pdf_free(ranges);
+	if(!success || prefetch->reads_count == 0) return success;
+
+	prefetch->scratch = (uint8_t*)pdf_malloc(PDF_PREFETCH_MAX_READ);
+#ifdef _WIN32
+	prefetch->file = CreateFileA(doc->filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+								 FILE_ATTRIBUTE_NORMAL, NULL);
+	if(prefetch->scratch == NULL || prefetch->file == INVALID_HANDLE_VALUE) return false;
+#else
+	prefetch->fd = open(doc->filename, O_RDONLY);
+	if(prefetch->scratch == NULL || prefetch->fd < 0) return false;
+#endif
+
+#ifdef PDF_USE_IO_URING
+	uint32_t depth = prefetch->reads_count < PDF_PREFETCH_QUEUE_DEPTH ? (uint32_t)prefetch->reads_count
+		: PDF_PREFETCH_QUEUE_DEPTH;
+	if(!pdf_prefetch_ring_is_disabled && pdf_ring_init(&prefetch->ring, depth))
+	{
+		prefetch->uses_ring = true;
+		prefetch->threads_count = 1;
+		prefetch->started[0] = pdf_thread_start(&prefetch->threads[0], pdf_prefetch_ring_run, prefetch);
+		return true;
+	}
+#endif
+
+	// Each thread takes every 'threads_count'th read
+	prefetch->threads_count = prefetch->reads_count < PDF_PREFETCH_THREADS ? prefetch->reads_count
+		: PDF_PREFETCH_THREADS;
+	for(size_t i = 0; i < prefetch->threads_count; ++i)
+	{
+		prefetch->workers[i].prefetch = prefetch;
+		prefetch->workers[i].first = i;
+		prefetch->workers[i].step = prefetch->threads_count;
+		prefetch->started[i] = pdf_thread_start(&prefetch->threads[i], pdf_prefetch_worker_run, &prefetch->workers[i]);
+	}
+	return true;
+}
+
+// Waits for the reads started by pdf_document_prefetch_begin, then
+// releases 'prefetch'
+void pdf_prefetch_end(PdfPrefetch* prefetch)
+{
+	for(size_t i = 0; i < prefetch->threads_count; ++i)
+		if(prefetch->started[i]) pdf_thread_join(&prefetch->threads[i]);
+#ifdef PDF_USE_IO_URING
+	if(prefetch->uses_ring) pdf_ring_free(&prefetch->ring);
+#endif
+#ifdef _WIN32
+	if(prefetch->file != INVALID_HANDLE_VALUE) CloseHandle(prefetch->file);
+#else
+	if(prefetch->fd >= 0) close(prefetch->fd);
+#endif
+	pdf_free(prefetch->scratch);
+	pdf_free(prefetch->reads);
+	memset(prefetch, 0, sizeof(PdfPrefetch));
+}
+
+// Starts reading what the pages need: the page objects, their resources
+// and content streams. The page objects are read first to find them.
+bool pdf_document_prefetch_pages(PdfDocument* doc, PdfPrefetch* out_prefetch)
+{
+	size_t pages_count = pdf_document_page_count(doc);
+	size_t capacity = 2*pages_count + 1;
+	size_t count = 0;
+	uint32_t* numbers = (uint32_t*)pdf_malloc(capacity*sizeof(uint32_t));
+	if(numbers == NULL)
+	{
+		pdf_document_prefetch_begin(doc, NULL, 0, out_prefetch);
+		return false;
+	}
+	for(size_t i = 0; i < pages_count; ++i)
+	{
+		const PdfPage* page = pdf_document_get_page(doc, i);
+		if(page->resources.type == PDF_OBJECT_TYPE_REFERENCE) numbers[count++] = page->resources.reference_value.number;
+		PdfObject page_obj;
+		if(!pdf_document_get_object(doc, page->number, &page_obj)) continue;
+		if(page_obj.type != PDF_OBJECT_TYPE_DICTIONARY)
+		{
+			pdf_object_free(&page_obj);
+			continue;
+		}
+		PdfObject contents = pdf_dictionary_get(&page_obj.dictionary_value, pdf_name("Contents"));
+		size_t parts = contents.type == PDF_OBJECT_TYPE_ARRAY ? contents.array_value.length : 1;
+		for(size_t j = 0; j < parts; ++j)
+		{
+			PdfObject part = contents.type == PDF_OBJECT_TYPE_ARRAY ? contents.array_value.start[j] : contents;
+			if(part.type != PDF_OBJECT_TYPE_REFERENCE) continue;
+			if(count == capacity)
+			{
+				uint32_t* grown = (uint32_t*)pdf_realloc(numbers, 2*capacity*sizeof(uint32_t));
+				if(grown == NULL) break;
+				numbers = grown;
+				capacity *= 2;
+			}
+			numbers[count++] = part.reference_value.number;
+		}
+		pdf_object_free(&page_obj);
+	}
+	bool success = pdf_document_prefetch_begin(doc, numbers, count, out_prefetch);
+	pdf_free(numbers);
+	return success;
+}
+
+void pdf_document_close(PdfDocument* doc)
+{
+	PDF_STATS_DOCUMENT_CLOSED(doc->filename);
+	pdf_document_free_page_index(doc);
+	pdf_document_free_object_streams(doc);
+	pdf_document_free_fonts(doc);
+	pdf_document_free_shared_objects(doc);
+	pdf_free(doc->object_offsets);
+	pdf_free(doc->linearization.pages);
+	pdf_free(doc->xref);
+	pdf_object_free(&doc->trailer);
+	for(size_t i = 0; i < doc->revisions_count; ++i) pdf_revision_free(&doc->revisions[i]);
+	pdf_free(doc->revisions);
+	for(size_t i = 0; i < doc->modified_count; ++i) pdf_object_free(&doc->modified[i].object);
+	pdf_free(doc->modified);
+	pdf_free(doc->filename);
+	pdf_file_close(&doc->index_file);
+	pdf_file_close(&doc->file);
+	memset(doc, 0, sizeof(PdfDocument));
+}
+
+// Reads the whole xref, repairing it if needed (and allowed by 'flags')
+bool pdf_document_read_full_xref(PdfDocument* doc, int flags)
+{
+	if(flags & PDF_OPEN_FORCE_REPAIR || !pdf_document_read_xref(doc))
+	{
+		if(flags & PDF_OPEN_NO_REPAIR) return false;
+		if(!pdf_document_repair_xref(doc, 0)) return false;
+	}
+
+	// New objects are numbered after the biggest one we know of
+	PdfObject size = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Size"));
+	if(doc->xref_count > doc->next_object_number) doc->next_object_number = (uint32_t)doc->xref_count;
+	if(size.type == PDF_OBJECT_TYPE_INTEGER && size.int_value > doc->next_object_number
+	   && size.int_value <= PDF_MAX_OBJECT_NUMBER + 1)
+		doc->next_object_number = (uint32_t)size.int_value;
+	if(doc->next_object_number == 0) doc->next_object_number = 1;
+	return true;
+}
+
+// Reads the rest of the xref of a document opened with PDF_OPEN_FIRST_PAGE
+bool pdf_document_complete_xref(PdfDocument* doc)
+{
+	if(!doc->has_partial_xref) return true;
+	pdf_document_reset_xref(doc);
+	return pdf_document_read_full_xref(doc, doc->open_flags);
+}
+
+// Sets up the decryption once the xref is known, the hint stream read
+// before was still encrypted.
+int pdf_document_load_encryption(PdfDocument* doc)
+{
+	int error = pdf_document_read_encryption(doc);
+	if(error || !doc->is_encrypted || !doc->is_linearized) return error;
+	pdf_free(doc->linearization.pages);
+	doc->linearization.pages = NULL;
+	pdf_document_read_page_hints(doc);
+	return PDF_ERROR_NONE;
+}
+
+// With a partial xref, new objects are numbered after the /Size of the
+// newest trailer, which covers the whole document.
+static void pdf_document_number_after_size(PdfDocument* doc)
+{
+	PdfObject size = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Size"));
+	doc->next_object_number = (uint32_t)doc->xref_count;
+	if(size.type == PDF_OBJECT_TYPE_INTEGER && size.int_value > doc->next_object_number
+	   && size.int_value <= PDF_MAX_OBJECT_NUMBER + 1)
+		doc->next_object_number = (uint32_t)size.int_value;
+}
+
+static int pdf_document_load_xref(PdfDocument* doc, int flags)
+{
+	doc->open_flags = flags;
+	// Not even the linearization dictionary, it is an object like the others
+	if(flags & PDF_OPEN_METADATA && !(flags & PDF_OPEN_FORCE_REPAIR))
+	{
+		doc->has_lazy_xref = true;
+		doc->has_partial_xref = true;
+		if(pdf_document_read_xref(doc))
+		{
+			pdf_document_number_after_size(doc);
+			return pdf_document_load_encryption(doc);
+		}
+		pdf_document_reset_xref(doc);
+	}
+	pdf_document_read_linearization(doc);
+	if(flags & PDF_OPEN_FIRST_PAGE && !(flags & PDF_OPEN_FORCE_REPAIR) && doc->is_linearized)
+	{
+		if(pdf_document_read_first_page_xref(doc))
+		{
+			pdf_document_number_after_size(doc);
+			return pdf_document_load_encryption(doc);
+		}
+		pdf_document_reset_xref(doc);
+	}
+	if(!pdf_document_read_full_xref(doc, flags)) return PDF_ERROR_XREF;
+	return pdf_document_load_encryption(doc);
+}
+
+int pdf_document_load(PdfDocument* doc, int flags)
+{
+	int64_t failures = pdf_memory_budget_failures();
+	int error = pdf_document_load_xref(doc, flags);
+	if(pdf_memory_budget_failures() == failures) return error;
+	// Caches give way first: what the first read kept is freed and the
+	// xref is read once more
+	pdf_document_trim_caches(doc);
+	pdf_document_reset_xref(doc);
+	pdf_free(doc->linearization.pages);
+	doc->linearization.pages = NULL;
+	failures = pdf_memory_budget_failures();
+	error = pdf_document_load_xref(doc, flags);
+	// A read cut short by the memory budget may look like a broken xref,
+	// it is reported for what it is
+	return pdf_memory_budget_failures() != failures ? PDF_ERROR_MEMORY : error;
+}
+
+// Object number of the first page, without walking the page tree for
+// linearized files. Returns 0 if there is no page.
+uint32_t pdf_document_first_page(PdfDocument* doc)
+{
+	if(doc->is_linearized) return doc->linearization.first_page_number;
+
+	// Follow the first kid down from the root of the page tree
+	PdfObject root = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Root"));
+	if(root.type != PDF_OBJECT_TYPE_REFERENCE) return 0;
+	PdfObject node;
+	if(!pdf_document_get_object(doc, root.reference_value.number, &node)) return 0;
+	PdfObject next = node.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&node.dictionary_value, pdf_name("Pages")) : node;
+	for(int depth = 0; depth < 64 && next.type == PDF_OBJECT_TYPE_REFERENCE; ++depth)
+	{
+		uint32_t number = next.reference_value.number;
+		pdf_object_free(&node);
+		if(!pdf_document_get_object(doc, number, &node) || node.type != PDF_OBJECT_TYPE_DICTIONARY) break;
+		PdfObject type = pdf_dictionary_get(&node.dictionary_value, pdf_name("Type"));
+		if(type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("Page")))
+		{
+			pdf_object_free(&node);
+			return number;
+		}
+		PdfObject kids = pdf_dictionary_get(&node.dictionary_value, pdf_name("Kids"));
+		next = kids.type == PDF_OBJECT_TYPE_ARRAY && kids.array_value.length > 0 ? kids.array_value.start[0] : kids;
+	}
+	pdf_object_free(&node);
+	return 0;
+}
+
+// Byte range of the page 'index' (0 based) of a linearized file, from its
+// hint table. Meant to prefetch the page before parsing it.
+bool pdf_document_page_range(PdfDocument* doc, uint32_t index, uint64_t* out_offset, uint64_t* out_length)
+{
+	if(!doc->is_linearized || doc->linearization.pages == NULL || index >= doc->linearization.pages_count) return false;
+	*out_offset = doc->linearization.pages[index].offset;
+	*out_length = doc->linearization.pages[index].length;
+	return true;
+}
+
+// Opens a document from memory, 'data' must stay valid until the document
+// is closed and must be followed by PDF_BUFFER_PADDING readable bytes.
+int pdf_document_open_memory(PdfDocument* doc, const uint8_t* data, size_t size, int flags)
+{
+	PDF_STATS_DOCUMENT_OPENED();
+	memset(doc, 0, sizeof(PdfDocument));
+	doc->data = data;
+	doc->size = size;
+	int error = pdf_document_load(doc, flags);
+	if(error) pdf_document_close(doc);
+	return error;
+}
+
+// Maps the file of a document, nothing is read yet
+int pdf_document_open_file(PdfDocument* doc, const char* filename)
+{
+	PDF_STATS_DOCUMENT_OPENED();
+	memset(doc, 0, sizeof(PdfDocument));
+	if(!pdf_file_open(filename, &doc->file)) return PDF_ERROR_FILE;
+	size_t filename_len = strlen(filename);
+	doc->filename = (char*)pdf_malloc(filename_len + 1);
+	if(doc->filename == NULL)
+	{
+		pdf_document_close(doc);
+		return PDF_ERROR_MEMORY;
+	}
+	memcpy(doc->filename, filename, filename_len + 1);
+	doc->data = doc->file.data;
+	doc->size = doc->file.size;
+	return PDF_ERROR_NONE;
+}
+
+int pdf_document_open(PdfDocument* doc, const char* filename, int flags)
+{
+	int error = pdf_document_open_file(doc, filename);
+	if(error) return error;
+	error = pdf_document_load(doc, flags);
+	if(error) pdf_document_close(doc);
+	return error;
+}
+
+/*
+  WRITING:
+  - Everything goes through a PdfWriter buffer which is flushed in large
+    writes, big payloads (stream data) are written directly. The buffer
+    is kept between uses so a service saving many documents reuses it.
+  - Numbers are formatted by hand, printf is by far the slowest part of
+    writing otherwise.
+  - Objects are written with their shortest usual syntax, dictionaries
+    and streams have their /Length rewritten from the actual data.
+  - An incremental update appends the modified objects, a new xref section
+    listing only them and a trailer pointing to the previous section with
+    /Prev. The original bytes are never touched, so a save costs the size
+    of the change and signatures over previous revisions stay valid.
+  - A full save rewrites every object, optionally packing the small ones
+    in compressed object streams and writing a compressed xref stream
+    instead of the 20 bytes per object of a classic table.
+  - An optimized save also drops what the trailer does not reach (old
+    object streams and xref streams included) and writes identical
+    streams once: streams are hashed in parallel, equal hashes checked
+    byte for byte, and references to a duplicate point to the copy kept.
+ */
+
+typedef struct {
+	FILE* file;			// NULL to write in memory, the buffer then grows as needed
+	uint8_t* buffer;
+	size_t length;		// Bytes waiting in the buffer
+	size_t capacity;
+	uint64_t offset;	// Offset in the output of the next byte written
+	bool failed;
+} PdfWriter;
+
+#define PDF_WRITER_BUFFER_SIZE (1 << 20)
+
+// Starts writing to 'file' (or in memory when NULL) at 'offset'. The buffer
+// of a previous use is kept, it is only released by pdf_writer_free.
+bool pdf_writer_begin(PdfWriter* writer, FILE* file, uint64_t offset)
+{
+	writer->file = file;
+	writer->length = 0;
+	writer->offset = offset;
+	writer->failed = false;
+	if(writer->buffer != NULL) return true;
+	writer->capacity = file != NULL ? PDF_WRITER_BUFFER_SIZE : 4096;
+	writer->buffer = (uint8_t*)pdf_malloc(writer->capacity);
+	if(writer->buffer == NULL)
+	{
+		writer->capacity = 0;
+		writer->failed = true;
+	}
+	return !writer->failed;
+}
+
+void pdf_writer_flush(PdfWriter* writer)
+{
+	if(writer->file == NULL || writer->length == 0) return;
+	if(!writer->failed && fwrite(writer->buffer, 1, writer->length, writer->file) != writer->length)
+		writer->failed = true;
+	writer->length = 0;
+}
+
+void pdf_writer_free(PdfWriter* writer)
+{
+	pdf_free(writer->buffer);
+	memset(writer, 0, sizeof(PdfWriter));
+}
+
+// Returns where to write the next 'size' bytes (at most), they are added
+// to the output by pdf_writer_commit. NULL once the writer failed.
+uint8_t* pdf_writer_reserve(PdfWriter* writer, size_t size)
+{
+	if(writer->failed) return NULL;
+	if(writer->capacity - writer->length >= size) return writer->buffer + writer->length;
+	pdf_writer_flush(writer);
+	if(writer->capacity - writer->length >= size) return writer->buffer + writer->length;
+
+	size_t capacity = 2*writer->capacity;
+	if(capacity < writer->length + size) capacity = writer->length + size;
+	uint8_t* buffer = (uint8_t*)pdf_realloc(writer->buffer, capacity);
+	if(buffer == NULL)
+	{
+		writer->failed = true;
+		return NULL;
+	}
+	writer->buffer = buffer;
+	writer->capacity = capacity;
+	return writer->buffer + writer->length;
+}
+
+void pdf_writer_commit(PdfWriter* writer, size_t size)
+{
+	writer->length += size;
+	writer->offset += size;
+}
+
+void pdf_write_bytes(PdfWriter* writer, const void* data, size_t length)
+{
+	if(writer->failed || length == 0) return;
+	// Big payloads are not worth a copy in the buffer
+	if(writer->file != NULL && length >= writer->capacity/2)
+	{
+		pdf_writer_flush(writer);
+		if(!writer->failed && fwrite(data, 1, length, writer->file) != length) writer->failed = true;
+		writer->offset += length;
+		return;
+	}
+	uint8_t* out = pdf_writer_reserve(writer, length);
+	if(out == NULL) return;
+	memcpy(out, data, length);
+	pdf_writer_commit(writer, length);
+}
+
+void pdf_write_string(PdfWriter* writer, const char* str)
+{
+	pdf_write_bytes(writer, str, strlen(str));
+}
+
+// Encodes 'code_point' in UTF-8 in the 4 bytes at 'out' and returns its
+// length, U+FFFD for surrogates and values past U+10FFFF. U+0000 is dropped.
+size_t pdf_utf8_encode(uint32_t code_point, uint8_t* out)
+{
+	if(code_point == 0) return 0;
+	if((code_point >= 0xD800 && code_point < 0xE000) || code_point > 0x10FFFF) code_point = 0xFFFD;
+	if(code_point < 0x80)
+	{
+		out[0] = (uint8_t)code_point;
+		return 1;
+	}
+	if(code_point < 0x800)
+	{
+		out[0] = (uint8_t)(0xC0 | (code_point >> 6));
+		out[1] = (uint8_t)(0x80 | (code_point & 0x3F));
+		return 2;
+	}
+	if(code_point < 0x10000)
+	{
+		out[0] = (uint8_t)(0xE0 | (code_point >> 12));
+		out[1] = (uint8_t)(0x80 | ((code_point >> 6) & 0x3F));
+		out[2] = (uint8_t)(0x80 | (code_point & 0x3F));
+		return 3;
+	}
+	out[0] = (uint8_t)(0xF0 | (code_point >> 18));
+	out[1] = (uint8_t)(0x80 | ((code_point >> 12) & 0x3F));
+	out[2] = (uint8_t)(0x80 | ((code_point >> 6) & 0x3F));
+	out[3] = (uint8_t)(0x80 | (code_point & 0x3F));
+	return 4;
+}
+
+// Writes 'code_point' in UTF-8, see pdf_utf8_encode
+void pdf_write_utf8(PdfWriter* writer, uint32_t code_point)
+{
+	uint8_t* out = pdf_writer_reserve(writer, 4);
+	if(out == NULL) return;
+	pdf_writer_commit(writer, pdf_utf8_encode(code_point, out));
+}
+
+void pdf_write_format(PdfWriter* writer, const char* format, ...)
+{
+	char tmp[128];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(tmp, sizeof(tmp), format, args);
+	va_end(args);
+	PDF_ASSERT(len >= 0 && (size_t)len < sizeof(tmp) && "Formatted output too long");
+	pdf_write_bytes(writer, tmp, (size_t)len);
+}
+
+static const char pdf_digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// Writes the decimal digits of 'value' backward from 'end', two at a time,
+// and returns where they start.
+char* pdf_format_unsigned(uint64_t value, char* end)
+{
+	while(value >= 100)
+	{
+		end -= 2;
+		memcpy(end, pdf_digit_pairs + 2*(value % 100), 2);
+		value /= 100;
+	}
+	if(value >= 10)
+	{
+		end -= 2;
+		memcpy(end, pdf_digit_pairs + 2*value, 2);
+	}
+	else *--end = (char)('0' + value);
+	return end;
+}
+
+void pdf_write_unsigned(PdfWriter* writer, uint64_t value)
+{
+	char tmp[24];
+	char* start = pdf_format_unsigned(value, tmp + sizeof(tmp));
+	pdf_write_bytes(writer, start, (size_t)(tmp + sizeof(tmp) - start));
+}
+
+void pdf_write_integer(PdfWriter* writer, int64_t value)
+{
+	char tmp[24];
+	uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+	char* start = pdf_format_unsigned(magnitude, tmp + sizeof(tmp));
+	if(value < 0) *--start = '-';
+	pdf_write_bytes(writer, start, (size_t)(tmp + sizeof(tmp) - start));
+}
+
+// Exactly 'width' digits, left padded with zeros as in xref tables
+void pdf_format_padded(uint64_t value, char* out, size_t width)
+{
+	for(size_t i = width; i-- > 0; )
+	{
+		out[i] = (char)('0' + value % 10);
+		value /= 10;
+	}
+}
+
+void pdf_write_real(PdfWriter* writer, PDF_REAL_TYPE value)
+{
+	// NOTE(Sam): PDF has no exponent notation, we write at most 6 decimals
+	//            and remove the useless zeros. Big values (out of the spec
+	//            limits anyway) go through printf.
+	double v = (double)value;
+	if(v - v != 0) v = 0; // NaN and infinities
+	if(v <= -1e12 || v >= 1e12)
+	{
+		pdf_write_format(writer, "%.0f", v);
+		return;
+	}
+
+	bool negative = v < 0;
+	if(negative) v = -v;
+	uint64_t scaled = (uint64_t)(v*1e6 + 0.5);
+	uint64_t integer = scaled / 1000000;
+	uint64_t fraction = scaled % 1000000;
+
+	char tmp[32];
+	char* start = tmp + sizeof(tmp);
+	if(fraction != 0)
+	{
+		int digits = 6;
+		while(fraction % 10 == 0)
+		{
+			fraction /= 10;
+			--digits;
+		}
+		while(digits-- > 0)
+		{
+			*--start = (char)('0' + fraction % 10);
+			fraction /= 10;
+		}
+		*--start = '.';
+	}
+	start = pdf_format_unsigned(integer, start);
+	if(negative && scaled != 0) *--start = '-';
+	pdf_write_bytes(writer, start, (size_t)(tmp + sizeof(tmp) - start));
+}
+
+void pdf_write_reference(PdfWriter* writer, uint32_t number, uint32_t generation)
+{
+	char tmp[32];
+	char* end = tmp + sizeof(tmp);
+	end -= 2;
+	memcpy(end, " R", 2);
+	end = pdf_format_unsigned(generation, end);
+	*--end = ' ';
+	end = pdf_format_unsigned(number, end);
+	pdf_write_bytes(writer, end, (size_t)(tmp + sizeof(tmp) - end));
+}
+
+void pdf_write_name(PdfWriter* writer, PdfName name)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	// At worst every byte is escaped as '#XX'
+	uint8_t* out = pdf_writer_reserve(writer, 1 + 3*name.length);
+	if(out == NULL) return;
+	size_t len = 0;
+	out[len++] = '/';
+	for(size_t i = 0; i < name.length; ++i)
+	{
+		uint8_t c = (uint8_t)name.start[i];
+		if(c < 0x21 || c > 0x7E || c == '#' || pdf_char_is_delimiter(c))
+		{
+			out[len++] = '#';
+			out[len++] = (uint8_t)hex[c >> 4];
+			out[len++] = (uint8_t)hex[c & 15];
+		}
+		else out[len++] = c;
+	}
+	pdf_writer_commit(writer, len);
+}
+
+void pdf_write_literal_string(PdfWriter* writer, PdfString string)
+{
+	// At worst every byte is escaped with a '\'
+	uint8_t* out = pdf_writer_reserve(writer, 2 + 2*string.length);
+	if(out == NULL) return;
+	size_t len = 0;
+	out[len++] = '(';
+	for(size_t i = 0; i < string.length; ++i)
+	{
+		uint8_t c = (uint8_t)string.start[i];
+		switch(c) {
+		case '(':
+		case ')':
+		case '\\':
+		{
+			out[len++] = '\\';
+			out[len++] = c;
+		} break;
+		case 0x0D: // A raw CR would be read back as LF
+		{
+			out[len++] = '\\';
+			out[len++] = 'r';
+		} break;
+		default: out[len++] = c;
+		}
+	}
+	out[len++] = ')';
+	pdf_writer_commit(writer, len);
+}
+
+void pdf_write_object(PdfWriter* writer, const PdfObject* obj);
+
+// Writes the dictionary entries, skipping /Length when 'length' is given
+// since we write the right one ourself.
+void pdf_write_dictionary(PdfWriter* writer, const PdfDictionary* dictionary, const size_t* length)
+{
+	pdf_write_bytes(writer, "<<", 2);
+	size_t slot = 0;
+	PdfName length_name = pdf_name("Length");
+	for(PdfDictionaryBucket* bucket = pdf_dictionary_next(dictionary, &slot, NULL);
+		bucket != NULL; bucket = pdf_dictionary_next(dictionary, &slot, bucket))
+	{
+		if(length != NULL && pdf_names_are_equals(bucket->key, length_name)) continue;
+		pdf_write_name(writer, bucket->key);
+		pdf_write_bytes(writer, " ", 1);
+		pdf_write_object(writer, &bucket->object);
+	}
+	if(length != NULL)
+	{
+		pdf_write_bytes(writer, "/Length ", 8);
+		pdf_write_unsigned(writer, *length);
+	}
+	pdf_write_bytes(writer, ">>", 2);
+}
+
+void pdf_write_object(PdfWriter* writer, const PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_NONE:
+	case PDF_OBJECT_TYPE_NULL:
+	{
+		pdf_write_bytes(writer, "null", 4);
+	} break;
+	case PDF_OBJECT_TYPE_BOOLEAN:
+	{
+		if(obj->bool_value) pdf_write_bytes(writer, "true", 4);
+		else pdf_write_bytes(writer, "false", 5);
+	} break;
+	case PDF_OBJECT_TYPE_INTEGER:
+	{
+		pdf_write_integer(writer, (int64_t)obj->int_value);
+	} break;
+	case PDF_OBJECT_TYPE_REAL:
+	{
+		pdf_write_real(writer, obj->real_value);
+	} break;
+	case PDF_OBJECT_TYPE_STRING:
+	{
+		pdf_write_literal_string(writer, obj->string_value);
+	} break;
+	case PDF_OBJECT_TYPE_NAME:
+	{
+		pdf_write_name(writer, obj->name_value);
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		pdf_write_bytes(writer, "[", 1);
+		for(size_t i = 0; i < obj->array_value.length; ++i)
+		{
+			if(i > 0) pdf_write_bytes(writer, " ", 1);
+			pdf_write_object(writer, &obj->array_value.start[i]);
+		}
+		pdf_write_bytes(writer, "]", 1);
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	{
+		pdf_write_dictionary(writer, &obj->dictionary_value, NULL);
+	} break;
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		pdf_write_dictionary(writer, &obj->stream_value.dictionary, &obj->stream_value.length);
+		pdf_write_bytes(writer, "\nstream\n", 8);
+		pdf_write_bytes(writer, obj->stream_value.data, obj->stream_value.length);
+		pdf_write_bytes(writer, "\nendstream", 10);
+	} break;
+	case PDF_OBJECT_TYPE_REFERENCE:
+	{
+		pdf_write_reference(writer, obj->reference_value.number, obj->reference_value.generation);
+	} break;
+	}
+}
+
+void pdf_write_object_header(PdfWriter* writer, uint32_t number, uint32_t generation)
+{
+	pdf_write_unsigned(writer, number);
+	pdf_write_bytes(writer, " ", 1);
+	pdf_write_unsigned(writer, generation);
+	pdf_write_bytes(writer, " obj\n", 5);
+}
+
+void pdf_write_indirect_object(PdfWriter* writer, uint32_t number, uint32_t generation, const PdfObject* obj)
+{
+	pdf_write_object_header(writer, number, generation);
+	pdf_write_object(writer, obj);
+	pdf_write_bytes(writer, "\nendobj\n", 8);
+}
+
+// Copies the original bytes of the document at the start of the output.
+// On Linux we let the kernel copy the file (copy_file_range, which may
+// even share the blocks, then sendfile), otherwise we write the mapping.
+void pdf_writer_copy_document(PdfWriter* writer, PdfDocument* doc)
+{
+	size_t copied = 0;
+#ifdef __linux__
+	int in_fd = doc->filename ? open(doc->filename, O_RDONLY) : -1;
+	pdf_writer_flush(writer);
+	if(in_fd >= 0 && writer->file != NULL && !writer->failed && fflush(writer->file) == 0)
+	{
+		int out_fd = fileno(writer->file);
+		off_t in_offset = 0;
+		while(copied < doc->size)
+		{
+			ssize_t count = copy_file_range(in_fd, &in_offset, out_fd, NULL, doc->size - copied, 0);
+			if(count <= 0) break;
+			copied += (size_t)count;
+		}
+		while(copied < doc->size)
+		{
+			ssize_t count = sendfile(out_fd, in_fd, &in_offset, doc->size - copied);
+			if(count <= 0) break;
+			copied += (size_t)count;
+		}
+		writer->offset += copied;
+	}
+	if(in_fd >= 0) close(in_fd);
+#endif
+	pdf_write_bytes(writer, doc->data + copied, doc->size - copied);
+}
+
+// The trailer entries we keep from the document, the others describe the
+// xref section they came from and are rewritten. Encrypted documents are
+// only written in clear (see pdf_document_write).
+void pdf_write_trailer_entries(PdfWriter* writer, const PdfDictionary* trailer)
+{
+	static const char* skipped[] = {
+		"Size", "Prev", "XRefStm", "Type", "W", "Index", "Filter", "DecodeParms", "Length", "Encrypt"
+	};
+	size_t slot = 0;
+	for(PdfDictionaryBucket* bucket = pdf_dictionary_next(trailer, &slot, NULL);
+		bucket != NULL; bucket = pdf_dictionary_next(trailer, &slot, bucket))
+	{
+		bool is_skipped = false;
+		for(size_t i = 0; i < sizeof(skipped)/sizeof(skipped[0]); ++i)
+			is_skipped |= pdf_names_are_equals(bucket->key, pdf_name(skipped[i]));
+		if(is_skipped) continue;
+		pdf_write_name(writer, bucket->key);
+		pdf_write_bytes(writer, " ", 1);
+		pdf_write_object(writer, &bucket->object);
+	}
+}
+
+void pdf_write_startxref(PdfWriter* writer, uint64_t xref_offset)
+{
+	pdf_write_bytes(writer, "startxref\n", 10);
+	pdf_write_unsigned(writer, xref_offset);
+	pdf_write_bytes(writer, "\n%%EOF\n", 7);
+}
+
+// Writes a classic xref section for the 'count' entries (of the objects
+// 'numbers', or 0 to count-1 when NULL) followed by the trailer, with the
+// entries of 'trailer' we keep. 'prev' is the offset of the previous
+// section, if any.
+void pdf_write_xref_table(PdfWriter* writer, const PdfDictionary* trailer, const uint32_t* numbers,
+						  const PdfXrefEntry* entries, size_t count, uint32_t size, const uint64_t* prev)
+{
+	uint64_t xref_offset = writer->offset;
+	pdf_write_bytes(writer, "xref\n", 5);
+
+	// One subsection per run of consecutive object numbers
+	for(size_t i = 0; i < count; )
+	{
+		size_t run_end = i + 1;
+		if(numbers == NULL) run_end = count;
+		else while(run_end < count && numbers[run_end] == numbers[run_end - 1] + 1) ++run_end;
+		pdf_write_unsigned(writer, numbers ? numbers[i] : 0);
+		pdf_write_bytes(writer, " ", 1);
+		pdf_write_unsigned(writer, run_end - i);
+		pdf_write_bytes(writer, "\n", 1);
+		for(; i < run_end; ++i)
+		{
+			// Fixed 20 bytes entries 'oooooooooo ggggg n\r\n'
+			char* out = (char*)pdf_writer_reserve(writer, 20);
+			if(out == NULL) return;
+			bool is_free = entries[i].type != PDF_XREF_ENTRY_IN_USE;
+			pdf_format_padded(is_free ? 0 : entries[i].offset, out, 10);
+			out[10] = ' ';
+			pdf_format_padded(entries[i].generation, out + 11, 5);
+			out[16] = ' ';
+			out[17] = is_free ? 'f' : 'n';
+			out[18] = '\r';
+			out[19] = '\n';
+			pdf_writer_commit(writer, 20);
+		}
+	}
+
+	pdf_write_bytes(writer, "trailer\n<<", 10);
+	pdf_write_trailer_entries(writer, trailer);
+	pdf_write_bytes(writer, "/Size ", 6);
+	pdf_write_unsigned(writer, size);
+	if(prev != NULL)
+	{
+		pdf_write_bytes(writer, "/Prev ", 6);
+		pdf_write_unsigned(writer, *prev);
+	}
+	pdf_write_bytes(writer, ">>\n", 3);
+	pdf_write_startxref(writer, xref_offset);
+}
+
+// Number of bytes needed to store 'value' in an xref stream field
+size_t pdf_field_width(uint64_t value)
+{
+	size_t width = 1;
+	while(width < 8 && value >> (8*width)) ++width;
+	return width;
+}
+
+// Same as pdf_write_xref_table with an xref stream, the object 'number'.
+// Its own entry must be in 'entries' with the current writer offset.
+void pdf_write_xref_stream(PdfWriter* writer, const PdfDictionary* trailer, uint32_t number, const uint32_t* numbers,
+						   const PdfXrefEntry* entries, size_t count, uint32_t size, const uint64_t* prev)
+{
+	uint64_t xref_offset = writer->offset;
+	uint64_t max_field2 = 0, max_field3 = 0;
+	for(size_t i = 0; i < count; ++i)
+	{
+		bool is_free = entries[i].type != PDF_XREF_ENTRY_IN_USE && entries[i].type != PDF_XREF_ENTRY_COMPRESSED;
+		if(!is_free && entries[i].offset > max_field2) max_field2 = entries[i].offset;
+		if(entries[i].generation > max_field3) max_field3 = entries[i].generation;
+	}
+	size_t w[3] = {1, pdf_field_width(max_field2), pdf_field_width(max_field3)};
+	size_t row_size = w[0] + w[1] + w[2];
+
+	// Rows are stored with the PNG 'Up' predictor (each row minus the
+	// previous one), consecutive offsets then compress to almost nothing.
+	uint8_t* rows = (uint8_t*)pdf_malloc(count*(row_size + 1) + 1);
+	if(rows == NULL)
+	{
+		writer->failed = true;
+		return;
+	}
+	uint8_t previous[17] = {0};
+	for(size_t i = 0; i < count; ++i)
+	{
+		uint8_t row[17];
+		uint64_t fields[3];
+		switch(entries[i].type) {
+		case PDF_XREF_ENTRY_IN_USE: fields[0] = 1; fields[1] = entries[i].offset; break;
+		case PDF_XREF_ENTRY_COMPRESSED: fields[0] = 2; fields[1] = entries[i].offset; break;
+		default: fields[0] = 0; fields[1] = 0; break;
+		}
+		fields[2] = entries[i].generation;
+		size_t pos = 0;
+		for(size_t f = 0; f < 3; ++f)
+			for(size_t b = w[f]; b-- > 0; ) row[pos++] = (uint8_t)(fields[f] >> (8*b));
+
+		uint8_t* out = rows + i*(row_size + 1);
+		out[0] = 2;
+		for(size_t b = 0; b < row_size; ++b) out[1 + b] = (uint8_t)(row[b] - previous[b]);
+		memcpy(previous, row, row_size);
+	}
+	uint8_t* data = NULL;
+	size_t data_len = 0;
+	bool success = pdf_flate_encode(rows, count*(row_size + 1), &data, &data_len);
+	pdf_free(rows);
+	if(!success)
+	{
+		writer->failed = true;
+		return;
+	}
+
+	pdf_write_object_header(writer, number, 0);
+	pdf_write_bytes(writer, "<</Type/XRef/Size ", 18);
+	pdf_write_unsigned(writer, size);
+	pdf_write_bytes(writer, "/W[", 3);
+	for(size_t f = 0; f < 3; ++f)
+	{
+		if(f > 0) pdf_write_bytes(writer, " ", 1);
+		pdf_write_unsigned(writer, w[f]);
+	}
+	pdf_write_bytes(writer, "]", 1);
+	if(numbers != NULL)
+	{
+		pdf_write_bytes(writer, "/Index[", 7);
+		for(size_t i = 0; i < count; )
+		{
+			size_t run_end = i + 1;
+			while(run_end < count && numbers[run_end] == numbers[run_end - 1] + 1) ++run_end;
+			if(i > 0) pdf_write_bytes(writer, " ", 1);
+			pdf_write_unsigned(writer, numbers[i]);
+			pdf_write_bytes(writer, " ", 1);
+			pdf_write_unsigned(writer, run_end - i);
+			i = run_end;
+		}
+		pdf_write_bytes(writer, "]", 1);
+	}
+	if(prev != NULL)
+	{
+		pdf_write_bytes(writer, "/Prev ", 6);
+		pdf_write_unsigned(writer, *prev);
+	}
+	pdf_write_bytes(writer, "/Filter/FlateDecode/DecodeParms<</Predictor 12/Columns ", 55);
+	pdf_write_unsigned(writer, row_size);
+	pdf_write_bytes(writer, ">>", 2);
+	pdf_write_trailer_entries(writer, trailer);
+	pdf_write_bytes(writer, "/Length ", 8);
+	pdf_write_unsigned(writer, data_len);
+	pdf_write_bytes(writer, ">>\nstream\n", 10);
+	pdf_write_bytes(writer, data, data_len);
+	pdf_write_bytes(writer, "\nendstream\nendobj\n", 18);
+	pdf_free(data);
+	pdf_write_startxref(writer, xref_offset);
+}
+
+// Appends the modified objects, their xref section and a new trailer.
+// The section is an xref stream if the newest revision is one.
+void pdf_document_write_update(PdfDocument* doc, PdfWriter* writer)
+{
+	if(doc->size > 0 && doc->data[doc->size - 1] != PDF_BYTE_TYPE_WHITE_SPACE_LINE_FEED
+	   && doc->data[doc->size - 1] != PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN)
+		pdf_write_bytes(writer, "\n", 1);
+
+	PdfRevision* newest = &doc->revisions[doc->revisions_count - 1];
+	uint32_t size = doc->next_object_number;
+	// The xref stream is an object of the update too
+	size_t count = doc->modified_count + (newest->is_xref_stream ? 1 : 0);
+	uint32_t* numbers = (uint32_t*)pdf_malloc((count + 1)*sizeof(uint32_t));
+	PdfXrefEntry* entries = (PdfXrefEntry*)pdf_malloc((count + 1)*sizeof(PdfXrefEntry));
+	if(numbers == NULL || entries == NULL)
+	{
+		pdf_free(numbers);
+		pdf_free(entries);
+		writer->failed = true;
+		return;
+	}
+	for(size_t i = 0; i < doc->modified_count; ++i)
+	{
+		PdfModifiedObject* modified = &doc->modified[i];
+		numbers[i] = modified->number;
+		entries[i].offset = writer->offset;
+		entries[i].generation = modified->generation;
+		entries[i].type = PDF_XREF_ENTRY_IN_USE;
+		if(modified->object.type == PDF_OBJECT_TYPE_NONE)
+		{
+			entries[i].type = PDF_XREF_ENTRY_FREE;
+			entries[i].generation = modified->generation < 65535 ? modified->generation + 1 : 65535;
+			continue;
+		}
+		pdf_write_indirect_object(writer, modified->number, modified->generation, &modified->object);
+	}
+
+	if(newest->is_xref_stream)
+	{
+		// Numbered after everything else so that the numbers stay sorted
+		uint32_t number = size++;
+		numbers[count - 1] = number;
+		entries[count - 1].type = PDF_XREF_ENTRY_IN_USE;
+		entries[count - 1].offset = writer->offset;
+		entries[count - 1].generation = 0;
+		pdf_write_xref_stream(writer, &doc->trailer.dictionary_value, number, numbers, entries, count, size,
+							  &newest->xref_offset);
+		if(!writer->failed) doc->next_object_number = size;
+	}
+	else pdf_write_xref_table(writer, &doc->trailer.dictionary_value, numbers, entries, count, size, &newest->xref_offset);
+	pdf_free(numbers);
+	pdf_free(entries);
+}
+
+// Saves the modifications as an incremental update. With a NULL 'filename'
+// (or the document own filename) the update is appended to the file in
+// place, otherwise the original bytes are copied first.
+// NOTE(Sam): The opened document does not see the new revision, reopen it.
+int pdf_document_save_incremental(PdfDocument* doc, const char* filename)
+{
+	// A repaired document has no valid xref to chain the update to
+	if(!pdf_document_complete_xref(doc)) return PDF_ERROR_XREF;
+	if(doc->was_repaired || doc->revisions_count == 0) return PDF_ERROR_XREF;
+	// NOTE(Sam): We can't encrypt, the objects of an update would be in clear
+	if(doc->is_encrypted) return PDF_ERROR_ENCRYPTED;
+
+	bool in_place = filename == NULL || (doc->filename != NULL && strcmp(filename, doc->filename) == 0);
+	if(in_place && doc->filename == NULL) return PDF_ERROR_FILE;
+
+	#pragma warning (disable : 4996)
+	FILE* file = fopen(in_place ? doc->filename : filename, in_place ? "ab" : "wb");
+	if(file == NULL) return PDF_ERROR_FILE;
+
+	PdfWriter writer = {0};
+	if(pdf_writer_begin(&writer, file, in_place ? doc->size : 0))
+	{
+		if(!in_place) pdf_writer_copy_document(&writer, doc);
+		pdf_document_write_update(doc, &writer);
+		pdf_writer_flush(&writer);
+	}
+	bool failed = writer.failed;
+	pdf_writer_free(&writer);
+
+	if(fclose(file) != 0) failed = true;
+	return failed ? PDF_ERROR_WRITE : PDF_ERROR_NONE;
+}
+
+enum PDF_SAVE_FLAGS {
+	PDF_SAVE_XREF_STREAM	= 1 << 0, // Compressed xref stream instead of a classic table (PDF 1.5)
+	PDF_SAVE_OBJECT_STREAMS = 1 << 1, // Pack the objects which allow it in compressed object streams, implies PDF_SAVE_XREF_STREAM
+	PDF_SAVE_OPTIMIZE		= 1 << 2, // Drop unreachable objects, write identical streams once and compress unfiltered ones, see pdf_document_optimize
+};
+
+// Objects packed in each object stream, more compress better but any
+// access to one of them decodes the whole stream.
+#define PDF_OBJECT_STREAM_MAX_OBJECTS 128
+
+// Generation of the object 'number' as it will be written
+uint32_t pdf_document_object_generation(PdfDocument* doc, uint32_t number)
+{
+	size_t index;
+	if(pdf_document_find_modified(doc, number, &index)) return doc->modified[index].generation;
+	if(number < doc->xref_count && doc->xref[number].type == PDF_XREF_ENTRY_IN_USE) return doc->xref[number].generation;
+	return 0;
+}
+
+// Writes an object stream made of the 'count' objects in 'body', 'header'
+// holds their 'number offset' pairs. Both are reset for the next one.
+void pdf_write_object_stream(PdfWriter* writer, uint32_t number, PdfWriter* header, PdfWriter* body, size_t count)
+{
+	size_t first = header->length;
+	pdf_write_bytes(header, body->buffer, body->length);
+	uint8_t* data = NULL;
+	size_t data_len = 0;
+	if(header->failed || !pdf_flate_encode(header->buffer, header->length, &data, &data_len))
+	{
+		writer->failed = true;
+		return;
+	}
+	pdf_write_object_header(writer, number, 0);
+	pdf_write_bytes(writer, "<</Type/ObjStm/N ", 17);
+	pdf_write_unsigned(writer, count);
+	pdf_write_bytes(writer, "/First ", 7);
+	pdf_write_unsigned(writer, first);
+	pdf_write_bytes(writer, "/Filter/FlateDecode/Length ", 27);
+	pdf_write_unsigned(writer, data_len);
+	pdf_write_bytes(writer, ">>\nstream\n", 10);
+	pdf_write_bytes(writer, data, data_len);
+	pdf_write_bytes(writer, "\nendstream\nendobj\n", 18);
+	pdf_free(data);
+	pdf_writer_begin(header, NULL, 0);
+	pdf_writer_begin(body, NULL, 0);
+}
+
+// Points the data of the stream 'obj', read from the file as the object
+// 'number', to its decrypted bytes when the document is encrypted. The
+// caller frees '*out_decrypted' with pdf_free.
+bool pdf_document_decrypt_file_stream(PdfDocument* doc, uint32_t number, uint32_t generation, PdfObject* obj,
+									  uint8_t** out_decrypted)
+{
+	*out_decrypted = NULL;
+	size_t modified_index;
+	if(!doc->is_encrypted || obj->type != PDF_OBJECT_TYPE_STREAM || pdf_document_find_modified(doc, number, &modified_index))
+		return true;
+	PdfCryptKey key;
+	pdf_document_stream_key(doc, number, generation, &obj->stream_value, &key);
+	uint8_t* decrypted = (uint8_t*)pdf_malloc(obj->stream_value.length + 1);
+	if(decrypted == NULL) return false;
+	obj->stream_value.length = pdf_crypt_decrypt(&key, obj->stream_value.data, obj->stream_value.length, decrypted);
+	obj->stream_value.data = decrypted;
+	*out_decrypted = decrypted;
+	return true;
+}
+
+// Replacement of the objects an optimized save drops
+#define PDF_OPTIMIZE_DROPPED UINT32_MAX
+
+// What an optimized save leaves out, see pdf_document_optimize
+typedef struct {
+	// By object number: 0 keeps the object, PDF_OPTIMIZE_DROPPED drops it,
+	// anything else is the number of the identical stream replacing it
+	uint32_t* replacements;
+	size_t count;
+	size_t unreachable_count;
+	size_t duplicate_count;
+	uint64_t duplicate_bytes; // Stream data not written anymore
+} PdfOptimization;
+
+void pdf_optimization_free(PdfOptimization* optimization)
+{
+	pdf_free(optimization->replacements);
+	memset(optimization, 0, sizeof(PdfOptimization));
+}
+
+typedef struct {
+	bool* seen;			// By object number
+	size_t count;
+	uint32_t* stack;	// Seen but not visited yet
+	size_t stack_count;
+	size_t stack_capacity;
+	bool failed;
+} PdfReachability;
+
+// Pushes the objects referenced by 'obj' and not seen yet. The /Length of
+// a stream is not followed, a save writes the length directly.
+static void pdf_reachability_visit(PdfReachability* reach, const PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_REFERENCE:
+	{
+		uint32_t number = obj->reference_value.number;
+		if(number >= reach->count || reach->seen[number]) return;
+		reach->seen[number] = true;
+		if(reach->stack_count == reach->stack_capacity)
+		{
+			size_t capacity = reach->stack_capacity > 0 ? 2*reach->stack_capacity : 256;
+			uint32_t* stack = (uint32_t*)pdf_realloc(reach->stack, capacity*sizeof(uint32_t));
+			if(stack == NULL)
+			{
+				reach->failed = true;
+				return;
+			}
+			reach->stack = stack;
+			reach->stack_capacity = capacity;
+		}
+		reach->stack[reach->stack_count++] = number;
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		for(size_t i = 0; i < obj->array_value.length; ++i) pdf_reachability_visit(reach, &obj->array_value.start[i]);
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		bool is_stream = obj->type == PDF_OBJECT_TYPE_STREAM;
+		const PdfDictionary* dictionary = is_stream ? &obj->stream_value.dictionary : &obj->dictionary_value;
+		PdfName length_name = pdf_name("Length");
+		size_t slot = 0;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(dictionary, &slot, NULL);
+			bucket != NULL; bucket = pdf_dictionary_next(dictionary, &slot, bucket))
+		{
+			if(is_stream && pdf_names_are_equals(bucket->key, length_name)) continue;
+			pdf_reachability_visit(reach, &bucket->object);
+		}
+	} break;
+	}
+}
+
+// Loads the stream object 'number' as a save writes it: 'out_dictionary'
+// gets its dictionary with the actual /Length and its data is decrypted.
+// The caller frees 'out_obj' and '*out_decrypted'.
+static bool pdf_document_load_written_stream(PdfDocument* doc, uint32_t number, PdfWriter* out_dictionary,
+											 PdfObject* out_obj, uint8_t** out_decrypted)
+{
+	*out_decrypted = NULL;
+	if(!pdf_document_get_object(doc, number, out_obj)) return false;
+	if(out_obj->type != PDF_OBJECT_TYPE_STREAM
+	   || !pdf_document_decrypt_file_stream(doc, number, pdf_document_object_generation(doc, number), out_obj, out_decrypted))
+	{
+		pdf_object_free(out_obj);
+		return false;
+	}
+	pdf_writer_begin(out_dictionary, NULL, 0);
+	pdf_write_dictionary(out_dictionary, &out_obj->stream_value.dictionary, &out_obj->stream_value.length);
+	return true;
+}
+
+typedef struct {
+	PdfDocument* doc;
+	uint32_t number;
+	uint32_t order;		// Streams of equal hashes are sorted by it, the first one is kept
+	uint64_t hash;		// Of the dictionary and the data
+	uint64_t length;	// Of the data
+	uint32_t kept;		// Index of the identical stream written instead, its own index if none
+	bool is_valid;		// False when the stream could not be read
+	bool has_references;// Besides /Length, such streams are only the same within a document
+} PdfStreamDigest;
+
+typedef struct {
+	PdfStreamDigest* digests;
+	size_t count;
+	size_t first; // Worker i hashes the streams i, i + step, i + 2*step...
+	size_t step;
+	PdfMemoryBudget* budget; // Of the calling thread
+#ifdef PDF_ENABLE_STATS
+	PdfStats stats;
+#endif
+} PdfDigestWorker;
+
+// True if 'obj' refers to other objects
+static bool pdf_object_has_references(const PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_REFERENCE: return true;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		for(size_t i = 0; i < obj->array_value.length; ++i)
+			if(pdf_object_has_references(&obj->array_value.start[i])) return true;
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	{
+		size_t slot = 0;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(&obj->dictionary_value, &slot, NULL);
+			bucket != NULL; bucket = pdf_dictionary_next(&obj->dictionary_value, &slot, bucket))
+			if(pdf_object_has_references(&bucket->object)) return true;
+	} break;
+	}
+	return false;
+}
+
+void pdf_digest_worker_run(void* param)
+{
+	PdfDigestWorker* worker = (PdfDigestWorker*)param;
+	pdf_memory_budget_use(worker->budget);
+	PdfWriter dictionary = {0};
+	for(size_t i = worker->first; i < worker->count; i += worker->step)
+	{
+		PdfStreamDigest* digest = &worker->digests[i];
+		PdfObject obj;
+		uint8_t* decrypted;
+		digest->is_valid = pdf_document_load_written_stream(digest->doc, digest->number, &dictionary, &obj, &decrypted);
+		if(!digest->is_valid) continue;
+		digest->is_valid = !dictionary.failed;
+		uint64_t seed = pdf_hash_bytes(dictionary.buffer, dictionary.length, 0);
+		digest->hash = pdf_hash_bytes(obj.stream_value.data, obj.stream_value.length, seed);
+		digest->length = obj.stream_value.length;
+		digest->has_references = false;
+		size_t slot = 0;
+		const PdfDictionary* stream_dictionary = &obj.stream_value.dictionary;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(stream_dictionary, &slot, NULL);
+			bucket != NULL; bucket = pdf_dictionary_next(stream_dictionary, &slot, bucket))
+		{
+			if(!pdf_names_are_equals(bucket->key, pdf_name("Length")))
+				digest->has_references |= pdf_object_has_references(&bucket->object);
+		}
+		pdf_free(decrypted);
+		pdf_object_free(&obj);
+	}
+	pdf_writer_free(&dictionary);
+	PDF_STATS_WORKER_DONE(&worker->stats);
+}
+
+static int pdf_compare_stream_digests(const void* a, const void* b)
+{
+	const PdfStreamDigest* digest_a = (const PdfStreamDigest*)a;
+	const PdfStreamDigest* digest_b = (const PdfStreamDigest*)b;
+	if(digest_a->hash != digest_b->hash) return digest_a->hash < digest_b->hash ? -1 : 1;
+	if(digest_a->order != digest_b->order) return digest_a->order < digest_b->order ? -1 : 1;
+	return 0;
+}
+
+// Hashes the streams of 'digests' on 'threads_count' threads, they may
+// come from several documents
+static bool pdf_hash_streams(PdfStreamDigest* digests, size_t count, size_t threads_count)
+{
+	if(threads_count > count) threads_count = count;
+	if(threads_count == 0) return true;
+	PdfDigestWorker* workers = (PdfDigestWorker*)pdf_malloc(threads_count*sizeof(PdfDigestWorker));
+	PdfThread* threads = (PdfThread*)pdf_malloc(threads_count*sizeof(PdfThread));
+	bool* started = (bool*)pdf_malloc(threads_count*sizeof(bool));
+	bool success = workers != NULL && threads != NULL && started != NULL;
+	for(size_t i = 0; success && i < threads_count; ++i)
+	{
+		workers[i].digests = digests;
+		workers[i].count = count;
+		workers[i].first = i;
+		workers[i].step = threads_count;
+		workers[i].budget = pdf_memory_budget_current();
+	}
+	// The calling thread takes the first share
+	for(size_t i = 1; success && i < threads_count; ++i)
+		started[i] = pdf_thread_start(&threads[i], pdf_digest_worker_run, &workers[i]);
+	if(success) pdf_digest_worker_run(&workers[0]);
+	for(size_t i = 1; success && i < threads_count; ++i)
+	{
+		if(started[i])
+		{
+			pdf_thread_join(&threads[i]);
+			PDF_STATS_WORKER_JOINED(&workers[i].stats);
+		}
+		else pdf_digest_worker_run(&workers[i]);
+	}
+	pdf_free(workers);
+	pdf_free(threads);
+	pdf_free(started);
+	return success;
+}
+
+// Sorts the hashed 'digests' and replaces the streams of each run of equal
+// hashes by the first of the run, once their bytes are checked to be the
+// same: their 'kept' is then the index of that first stream.
+static bool pdf_find_duplicate_streams(PdfStreamDigest* digests, size_t count)
+{
+	if(count > 0) qsort(digests, count, sizeof(PdfStreamDigest), pdf_compare_stream_digests);
+	for(size_t i = 0; i < count; ++i) digests[i].kept = (uint32_t)i;
+	PdfWriter kept_dictionary = {0};
+	PdfWriter dictionary = {0};
+	bool success = true;
+	for(size_t start = 0; start < count && success; )
+	{
+		size_t end = start + 1;
+		while(end < count && digests[end].hash == digests[start].hash) ++end;
+		size_t kept = start;
+		while(kept < end && !digests[kept].is_valid) ++kept;
+		PdfObject kept_obj;
+		uint8_t* kept_decrypted;
+		if(end - kept < 2 || !pdf_document_load_written_stream(digests[kept].doc, digests[kept].number, &kept_dictionary,
+															   &kept_obj, &kept_decrypted))
+		{
+			start = end;
+			continue;
+		}
+		for(size_t i = kept + 1; i < end; ++i)
+		{
+			PdfObject obj;
+			uint8_t* decrypted;
+			if(!digests[i].is_valid
+			   || !pdf_document_load_written_stream(digests[i].doc, digests[i].number, &dictionary, &obj, &decrypted))
+				continue;
+			// NOTE(Sam): A hash collision is unlikely, but it would silently
+			//            replace an image by another one. The same reference
+			//            in two documents (an /SMask) is not the same object.
+			if((digests[i].doc == digests[kept].doc || !digests[i].has_references)
+			   && dictionary.length == kept_dictionary.length && obj.stream_value.length == kept_obj.stream_value.length
+			   && memcmp(dictionary.buffer, kept_dictionary.buffer, dictionary.length) == 0
+			   && memcmp(obj.stream_value.data, kept_obj.stream_value.data, obj.stream_value.length) == 0)
+				digests[i].kept = (uint32_t)kept;
+			pdf_free(decrypted);
+			pdf_object_free(&obj);
+		}
+		success = !kept_dictionary.failed && !dictionary.failed;
+		pdf_free(kept_decrypted);
+		pdf_object_free(&kept_obj);
+		start = end;
+	}
+	pdf_writer_free(&kept_dictionary);
+	pdf_writer_free(&dictionary);
+	return success;
+}
+
+// Finds what an optimized save can leave out: the objects not reachable
+// from the trailer, and the streams identical to another one (dictionary
+// and data) which are written once and referenced by the others. Streams
+// are hashed on 'threads_count' threads, 0 meaning one per core. Free
+// 'out' with pdf_optimization_free.
+// NOTE(Sam): Streams only become identical after their own references
+//            are merged (an image and its /SMask) are not found.
+int pdf_document_optimize(PdfDocument* doc, size_t threads_count, PdfOptimization* out)
+{
+	memset(out, 0, sizeof(PdfOptimization));
+	// Workers read the xref concurrently, it must not change under them
+	if(!pdf_document_complete_xref(doc)) return PDF_ERROR_XREF;
+	if(threads_count == 0) threads_count = pdf_cpu_count();
+	size_t count = doc->next_object_number;
+
+	PdfReachability reach = {0};
+	reach.count = count;
+	reach.seen = (bool*)pdf_malloc(count*sizeof(bool));
+	out->replacements = (uint32_t*)pdf_malloc(count*sizeof(uint32_t));
+	out->count = count;
+	if(reach.seen == NULL || out->replacements == NULL)
+	{
+		pdf_free(reach.seen);
+		pdf_optimization_free(out);
+		return PDF_ERROR_MEMORY;
+	}
+	memset(reach.seen, 0, count*sizeof(bool));
+	memset(out->replacements, 0, count*sizeof(uint32_t));
+
+	// The trailer is the root, but for /Encrypt since a save is in clear
+	PdfName encrypt_name = pdf_name("Encrypt");
+	size_t slot = 0;
+	const PdfDictionary* trailer = &doc->trailer.dictionary_value;
+	for(PdfDictionaryBucket* bucket = pdf_dictionary_next(trailer, &slot, NULL);
+		bucket != NULL; bucket = pdf_dictionary_next(trailer, &slot, bucket))
+	{
+		if(!pdf_names_are_equals(bucket->key, encrypt_name)) pdf_reachability_visit(&reach, &bucket->object);
+	}
+
+	PdfStreamDigest* digests = NULL;
+	size_t digests_count = 0;
+	size_t digests_capacity = 0;
+	while(reach.stack_count > 0 && !reach.failed)
+	{
+		uint32_t number = reach.stack[--reach.stack_count];
+		PdfObject obj;
+		if(!pdf_document_get_object(doc, number, &obj)) continue;
+		if(obj.type == PDF_OBJECT_TYPE_STREAM)
+		{
+			if(digests_count == digests_capacity)
+			{
+				size_t capacity = digests_capacity > 0 ? 2*digests_capacity : 64;
+				PdfStreamDigest* grown = (PdfStreamDigest*)pdf_realloc(digests, capacity*sizeof(PdfStreamDigest));
+				if(grown == NULL) reach.failed = true;
+				else
+				{
+					digests = grown;
+					digests_capacity = capacity;
+				}
+			}
+			if(!reach.failed)
+			{
+				digests[digests_count].doc = doc;
+				digests[digests_count].number = number;
+				digests[digests_count].order = number;
+				++digests_count;
+			}
+		}
+		pdf_reachability_visit(&reach, &obj);
+		pdf_object_free(&obj);
+	}
+
+	bool success = !reach.failed;
+	for(size_t number = 1; success && number < count; ++number)
+	{
+		if(reach.seen[number]) continue;
+		out->replacements[number] = PDF_OPTIMIZE_DROPPED;
+		size_t index;
+		bool is_modified = pdf_document_find_modified(doc, (uint32_t)number, &index);
+		if(is_modified ? doc->modified[index].object.type != PDF_OBJECT_TYPE_NONE
+		   : number < doc->xref_count && (doc->xref[number].type == PDF_XREF_ENTRY_IN_USE
+										  || doc->xref[number].type == PDF_XREF_ENTRY_COMPRESSED))
+			out->unreachable_count += 1;
+	}
+
+	success = success && pdf_hash_streams(digests, digests_count, threads_count)
+		&& pdf_find_duplicate_streams(digests, digests_count);
+	for(size_t i = 0; success && i < digests_count; ++i)
+	{
+		if(digests[i].kept == i) continue;
+		out->replacements[digests[i].number] = digests[digests[i].kept].number;
+		out->duplicate_count += 1;
+		out->duplicate_bytes += digests[i].length;
+	}
+	pdf_free(digests);
+	pdf_free(reach.stack);
+	pdf_free(reach.seen);
+	if(!success)
+	{
+		pdf_optimization_free(out);
+		return PDF_ERROR_MEMORY;
+	}
+	return PDF_ERROR_NONE;
+}
+
+// Points the references of 'obj' to merged streams to the stream kept
+static void pdf_optimization_apply(PdfDocument* doc, const PdfOptimization* optimization, PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_REFERENCE:
+	{
+		uint32_t number = obj->reference_value.number;
+		if(number >= optimization->count) return;
+		uint32_t replacement = optimization->replacements[number];
+		if(replacement == 0 || replacement == PDF_OPTIMIZE_DROPPED) return;
+		obj->reference_value.number = replacement;
+		obj->reference_value.generation = pdf_document_object_generation(doc, replacement);
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		for(size_t i = 0; i < obj->array_value.length; ++i)
+			pdf_optimization_apply(doc, optimization, &obj->array_value.start[i]);
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		const PdfDictionary* dictionary = obj->type == PDF_OBJECT_TYPE_STREAM
+			? &obj->stream_value.dictionary : &obj->dictionary_value;
+		size_t slot = 0;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(dictionary, &slot, NULL);
+			bucket != NULL; bucket = pdf_dictionary_next(dictionary, &slot, bucket))
+			pdf_optimization_apply(doc, optimization, &bucket->object);
+	} break;
+	}
+}
+
+// Streams smaller than this are left uncompressed by an optimized save,
+// the filter entry would cost more than it saves
+#define PDF_OPTIMIZE_MIN_COMPRESSED_LENGTH 64
+
+// Compresses the data of the stream 'obj' with Flate when it has no filter
+// and it gets smaller, adding /Filter/FlateDecode to its dictionary. The
+// caller frees '*out_compressed' with pdf_free. XMP metadata is kept as
+// is, readers not knowing PDF look for it in clear.
+static bool pdf_optimize_compress_stream(PdfObject* obj, uint8_t** out_compressed)
+{
+	*out_compressed = NULL;
+	if(obj->type != PDF_OBJECT_TYPE_STREAM || obj->stream_value.length < PDF_OPTIMIZE_MIN_COMPRESSED_LENGTH) return true;
+	PdfDictionary* dictionary = &obj->stream_value.dictionary;
+	PdfObject type = pdf_dictionary_get(dictionary, pdf_name("Type"));
+	if(pdf_dictionary_get(dictionary, pdf_name("Filter")).type != PDF_OBJECT_TYPE_NONE
+	   || pdf_dictionary_get(dictionary, pdf_name("DecodeParms")).type != PDF_OBJECT_TYPE_NONE
+	   || pdf_dictionary_get(dictionary, pdf_name("F")).type != PDF_OBJECT_TYPE_NONE
+	   || (type.type == PDF_OBJECT_TYPE_NAME && pdf_names_are_equals(type.name_value, pdf_name("Metadata"))))
+		return true;
+
+	uint8_t* compressed;
+	size_t compressed_length;
+	if(!pdf_flate_encode(obj->stream_value.data, obj->stream_value.length, &compressed, &compressed_length))
+		return false;
+	// '/Filter/FlateDecode' takes 19 bytes
+	if(compressed_length + 19 >= obj->stream_value.length)
+	{
+		pdf_free(compressed);
+		return true;
+	}
+	PdfName key;
+	PdfObject value = {0};
+	value.type = PDF_OBJECT_TYPE_NAME;
+	if(!pdf_name_allocate("Filter", &key))
+	{
+		pdf_free(compressed);
+		return false;
+	}
+	if(!pdf_name_allocate("FlateDecode", &value.name_value) || !pdf_dictionary_insert(dictionary, key, value))
+	{
+		pdf_free(key.start);
+		pdf_free(value.name_value.start);
+		pdf_free(compressed);
+		return false;
+	}
+	obj->stream_value.data = compressed;
+	obj->stream_value.length = compressed_length;
+	*out_compressed = compressed;
+	return true;
+}
+
+// Objects of a full save with their xref entries, written as they come or
+// packed in object streams with PDF_SAVE_OBJECT_STREAMS
+typedef struct {
+	PdfWriter* writer;
+	int flags;
+	PdfXrefEntry* entries;	// By object number
+	uint32_t next_number;	// Of the next object stream, then of the xref stream
+	PdfWriter header;		// 'number offset' pairs of the object stream being filled
+	PdfWriter body;
+	size_t packed_count;
+	uint32_t stream_number;
+} PdfSaveWriter;
+
+// Keeps in 'version' ("1.4" by default) the version of the header of 'doc'
+// if it is newer
+void pdf_document_header_version(const PdfDocument* doc, char* version)
+{
+	if(doc->size >= 8 && memcmp(doc->data, "%PDF-", 5) == 0 && doc->data[5] >= '1' && doc->data[5] <= '9'
+	   && doc->data[6] == '.' && doc->data[7] >= '0' && doc->data[7] <= '9' && memcmp(doc->data + 5, version, 3) > 0)
+		memcpy(version, doc->data + 5, 3);
+}
+
+// Writes the file header, the objects written are numbered below 'count'
+bool pdf_save_writer_begin(PdfSaveWriter* save, PdfWriter* writer, int flags, size_t count, char* version)
+{
+	memset(save, 0, sizeof(PdfSaveWriter));
+	if(flags & PDF_SAVE_OBJECT_STREAMS) flags |= PDF_SAVE_XREF_STREAM;
+	save->writer = writer;
+	save->flags = flags;
+	save->next_number = (uint32_t)count;
+	// Room for the object streams and the xref stream numbered after the objects
+	size_t capacity = count + count/PDF_OBJECT_STREAM_MAX_OBJECTS + 2;
+	save->entries = (PdfXrefEntry*)pdf_malloc(capacity*sizeof(PdfXrefEntry));
+	if(save->entries == NULL) return false;
+	memset(save->entries, 0, capacity*sizeof(PdfXrefEntry));
+	save->entries[0].type = PDF_XREF_ENTRY_FREE;
+	save->entries[0].generation = 65535;
+
+	if(flags & PDF_SAVE_XREF_STREAM && strcmp(version, "1.5") < 0) memcpy(version, "1.5", 3);
+	pdf_write_bytes(writer, "%PDF-", 5);
+	pdf_write_bytes(writer, version, 3);
+	// A comment with high bytes tells transfer tools the file is binary
+	pdf_write_bytes(writer, "\n%\xE2\xE3\xCF\xD3\n", 7);
+	if(flags & PDF_SAVE_OBJECT_STREAMS)
+	{
+		pdf_writer_begin(&save->header, NULL, 0);
+		pdf_writer_begin(&save->body, NULL, 0);
+	}
+	return true;
+}
+
+void pdf_save_writer_add(PdfSaveWriter* save, uint32_t number, uint32_t generation, const PdfObject* obj)
+{
+	PdfXrefEntry* entry = &save->entries[number];
+	// Streams and objects with a generation can't be compressed
+	if(save->flags & PDF_SAVE_OBJECT_STREAMS && obj->type != PDF_OBJECT_TYPE_STREAM && generation == 0)
+	{
+		if(save->packed_count == 0) save->stream_number = save->next_number++;
+		entry->type = PDF_XREF_ENTRY_COMPRESSED;
+		entry->offset = save->stream_number;
+		entry->generation = (uint32_t)save->packed_count;
+		pdf_write_unsigned(&save->header, number);
+		pdf_write_bytes(&save->header, " ", 1);
+		pdf_write_unsigned(&save->header, save->body.length);
+		pdf_write_bytes(&save->header, " ", 1);
+		pdf_write_object(&save->body, obj);
+		pdf_write_bytes(&save->body, "\n", 1);
+		if(++save->packed_count == PDF_OBJECT_STREAM_MAX_OBJECTS)
+		{
+			save->entries[save->stream_number].type = PDF_XREF_ENTRY_IN_USE;
+			save->entries[save->stream_number].offset = save->writer->offset;
+			pdf_write_object_stream(save->writer, save->stream_number, &save->header, &save->body, save->packed_count);
+			save->packed_count = 0;
+		}
+	}
+	else
+	{
+		entry->type = PDF_XREF_ENTRY_IN_USE;
+		entry->offset = save->writer->offset;
+		entry->generation = generation;
+		pdf_write_indirect_object(save->writer, number, generation, obj);
+	}
+}
+
+// Writes the last object stream and the xref section, with the entries
+// of 'trailer' we keep. Returns a PDF_ERROR.
+int pdf_save_writer_end(PdfSaveWriter* save, const PdfDictionary* trailer)
+{
+	PdfWriter* writer = save->writer;
+	if(save->packed_count > 0)
+	{
+		save->entries[save->stream_number].type = PDF_XREF_ENTRY_IN_USE;
+		save->entries[save->stream_number].offset = writer->offset;
+		pdf_write_object_stream(writer, save->stream_number, &save->header, &save->body, save->packed_count);
+	}
+	pdf_writer_free(&save->header);
+	pdf_writer_free(&save->body);
+
+	uint32_t size = save->next_number;
+	if(save->flags & PDF_SAVE_XREF_STREAM)
+	{
+		uint32_t xref_number = size++;
+		save->entries[xref_number].type = PDF_XREF_ENTRY_IN_USE;
+		save->entries[xref_number].offset = writer->offset;
+		pdf_write_xref_stream(writer, trailer, xref_number, NULL, save->entries, size, size, NULL);
+	}
+	else pdf_write_xref_table(writer, trailer, NULL, save->entries, size, size, NULL);
+	pdf_free(save->entries);
+	save->entries = NULL;
+	return writer->failed ? PDF_ERROR_WRITE : PDF_ERROR_NONE;
+}
+
+// Whether 'obj' is an xref stream or an object stream, which a full save
+// rebuilds instead of copying them
+static bool pdf_save_is_rebuilt_stream(const PdfObject* obj)
+{
+	if(obj->type != PDF_OBJECT_TYPE_STREAM) return false;
+	PdfObject type = pdf_dictionary_get(&obj->stream_value.dictionary, pdf_name("Type"));
+	return type.type == PDF_OBJECT_TYPE_NAME && (pdf_names_are_equals(type.name_value, pdf_name("XRef"))
+												 || pdf_names_are_equals(type.name_value, pdf_name("ObjStm")));
+}
+
+// Writes the whole document (with its modifications) to 'writer', object
+// numbers are kept, but not the xref and object streams of the file.
+// Stream data is written as it is, without decoding. An encrypted
+// document is written in clear: its strings are decrypted when parsed
+// and the streams read from the file are decrypted here.
+// 'optimization' (from pdf_document_optimize) drops and merges objects
+// and compresses the streams without filter, it is NULL to write all of
+// them as they are.
+// NOTE(Sam): Modified streams are written as given, so a stream of the
+//            file set under another number stays encrypted.
+int pdf_document_write_optimized(PdfDocument* doc, PdfWriter* writer, int flags, const PdfOptimization* optimization)
+{
+	if(!pdf_document_complete_xref(doc)) return PDF_ERROR_XREF;
+	size_t count = doc->next_object_number;
+	// Keep the version of the original header unless we need a newer one
+	char version[4] = "1.4";
+	pdf_document_header_version(doc, version);
+	PdfSaveWriter save;
+	if(!pdf_save_writer_begin(&save, writer, flags, count, version)) return PDF_ERROR_MEMORY;
+
+	for(uint32_t number = 1; number < count && !writer->failed; ++number)
+	{
+		PdfObject obj;
+		bool is_dropped = optimization != NULL && number < optimization->count && optimization->replacements[number] != 0;
+		if(is_dropped || (doc->is_encrypted && number == doc->encryption.number)
+		   || !pdf_document_get_object(doc, number, &obj))
+		{
+			save.entries[number].type = PDF_XREF_ENTRY_FREE;
+			continue;
+		}
+		if(pdf_save_is_rebuilt_stream(&obj))
+		{
+			pdf_object_free(&obj);
+			save.entries[number].type = PDF_XREF_ENTRY_FREE;
+			continue;
+		}
+		uint32_t generation = pdf_document_object_generation(doc, number);
+		uint8_t* decrypted;
+		if(!pdf_document_decrypt_file_stream(doc, number, generation, &obj, &decrypted))
+		{
+			pdf_object_free(&obj);
+			writer->failed = true;
+			break;
+		}
+		uint8_t* compressed = NULL;
+		if(optimization != NULL)
+		{
+			pdf_optimization_apply(doc, optimization, &obj);
+			if(!pdf_optimize_compress_stream(&obj, &compressed)) writer->failed = true;
+		}
+		pdf_save_writer_add(&save, number, generation, &obj);
+		pdf_free(compressed);
+		pdf_free(decrypted);
+		pdf_object_free(&obj);
+	}
+	return pdf_save_writer_end(&save, &doc->trailer.dictionary_value);
+}
+
+// Writes the whole document, see pdf_document_write_optimized. With
+// PDF_SAVE_OPTIMIZE the objects to leave out are found on every core.
+int pdf_document_write(PdfDocument* doc, PdfWriter* writer, int flags)
+{
+	if(!(flags & PDF_SAVE_OPTIMIZE)) return pdf_document_write_optimized(doc, writer, flags, NULL);
+	PdfOptimization optimization;
+	int error = pdf_document_optimize(doc, 0, &optimization);
+	if(error) return error;
+	error = pdf_document_write_optimized(doc, writer, flags, &optimization);
+	pdf_optimization_free(&optimization);
+	return error;
+}
+
+// Saves the whole document in a new file, see pdf_document_write.
+int pdf_document_save(PdfDocument* doc, const char* filename, int flags)
+{
+	// The document data may be mapped from its file, it can't be rewritten in place
+	if(doc->filename != NULL && strcmp(filename, doc->filename) == 0) return PDF_ERROR_FILE;
+
+	#pragma warning (disable : 4996)
+	FILE* file = fopen(filename, "wb");
+	if(file == NULL) return PDF_ERROR_FILE;
+
+	PdfWriter writer = {0};
+	int error = PDF_ERROR_MEMORY;
+	if(pdf_writer_begin(&writer, file, 0))
+	{
+		error = pdf_document_write(doc, &writer, flags);
+		pdf_writer_flush(&writer);
+		if(writer.failed && !error) error = PDF_ERROR_WRITE;
+	}
+	pdf_writer_free(&writer);
+
+	if(fclose(file) != 0 && !error) error = PDF_ERROR_WRITE;
+	return error;
+}
+
+/*
+  PAGE ASSEMBLY:
+  - pdf_write_pages writes a new document made of page ranges of one or
+    more documents (split, extract, merge), without going through a
+    modified document.
+  - Each page brings the objects it reaches (contents, resources, fonts,
+    images, annotations...) but not the page tree, the catalog or the
+    other pages: references to those become null. Inherited attributes
+    are written in the page itself since its ancestors are left out.
+  - Objects are renumbered densely in the order they are reached, objects
+    of the same document reached from several pages are written once. A
+    page given twice is copied, its resources being shared.
+  - Stream data is written as it is in the input mapping, never decoded
+    nor compressed again (encrypted documents are written in clear, which
+    needs a decrypted copy). Identical streams (same dictionary and data)
+    of any of the inputs are written once, as pdf_document_optimize does.
+ */
+
+// Pages 'first' to 'first + count' (excluded, 0 based) of 'doc'
+typedef struct {
+	PdfDocument* doc;
+	size_t first;
+	size_t count;
+} PdfPageRange;
+
+// Map entry of the objects left out of the assembly
+#define PDF_ASSEMBLY_NULL UINT32_MAX
+
+// A document of the assembly: by object number 'map' is 0 while the object
+// was not reached, PDF_ASSEMBLY_NULL if it is left out and the index of the
+// object in the assembly + 1 otherwise
+typedef struct {
+	PdfDocument* doc;
+	uint32_t* map;
+	PdfReachability reach;
+} PdfAssemblySource;
+
+typedef struct {
+	PdfAssemblySource* source;
+	uint32_t number;		// In its document
+	uint32_t output;		// Number in the output
+	uint32_t kept;			// Index of the identical stream written instead, its own index if none
+	const PdfPage* page;	// If the object is a page of the assembly
+} PdfAssemblyObject;
+
+typedef struct {
+	PdfAssemblySource* sources;
+	size_t sources_count;
+	PdfAssemblyObject* objects;
+	size_t objects_count;
+	size_t objects_capacity;
+	PdfStreamDigest* digests;
+	size_t digests_count;
+	size_t digests_capacity;
+} PdfAssembly;
+
+static void pdf_assembly_free(PdfAssembly* assembly)
+{
+	for(size_t i = 0; i < assembly->sources_count; ++i)
+	{
+		pdf_free(assembly->sources[i].map);
+		pdf_free(assembly->sources[i].reach.seen);
+		pdf_free(assembly->sources[i].reach.stack);
+	}
+	pdf_free(assembly->sources);
+	pdf_free(assembly->objects);
+	pdf_free(assembly->digests);
+	memset(assembly, 0, sizeof(PdfAssembly));
+}
+
+// Finds the source of 'doc' in 'out_source', adding it with its maps if
+// it is new. Returns a PDF_ERROR.
+static int pdf_assembly_source(PdfAssembly* assembly, PdfDocument* doc, PdfAssemblySource** out_source)
+{
+	for(size_t i = 0; i < assembly->sources_count; ++i)
+	{
+		*out_source = &assembly->sources[i];
+		if(assembly->sources[i].doc == doc) return PDF_ERROR_NONE;
+	}
+
+	// Streams are hashed on several threads, the xref must not change under them
+	if(!pdf_document_complete_xref(doc)) return PDF_ERROR_XREF;
+	PdfAssemblySource* source = &assembly->sources[assembly->sources_count++];
+	memset(source, 0, sizeof(PdfAssemblySource));
+	size_t count = doc->next_object_number;
+	source->doc = doc;
+	source->reach.count = count;
+	source->map = (uint32_t*)pdf_malloc(count*sizeof(uint32_t));
+	source->reach.seen = (bool*)pdf_malloc(count*sizeof(bool));
+	if(source->map == NULL || source->reach.seen == NULL) return PDF_ERROR_MEMORY;
+	memset(source->map, 0, count*sizeof(uint32_t));
+	memset(source->reach.seen, 0, count*sizeof(bool));
+	*out_source = source;
+	return PDF_ERROR_NONE;
+}
+
+// Appends the object 'number' of 'source', false if out of memory
+static bool pdf_assembly_add(PdfAssembly* assembly, PdfAssemblySource* source, uint32_t number, const PdfPage* page)
+{
+	if(assembly->objects_count == assembly->objects_capacity)
+	{
+		size_t capacity = assembly->objects_capacity > 0 ? 2*assembly->objects_capacity : 256;
+		PdfAssemblyObject* objects = (PdfAssemblyObject*)pdf_realloc(assembly->objects, capacity*sizeof(PdfAssemblyObject));
+		if(objects == NULL) return false;
+		assembly->objects = objects;
+		assembly->objects_capacity = capacity;
+	}
+	// Room for the catalog and the page tree numbered before the objects
+	if(assembly->objects_count >= UINT32_MAX - 4) return false;
+	PdfAssemblyObject* obj = &assembly->objects[assembly->objects_count];
+	obj->source = source;
+	obj->number = number;
+	obj->output = 0;
+	obj->kept = (uint32_t)assembly->objects_count;
+	obj->page = page;
+	source->map[number] = (uint32_t)++assembly->objects_count;
+	return true;
+}
+
+static bool pdf_assembly_add_digest(PdfAssembly* assembly, PdfDocument* doc, uint32_t number)
+{
+	if(assembly->digests_count == assembly->digests_capacity)
+	{
+		size_t capacity = assembly->digests_capacity > 0 ? 2*assembly->digests_capacity : 64;
+		PdfStreamDigest* digests = (PdfStreamDigest*)pdf_realloc(assembly->digests, capacity*sizeof(PdfStreamDigest));
+		if(digests == NULL) return false;
+		assembly->digests = digests;
+		assembly->digests_capacity = capacity;
+	}
+	PdfStreamDigest* digest = &assembly->digests[assembly->digests_count++];
+	digest->doc = doc;
+	digest->number = number;
+	digest->order = (uint32_t)(assembly->objects_count - 1);
+	return true;
+}
+
+// True for the catalog and the nodes of the page tree, pages included
+static bool pdf_assembly_is_structure(const PdfObject* obj)
+{
+	if(obj->type != PDF_OBJECT_TYPE_DICTIONARY) return false;
+	PdfObject type = pdf_dictionary_get(&obj->dictionary_value, pdf_name("Type"));
+	if(type.type == PDF_OBJECT_TYPE_NAME && (pdf_names_are_equals(type.name_value, pdf_name("Page"))
+											 || pdf_names_are_equals(type.name_value, pdf_name("Catalog"))))
+		return true;
+	return pdf_page_node_is_tree(&obj->dictionary_value);
+}
+
+// Adds 'value' as 'key' to 'dictionary' unless it has it already. The
+// dictionary owns 'value' if it returns true.
+static bool pdf_assembly_set_default(PdfDictionary* dictionary, const char* key, PdfObject value)
+{
+	if(pdf_dictionary_get(dictionary, pdf_name(key)).type != PDF_OBJECT_TYPE_NONE) return false;
+	PdfName name;
+	if(!pdf_name_allocate(key, &name)) return false;
+	if(pdf_dictionary_insert(dictionary, name, value)) return true;
+	pdf_free(name.start);
+	return false;
+}
+
+static bool pdf_assembly_boxes_are_equal(const PdfObject* a, const PdfObject* b)
+{
+	if(a->type != PDF_OBJECT_TYPE_ARRAY || b->type != PDF_OBJECT_TYPE_ARRAY
+	   || a->array_value.length != b->array_value.length) return false;
+	for(size_t i = 0; i < a->array_value.length; ++i)
+	{
+		PdfObject x = a->array_value.start[i];
+		PdfObject y = b->array_value.start[i];
+		if(x.type != y.type) return false;
+		if(x.type == PDF_OBJECT_TYPE_INTEGER && x.int_value != y.int_value) return false;
+		if(x.type == PDF_OBJECT_TYPE_REAL && x.real_value != y.real_value) return false;
+		if(x.type != PDF_OBJECT_TYPE_INTEGER && x.type != PDF_OBJECT_TYPE_REAL) return false;
+	}
+	return true;
+}
+
+// Writes in the page dictionary 'obj' the attributes it inherits, the
+// crop box only when it differs from the media box. False if out of memory.
+static bool pdf_assembly_inherit(const PdfPage* page, PdfObject* obj)
+{
+	PdfDictionary* dictionary = &obj->dictionary_value;
+	PdfObject copy;
+	if(page->resources.type != PDF_OBJECT_TYPE_NONE
+	   && pdf_dictionary_get(dictionary, pdf_name("Resources")).type == PDF_OBJECT_TYPE_NONE)
+	{
+		if(!pdf_object_copy(&page->resources, &copy)) return false;
+		if(!pdf_assembly_set_default(dictionary, "Resources", copy))
+		{
+			pdf_object_free(&copy);
+			return false;
+		}
+	}
+	if(page->media_box.type != PDF_OBJECT_TYPE_NONE
+	   && pdf_dictionary_get(dictionary, pdf_name("MediaBox")).type == PDF_OBJECT_TYPE_NONE)
+	{
+		if(!pdf_object_copy(&page->media_box, &copy)) return false;
+		if(!pdf_assembly_set_default(dictionary, "MediaBox", copy))
+		{
+			pdf_object_free(&copy);
+			return false;
+		}
+	}
+	if(page->crop_box.type != PDF_OBJECT_TYPE_NONE && !pdf_assembly_boxes_are_equal(&page->crop_box, &page->media_box)
+	   && pdf_dictionary_get(dictionary, pdf_name("CropBox")).type == PDF_OBJECT_TYPE_NONE)
+	{
+		if(!pdf_object_copy(&page->crop_box, &copy)) return false;
+		if(!pdf_assembly_set_default(dictionary, "CropBox", copy))
+		{
+			pdf_object_free(&copy);
+			return false;
+		}
+	}
+	if(page->rotate != 0 && pdf_dictionary_get(dictionary, pdf_name("Rotate")).type == PDF_OBJECT_TYPE_NONE)
+	{
+		copy.type = PDF_OBJECT_TYPE_INTEGER;
+		copy.int_value = page->rotate;
+		if(!pdf_assembly_set_default(dictionary, "Rotate", copy)) return false;
+	}
+	return true;
+}
+
+// Loads the object 'index' of the assembly as it is written, but for its
+// references. The caller frees 'out_obj' and '*out_decrypted'.
+static bool pdf_assembly_load(PdfAssembly* assembly, size_t index, PdfObject* out_obj, uint8_t** out_decrypted)
+{
+	PdfAssemblyObject* obj = &assembly->objects[index];
+	PdfDocument* doc = obj->source->doc;
+	*out_decrypted = NULL;
+	if(!pdf_document_get_object(doc, obj->number, out_obj)) return false;
+	bool success = true;
+	if(obj->page != NULL)
+		success = out_obj->type == PDF_OBJECT_TYPE_DICTIONARY && pdf_assembly_inherit(obj->page, out_obj);
+	else
+		success = pdf_document_decrypt_file_stream(doc, obj->number, pdf_document_object_generation(doc, obj->number),
+												   out_obj, out_decrypted);
+	if(!success) pdf_object_free(out_obj);
+	return success;
+}
+
+// Adds the objects reached from the pages of 'source' and from the
+// objects already pushed. A page reaches everything but its /Parent.
+static bool pdf_assembly_walk(PdfAssembly* assembly, PdfAssemblySource* source)
+{
+	PdfReachability* reach = &source->reach;
+	PdfName parent_name = pdf_name("Parent");
+	for(size_t index = 0; index < assembly->objects_count; ++index)
+	{
+		if(assembly->objects[index].source != source || assembly->objects[index].page == NULL) continue;
+		PdfObject obj;
+		uint8_t* decrypted;
+		if(!pdf_assembly_load(assembly, index, &obj, &decrypted)) return false;
+		size_t slot = 0;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(&obj.dictionary_value, &slot, NULL);
+			bucket != NULL; bucket = pdf_dictionary_next(&obj.dictionary_value, &slot, bucket))
+		{
+			if(!pdf_names_are_equals(bucket->key, parent_name)) pdf_reachability_visit(reach, &bucket->object);
+		}
+		pdf_object_free(&obj);
+	}
+
+	while(reach->stack_count > 0 && !reach->failed)
+	{
+		uint32_t number = reach->stack[--reach->stack_count];
+		PdfObject obj;
+		if(!pdf_document_get_object(source->doc, number, &obj))
+		{
+			source->map[number] = PDF_ASSEMBLY_NULL;
+			continue;
+		}
+		bool success = true;
+		if(pdf_assembly_is_structure(&obj)) source->map[number] = PDF_ASSEMBLY_NULL;
+		else
+		{
+			success = pdf_assembly_add(assembly, source, number, NULL)
+				&& (obj.type != PDF_OBJECT_TYPE_STREAM || pdf_assembly_add_digest(assembly, source->doc, number));
+			pdf_reachability_visit(reach, &obj);
+		}
+		pdf_object_free(&obj);
+		if(!success) return false;
+	}
+	return !reach->failed;
+}
+
+// Points the references of 'obj' to their number in the output, null for
+// the objects left out
+static void pdf_assembly_apply(const PdfAssembly* assembly, const PdfAssemblySource* source, PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_REFERENCE:
+	{
+		uint32_t number = obj->reference_value.number;
+		uint32_t index = number < source->reach.count ? source->map[number] : 0;
+		if(index == 0 || index == PDF_ASSEMBLY_NULL) obj->type = PDF_OBJECT_TYPE_NULL;
+		else
+		{
+			obj->reference_value.number = assembly->objects[index - 1].output;
+			obj->reference_value.generation = 0;
+		}
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		for(size_t i = 0; i < obj->array_value.length; ++i)
+			pdf_assembly_apply(assembly, source, &obj->array_value.start[i]);
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		const PdfDictionary* dictionary = obj->type == PDF_OBJECT_TYPE_STREAM
+			? &obj->stream_value.dictionary : &obj->dictionary_value;
+		size_t slot = 0;
+		for(PdfDictionaryBucket* bucket = pdf_dictionary_next(dictionary, &slot, NULL);
+			bucket != NULL; bucket = pdf_dictionary_next(dictionary, &slot, bucket))
+			pdf_assembly_apply(assembly, source, &bucket->object);
+	} break;
+	}
+}
+
+// Finds the objects of the assembly and their output numbers: 1 is the
+// catalog, 2 the page tree and the objects follow. Returns a PDF_ERROR.
+static int pdf_assembly_build(PdfAssembly* assembly, const PdfPageRange* ranges, size_t ranges_count,
+							  size_t* out_pages_count)
+{
+	assembly->sources = (PdfAssemblySource*)pdf_malloc((ranges_count > 0 ? ranges_count : 1)*sizeof(PdfAssemblySource));
+	if(assembly->sources == NULL) return PDF_ERROR_MEMORY;
+
+	// Pages first, in the order of the ranges, so that they are the first
+	// objects of the assembly and the kids of the page tree
+	size_t pages_count = 0;
+	for(size_t i = 0; i < ranges_count; ++i)
+	{
+		PdfAssemblySource* source;
+		int error = pdf_assembly_source(assembly, ranges[i].doc, &source);
+		if(error) return error;
+		for(size_t p = ranges[i].first; p < ranges[i].first + ranges[i].count; ++p)
+		{
+			const PdfPage* page = pdf_document_get_page(ranges[i].doc, p);
+			// No such page, or a broken page tree
+			if(page == NULL || page->number >= source->reach.count) return PDF_ERROR_XREF;
+			// A page given twice is written twice, references to it going to the first copy
+			uint32_t first_copy = source->map[page->number];
+			source->reach.seen[page->number] = true;
+			if(!pdf_assembly_add(assembly, source, page->number, page)) return PDF_ERROR_MEMORY;
+			if(first_copy != 0) source->map[page->number] = first_copy;
+			pages_count += 1;
+		}
+	}
+
+	// The /Info of the first document is kept, with what it reaches
+	if(ranges_count > 0)
+	{
+		PdfAssemblySource* source = &assembly->sources[0];
+		PdfObject info = pdf_dictionary_get(&source->doc->trailer.dictionary_value, pdf_name("Info"));
+		if(info.type == PDF_OBJECT_TYPE_REFERENCE) pdf_reachability_visit(&source->reach, &info);
+	}
+	for(size_t i = 0; i < assembly->sources_count; ++i)
+	{
+		if(!pdf_assembly_walk(assembly, &assembly->sources[i])) return PDF_ERROR_MEMORY;
+	}
+
+	PdfStreamDigest* digests = assembly->digests;
+	if(!pdf_hash_streams(digests, assembly->digests_count, pdf_cpu_count())
+	   || !pdf_find_duplicate_streams(digests, assembly->digests_count))
+		return PDF_ERROR_MEMORY;
+	for(size_t i = 0; i < assembly->digests_count; ++i)
+		assembly->objects[digests[i].order].kept = digests[digests[i].kept].order;
+
+	// A duplicate comes after the stream kept for it
+	uint32_t next_number = 3;
+	for(size_t i = 0; i < assembly->objects_count; ++i)
+	{
+		PdfAssemblyObject* obj = &assembly->objects[i];
+		obj->output = obj->kept == i ? next_number++ : assembly->objects[obj->kept].output;
+	}
+	*out_pages_count = pages_count;
+	return PDF_ERROR_NONE;
+}
+
+// Builds the catalog and the page tree of the assembly in 'out_catalog'
+// and 'out_tree', false if out of memory
+static bool pdf_assembly_build_tree(size_t pages_count, PdfObject* out_catalog, PdfObject* out_tree)
+{
+	memset(out_catalog, 0, sizeof(PdfObject));
+	memset(out_tree, 0, sizeof(PdfObject));
+	out_catalog->type = PDF_OBJECT_TYPE_DICTIONARY;
+	out_tree->type = PDF_OBJECT_TYPE_DICTIONARY;
+	if(!pdf_dictionary_reserve(&out_catalog->dictionary_value, pdf_dictionary_slots_for(2))
+	   || !pdf_dictionary_reserve(&out_tree->dictionary_value, pdf_dictionary_slots_for(3)))
+		return false;
+
+	PdfObject value = {0};
+	value.type = PDF_OBJECT_TYPE_NAME;
+	if(!pdf_name_allocate("Catalog", &value.name_value)) return false;
+	if(!pdf_assembly_set_default(&out_catalog->dictionary_value, "Type", value))
+	{
+		pdf_object_free(&value);
+		return false;
+	}
+	value.type = PDF_OBJECT_TYPE_NAME;
+	if(!pdf_name_allocate("Pages", &value.name_value)) return false;
+	if(!pdf_assembly_set_default(&out_tree->dictionary_value, "Type", value))
+	{
+		pdf_object_free(&value);
+		return false;
+	}
+	value.type = PDF_OBJECT_TYPE_REFERENCE;
+	value.reference_value.number = 2;
+	value.reference_value.generation = 0;
+	if(!pdf_assembly_set_default(&out_catalog->dictionary_value, "Pages", value)) return false;
+	value.type = PDF_OBJECT_TYPE_INTEGER;
+	value.int_value = (PDF_INTEGER_TYPE)pages_count;
+	if(!pdf_assembly_set_default(&out_tree->dictionary_value, "Count", value)) return false;
+
+	// The pages are the first objects, numbered from 3
+	value.type = PDF_OBJECT_TYPE_ARRAY;
+	value.array_value.length = pages_count;
+	value.array_value.start = (PdfObject*)pdf_malloc((pages_count > 0 ? pages_count : 1)*sizeof(PdfObject));
+	if(value.array_value.start == NULL) return false;
+	for(size_t i = 0; i < pages_count; ++i)
+	{
+		memset(&value.array_value.start[i], 0, sizeof(PdfObject));
+		value.array_value.start[i].type = PDF_OBJECT_TYPE_REFERENCE;
+		value.array_value.start[i].reference_value.number = (uint32_t)(3 + i);
+	}
+	if(!pdf_assembly_set_default(&out_tree->dictionary_value, "Kids", value))
+	{
+		pdf_object_free(&value);
+		return false;
+	}
+	return true;
+}
+
+// Writes to 'writer' a new document made of the pages of 'ranges', in
+// order, with the /Info of the first document (see PAGE ASSEMBLY). Only
+// PDF_SAVE_XREF_STREAM and PDF_SAVE_OBJECT_STREAMS are used in 'flags'.
+// Returns a PDF_ERROR, PDF_ERROR_XREF if a range goes past the last page.
+int pdf_write_pages(PdfWriter* writer, const PdfPageRange* ranges, size_t ranges_count, int flags)
+{
+	PdfAssembly assembly = {0};
+	size_t pages_count = 0;
+	int error = pdf_assembly_build(&assembly, ranges, ranges_count, &pages_count);
+	PdfObject catalog, tree;
+	if(!error && !pdf_assembly_build_tree(pages_count, &catalog, &tree)) error = PDF_ERROR_MEMORY;
+	if(error)
+	{
+		pdf_assembly_free(&assembly);
+		return error;
+	}
+
+	size_t count = 3;
+	char version[4] = "1.4";
+	for(size_t i = 0; i < assembly.objects_count; ++i)
+		if(assembly.objects[i].kept == i) ++count;
+	for(size_t i = 0; i < assembly.sources_count; ++i)
+		pdf_document_header_version(assembly.sources[i].doc, version);
+	PdfSaveWriter save;
+	if(!pdf_save_writer_begin(&save, writer, flags & (PDF_SAVE_XREF_STREAM | PDF_SAVE_OBJECT_STREAMS), count, version))
+		error = PDF_ERROR_MEMORY;
+	if(!error)
+	{
+		pdf_save_writer_add(&save, 1, 0, &catalog);
+		pdf_save_writer_add(&save, 2, 0, &tree);
+	}
+
+	for(size_t i = 0; !error && i < assembly.objects_count && !writer->failed; ++i)
+	{
+		PdfAssemblyObject* obj = &assembly.objects[i];
+		if(obj->kept != i) continue;
+		PdfObject value;
+		uint8_t* decrypted;
+		if(!pdf_assembly_load(&assembly, i, &value, &decrypted))
+		{
+			writer->failed = true;
+			break;
+		}
+		pdf_assembly_apply(&assembly, obj->source, &value);
+		if(obj->page != NULL)
+		{
+			PdfObject parent = {0};
+			parent.type = PDF_OBJECT_TYPE_REFERENCE;
+			parent.reference_value.number = 2;
+			PdfName name;
+			if(!pdf_name_allocate("Parent", &name)) writer->failed = true;
+			else if(!pdf_dictionary_insert(&value.dictionary_value, name, parent))
+			{
+				pdf_free(name.start);
+				writer->failed = true;
+			}
+		}
+		pdf_save_writer_add(&save, obj->output, 0, &value);
+		pdf_free(decrypted);
+		pdf_object_free(&value);
+	}
+
+	if(!error)
+	{
+		// The trailer of the output, built like the catalog
+		PdfObject trailer = {0};
+		trailer.type = PDF_OBJECT_TYPE_DICTIONARY;
+		PdfObject value = {0};
+		value.type = PDF_OBJECT_TYPE_REFERENCE;
+		value.reference_value.number = 1;
+		if(!pdf_dictionary_reserve(&trailer.dictionary_value, pdf_dictionary_slots_for(2))
+		   || !pdf_assembly_set_default(&trailer.dictionary_value, "Root", value))
+			writer->failed = true;
+		if(assembly.sources_count > 0)
+			value = pdf_dictionary_get(&assembly.sources[0].doc->trailer.dictionary_value, pdf_name("Info"));
+		if(assembly.sources_count > 0 && value.type == PDF_OBJECT_TYPE_REFERENCE)
+		{
+			pdf_assembly_apply(&assembly, &assembly.sources[0], &value);
+			if(value.type == PDF_OBJECT_TYPE_REFERENCE && !pdf_assembly_set_default(&trailer.dictionary_value, "Info", value))
+				writer->failed = true;
+		}
+		error = pdf_save_writer_end(&save, &trailer.dictionary_value);
+		pdf_object_free(&trailer);
+	}
+	pdf_object_free(&catalog);
+	pdf_object_free(&tree);
+	pdf_assembly_free(&assembly);
+	return error;
+}
+
+// Saves the pages of 'ranges' in a new file, see pdf_write_pages
+int pdf_save_pages(const char* filename, const PdfPageRange* ranges, size_t ranges_count, int flags)
+{
+	// The inputs may be mapped from their file, none can be rewritten in place
+	for(size_t i = 0; i < ranges_count; ++i)
+	{
+		if(ranges[i].doc->filename != NULL && strcmp(filename, ranges[i].doc->filename) == 0) return PDF_ERROR_FILE;
+	}
+
+	#pragma warning (disable : 4996)
+	FILE* file = fopen(filename, "wb");
+	if(file == NULL) return PDF_ERROR_FILE;
+
+	PdfWriter writer = {0};
+	int error = PDF_ERROR_MEMORY;
+	if(pdf_writer_begin(&writer, file, 0))
+	{
+		error = pdf_write_pages(&writer, ranges, ranges_count, flags);
+		pdf_writer_flush(&writer);
+		if(writer.failed && !error) error = PDF_ERROR_WRITE;
+	}
+	pdf_writer_free(&writer);
+
+	if(fclose(file) != 0 && !error) error = PDF_ERROR_WRITE;
+	return error;
+}
+
+/*
+  SIDECAR INDEX:
+  - What an open reads from a document (the merged xref, the revisions
+    and their trailers), the headers of its object streams and its page
+    index are saved in a file next to it. The next open maps that file and
+    uses it in place instead of parsing the xref and walking the tree.
+  - The index is bound to the document by its size, its modification time
+    and a hash of its first and last PDF_INDEX_HASHED_BYTES: they hold the
+    header, the linearization dictionary, the last xref and trailer, and
+    any appended update, so we don't read the whole file to check it.
+  - A checksum of the index itself catches partial writes. The index is
+    written next to its final name then renamed, readers see either the
+    previous index or the new one.
+ */
+
+#define PDF_INDEX_MAGIC "PDFINDEX"
+#define PDF_INDEX_VERSION 1
+#define PDF_INDEX_BYTE_ORDER 0x01020304u
+#define PDF_INDEX_HASHED_BYTES (64*1024)
+
+uint64_t pdf_document_content_hash(const PdfDocument* doc)
+{
+	size_t head = doc->size < PDF_INDEX_HASHED_BYTES ? doc->size : PDF_INDEX_HASHED_BYTES;
+	uint64_t hash = pdf_hash_bytes(doc->data, head, (uint64_t)doc->size);
+	size_t tail = doc->size - head < PDF_INDEX_HASHED_BYTES ? doc->size - head : PDF_INDEX_HASHED_BYTES;
+	return pdf_hash_bytes(doc->data + doc->size - tail, tail, hash);
+}
+
+// Pads the output with zeros up to the next multiple of 8 bytes
+void pdf_index_align(PdfWriter* writer)
+{
+	static const uint8_t zeros[8] = {0};
+	pdf_write_bytes(writer, zeros, (size_t)((8 - writer->offset % 8) % 8));
+}
+
+PdfIndexSection pdf_index_write_object(PdfWriter* writer, const PdfObject* obj)
+{
+	PdfIndexSection section = {writer->offset, 0};
+	pdf_write_object(writer, obj);
+	section.count = writer->offset - section.offset;
+	pdf_index_align(writer);
+	return section;
+}
+
+PdfIndexSection pdf_index_write_entries(PdfWriter* writer, const PdfXrefEntry* entries, size_t count)
+{
+	PdfIndexSection section = {writer->offset, count};
+	for(size_t i = 0; i < count; ++i)
+	{
+		PdfIndexXrefEntry entry = {entries[i].offset, entries[i].generation, entries[i].type};
+		pdf_write_bytes(writer, &entry, sizeof(PdfIndexXrefEntry));
+	}
+	return section;
+}
+
+// Writes the whole index in memory, the header comes first
+bool pdf_document_write_index(PdfDocument* doc, PdfWriter* writer)
+{
+	PdfIndexHeader header;
+	memset(&header, 0, sizeof(PdfIndexHeader));
+	memcpy(header.magic, PDF_INDEX_MAGIC, sizeof(header.magic));
+	header.version = PDF_INDEX_VERSION;
+	header.byte_order = PDF_INDEX_BYTE_ORDER;
+	header.file_size = doc->size;
+	header.file_mtime = doc->file.mtime;
+	header.file_hash = pdf_document_content_hash(doc);
+	header.next_object_number = doc->next_object_number;
+	header.was_repaired = doc->was_repaired;
+	pdf_write_bytes(writer, &header, sizeof(PdfIndexHeader));
+
+	header.xref = pdf_index_write_entries(writer, doc->xref, doc->xref_count);
+	header.trailer = pdf_index_write_object(writer, &doc->trailer);
+
+	PdfIndexRevision* revisions = (PdfIndexRevision*)pdf_malloc((doc->revisions_count + 1)*sizeof(PdfIndexRevision));
+	if(revisions == NULL) return false;
+	memset(revisions, 0, (doc->revisions_count + 1)*sizeof(PdfIndexRevision));
+	for(size_t i = 0; i < doc->revisions_count; ++i)
+	{
+		const PdfRevision* revision = &doc->revisions[i];
+		revisions[i].xref_offset = revision->xref_offset;
+		revisions[i].end_offset = revision->end_offset;
+		revisions[i].is_xref_stream = revision->is_xref_stream;
+		revisions[i].trailer = pdf_index_write_object(writer, &revision->trailer);
+		revisions[i].entries = pdf_index_write_entries(writer, revision->entries, revision->entries_count);
+		pdf_write_bytes(writer, revision->numbers, revision->entries_count*sizeof(uint32_t));
+		pdf_index_align(writer);
+	}
+	header.revisions.offset = writer->offset;
+	header.revisions.count = doc->revisions_count;
+	pdf_write_bytes(writer, revisions, doc->revisions_count*sizeof(PdfIndexRevision));
+	pdf_free(revisions);
+
+	// Every object stream is decoded once to store its header
+	size_t streams_count = 0;
+	for(size_t i = 0; i < doc->xref_count; ++i)
+	{
+		if(doc->xref[i].type != PDF_XREF_ENTRY_COMPRESSED || doc->xref[i].offset >= doc->xref_count) continue;
+		// Streams the budget did not let the document keep are left out
+		bool must_free;
+		PdfObjectStream* stream = pdf_document_get_object_stream(doc, (uint32_t)doc->xref[i].offset, &must_free);
+		if(must_free) pdf_object_stream_free(stream);
+	}
+	for(size_t i = 0; doc->object_streams != NULL && i < doc->xref_count; ++i)
+		streams_count += doc->object_streams[i] != NULL;
+	PdfIndexObjectStream* streams = (PdfIndexObjectStream*)pdf_malloc((streams_count + 1)*sizeof(PdfIndexObjectStream));
+	if(streams == NULL) return false;
+	streams_count = 0;
+	for(size_t i = 0; doc->object_streams != NULL && i < doc->xref_count; ++i)
+	{
+		const PdfObjectStream* stream = (const PdfObjectStream*)doc->object_streams[i];
+		if(stream == NULL) continue;
+		PdfIndexObjectStream* record = &streams[streams_count++];
+		record->number = (uint32_t)i;
+		record->count = stream->count;
+		record->offset = writer->offset;
+		for(uint32_t j = 0; j <= stream->count; ++j)
+		{
+			uint64_t offset = stream->offsets[j];
+			pdf_write_bytes(writer, &offset, sizeof(uint64_t));
+		}
+		pdf_write_bytes(writer, stream->numbers, stream->count*sizeof(uint32_t));
+		pdf_index_align(writer);
+	}
+	header.object_streams.offset = writer->offset;
+	header.object_streams.count = streams_count;
+	pdf_write_bytes(writer, streams, streams_count*sizeof(PdfIndexObjectStream));
+	pdf_free(streams);
+
+	// Failing to build the page index is fine, the tree is walked on use
+	size_t pages_count = pdf_document_build_page_index(doc, 0) ? doc->pages_count : 0;
+	PdfIndexPage* pages = (PdfIndexPage*)pdf_malloc((pages_count + 1)*sizeof(PdfIndexPage));
+	if(pages == NULL) return false;
+	memset(pages, 0, (pages_count + 1)*sizeof(PdfIndexPage));
+	for(size_t i = 0; i < pages_count; ++i)
+	{
+		const PdfPage* page = &doc->pages[i];
+		pages[i].number = page->number;
+		pages[i].generation = page->generation;
+		pages[i].rotate = page->rotate;
+		pages[i].attributes.offset = writer->offset;
+		pdf_write_object(writer, &page->resources);
+		pdf_write_bytes(writer, " ", 1);
+		pdf_write_object(writer, &page->media_box);
+		pdf_write_bytes(writer, " ", 1);
+		pdf_write_object(writer, &page->crop_box);
+		pages[i].attributes.count = writer->offset - pages[i].attributes.offset;
+		pdf_index_align(writer);
+	}
+	header.pages.offset = writer->offset;
+	header.pages.count = pages_count;
+	pdf_write_bytes(writer, pages, pages_count*sizeof(PdfIndexPage));
+	pdf_free(pages);
+	if(writer->failed) return false;
+
+	const size_t checked = offsetof(PdfIndexHeader, size);
+	header.size = writer->offset;
+	memcpy(writer->buffer, &header, sizeof(PdfIndexHeader));
+	header.checksum = pdf_hash_bytes(writer->buffer + checked, writer->length - checked, 0);
+	memcpy(writer->buffer, &header, sizeof(PdfIndexHeader));
+	return true;
+}
+
+// Writes the sidecar index of 'doc' in 'index_filename'. The document must
+// be opened from its file and not modified, the index describes the file.
+int pdf_document_save_index(PdfDocument* doc, const char* index_filename)
+{
+	if(doc->filename == NULL || doc->modified_count > 0) return PDF_ERROR_FILE;
+	if(!pdf_document_complete_xref(doc)) return PDF_ERROR_XREF;
+
+	PdfWriter writer = {0};
+	if(!pdf_writer_begin(&writer, NULL, 0) || !pdf_document_write_index(doc, &writer))
+	{
+		pdf_writer_free(&writer);
+		return PDF_ERROR_MEMORY;
+	}
+
+	size_t filename_len = strlen(index_filename);
+	char* temporary = (char*)pdf_malloc(filename_len + 5);
+	if(temporary == NULL)
+	{
+		pdf_writer_free(&writer);
+		return PDF_ERROR_MEMORY;
+	}
+	memcpy(temporary, index_filename, filename_len);
+	memcpy(temporary + filename_len, ".tmp", 5);
+
+	#pragma warning (disable : 4996)
+	FILE* file = fopen(temporary, "wb");
+	int error = file == NULL ? PDF_ERROR_FILE : PDF_ERROR_NONE;
+	if(file != NULL)
+	{
+		if(fwrite(writer.buffer, 1, writer.length, file) != writer.length) error = PDF_ERROR_WRITE;
+		if(fclose(file) != 0) error = PDF_ERROR_WRITE;
+#ifdef _WIN32
+		// NOTE(Sam): rename does not replace an existing file on Windows
+		if(!error) remove(index_filename);
+#endif
+		if(!error && rename(temporary, index_filename) != 0) error = PDF_ERROR_WRITE;
+		if(error) remove(temporary);
+	}
+	pdf_free(temporary);
+	pdf_writer_free(&writer);
+	return error;
+}
+
+// Checks 'section' holds 'count' items of 'item_size' bytes in the index
+bool pdf_index_section_is_valid(const PdfFile* index, PdfIndexSection section, size_t item_size)
+{
+	return section.offset % 8 == 0 && section.offset <= index->size
+		&& section.count <= (index->size - section.offset)/item_size;
+}
+
+bool pdf_index_read_object(const PdfFile* index, PdfIndexSection section, PdfObject* out_obj)
+{
+	size_t pos = (size_t)section.offset;
+	if(!pdf_index_section_is_valid(index, section, 1)
+	   || !pdf_parse_object(index->data, &pos, (size_t)(section.offset + section.count), out_obj)) return false;
+	if(out_obj->type == PDF_OBJECT_TYPE_NULL) out_obj->type = PDF_OBJECT_TYPE_NONE;
+	return true;
+}
+
+bool pdf_index_read_entries(const PdfFile* index, PdfIndexSection section, PdfXrefEntry* out_entries)
+{
+	if(!pdf_index_section_is_valid(index, section, sizeof(PdfIndexXrefEntry))) return false;
+	const PdfIndexXrefEntry* entries = (const PdfIndexXrefEntry*)(index->data + section.offset);
+	for(size_t i = 0; i < section.count; ++i)
+	{
+		if(entries[i].type > PDF_XREF_ENTRY_COMPRESSED) return false;
+		out_entries[i].offset = entries[i].offset;
+		out_entries[i].generation = entries[i].generation;
+		out_entries[i].type = (uint8_t)entries[i].type;
+	}
+	return true;
+}
+
+// Reads the revisions from the index, 'doc->revisions' is already allocated
+bool pdf_document_read_indexed_revisions(PdfDocument* doc)
+{
+	const PdfFile* index = &doc->index_file;
+	const PdfIndexRevision* records = (const PdfIndexRevision*)(index->data + doc->index->revisions.offset);
+	for(size_t i = 0; i < doc->revisions_count; ++i)
+	{
+		PdfRevision* revision = &doc->revisions[i];
+		PdfIndexSection entries = records[i].entries;
+		revision->xref_offset = records[i].xref_offset;
+		revision->end_offset = records[i].end_offset;
+		revision->is_xref_stream = records[i].is_xref_stream != 0;
+		if(!pdf_index_read_object(index, records[i].trailer, &revision->trailer)
+		   || !pdf_index_section_is_valid(index, entries, sizeof(PdfIndexXrefEntry) + sizeof(uint32_t)))
+			return false;
+		if(entries.count == 0) continue;
+		revision->entries = (PdfXrefEntry*)pdf_malloc((size_t)entries.count*sizeof(PdfXrefEntry));
+		revision->numbers = (uint32_t*)pdf_malloc((size_t)entries.count*sizeof(uint32_t));
+		if(revision->entries == NULL || revision->numbers == NULL) return false;
+		revision->entries_count = (size_t)entries.count;
+		if(!pdf_index_read_entries(index, entries, revision->entries)) return false;
+		memcpy(revision->numbers, index->data + entries.offset + entries.count*sizeof(PdfIndexXrefEntry),
+			   (size_t)entries.count*sizeof(uint32_t));
+	}
+	return true;
+}
+
+// Opens the sidecar index of a mapped document and takes its xref from it.
+// Returns false if the index is missing, damaged or for another version of
+// the file, nothing is kept then.
+bool pdf_document_load_index(PdfDocument* doc, const char* index_filename)
+{
+	if(!pdf_file_open(index_filename, &doc->index_file)) return false;
+	const PdfFile* index = &doc->index_file;
+	const PdfIndexHeader* header = (const PdfIndexHeader*)index->data;
+	const size_t checked = offsetof(PdfIndexHeader, size);
+	bool is_valid = index->size >= sizeof(PdfIndexHeader) && memcmp(header->magic, PDF_INDEX_MAGIC, 8) == 0
+		&& header->version == PDF_INDEX_VERSION && header->byte_order == PDF_INDEX_BYTE_ORDER
+		&& header->size == index->size && header->file_size == doc->size && header->file_mtime == doc->file.mtime
+		&& header->xref.count <= PDF_MAX_OBJECT_NUMBER + 1
+		&& header->next_object_number <= PDF_MAX_OBJECT_NUMBER + 1
+		&& pdf_index_section_is_valid(index, header->revisions, sizeof(PdfIndexRevision))
+		&& pdf_index_section_is_valid(index, header->object_streams, sizeof(PdfIndexObjectStream))
+		&& pdf_index_section_is_valid(index, header->pages, sizeof(PdfIndexPage))
+		&& header->checksum == pdf_hash_bytes(index->data + checked, index->size - checked, 0)
+		&& header->file_hash == pdf_document_content_hash(doc);
+	if(!is_valid)
+	{
+		pdf_file_close(&doc->index_file);
+		return false;
+	}
+	doc->index = header;
+
+	doc->xref_count = (size_t)header->xref.count;
+	doc->xref = (PdfXrefEntry*)pdf_malloc((doc->xref_count + 1)*sizeof(PdfXrefEntry));
+	doc->revisions_count = (size_t)header->revisions.count;
+	doc->revisions = (PdfRevision*)pdf_malloc((doc->revisions_count + 1)*sizeof(PdfRevision));
+	if(doc->revisions != NULL) memset(doc->revisions, 0, (doc->revisions_count + 1)*sizeof(PdfRevision));
+	is_valid = doc->xref != NULL && doc->revisions != NULL
+		&& pdf_index_read_entries(index, header->xref, doc->xref)
+		&& pdf_index_read_object(index, header->trailer, &doc->trailer)
+		&& doc->trailer.type == PDF_OBJECT_TYPE_DICTIONARY
+		&& pdf_document_read_indexed_revisions(doc);
+	if(!is_valid)
+	{
+		if(doc->revisions == NULL) doc->revisions_count = 0;
+		pdf_document_reset_xref(doc);
+		pdf_file_close(&doc->index_file);
+		doc->index = NULL;
+		return false;
+	}
+
+	doc->next_object_number = (uint32_t)header->next_object_number;
+	doc->was_repaired = header->was_repaired != 0;
+	doc->has_index_pages = header->pages.count > 0;
+	pdf_document_read_linearization(doc);
+	return true;
+}
+
+const PdfIndexObjectStream* pdf_document_find_indexed_object_stream(const PdfDocument* doc, uint32_t number)
+{
+	if(doc->index == NULL) return NULL;
+	const PdfFile* index = &doc->index_file;
+	const PdfIndexObjectStream* streams = (const PdfIndexObjectStream*)(index->data + doc->index->object_streams.offset);
+	size_t low = 0, high = (size_t)doc->index->object_streams.count;
+	while(low < high)
+	{
+		size_t middle = low + (high - low)/2;
+		if(streams[middle].number < number) low = middle + 1;
+		else high = middle;
+	}
+	if(low == doc->index->object_streams.count || streams[low].number != number) return NULL;
+	// 'count' + 1 offsets and 'count' numbers
+	uint64_t offset = streams[low].offset, count = streams[low].count;
+	bool is_valid = offset % 8 == 0 && offset <= index->size
+		&& (count + 1)*sizeof(uint64_t) + count*sizeof(uint32_t) <= index->size - offset;
+	return is_valid ? &streams[low] : NULL;
+}
+
+// Fills the page index from the sidecar index, only tried once
+bool pdf_document_read_indexed_pages(PdfDocument* doc)
+{
+	doc->has_index_pages = false;
+	const PdfFile* index = &doc->index_file;
+	const PdfIndexPage* records = (const PdfIndexPage*)(index->data + doc->index->pages.offset);
+	size_t count = (size_t)doc->index->pages.count;
+	PdfPage* pages = (PdfPage*)pdf_malloc(count*sizeof(PdfPage));
+	if(pages == NULL) return false;
+	memset(pages, 0, count*sizeof(PdfPage));
+
+	size_t read = 0;
+	for(; read < count; ++read)
+	{
+		PdfIndexSection section = records[read].attributes;
+		if(records[read].number >= doc->xref_count || !pdf_index_section_is_valid(index, section, 1)) break;
+		size_t pos = (size_t)section.offset;
+		size_t end = (size_t)(section.offset + section.count);
+		PdfObject* values[3] = {&pages[read].resources, &pages[read].media_box, &pages[read].crop_box};
+		bool success = true;
+		for(int i = 0; i < 3 && success; ++i)
+		{
+			pdf_skip_white_spaces_and_comments(index->data, &pos, end);
+			success = pdf_parse_object(index->data, &pos, end, values[i]);
+			if(success && values[i]->type == PDF_OBJECT_TYPE_NULL) values[i]->type = PDF_OBJECT_TYPE_NONE;
+		}
+		pages[read].number = records[read].number;
+		pages[read].generation = records[read].generation;
+		pages[read].rotate = records[read].rotate;
+		if(!success)
+		{
+			pdf_page_free(&pages[read]);
+			break;
+		}
+	}
+	if(read < count)
+	{
+		for(size_t i = 0; i < read; ++i) pdf_page_free(&pages[i]);
+		pdf_free(pages);
+		return false;
+	}
+	doc->pages = pages;
+	doc->pages_count = count;
+	doc->has_page_index = true;
+	return true;
+}
+
+// Opens a document with its sidecar index 'index_filename' when the index
+// matches the file, otherwise opens it as usual and writes the index for
+// the next time.
+int pdf_document_open_indexed(PdfDocument* doc, const char* filename, const char* index_filename, int flags)
+{
+	int error = pdf_document_open_file(doc, filename);
+	if(error) return error;
+	doc->open_flags = flags;
+	if(!(flags & PDF_OPEN_FORCE_REPAIR) && pdf_document_load_index(doc, index_filename))
+	{
+		error = pdf_document_load_encryption(doc);
+		if(error) pdf_document_close(doc);
+		return error;
+	}
+
+	error = pdf_document_load(doc, flags);
+	if(error)
+	{
+		pdf_document_close(doc);
+		return error;
+	}
+	// A first page open is meant to stay cheap, it does not build the index
+	if(!doc->has_partial_xref) pdf_document_save_index(doc, index_filename);
+	return PDF_ERROR_NONE;
+}
+
+/*
+  JSON EXPORT:
+  - Objects map to JSON values: names are strings starting with '/',
+    references are "N G R" strings and streams are an object holding their
+    dictionary and the length of their raw data.
+  - PDF strings are bytes, those out of ASCII are escaped as \u00XX so the
+    output is valid JSON whatever the string encoding.
+  - Strings are mostly plain text: they are copied 16 bytes at a time (SSE2)
+    up to the next byte to escape, only that one goes through the switch.
+ */
+
+#define PDF_JSON_STRING_CHUNK 4096
+
+void pdf_write_json_string(PdfWriter* writer, const uint8_t* str, size_t length)
+{
+	static const char hex[] = "0123456789abcdef";
+	pdf_write_bytes(writer, "\"", 1);
+	for(size_t start = 0; start < length; start += PDF_JSON_STRING_CHUNK)
+	{
+		size_t end = length - start > PDF_JSON_STRING_CHUNK ? start + PDF_JSON_STRING_CHUNK : length;
+		// Worst case every byte becomes \u00XX
+		uint8_t* out = pdf_writer_reserve(writer, 6*(end - start));
+		if(out == NULL) return;
+		uint8_t* cursor = out;
+		for(size_t i = start; i < end; ++i)
+		{
+#ifdef PDF_USE_SSE2
+			// Signed compare, bytes from 0x80 are below 0x20 too
+			const __m128i control = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7F);
+			const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+			while(i + 16 <= end)
+			{
+				__m128i bytes = _mm_loadu_si128((const __m128i*)(str + i));
+				__m128i special = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(bytes, control), _mm_cmpeq_epi8(bytes, del)),
+											   _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)));
+				uint32_t mask = (uint32_t)_mm_movemask_epi8(special);
+				// NOTE(Sam): Room was reserved for 6 bytes per input byte, the
+				//            whole block always fits even if only its start is kept.
+				_mm_storeu_si128((__m128i*)cursor, bytes);
+				size_t plain = mask ? pdf_count_trailing_zeros(mask) : 16;
+				i += plain;
+				cursor += plain;
+				if(mask) break;
+			}
+			if(i == end) break;
+#endif
+			uint8_t c = str[i];
+			if(c >= 0x20 && c < 0x7F && c != '"' && c != '\\')
+			{
+				*cursor++ = c;
+				continue;
+			}
+			*cursor++ = '\\';
+			switch(c)
+			{
+			case '"': *cursor++ = '"'; break;
+			case '\\': *cursor++ = '\\'; break;
+			case '\n': *cursor++ = 'n'; break;
+			case '\r': *cursor++ = 'r'; break;
+			case '\t': *cursor++ = 't'; break;
+			default:
+			{
+				memcpy(cursor, "u00", 3);
+				cursor[3] = (uint8_t)hex[c >> 4];
+				cursor[4] = (uint8_t)hex[c & 0xF];
+				cursor += 5;
+			} break;
+			}
+		}
+		pdf_writer_commit(writer, (size_t)(cursor - out));
+	}
+	pdf_write_bytes(writer, "\"", 1);
+}
+
+void pdf_write_json_object(PdfWriter* writer, const PdfObject* obj);
+
+void pdf_write_json_dictionary(PdfWriter* writer, const PdfDictionary* dictionary)
+{
+	pdf_write_bytes(writer, "{", 1);
+	size_t slot = 0;
+	bool is_first = true;
+	for(PdfDictionaryBucket* bucket = pdf_dictionary_next(dictionary, &slot, NULL);
+		bucket != NULL; bucket = pdf_dictionary_next(dictionary, &slot, bucket))
+	{
+		if(!is_first) pdf_write_bytes(writer, ",", 1);
+		is_first = false;
+		pdf_write_json_string(writer, (const uint8_t*)bucket->key.start, bucket->key.length);
+		pdf_write_bytes(writer, ":", 1);
+		pdf_write_json_object(writer, &bucket->object);
+	}
+	pdf_write_bytes(writer, "}", 1);
+}
+
+void pdf_write_json_object(PdfWriter* writer, const PdfObject* obj)
+{
+	switch(obj->type)
+	{
+	case PDF_OBJECT_TYPE_BOOLEAN:
+	{
+		if(obj->bool_value) pdf_write_bytes(writer, "true", 4);
+		else pdf_write_bytes(writer, "false", 5);
+	} break;
+	case PDF_OBJECT_TYPE_INTEGER:
+	{
+		pdf_write_integer(writer, (int64_t)obj->int_value);
+	} break;
+	case PDF_OBJECT_TYPE_REAL:
+	{
+		pdf_write_real(writer, obj->real_value);
+	} break;
+	case PDF_OBJECT_TYPE_STRING:
+	{
+		pdf_write_json_string(writer, (const uint8_t*)obj->string_value.start, obj->string_value.length);
+	} break;
+	case PDF_OBJECT_TYPE_NAME:
+	{
+		// Names are short, the slash is added in a copy
+		uint8_t tmp[128];
+		if(obj->name_value.length < sizeof(tmp))
+		{
+			tmp[0] = '/';
+			memcpy(tmp + 1, obj->name_value.start, obj->name_value.length);
+			pdf_write_json_string(writer, tmp, obj->name_value.length + 1);
+		}
+		else pdf_write_json_string(writer, (const uint8_t*)obj->name_value.start, obj->name_value.length);
+	} break;
+	case PDF_OBJECT_TYPE_ARRAY:
+	{
+		pdf_write_bytes(writer, "[", 1);
+		for(size_t i = 0; i < obj->array_value.length; ++i)
+		{
+			if(i > 0) pdf_write_bytes(writer, ",", 1);
+			pdf_write_json_object(writer, &obj->array_value.start[i]);
+		}
+		pdf_write_bytes(writer, "]", 1);
+	} break;
+	case PDF_OBJECT_TYPE_DICTIONARY:
+	{
+		pdf_write_json_dictionary(writer, &obj->dictionary_value);
+	} break;
+	case PDF_OBJECT_TYPE_STREAM:
+	{
+		pdf_write_bytes(writer, "{\"stream\":", 10);
+		pdf_write_json_dictionary(writer, &obj->stream_value.dictionary);
+		pdf_write_bytes(writer, ",\"length\":", 10);
+		pdf_write_unsigned(writer, obj->stream_value.length);
+		pdf_write_bytes(writer, "}", 1);
+	} break;
+	case PDF_OBJECT_TYPE_REFERENCE:
+	{
+		pdf_write_bytes(writer, "\"", 1);
+		pdf_write_reference(writer, obj->reference_value.number, obj->reference_value.generation);
+		pdf_write_bytes(writer, "\"", 1);
+	} break;
+	default:
+	{
+		pdf_write_bytes(writer, "null", 4);
+	} break;
+	}
+}
+
+// Writes every object of the document that can be read as one JSON object
+// keyed by object number
+void pdf_document_write_json_objects(PdfDocument* doc, PdfWriter* writer)
+{
+	pdf_write_bytes(writer, "{", 1);
+	bool is_first = true;
+	for(size_t i = 1; i < doc->xref_count && !writer->failed; ++i)
+	{
+		PdfObject obj;
+		if(!pdf_document_get_object(doc, (uint32_t)i, &obj)) continue;
+		if(!is_first) pdf_write_bytes(writer, ",", 1);
+		pdf_write_bytes(writer, "\"", 1);
+		pdf_write_unsigned(writer, i);
+		pdf_write_bytes(writer, "\":", 2);
+		pdf_write_json_object(writer, &obj);
+		pdf_object_free(&obj);
+		is_first = false;
+	}
+	pdf_write_bytes(writer, "}", 1);
+}
+
+/*
+  TEXT STRINGS:
+  - Text strings (document information, outline titles, annotation
+    contents...) are in UTF-16BE when they start with the bytes FE FF, in
+    UTF-8 when they start with EF BB BF (PDF 2.0), and in PDFDocEncoding
+    otherwise, a superset of ASCII read through a table.
+  - Runs of printable ASCII are converted 16 bytes (8 UTF-16 units) at a
+    time with SSE2, only the other characters go through the table and
+    pdf_utf8_encode.
+  - The UTF-8 is written in place, in room sized for the worst case, so
+    decoding with an arena in use takes the text straight from it.
+  - The language escapes of Unicode strings (ESC code ESC) are dropped, the
+    bytes of UTF-8 strings are kept as they are.
+ */
+
+// Code points of PDFDocEncoding (Annex D.3), U+FFFD for the undefined codes
+static const uint16_t pdf_doc_encoding[256] = {
+	0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007, 0x0008, 0x0009, 0x000a, 0x000b, 0x000c, 0x000d, 0x000e, 0x000f,
+	0x0010, 0x0011, 0x0012, 0x0013, 0x0014, 0x0015, 0x0016, 0x0017, 0x02d8, 0x02c7, 0x02c6, 0x02d9, 0x02dd, 0x02db, 0x02da, 0x02dc,
+	0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027, 0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+	0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+	0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047, 0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+	0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005a, 0x005b, 0x005c, 0x005d, 0x005e, 0x005f,
+	0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+	0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077, 0x0078, 0x0079, 0x007a, 0x007b, 0x007c, 0x007d, 0x007e, 0xfffd,
+	0x2022, 0x2020, 0x2021, 0x2026, 0x2014, 0x2013, 0x0192, 0x2044, 0x2039, 0x203a, 0x2212, 0x2030, 0x201e, 0x201c, 0x201d, 0x2018,
+	0x2019, 0x201a, 0x2122, 0xfb01, 0xfb02, 0x0141, 0x0152, 0x0160, 0x0178, 0x017d, 0x0131, 0x0142, 0x0153, 0x0161, 0x017e, 0xfffd,
+	0x20ac, 0x00a1, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a6, 0x00a7, 0x00a8, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0xfffd, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b7, 0x00b8, 0x00b9, 0x00ba, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7, 0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7, 0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7, 0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7, 0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff,
+};
+
+// Most bytes of UTF-8 a text string of 'length' bytes can give
+size_t pdf_text_string_utf8_bound(size_t length)
+{
+	return 3*length;
+}
+
+static size_t pdf_doc_encoding_to_utf8(const uint8_t* data, size_t length, uint8_t* out)
+{
+	uint8_t* cursor = out;
+	size_t i = 0;
+	while(i < length)
+	{
+#ifdef PDF_USE_SSE2
+		// Signed compare, bytes from 0x80 are below 0x20 too
+		const __m128i space = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7F);
+		while(i + 16 <= length)
+		{
+			__m128i bytes = _mm_loadu_si128((const __m128i*)(data + i));
+			uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(bytes, space),
+																	   _mm_cmpeq_epi8(bytes, del)));
+			// NOTE(Sam): There is room for 3 bytes per input byte, the whole
+			//            block always fits even if only its start is kept.
+			_mm_storeu_si128((__m128i*)cursor, bytes);
+			size_t plain = mask ? pdf_count_trailing_zeros(mask) : 16;
+			i += plain;
+			cursor += plain;
+			if(mask) break;
+		}
+		if(i == length) break;
+#endif
+		cursor += pdf_utf8_encode(pdf_doc_encoding[data[i++]], cursor);
+	}
+	return (size_t)(cursor - out);
+}
+
+static size_t pdf_utf16be_to_utf8(const uint8_t* data, size_t length, uint8_t* out)
+{
+	uint8_t* cursor = out;
+	size_t i = 0;
+	while(i + 1 < length)
+	{
+#ifdef PDF_USE_SSE2
+		// Signed compare, units from 0x8000 are below 0x20 too
+		const __m128i space = _mm_set1_epi16(0x20), tilde = _mm_set1_epi16(0x7E);
+		while(i + 16 <= length)
+		{
+			__m128i units = _mm_loadu_si128((const __m128i*)(data + i));
+			// Big endian units to the little endian lanes
+			units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+			uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi16(units, space),
+																	   _mm_cmpgt_epi16(units, tilde)));
+			_mm_storel_epi64((__m128i*)cursor, _mm_packus_epi16(units, units));
+			size_t plain = mask ? pdf_count_trailing_zeros(mask)/2 : 8;
+			i += 2*plain;
+			cursor += plain;
+			if(mask) break;
+		}
+		if(i + 1 >= length) break;
+#endif
+		uint32_t code_point = (uint32_t)data[i] << 8 | data[i+1];
+		i += 2;
+		if(code_point == 0x1B)
+		{
+			while(i + 1 < length && !(data[i] == 0 && data[i+1] == 0x1B)) i += 2;
+			i += 2;
+			continue;
+		}
+		if(code_point >= 0xD800 && code_point < 0xDC00 && i + 1 < length)
+		{
+			uint32_t low = (uint32_t)data[i] << 8 | data[i+1];
+			if(low >= 0xDC00 && low < 0xE000)
+			{
+				code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+				i += 2;
+			}
+		}
+		// Lonely surrogates become U+FFFD
+		cursor += pdf_utf8_encode(code_point, cursor);
+	}
+	return (size_t)(cursor - out);
+}
+
+static size_t pdf_utf8_text_copy(const uint8_t* data, size_t length, uint8_t* out)
+{
+	uint8_t* cursor = out;
+	size_t i = 0;
+	while(i < length)
+	{
+		const uint8_t* escape = (const uint8_t*)memchr(data + i, 0x1B, length - i);
+		size_t end = escape != NULL ? (size_t)(escape - data) : length;
+		memcpy(cursor, data + i, end - i);
+		cursor += end - i;
+		if(escape == NULL) break;
+		const uint8_t* close = (const uint8_t*)memchr(escape + 1, 0x1B, length - end - 1);
+		i = close != NULL ? (size_t)(close - data) + 1 : length;
+	}
+	return (size_t)(cursor - out);
+}
+
+// Converts the text string 'data' to UTF-8 in 'out', which has room for
+// pdf_text_string_utf8_bound(length) bytes. Returns the length written.
+size_t pdf_text_string_to_utf8(const uint8_t* data, size_t length, uint8_t* out)
+{
+	if(length >= 2 && data[0] == 0xFE && data[1] == 0xFF)
+		return pdf_utf16be_to_utf8(data + 2, length - 2, out);
+	if(length >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF)
+		return pdf_utf8_text_copy(data + 3, length - 3, out);
+	return pdf_doc_encoding_to_utf8(data, length, out);
+}
+
+void pdf_write_text_string(PdfWriter* writer, const PdfString* string)
+{
+	uint8_t* out = pdf_writer_reserve(writer, pdf_text_string_utf8_bound(string->length));
+	if(out == NULL) return;
+	pdf_writer_commit(writer, pdf_text_string_to_utf8((const uint8_t*)string->start, string->length, out));
+}
+
+// The text of 'string' in UTF-8, zero terminated and allocated with
+// pdf_malloc (so in the arena in use, if any). False if out of memory.
+bool pdf_string_decode_text(const PdfString* string, PdfString* out_text)
+{
+	if(string->length >= SIZE_MAX/4) return false;
+	size_t bound = pdf_text_string_utf8_bound(string->length);
+	char* text = (char*)pdf_malloc(bound + 1);
+	if(text == NULL) return false;
+	size_t length = pdf_text_string_to_utf8((const uint8_t*)string->start, string->length, (uint8_t*)text);
+	text[length] = '\0';
+	// Heap blocks give back what the worst case did not need, arena
+	// blocks keep their size class anyway
+	if(length + 1 < bound/2)
+	{
+		char* shrunk = (char*)pdf_realloc(text, length + 1);
+		if(shrunk != NULL) text = shrunk;
+	}
+	out_text->start = text;
+	out_text->length = length;
+	return true;
+}
+
+/*
+  METADATA:
+  - A catalog of documents needs the /Info strings, the XMP packet of the
+    catalog /Metadata and the page count, nothing else. PDF_OPEN_METADATA
+    reads the trailers of the xref chain but leaves the entries of classic
+    xref tables in the file, the entry of an object is read at its place in
+    its subsection when the object is loaded (20 bytes per entry). Xref
+    streams are compressed, they are read entirely.
+  - pdf_document_read_metadata then loads the /Info dictionary, the catalog,
+    its /Metadata stream and the root of the page tree, whose /Count is the
+    number of pages. The only other objects ever parsed are /Encrypt and
+    indirect values of those (a /Length, a /Title...).
+  - The document stays usable for anything else: the whole xref is read
+    the first time something needs it, like for PDF_OPEN_FIRST_PAGE.
+ */
+
+enum PDF_INFO_KEYS {
+	PDF_INFO_TITLE,
+	PDF_INFO_AUTHOR,
+	PDF_INFO_SUBJECT,
+	PDF_INFO_KEYWORDS,
+	PDF_INFO_CREATOR,
+	PDF_INFO_PRODUCER,
+	PDF_INFO_CREATION_DATE,
+	PDF_INFO_MOD_DATE,
+	PDF_INFO_COUNT,
+};
+
+static const char* pdf_info_key_names[PDF_INFO_COUNT] = {
+	"Title", "Author", "Subject", "Keywords", "Creator", "Producer", "CreationDate", "ModDate",
+};
+
+typedef struct {
+	// /Info entries decoded to UTF-8 (dates as written), NULL when absent
+	PdfString info[PDF_INFO_COUNT];
+	// Decoded /Metadata stream of the catalog, NULL when absent
+	uint8_t* xmp;
+	size_t xmp_length;
+	// /Count of the root of the page tree, -1 when unknown
+	int64_t pages_count;
+} PdfMetadata;
+
+void pdf_metadata_free(PdfMetadata* metadata)
+{
+	for(size_t i = 0; i < PDF_INFO_COUNT; ++i) pdf_free(metadata->info[i].start);
+	pdf_free(metadata->xmp);
+	memset(metadata, 0, sizeof(PdfMetadata));
+	metadata->pages_count = -1;
+}
+
+// Loads the object 'reference' points to, if it is one, in 'out_obj'
+static bool pdf_metadata_load(PdfDocument* doc, PdfObject reference, PdfObject* out_obj)
+{
+	out_obj->type = PDF_OBJECT_TYPE_NONE;
+	if(reference.type != PDF_OBJECT_TYPE_REFERENCE) return false;
+	return pdf_document_get_object(doc, reference.reference_value.number, out_obj);
+}
+
+static bool pdf_metadata_read_info(PdfDocument* doc, PdfMetadata* metadata)
+{
+	PdfObject info_ref = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Info"));
+	PdfObject info;
+	if(!pdf_metadata_load(doc, info_ref, &info)) return true;
+	bool success = true;
+	for(size_t i = 0; success && i < PDF_INFO_COUNT && info.type == PDF_OBJECT_TYPE_DICTIONARY; ++i)
+	{
+		PdfObject value = pdf_dictionary_get(&info.dictionary_value, pdf_name(pdf_info_key_names[i]));
+		PdfObject loaded = {.type = PDF_OBJECT_TYPE_NONE};
+		if(value.type == PDF_OBJECT_TYPE_REFERENCE && pdf_metadata_load(doc, value, &loaded)) value = loaded;
+		if(value.type == PDF_OBJECT_TYPE_STRING)
+			success = pdf_string_decode_text(&value.string_value, &metadata->info[i]);
+		pdf_object_free(&loaded);
+	}
+	pdf_object_free(&info);
+	return success;
+}
+
+// Reads what PDF_OPEN_METADATA opens a document for in 'out_metadata',
+// which must be freed with pdf_metadata_free. Missing or broken parts are
+// left empty, false is only returned when a string could not be decoded
+// for lack of memory.
+bool pdf_document_read_metadata(PdfDocument* doc, PdfMetadata* out_metadata)
+{
+	memset(out_metadata, 0, sizeof(PdfMetadata));
+	out_metadata->pages_count = -1;
+	bool success = pdf_metadata_read_info(doc, out_metadata);
+
+	PdfObject catalog;
+	if(!pdf_metadata_load(doc, pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Root")), &catalog))
+		return success;
+	if(catalog.type == PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		PdfObject metadata_ref = pdf_dictionary_get(&catalog.dictionary_value, pdf_name("Metadata"));
+		PdfObject metadata;
+		if(pdf_metadata_load(doc, metadata_ref, &metadata) && metadata.type == PDF_OBJECT_TYPE_STREAM)
+		{
+			uint32_t number = metadata_ref.reference_value.number;
+			uint32_t generation = number < doc->xref_count ? doc->xref[number].generation : 0;
+			// A stream we can't decode is left out, 'xmp' stays NULL
+			pdf_document_decode_stream(doc, number, generation, &metadata.stream_value, &out_metadata->xmp,
+									   &out_metadata->xmp_length);
+		}
+		pdf_object_free(&metadata);
+
+		// The root of the page tree counts the pages of the whole tree
+		PdfObject pages;
+		if(pdf_metadata_load(doc, pdf_dictionary_get(&catalog.dictionary_value, pdf_name("Pages")), &pages)
+		   && pages.type == PDF_OBJECT_TYPE_DICTIONARY)
+		{
+			PdfObject count = pdf_dictionary_get(&pages.dictionary_value, pdf_name("Count"));
+			PdfObject loaded = {.type = PDF_OBJECT_TYPE_NONE};
+			if(count.type == PDF_OBJECT_TYPE_REFERENCE && pdf_metadata_load(doc, count, &loaded)) count = loaded;
+			if(count.type == PDF_OBJECT_TYPE_INTEGER && count.int_value >= 0) out_metadata->pages_count = count.int_value;
+			pdf_object_free(&loaded);
+		}
+		pdf_object_free(&pages);
+	}
+	pdf_object_free(&catalog);
+	return success;
+}
+
+/*
+  FONTS:
+  - Text is shown as codes of the current font. A /ToUnicode CMap maps them
+    to Unicode, simple fonts without one map them through their /Encoding:
+    a base encoding changed by /Differences, whose glyph names give the
+    code points.
+  - Both become a PdfCMap: a table for the one byte codes and sorted ranges
+    for the others. Only the mappings are read from a CMap, the PostScript
+    around them is skipped.
+  - Documents from the same producer embed the same CMaps and encodings
+    again and again, so they are kept in a process-wide cache keyed by a
+    hash of their decoded bytes: a document still decodes and hashes the
+    stream, but the CMap is parsed once per process.
+  - The cache has a budget in bytes and evicts the least recently used
+    entries. Entries are reference counted, an evicted one lives until the
+    last document using it is closed.
+  - Each document remembers the decoder of its font objects, a font used
+    on every page is looked up once.
+ */
+
+// Default memory budget of the font cache, see pdf_font_cache_set_budget
+#define PDF_FONT_CACHE_DEFAULT_BUDGET ((size_t)64 << 20)
+#define PDF_FONT_CACHE_BUCKETS 1024
+
+// Code points a single code can map to (ligatures, decompositions)
+#define PDF_CMAP_MAX_DESTINATION 32
+
+enum PDF_CMAP_KINDS {
+	PDF_CMAP_TO_UNICODE = 1,	// Parsed from a /ToUnicode stream
+	PDF_CMAP_ENCODING,			// Built from the /Encoding of a simple font
+};
+
+// Codes from 'low' to 'high', on 'code_length' bytes in big endian, mapped
+// to the 'unicode_length' code points at 'unicode', the last code point
+// growing with the code.
+typedef struct {
+	uint32_t low;
+	uint32_t high;
+	uint32_t unicode;		// Index in PdfCMap.unicode
+	uint16_t unicode_length;
+	uint8_t code_length;
+} PdfCMapRange;
+
+typedef struct PdfCMap {
+	// Cache entry, guarded by the mutex of the cache
+	int kind;
+	uint64_t hash;			// Of the bytes it was built from
+	size_t source_length;
+	size_t size;			// Memory used, counted in the budget
+	uint32_t references;	// The cache holds one while the entry is in it
+	bool is_cached;
+	struct PdfCMap* next_in_bucket;
+	struct PdfCMap* newer;
+	struct PdfCMap* older;
+
+	uint8_t code_lengths[256];	// Bytes of a code, by its first byte
+	uint32_t single[256];		// One byte codes mapped to one code point, 0 otherwise
+	PdfCMapRange* ranges;		// Sorted by code length then low code
+	size_t ranges_count;
+	size_t ranges_capacity;
+	uint32_t* unicode;
+	size_t unicode_count;
+	size_t unicode_capacity;
+} PdfCMap;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+	size_t bytes;
+	size_t budget;
+} PdfFontCacheStats;
+
+typedef struct {
+	PdfMutex mutex;
+	PdfCMap* buckets[PDF_FONT_CACHE_BUCKETS];
+	PdfCMap* newest;
+	PdfCMap* oldest;
+	PdfFontCacheStats stats;
+} PdfFontCache;
+
+// Created by the first thread needing it, lives as long as the process
+static void* volatile pdf_font_cache;
+
+// Remembered by documents for fonts whose codes can't be mapped, simple
+// and composite ones
+static PdfCMap pdf_cmap_none;
+static PdfCMap pdf_cmap_none_composite;
+
+typedef struct {
+	const char* name;
+	uint16_t unicode;
+} PdfGlyphName;
+
+// Glyph names of the usual Latin fonts, sorted for a binary search. Other
+// names are only understood in the uniXXXX and uXXXX[XX] forms.
+static const PdfGlyphName pdf_glyph_names[] = {
+	{"A", 0x0041}, {"AE", 0x00c6}, {"Aacute", 0x00c1}, {"Acircumflex", 0x00c2}, {"Adieresis", 0x00c4},
+	{"Agrave", 0x00c0}, {"Aogonek", 0x0104}, {"Aring", 0x00c5}, {"Atilde", 0x00c3}, {"B", 0x0042},
+	{"C", 0x0043}, {"Cacute", 0x0106}, {"Ccaron", 0x010c}, {"Ccedilla", 0x00c7}, {"D", 0x0044},
+	{"Dcaron", 0x010e}, {"Delta", 0x2206}, {"E", 0x0045}, {"Eacute", 0x00c9}, {"Ecaron", 0x011a},
+	{"Ecircumflex", 0x00ca}, {"Edieresis", 0x00cb}, {"Egrave", 0x00c8}, {"Eogonek", 0x0118}, {"Eth", 0x00d0},
+	{"Euro", 0x20ac}, {"F", 0x0046}, {"G", 0x0047}, {"Gbreve", 0x011e}, {"H", 0x0048}, {"I", 0x0049},
+	{"Iacute", 0x00cd}, {"Icircumflex", 0x00ce}, {"Idieresis", 0x00cf}, {"Idotaccent", 0x0130},
+	{"Igrave", 0x00cc}, {"J", 0x004a}, {"K", 0x004b}, {"L", 0x004c}, {"Lslash", 0x0141}, {"M", 0x004d},
+	{"N", 0x004e}, {"Nacute", 0x0143}, {"Ncaron", 0x0147}, {"Ntilde", 0x00d1}, {"O", 0x004f}, {"OE", 0x0152},
+	{"Oacute", 0x00d3}, {"Ocircumflex", 0x00d4}, {"Odieresis", 0x00d6}, {"Ograve", 0x00d2},
+	{"Ohungarumlaut", 0x0150}, {"Omega", 0x2126}, {"Oslash", 0x00d8}, {"Otilde", 0x00d5}, {"P", 0x0050},
+	{"Q", 0x0051}, {"R", 0x0052}, {"Rcaron", 0x0158}, {"S", 0x0053}, {"Sacute", 0x015a}, {"Scaron", 0x0160},
+	{"Scedilla", 0x015e}, {"T", 0x0054}, {"Tcaron", 0x0164}, {"Thorn", 0x00de}, {"U", 0x0055},
+	{"Uacute", 0x00da}, {"Ucircumflex", 0x00db}, {"Udieresis", 0x00dc}, {"Ugrave", 0x00d9},
+	{"Uhungarumlaut", 0x0170}, {"Uring", 0x016e}, {"V", 0x0056}, {"W", 0x0057}, {"X", 0x0058}, {"Y", 0x0059},
+	{"Yacute", 0x00dd}, {"Ydieresis", 0x0178}, {"Z", 0x005a}, {"Zacute", 0x0179}, {"Zcaron", 0x017d},
+	{"Zdotaccent", 0x017b}, {"a", 0x0061}, {"aacute", 0x00e1}, {"acircumflex", 0x00e2}, {"acute", 0x00b4},
+	{"adieresis", 0x00e4}, {"ae", 0x00e6}, {"agrave", 0x00e0}, {"ampersand", 0x0026}, {"aogonek", 0x0105},
+	{"apple", 0xf8ff}, {"approxequal", 0x2248}, {"aring", 0x00e5}, {"arrowdown", 0x2193}, {"arrowleft", 0x2190},
+	{"arrowright", 0x2192}, {"arrowup", 0x2191}, {"asciicircum", 0x005e}, {"asciitilde", 0x007e},
+	{"asterisk", 0x002a}, {"at", 0x0040}, {"atilde", 0x00e3}, {"b", 0x0062}, {"backslash", 0x005c},
+	{"bar", 0x007c}, {"braceleft", 0x007b}, {"braceright", 0x007d}, {"bracketleft", 0x005b},
+	{"bracketright", 0x005d}, {"breve", 0x02d8}, {"brokenbar", 0x00a6}, {"bullet", 0x2022}, {"c", 0x0063},
+	{"cacute", 0x0107}, {"caron", 0x02c7}, {"ccaron", 0x010d}, {"ccedilla", 0x00e7}, {"cedilla", 0x00b8},
+	{"cent", 0x00a2}, {"checkmark", 0x2713}, {"circumflex", 0x02c6}, {"colon", 0x003a}, {"comma", 0x002c},
+	{"copyright", 0x00a9}, {"currency", 0x00a4}, {"d", 0x0064}, {"dagger", 0x2020}, {"daggerdbl", 0x2021},
+	{"dcaron", 0x010f}, {"degree", 0x00b0}, {"dieresis", 0x00a8}, {"divide", 0x00f7}, {"dollar", 0x0024},
+	{"dotaccent", 0x02d9}, {"dotlessi", 0x0131}, {"e", 0x0065}, {"eacute", 0x00e9}, {"ecaron", 0x011b},
+	{"ecircumflex", 0x00ea}, {"edieresis", 0x00eb}, {"egrave", 0x00e8}, {"eight", 0x0038}, {"ellipsis", 0x2026},
+	{"emdash", 0x2014}, {"endash", 0x2013}, {"eogonek", 0x0119}, {"equal", 0x003d}, {"eth", 0x00f0},
+	{"exclam", 0x0021}, {"exclamdown", 0x00a1}, {"f", 0x0066}, {"ff", 0xfb00}, {"ffi", 0xfb03}, {"ffl", 0xfb04},
+	{"fi", 0xfb01}, {"five", 0x0035}, {"fl", 0xfb02}, {"florin", 0x0192}, {"four", 0x0034},
+	{"fraction", 0x2044}, {"g", 0x0067}, {"gbreve", 0x011f}, {"germandbls", 0x00df}, {"grave", 0x0060},
+	{"greater", 0x003e}, {"greaterequal", 0x2265}, {"guillemotleft", 0x00ab}, {"guillemotright", 0x00bb},
+	{"guilsinglleft", 0x2039}, {"guilsinglright", 0x203a}, {"h", 0x0068}, {"hungarumlaut", 0x02dd},
+	{"hyphen", 0x002d}, {"i", 0x0069}, {"iacute", 0x00ed}, {"icircumflex", 0x00ee}, {"idieresis", 0x00ef},
+	{"igrave", 0x00ec}, {"infinity", 0x221e}, {"integral", 0x222b}, {"j", 0x006a}, {"k", 0x006b}, {"l", 0x006c},
+	{"less", 0x003c}, {"lessequal", 0x2264}, {"logicalnot", 0x00ac}, {"lozenge", 0x25ca}, {"lslash", 0x0142},
+	{"m", 0x006d}, {"macron", 0x00af}, {"middot", 0x00b7}, {"minus", 0x2212}, {"mu", 0x00b5},
+	{"multiply", 0x00d7}, {"n", 0x006e}, {"nacute", 0x0144}, {"nbspace", 0x00a0}, {"ncaron", 0x0148},
+	{"nine", 0x0039}, {"notequal", 0x2260}, {"ntilde", 0x00f1}, {"numbersign", 0x0023}, {"o", 0x006f},
+	{"oacute", 0x00f3}, {"ocircumflex", 0x00f4}, {"odieresis", 0x00f6}, {"oe", 0x0153}, {"ogonek", 0x02db},
+	{"ograve", 0x00f2}, {"ohungarumlaut", 0x0151}, {"one", 0x0031}, {"onehalf", 0x00bd}, {"onequarter", 0x00bc},
+	{"onesuperior", 0x00b9}, {"ordfeminine", 0x00aa}, {"ordmasculine", 0x00ba}, {"oslash", 0x00f8},
+	{"otilde", 0x00f5}, {"p", 0x0070}, {"paragraph", 0x00b6}, {"parenleft", 0x0028}, {"parenright", 0x0029},
+	{"partialdiff", 0x2202}, {"percent", 0x0025}, {"period", 0x002e}, {"periodcentered", 0x00b7},
+	{"perthousand", 0x2030}, {"pi", 0x03c0}, {"plus", 0x002b}, {"plusminus", 0x00b1}, {"product", 0x220f},
+	{"q", 0x0071}, {"question", 0x003f}, {"questiondown", 0x00bf}, {"quotedbl", 0x0022},
+	{"quotedblbase", 0x201e}, {"quotedblleft", 0x201c}, {"quotedblright", 0x201d}, {"quoteleft", 0x2018},
+	{"quotereversed", 0x201b}, {"quoteright", 0x2019}, {"quotesinglbase", 0x201a}, {"quotesingle", 0x0027},
+	{"r", 0x0072}, {"radical", 0x221a}, {"rcaron", 0x0159}, {"registered", 0x00ae}, {"ring", 0x02da},
+	{"s", 0x0073}, {"sacute", 0x015b}, {"scaron", 0x0161}, {"scedilla", 0x015f}, {"section", 0x00a7},
+	{"semicolon", 0x003b}, {"seven", 0x0037}, {"sfthyphen", 0x00ad}, {"six", 0x0036}, {"slash", 0x002f},
+	{"space", 0x0020}, {"sterling", 0x00a3}, {"summation", 0x2211}, {"t", 0x0074}, {"tcaron", 0x0165},
+	{"thorn", 0x00fe}, {"three", 0x0033}, {"threequarters", 0x00be}, {"threesuperior", 0x00b3},
+	{"tilde", 0x02dc}, {"trademark", 0x2122}, {"two", 0x0032}, {"twosuperior", 0x00b2}, {"u", 0x0075},
+	{"uacute", 0x00fa}, {"ucircumflex", 0x00fb}, {"udieresis", 0x00fc}, {"ugrave", 0x00f9},
+	{"uhungarumlaut", 0x0171}, {"underscore", 0x005f}, {"uring", 0x016f}, {"v", 0x0076}, {"w", 0x0077},
+	{"x", 0x0078}, {"y", 0x0079}, {"yacute", 0x00fd}, {"ydieresis", 0x00ff}, {"yen", 0x00a5}, {"z", 0x007a},
+	{"zacute", 0x017a}, {"zcaron", 0x017e}, {"zdotaccent", 0x017c}, {"zero", 0x0030},
+};
+
+static const uint16_t pdf_standard_encoding[256] = {
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x2019, 0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+	0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+	0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047, 0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+	0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005a, 0x005b, 0x005c, 0x005d, 0x005e, 0x005f,
+	0x2018, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+	0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077, 0x0078, 0x0079, 0x007a, 0x007b, 0x007c, 0x007d, 0x007e, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x00a1, 0x00a2, 0x00a3, 0x2044, 0x00a5, 0x0192, 0x00a7, 0x00a4, 0x0027, 0x201c, 0x00ab, 0x2039, 0x203a, 0xfb01, 0xfb02,
+	0x0000, 0x2013, 0x2020, 0x2021, 0x00b7, 0x0000, 0x00b6, 0x2022, 0x201a, 0x201e, 0x201d, 0x00bb, 0x2026, 0x2030, 0x0000, 0x00bf,
+	0x0000, 0x0060, 0x00b4, 0x02c6, 0x02dc, 0x00af, 0x02d8, 0x02d9, 0x00a8, 0x0000, 0x02da, 0x00b8, 0x0000, 0x02dd, 0x02db, 0x02c7,
+	0x2014, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x00c6, 0x0000, 0x00aa, 0x0000, 0x0000, 0x0000, 0x0000, 0x0141, 0x00d8, 0x0152, 0x00ba, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x00e6, 0x0000, 0x0000, 0x0000, 0x0131, 0x0000, 0x0000, 0x0142, 0x00f8, 0x0153, 0x00df, 0x0000, 0x0000, 0x0000, 0x0000,
+};
+static const uint16_t pdf_win_ansi_encoding[256] = {
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027, 0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+	0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+	0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047, 0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+	0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005a, 0x005b, 0x005c, 0x005d, 0x005e, 0x005f,
+	0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+	0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077, 0x0078, 0x0079, 0x007a, 0x007b, 0x007c, 0x007d, 0x007e, 0x0000,
+	0x20ac, 0x0000, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021, 0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x0000, 0x017d, 0x0000,
+	0x0000, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014, 0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x0000, 0x017e, 0x0178,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a6, 0x00a7, 0x00a8, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b7, 0x00b8, 0x00b9, 0x00ba, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7, 0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7, 0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7, 0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7, 0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff,
+};
+static const uint16_t pdf_mac_roman_encoding[256] = {
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027, 0x0028, 0x0029, 0x002a, 0x002b, 0x002c, 0x002d, 0x002e, 0x002f,
+	0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037, 0x0038, 0x0039, 0x003a, 0x003b, 0x003c, 0x003d, 0x003e, 0x003f,
+	0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047, 0x0048, 0x0049, 0x004a, 0x004b, 0x004c, 0x004d, 0x004e, 0x004f,
+	0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057, 0x0058, 0x0059, 0x005a, 0x005b, 0x005c, 0x005d, 0x005e, 0x005f,
+	0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067, 0x0068, 0x0069, 0x006a, 0x006b, 0x006c, 0x006d, 0x006e, 0x006f,
+	0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077, 0x0078, 0x0079, 0x007a, 0x007b, 0x007c, 0x007d, 0x007e, 0x0000,
+	0x00c4, 0x00c5, 0x00c7, 0x00c9, 0x00d1, 0x00d6, 0x00dc, 0x00e1, 0x00e0, 0x00e2, 0x00e4, 0x00e3, 0x00e5, 0x00e7, 0x00e9, 0x00e8,
+	0x00ea, 0x00eb, 0x00ed, 0x00ec, 0x00ee, 0x00ef, 0x00f1, 0x00f3, 0x00f2, 0x00f4, 0x00f6, 0x00f5, 0x00fa, 0x00f9, 0x00fb, 0x00fc,
+	0x2020, 0x00b0, 0x00a2, 0x00a3, 0x00a7, 0x2022, 0x00b6, 0x00df, 0x00ae, 0x00a9, 0x2122, 0x00b4, 0x00a8, 0x2260, 0x00c6, 0x00d8,
+	0x221e, 0x00b1, 0x2264, 0x2265, 0x00a5, 0x00b5, 0x2202, 0x2211, 0x220f, 0x03c0, 0x222b, 0x00aa, 0x00ba, 0x03a9, 0x00e6, 0x00f8,
+	0x00bf, 0x00a1, 0x00ac, 0x221a, 0x0192, 0x2248, 0x2206, 0x00ab, 0x00bb, 0x2026, 0x00a0, 0x00c0, 0x00c3, 0x00d5, 0x0152, 0x0153,
+	0x2013, 0x2014, 0x201c, 0x201d, 0x2018, 0x2019, 0x00f7, 0x25ca, 0x00ff, 0x0178, 0x2044, 0x00a4, 0x2039, 0x203a, 0xfb01, 0xfb02,
+	0x2021, 0x00b7, 0x201a, 0x201e, 0x2030, 0x00c2, 0x00ca, 0x00c1, 0x00cb, 0x00c8, 0x00cd, 0x00ce, 0x00cf, 0x00cc, 0x00d3, 0x00d4,
+	0x0000, 0x00d2, 0x00da, 0x00db, 0x00d9, 0x0131, 0x02c6, 0x02dc, 0x00af, 0x02d8, 0x02d9, 0x02da, 0x00b8, 0x02dd, 0x02db, 0x02c7,
+};
+
+// Unicode of the glyph 'name', 0 if unknown. The suffix after a period
+// (small caps, alternates...) is ignored.
+uint32_t pdf_glyph_name_unicode(const char* name, size_t length)
+{
+	for(size_t i = 1; i < length; ++i)
+	{
+		if(name[i] == '.')
+		{
+			length = i;
+			break;
+		}
+	}
+
+	size_t low = 0;
+	size_t high = sizeof(pdf_glyph_names)/sizeof(pdf_glyph_names[0]);
+	while(low < high)
+	{
+		size_t middle = (low + high)/2;
+		const char* candidate = pdf_glyph_names[middle].name;
+		size_t candidate_length = strlen(candidate);
+		int order = memcmp(candidate, name, candidate_length < length ? candidate_length : length);
+		if(order == 0) order = candidate_length < length ? -1 : candidate_length > length ? 1 : 0;
+		if(order == 0) return pdf_glyph_names[middle].unicode;
+		if(order < 0) low = middle + 1;
+		else high = middle;
+	}
+
+	// uniXXXX (the first of a sequence of them) or uXXXX to uXXXXXX
+	size_t start, digits;
+	if(length >= 7 && memcmp(name, "uni", 3) == 0 && (length - 3) % 4 == 0)
+	{
+		start = 3;
+		digits = 4;
+	}
+	else if(length >= 5 && length <= 7 && name[0] == 'u')
+	{
+		start = 1;
+		digits = length - 1;
+	}
+	else return 0;
+	uint32_t code_point = 0;
+	for(size_t i = start; i < start + digits; ++i)
+	{
+		char c = name[i];
+		uint32_t digit;
+		if(c >= '0' && c <= '9') digit = (uint32_t)(c - '0');
+		else if(c >= 'A' && c <= 'F') digit = (uint32_t)(c - 'A' + 10);
+		else return 0; // Glyph names use upper case hexadecimal only
+		code_point = 16*code_point + digit;
+	}
+	return code_point;
+}
+
+// NOTE(Sam): CMaps outlive the documents and the threads that built them,
+//            so they are allocated with malloc, never in a thread arena.
+PdfCMap* pdf_cmap_create(int kind)
+{
+	PdfCMap* cmap = (PdfCMap*)malloc(sizeof(PdfCMap));
+	if(cmap == NULL) return NULL;
+	memset(cmap, 0, sizeof(PdfCMap));
+	cmap->kind = kind;
+	cmap->references = 1;
+	cmap->size = sizeof(PdfCMap);
+	return cmap;
+}
+
+void pdf_cmap_free(PdfCMap* cmap)
+{
+	free(cmap->ranges);
+	free(cmap->unicode);
+	free(cmap);
+}
+
+// Maps the codes 'low' to 'high' to 'code_points', see PdfCMapRange
+bool pdf_cmap_add_range(PdfCMap* cmap, uint32_t low, uint32_t high, uint32_t code_length,
+						const uint32_t* code_points, size_t count)
+{
+	if(count == 0 || low > high) return true; // Nothing to map
+
+	if(cmap->ranges_count == cmap->ranges_capacity)
+	{
+		size_t capacity = cmap->ranges_capacity > 0 ? 2*cmap->ranges_capacity : 64;
+		PdfCMapRange* ranges = (PdfCMapRange*)realloc(cmap->ranges, capacity*sizeof(PdfCMapRange));
+		if(ranges == NULL) return false;
+		cmap->ranges = ranges;
+		cmap->ranges_capacity = capacity;
+	}
+	if(cmap->unicode_count + count > cmap->unicode_capacity)
+	{
+		size_t capacity = cmap->unicode_capacity > 0 ? 2*cmap->unicode_capacity : 256;
+		while(capacity < cmap->unicode_count + count) capacity *= 2;
+		uint32_t* unicode = (uint32_t*)realloc(cmap->unicode, capacity*sizeof(uint32_t));
+		if(unicode == NULL) return false;
+		cmap->unicode = unicode;
+		cmap->unicode_capacity = capacity;
+	}
+
+	PdfCMapRange* range = &cmap->ranges[cmap->ranges_count++];
+	range->low = low;
+	range->high = high;
+	range->unicode = (uint32_t)cmap->unicode_count;
+	range->unicode_length = (uint16_t)count;
+	range->code_length = (uint8_t)code_length;
+	memcpy(cmap->unicode + cmap->unicode_count, code_points, count*sizeof(uint32_t));
+	cmap->unicode_count += count;
+	return true;
+}
+
+// A source code of a CMap: a string of 1 to 4 bytes
+static bool pdf_cmap_code(const PdfObject* obj, uint32_t* out_code, uint32_t* out_length)
+{
+	if(obj->type != PDF_OBJECT_TYPE_STRING || obj->string_value.length == 0 || obj->string_value.length > 4)
+		return false;
+	const uint8_t* bytes = (const uint8_t*)obj->string_value.start;
+	*out_code = 0;
+	for(size_t i = 0; i < obj->string_value.length; ++i) *out_code = (*out_code << 8) | bytes[i];
+	*out_length = (uint32_t)obj->string_value.length;
+	return true;
+}
+
+// Code points of a destination: a UTF-16BE string, or a glyph name
+static size_t pdf_cmap_destination(const PdfObject* obj, uint32_t* out_code_points)
+{
+	if(obj->type == PDF_OBJECT_TYPE_NAME)
+	{
+		out_code_points[0] = pdf_glyph_name_unicode(obj->name_value.start, obj->name_value.length);
+		return out_code_points[0] != 0 ? 1 : 0;
+	}
+	if(obj->type != PDF_OBJECT_TYPE_STRING) return 0;
+
+	const uint8_t* bytes = (const uint8_t*)obj->string_value.start;
+	size_t length = obj->string_value.length;
+	size_t count = 0;
+	for(size_t i = 0; i + 1 < length && count < PDF_CMAP_MAX_DESTINATION; i += 2)
+	{
+		uint32_t unit = ((uint32_t)bytes[i] << 8) | bytes[i + 1];
+		if(unit >= 0xD800 && unit < 0xDC00 && i + 3 < length)
+		{
+			uint32_t low = ((uint32_t)bytes[i + 2] << 8) | bytes[i + 3];
+			if(low >= 0xDC00 && low < 0xE000)
+			{
+				unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+				i += 2;
+			}
+		}
+		out_code_points[count++] = unit;
+	}
+	return count;
+}
+
+enum PDF_CMAP_BLOCKS {
+	PDF_CMAP_BLOCK_NONE,
+	PDF_CMAP_BLOCK_CODESPACE,	// begincodespacerange, pairs of codes
+	PDF_CMAP_BLOCK_BFCHAR,		// beginbfchar, a code and its destination
+	PDF_CMAP_BLOCK_BFRANGE,		// beginbfrange, two codes and a destination or an array of them
+};
+
+// Adds the entry made of 'operands' found in 'block'. Malformed entries
+// are skipped, false means we ran out of memory.
+static bool pdf_cmap_add_entry(PdfCMap* cmap, int block, const PdfObject* operands, bool* inout_has_codespace)
+{
+	uint32_t low, high, low_length, high_length;
+	uint32_t code_points[PDF_CMAP_MAX_DESTINATION];
+	if(!pdf_cmap_code(&operands[0], &low, &low_length)) return true;
+	switch(block)
+	{
+	case PDF_CMAP_BLOCK_CODESPACE:
+	{
+		if(!pdf_cmap_code(&operands[1], &high, &high_length) || high_length != low_length) return true;
+		uint32_t first_low = low >> 8*(low_length - 1);
+		uint32_t first_high = high >> 8*(high_length - 1);
+		for(uint32_t first = first_low; first <= first_high; ++first) cmap->code_lengths[first] = (uint8_t)low_length;
+		*inout_has_codespace = true;
+	} break;
+	case PDF_CMAP_BLOCK_BFCHAR:
+	{
+		size_t count = pdf_cmap_destination(&operands[1], code_points);
+		return pdf_cmap_add_range(cmap, low, low, low_length, code_points, count);
+	} break;
+	case PDF_CMAP_BLOCK_BFRANGE:
+	{
+		if(!pdf_cmap_code(&operands[1], &high, &high_length) || high_length != low_length) return true;
+		if(operands[2].type != PDF_OBJECT_TYPE_ARRAY)
+		{
+			size_t count = pdf_cmap_destination(&operands[2], code_points);
+			return pdf_cmap_add_range(cmap, low, high, low_length, code_points, count);
+		}
+		// One destination per code
+		const PdfArray* destinations = &operands[2].array_value;
+		for(size_t i = 0; i < destinations->length && i <= high - low; ++i)
+		{
+			size_t count = pdf_cmap_destination(&destinations->start[i], code_points);
+			uint32_t code = low + (uint32_t)i;
+			if(!pdf_cmap_add_range(cmap, code, code, low_length, code_points, count)) return false;
+		}
+	} break;
+	}
+	return true;
+}
+
+static int pdf_cmap_compare_ranges(const void* a, const void* b)
+{
+	const PdfCMapRange* range_a = (const PdfCMapRange*)a;
+	const PdfCMapRange* range_b = (const PdfCMapRange*)b;
+	if(range_a->code_length != range_b->code_length) return range_a->code_length < range_b->code_length ? -1 : 1;
+	if(range_a->low != range_b->low) return range_a->low < range_b->low ? -1 : 1;
+	return 0;
+}
+
+// Sorts the ranges and fills the tables of the one byte codes
+static void pdf_cmap_finish(PdfCMap* cmap, bool has_codespace)
+{
+	// Codes outside of the codespace are read as one byte, a CMap without a
+	// codespace is guessed to have codes as long as its first mapping.
+	uint8_t default_length = !has_codespace && cmap->ranges_count > 0 ? cmap->ranges[0].code_length : 1;
+	for(size_t i = 0; i < 256; ++i)
+	{
+		if(cmap->code_lengths[i] == 0) cmap->code_lengths[i] = default_length;
+	}
+
+	if(cmap->ranges_count > 0)
+		qsort(cmap->ranges, cmap->ranges_count, sizeof(PdfCMapRange), pdf_cmap_compare_ranges);
+	for(size_t i = 0; i < cmap->ranges_count && cmap->ranges[i].code_length == 1; ++i)
+	{
+		const PdfCMapRange* range = &cmap->ranges[i];
+		if(range->unicode_length != 1) continue;
+		for(uint32_t code = range->low; code <= range->high && code < 256; ++code)
+			cmap->single[code] = cmap->unicode[range->unicode] + (code - range->low);
+	}
+
+	// Cached for long, give the spare capacity back
+	if(cmap->ranges_count > 0 && cmap->ranges_count < cmap->ranges_capacity)
+	{
+		PdfCMapRange* ranges = (PdfCMapRange*)realloc(cmap->ranges, cmap->ranges_count*sizeof(PdfCMapRange));
+		if(ranges != NULL)
+		{
+			cmap->ranges = ranges;
+			cmap->ranges_capacity = cmap->ranges_count;
+		}
+	}
+	if(cmap->unicode_count > 0 && cmap->unicode_count < cmap->unicode_capacity)
+	{
+		uint32_t* unicode = (uint32_t*)realloc(cmap->unicode, cmap->unicode_count*sizeof(uint32_t));
+		if(unicode != NULL)
+		{
+			cmap->unicode = unicode;
+			cmap->unicode_capacity = cmap->unicode_count;
+		}
+	}
+	cmap->size = sizeof(PdfCMap) + cmap->ranges_capacity*sizeof(PdfCMapRange) + cmap->unicode_capacity*sizeof(uint32_t);
+}
+
+// Parses the decoded /ToUnicode CMap 'data', which must be followed by
+// PDF_BUFFER_PADDING readable bytes. NULL when out of memory.
+PdfCMap* pdf_cmap_parse(const uint8_t* data, size_t length)
+{
+	PdfCMap* cmap = pdf_cmap_create(PDF_CMAP_TO_UNICODE);
+	if(cmap == NULL) return NULL;
+
+	int block = PDF_CMAP_BLOCK_NONE;
+	bool has_codespace = false;
+	bool success = true;
+	PdfObject operands[3];
+	size_t operands_count = 0;
+	size_t pos = 0;
+	while(success)
+	{
+		pdf_skip_white_spaces_and_comments(data, &pos, length);
+		if(pos >= length) break;
+		PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+		size_t next = pos;
+		if(pdf_parse_object(data, &next, length, &obj))
+		{
+			pos = next;
+			if(block == PDF_CMAP_BLOCK_NONE)
+			{
+				pdf_object_free(&obj);
+				continue;
+			}
+			operands[operands_count++] = obj;
+			if(operands_count < (block == PDF_CMAP_BLOCK_BFRANGE ? 3u : 2u)) continue;
+			success = pdf_cmap_add_entry(cmap, block, operands, &has_codespace);
+			for(size_t i = 0; i < operands_count; ++i) pdf_object_free(&operands[i]);
+			operands_count = 0;
+			continue;
+		}
+
+		// An operator, or a stray delimiter of the PostScript we skip
+		size_t start = pos;
+		while(pos < length && pdf_char_is_regular(data[pos])) ++pos;
+		if(pos == start) ++pos;
+		const char* op = (const char*)data + start;
+		size_t op_len = pos - start;
+		if(op_len == 19 && memcmp(op, "begincodespacerange", 19) == 0) block = PDF_CMAP_BLOCK_CODESPACE;
+		else if(op_len == 11 && memcmp(op, "beginbfchar", 11) == 0) block = PDF_CMAP_BLOCK_BFCHAR;
+		else if(op_len == 12 && memcmp(op, "beginbfrange", 12) == 0) block = PDF_CMAP_BLOCK_BFRANGE;
+		else block = PDF_CMAP_BLOCK_NONE;
+		for(size_t i = 0; i < operands_count; ++i) pdf_object_free(&operands[i]);
+		operands_count = 0;
+	}
+	for(size_t i = 0; i < operands_count; ++i) pdf_object_free(&operands[i]);
+
+	if(!success)
+	{
+		pdf_cmap_free(cmap);
+		return NULL;
+	}
+	pdf_cmap_finish(cmap, has_codespace);
+	return cmap;
+}
+
+// Builds the mapping of a simple font from its /Encoding: the name of a base
+// encoding or a dictionary with /BaseEncoding and /Differences. NULL when
+// out of memory.
+PdfCMap* pdf_cmap_from_encoding(const PdfObject* encoding)
+{
+	PdfCMap* cmap = pdf_cmap_create(PDF_CMAP_ENCODING);
+	if(cmap == NULL) return NULL;
+
+	PdfObject base_name = *encoding;
+	if(encoding->type == PDF_OBJECT_TYPE_DICTIONARY)
+		base_name = pdf_dictionary_get(&encoding->dictionary_value, pdf_name("BaseEncoding"));
+	const uint16_t* base = pdf_standard_encoding;
+	if(base_name.type == PDF_OBJECT_TYPE_NAME)
+	{
+		if(pdf_names_are_equals(base_name.name_value, pdf_name("WinAnsiEncoding"))) base = pdf_win_ansi_encoding;
+		else if(pdf_names_are_equals(base_name.name_value, pdf_name("MacRomanEncoding"))) base = pdf_mac_roman_encoding;
+	}
+	memset(cmap->code_lengths, 1, sizeof(cmap->code_lengths));
+	for(size_t i = 0; i < 256; ++i) cmap->single[i] = base[i];
+
+	// [code name name ... code name ...], names go to consecutive codes
+	PdfObject differences = encoding->type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&encoding->dictionary_value, pdf_name("Differences"))
+		: (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+	if(differences.type == PDF_OBJECT_TYPE_ARRAY)
+	{
+		PDF_INTEGER_TYPE code = 0;
+		for(size_t i = 0; i < differences.array_value.length; ++i)
+		{
+			const PdfObject* item = &differences.array_value.start[i];
+			if(item->type == PDF_OBJECT_TYPE_INTEGER) code = item->int_value;
+			else if(item->type == PDF_OBJECT_TYPE_NAME)
+			{
+				if(code >= 0 && code < 256)
+					cmap->single[code] = pdf_glyph_name_unicode(item->name_value.start, item->name_value.length);
+				++code;
+			}
+		}
+	}
+	return cmap;
+}
+
+// Range of the code 'code' of 'code_length' bytes, NULL if not mapped
+static const PdfCMapRange* pdf_cmap_find(const PdfCMap* cmap, uint32_t code, uint32_t code_length)
+{
+	// The last range starting at or before the code
+	size_t low = 0;
+	size_t high = cmap->ranges_count;
+	while(low < high)
+	{
+		size_t middle = (low + high)/2;
+		const PdfCMapRange* range = &cmap->ranges[middle];
+		if(range->code_length < code_length || (range->code_length == code_length && range->low <= code))
+			low = middle + 1;
+		else high = middle;
+	}
+	if(low == 0) return NULL;
+	const PdfCMapRange* range = &cmap->ranges[low - 1];
+	return range->code_length == code_length && range->high >= code ? range : NULL;
+}
+
+// Writes the text of the codes 'data' in UTF-8. Unmapped codes of several
+// bytes become U+FFFD, printable one byte codes are taken as Latin-1 and
+// the others dropped.
+void pdf_cmap_write_utf8(const PdfCMap* cmap, const uint8_t* data, size_t length, PdfWriter* out)
+{
+	size_t pos = 0;
+	while(pos < length)
+	{
+		uint32_t code_length = cmap->code_lengths[data[pos]];
+		if(code_length == 1 && cmap->single[data[pos]] != 0)
+		{
+			pdf_write_utf8(out, cmap->single[data[pos]]);
+			++pos;
+			continue;
+		}
+		if(pos + code_length > length) break; // A truncated code
+
+		uint32_t code = 0;
+		for(uint32_t i = 0; i < code_length; ++i) code = (code << 8) | data[pos + i];
+		const PdfCMapRange* range = pdf_cmap_find(cmap, code, code_length);
+		if(range != NULL)
+		{
+			const uint32_t* code_points = cmap->unicode + range->unicode;
+			for(uint32_t i = 0; i + 1 < range->unicode_length; ++i) pdf_write_utf8(out, code_points[i]);
+			pdf_write_utf8(out, code_points[range->unicode_length - 1] + (code - range->low));
+		}
+		else if(code_length > 1) pdf_write_utf8(out, 0xFFFD);
+		else if(code >= 0x20) pdf_write_utf8(out, code);
+		pos += code_length;
+	}
+}
+
+static PdfFontCache* pdf_font_cache_get(void)
+{
+	PdfFontCache* cache = (PdfFontCache*)pdf_atomic_load_pointer(&pdf_font_cache);
+	if(cache != NULL) return cache;
+	PdfFontCache* fresh = (PdfFontCache*)malloc(sizeof(PdfFontCache));
+	if(fresh == NULL) return NULL;
+	memset(fresh, 0, sizeof(PdfFontCache));
+	pdf_mutex_init(&fresh->mutex);
+	fresh->stats.budget = PDF_FONT_CACHE_DEFAULT_BUDGET;
+	if(pdf_atomic_compare_exchange_pointer(&pdf_font_cache, NULL, fresh)) return fresh;
+	pdf_mutex_destroy(&fresh->mutex);
+	free(fresh);
+	return (PdfFontCache*)pdf_atomic_load_pointer(&pdf_font_cache);
+}
+
+static void pdf_font_cache_unlink_lru(PdfFontCache* cache, PdfCMap* cmap)
+{
+	if(cmap->newer != NULL) cmap->newer->older = cmap->older;
+	else cache->newest = cmap->older;
+	if(cmap->older != NULL) cmap->older->newer = cmap->newer;
+	else cache->oldest = cmap->newer;
+	cmap->newer = NULL;
+	cmap->older = NULL;
+}
+
+static void pdf_font_cache_push_newest(PdfFontCache* cache, PdfCMap* cmap)
+{
+	cmap->older = cache->newest;
+	cmap->newer = NULL;
+	if(cache->newest != NULL) cache->newest->newer = cmap;
+	else cache->oldest = cmap;
+	cache->newest = cmap;
+}
+
+static PdfCMap* pdf_font_cache_lookup(PdfFontCache* cache, int kind, uint64_t hash, size_t source_length)
+{
+	PdfCMap* cmap = cache->buckets[hash % PDF_FONT_CACHE_BUCKETS];
+	while(cmap != NULL && (cmap->kind != kind || cmap->hash != hash || cmap->source_length != source_length))
+		cmap = cmap->next_in_bucket;
+	return cmap;
+}
+
+// Evicts the least recently used entries until the cache fits in 'budget'.
+// The cache must be locked.
+static void pdf_font_cache_shrink(PdfFontCache* cache, size_t budget)
+{
+	while(cache->stats.bytes > budget && cache->oldest != NULL)
+	{
+		PdfCMap* cmap = cache->oldest;
+		PdfCMap** link = &cache->buckets[cmap->hash % PDF_FONT_CACHE_BUCKETS];
+		while(*link != cmap) link = &(*link)->next_in_bucket;
+		*link = cmap->next_in_bucket;
+		cmap->next_in_bucket = NULL;
+		pdf_font_cache_unlink_lru(cache, cmap);
+		cmap->is_cached = false;
+		cache->stats.entries -= 1;
+		cache->stats.bytes -= cmap->size;
+		cache->stats.evictions += 1;
+		if(--cmap->references == 0) pdf_cmap_free(cmap);
+	}
+}
+
+// The cached CMap of 'kind' built from 'source_length' bytes hashing to
+// 'hash', NULL if not cached. The caller gives it back with pdf_cmap_release.
+const PdfCMap* pdf_font_cache_find(int kind, uint64_t hash, size_t source_length)
+{
+	PdfFontCache* cache = pdf_font_cache_get();
+	if(cache == NULL) return NULL;
+	pdf_mutex_lock(&cache->mutex);
+	PdfCMap* cmap = pdf_font_cache_lookup(cache, kind, hash, source_length);
+	if(cmap != NULL)
+	{
+		cmap->references += 1;
+		pdf_font_cache_unlink_lru(cache, cmap);
+		pdf_font_cache_push_newest(cache, cmap);
+		cache->stats.hits += 1;
+	}
+	else cache->stats.misses += 1;
+	pdf_mutex_unlock(&cache->mutex);
+	return cmap;
+}
+
+// Adds 'cmap', just built from 'source_length' bytes hashing to 'hash'.
+// The reference of the caller moves to the CMap returned, which is the one
+// already cached when another thread added the same meanwhile. A CMap over
+// the budget is not cached but still returned.
+const PdfCMap* pdf_font_cache_insert(PdfCMap* cmap, uint64_t hash, size_t source_length)
+{
+	cmap->hash = hash;
+	cmap->source_length = source_length;
+	PdfFontCache* cache = pdf_font_cache_get();
+	if(cache == NULL) return cmap;
+
+	pdf_mutex_lock(&cache->mutex);
+	PdfCMap* existing = pdf_font_cache_lookup(cache, cmap->kind, hash, source_length);
+	if(existing != NULL)
+	{
+		existing->references += 1;
+		pdf_font_cache_unlink_lru(cache, existing);
+		pdf_font_cache_push_newest(cache, existing);
+		pdf_mutex_unlock(&cache->mutex);
+		pdf_cmap_free(cmap);
+		return existing;
+	}
+	if(cmap->size <= cache->stats.budget)
+	{
+		PdfCMap** bucket = &cache->buckets[hash % PDF_FONT_CACHE_BUCKETS];
+		cmap->next_in_bucket = *bucket;
+		*bucket = cmap;
+		pdf_font_cache_push_newest(cache, cmap);
+		cmap->is_cached = true;
+		cmap->references += 1;
+		cache->stats.entries += 1;
+		cache->stats.bytes += cmap->size;
+		pdf_font_cache_shrink(cache, cache->stats.budget);
+	}
+	pdf_mutex_unlock(&cache->mutex);
+	return cmap;
+}
+
+// Gives back a CMap of pdf_font_cache_find or pdf_font_cache_insert
+void pdf_cmap_release(const PdfCMap* cmap)
+{
+	if(cmap == NULL || cmap == &pdf_cmap_none || cmap == &pdf_cmap_none_composite) return;
+	PdfCMap* owned = (PdfCMap*)cmap;
+	PdfFontCache* cache = pdf_font_cache_get();
+	if(cache != NULL) pdf_mutex_lock(&cache->mutex);
+	bool is_last = --owned->references == 0;
+	if(cache != NULL) pdf_mutex_unlock(&cache->mutex);
+	if(is_last) pdf_cmap_free(owned);
+}
+
+// Changes the memory budget of the font cache, evicting entries if needed.
+// 0 disables the cache.
+void pdf_font_cache_set_budget(size_t budget)
+{
+	PdfFontCache* cache = pdf_font_cache_get();
+	if(cache == NULL) return;
+	pdf_mutex_lock(&cache->mutex);
+	cache->stats.budget = budget;
+	pdf_font_cache_shrink(cache, budget);
+	pdf_mutex_unlock(&cache->mutex);
+}
+
+// Evicts every entry, the budget is kept
+void pdf_font_cache_clear(void)
+{
+	PdfFontCache* cache = pdf_font_cache_get();
+	if(cache == NULL) return;
+	pdf_mutex_lock(&cache->mutex);
+	pdf_font_cache_shrink(cache, 0);
+	pdf_mutex_unlock(&cache->mutex);
+}
+
+PdfFontCacheStats pdf_font_cache_get_stats(void)
+{
+	PdfFontCacheStats stats = {0};
+	PdfFontCache* cache = pdf_font_cache_get();
+	if(cache == NULL) return stats;
+	pdf_mutex_lock(&cache->mutex);
+	stats = cache->stats;
+	pdf_mutex_unlock(&cache->mutex);
+	return stats;
+}
+
+void pdf_document_free_fonts(PdfDocument* doc)
+{
+	if(doc->fonts == NULL) return;
+	for(size_t i = 0; i < doc->xref_count; ++i) pdf_cmap_release((const PdfCMap*)doc->fonts[i]);
+	pdf_free((void*)doc->fonts);
+	doc->fonts = NULL;
+}
+
+// Decoder of the /ToUnicode stream 'reference', from the cache when a
+// stream with the same bytes was seen before
+static const PdfCMap* pdf_document_load_to_unicode(PdfDocument* doc, PdfReference reference)
+{
+	PdfObject stream;
+	if(!pdf_document_get_object(doc, reference.number, &stream)) return NULL;
+	const PdfCMap* result = NULL;
+	uint8_t* data;
+	size_t length;
+	if(stream.type == PDF_OBJECT_TYPE_STREAM
+	   && pdf_document_decode_stream(doc, reference.number, reference.generation, &stream.stream_value, &data, &length))
+	{
+		uint64_t hash = pdf_hash_bytes(data, length, PDF_CMAP_TO_UNICODE);
+		result = pdf_font_cache_find(PDF_CMAP_TO_UNICODE, hash, length);
+		if(result == NULL)
+		{
+			PdfCMap* cmap = pdf_cmap_parse(data, length);
+			if(cmap != NULL) result = pdf_font_cache_insert(cmap, hash, length);
+		}
+		pdf_free(data);
+	}
+	pdf_object_free(&stream);
+	return result;
+}
+
+// Decoder of the /Encoding 'encoding' of a simple font, keyed in the cache
+// by its PDF syntax
+static const PdfCMap* pdf_document_load_encoding(PdfDocument* doc, const PdfObject* encoding)
+{
+	PdfObject resolved = {.type = PDF_OBJECT_TYPE_NONE};
+	if(encoding->type == PDF_OBJECT_TYPE_REFERENCE)
+	{
+		if(!pdf_document_get_object(doc, encoding->reference_value.number, &resolved)) return NULL;
+		encoding = &resolved;
+	}
+	const PdfCMap* result = NULL;
+	if(encoding->type == PDF_OBJECT_TYPE_NAME || encoding->type == PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		PdfWriter syntax = {0};
+		pdf_writer_begin(&syntax, NULL, 0);
+		pdf_write_object(&syntax, encoding);
+		if(!syntax.failed)
+		{
+			uint64_t hash = pdf_hash_bytes(syntax.buffer, syntax.length, PDF_CMAP_ENCODING);
+			result = pdf_font_cache_find(PDF_CMAP_ENCODING, hash, syntax.length);
+			if(result == NULL)
+			{
+				PdfCMap* cmap = pdf_cmap_from_encoding(encoding);
+				if(cmap != NULL) result = pdf_font_cache_insert(cmap, hash, syntax.length);
+			}
+		}
+		pdf_writer_free(&syntax);
+	}
+	pdf_object_free(&resolved);
+	return result;
+}
+
+// Loads the decoder of the font 'number', pdf_cmap_none_composite for a
+// composite font without one
+static const PdfCMap* pdf_document_load_font_cmap(PdfDocument* doc, uint32_t number)
+{
+	PdfObject font;
+	if(!pdf_document_get_object(doc, number, &font)) return NULL;
+	const PdfCMap* result = NULL;
+	if(font.type == PDF_OBJECT_TYPE_DICTIONARY)
+	{
+		PdfObject to_unicode = pdf_dictionary_get(&font.dictionary_value, pdf_name("ToUnicode"));
+		if(to_unicode.type == PDF_OBJECT_TYPE_REFERENCE)
+			result = pdf_document_load_to_unicode(doc, to_unicode.reference_value);
+
+		// The encoding of a composite font is a CMap to CIDs, not to Unicode
+		PdfObject subtype = pdf_dictionary_get(&font.dictionary_value, pdf_name("Subtype"));
+		bool is_composite = subtype.type == PDF_OBJECT_TYPE_NAME
+			&& pdf_names_are_equals(subtype.name_value, pdf_name("Type0"));
+		PdfObject encoding = pdf_dictionary_get(&font.dictionary_value, pdf_name("Encoding"));
+		if(result == NULL && !is_composite && encoding.type != PDF_OBJECT_TYPE_NONE)
+			result = pdf_document_load_encoding(doc, &encoding);
+		if(result == NULL && is_composite) result = &pdf_cmap_none_composite;
+	}
+	pdf_object_free(&font);
+	return result;
+}
+
+// Decoder of the font 'number' as remembered by the document, which may
+// be pdf_cmap_none or pdf_cmap_none_composite, see pdf_document_font_cmap
+static const PdfCMap* pdf_document_font_decoder(PdfDocument* doc, uint32_t number)
+{
+	if(number >= doc->xref_count) return NULL;
+
+	void* volatile* fonts = pdf_document_shared_array(doc, &doc->fonts);
+	if(fonts == NULL) return NULL;
+
+	const PdfCMap* cmap = (const PdfCMap*)pdf_atomic_load_pointer(&fonts[number]);
+	if(cmap == NULL)
+	{
+		cmap = pdf_document_load_font_cmap(doc, number);
+		if(cmap == NULL) cmap = &pdf_cmap_none;
+		// Another thread may have loaded it meanwhile, keep the first one
+		if(!pdf_atomic_compare_exchange_pointer(&fonts[number], NULL, (void*)cmap))
+		{
+			pdf_cmap_release(cmap);
+			cmap = (const PdfCMap*)pdf_atomic_load_pointer(&fonts[number]);
+		}
+	}
+	return cmap;
+}
+
+// Decoder of the text shown with the font object 'number': its /ToUnicode
+// CMap, or the mapping of its /Encoding for a simple font. NULL when its
+// codes can't be mapped. It stays valid until the document is closed and
+// is safe to get from several threads reading the same document.
+// NOTE(Sam): Fonts are remembered by object number, a font changed with
+//            pdf_document_set_object keeps its first decoder.
+const PdfCMap* pdf_document_font_cmap(PdfDocument* doc, uint32_t number)
+{
+	const PdfCMap* cmap = pdf_document_font_decoder(doc, number);
+	return cmap != &pdf_cmap_none && cmap != &pdf_cmap_none_composite ? cmap : NULL;
+}
+
+/*
+  TEXT EXTRACTION:
+  - The text of a page is made of the strings shown by the text operators
+    of its content streams (Tj, TJ, ' and "), in content order. Operators
+    moving to the next line end a line, large negative TJ adjustments
+    become spaces.
+  - Strings are written in UTF-8 through the decoder of the current font
+    (see FONTS). Without one, bytes are taken as Latin-1 for simple fonts
+    and every 2 bytes (the codes of Identity-H, by far the most common
+    CMap of composite fonts) become U+FFFD for composite ones, so the
+    output is always valid UTF-8.
+  - Content streams are read operator by operator with their operands by
+    pdf_content_next_operator. The binary data of inline images is jumped
+    over in one step when its dictionary gives its length, and searched
+    16 bytes at a time for its 'EI' otherwise.
+ */
+
+// Operands kept before an operator, the extra ones are dropped
+#define PDF_CONTENT_MAX_OPERANDS 32
+
+// TJ adjustments (in thousandths of text space unit) under this are word gaps
+#define PDF_TEXT_SPACE_ADJUSTMENT -200
+
+// Decoded content streams of the page object 'page' concatenated, padded
+// with PDF_BUFFER_PADDING zeros. The caller frees 'out_data'.
+bool pdf_document_page_contents(PdfDocument* doc, const PdfPage* page, uint8_t** out_data, size_t* out_len)
+{
+	*out_data = NULL;
+	*out_len = 0;
+	PdfObject page_obj;
+	if(!pdf_document_get_object(doc, page->number, &page_obj)) return false;
+	PdfObject contents = page_obj.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&page_obj.dictionary_value, pdf_name("Contents")) : page_obj;
+
+	// Either a stream or an array of streams, which may be indirect too. A
+	// stream is always indirect, its reference gives its key when encrypted.
+	PdfObject resolved = {.type = PDF_OBJECT_TYPE_NONE};
+	PdfReference reference = {0};
+	if(contents.type == PDF_OBJECT_TYPE_REFERENCE)
+	{
+		reference = contents.reference_value;
+		if(!pdf_document_get_object(doc, contents.reference_value.number, &resolved))
+			resolved.type = PDF_OBJECT_TYPE_NONE;
+		contents = resolved;
+	}
+	size_t count = contents.type == PDF_OBJECT_TYPE_ARRAY ? contents.array_value.length : 1;
+
+	PdfWriter writer = {0};
+	bool success = pdf_writer_begin(&writer, NULL, 0);
+	for(size_t i = 0; i < count && success; ++i)
+	{
+		PdfObject part = contents.type == PDF_OBJECT_TYPE_ARRAY ? contents.array_value.start[i] : contents;
+		PdfObject loaded = {.type = PDF_OBJECT_TYPE_NONE};
+		if(part.type == PDF_OBJECT_TYPE_REFERENCE)
+		{
+			reference = part.reference_value;
+			if(!pdf_document_get_object(doc, part.reference_value.number, &loaded)) continue;
+			part = loaded;
+		}
+		uint8_t* data;
+		size_t length;
+		if(part.type == PDF_OBJECT_TYPE_STREAM
+		   && pdf_document_decode_stream(doc, reference.number, reference.generation, &part.stream_value, &data, &length))
+		{
+			// Operators can't span two streams, but tokens must not merge
+			pdf_write_bytes(&writer, data, length);
+			pdf_write_bytes(&writer, "\n", 1);
+			pdf_free(data);
+		}
+		pdf_object_free(&loaded);
+		success = !writer.failed;
+	}
+	pdf_object_free(&resolved);
+	pdf_object_free(&page_obj);
+
+	uint8_t padding[PDF_BUFFER_PADDING] = {0};
+	size_t length = writer.length;
+	pdf_write_bytes(&writer, padding, PDF_BUFFER_PADDING);
+	if(!success || writer.failed)
+	{
+		pdf_writer_free(&writer);
+		return false;
+	}
+	*out_data = writer.buffer;
+	*out_len = length;
+	return true;
+}
+
+// Value of the entry 'key' (or its abbreviation 'short_key') of the
+// dictionary of an inline image, given as the key/value operands of 'ID'
+static PdfObject pdf_content_inline_image_get(const PdfObject* operands, size_t count, const char* key, const char* short_key)
+{
+	PdfName name = pdf_name(key);
+	PdfName short_name = pdf_name(short_key);
+	for(size_t i = 0; i + 1 < count; i += 2)
+	{
+		if(operands[i].type != PDF_OBJECT_TYPE_NAME) continue;
+		if(pdf_names_are_equals(operands[i].name_value, name) || pdf_names_are_equals(operands[i].name_value, short_name))
+			return operands[i + 1];
+	}
+	return (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+}
+
+// Length of the data of an inline image from its dictionary: /L (PDF 2.0)
+// when given, else its size from the dimensions if it is not compressed.
+// False if unknown, a color space from the resources for instance.
+static bool pdf_content_inline_image_length(const PdfObject* operands, size_t count, size_t* out_length)
+{
+	PdfObject value = pdf_content_inline_image_get(operands, count, "Length", "L");
+	if(value.type == PDF_OBJECT_TYPE_INTEGER && value.int_value >= 0)
+	{
+		*out_length = (size_t)value.int_value;
+		return true;
+	}
+	PdfObject filter = pdf_content_inline_image_get(operands, count, "Filter", "F");
+	if(filter.type == PDF_OBJECT_TYPE_NAME || (filter.type == PDF_OBJECT_TYPE_ARRAY && filter.array_value.length > 0))
+		return false;
+
+	PdfObject width = pdf_content_inline_image_get(operands, count, "Width", "W");
+	PdfObject height = pdf_content_inline_image_get(operands, count, "Height", "H");
+	PdfObject bits = pdf_content_inline_image_get(operands, count, "BitsPerComponent", "BPC");
+	PdfObject mask = pdf_content_inline_image_get(operands, count, "ImageMask", "IM");
+	PdfObject space = pdf_content_inline_image_get(operands, count, "ColorSpace", "CS");
+	int64_t components = 0;
+	int64_t bits_per_component = bits.type == PDF_OBJECT_TYPE_INTEGER ? bits.int_value : 0;
+	if(mask.type == PDF_OBJECT_TYPE_BOOLEAN && mask.bool_value)
+	{
+		components = 1;
+		bits_per_component = 1;
+	}
+	else if(space.type == PDF_OBJECT_TYPE_NAME)
+	{
+		static const struct { const char* name; int components; } spaces[] = {
+			{"G", 1}, {"DeviceGray", 1}, {"RGB", 3}, {"DeviceRGB", 3}, {"CMYK", 4}, {"DeviceCMYK", 4}
+		};
+		for(size_t i = 0; i < sizeof(spaces)/sizeof(spaces[0]); ++i)
+			if(pdf_names_are_equals(space.name_value, pdf_name(spaces[i].name))) components = spaces[i].components;
+	}
+	else if(space.type == PDF_OBJECT_TYPE_ARRAY && space.array_value.length > 0
+			&& space.array_value.start[0].type == PDF_OBJECT_TYPE_NAME
+			&& (pdf_names_are_equals(space.array_value.start[0].name_value, pdf_name("I"))
+				|| pdf_names_are_equals(space.array_value.start[0].name_value, pdf_name("Indexed"))))
+		components = 1;
+
+	if(width.type != PDF_OBJECT_TYPE_INTEGER || height.type != PDF_OBJECT_TYPE_INTEGER || components == 0) return false;
+	if(width.int_value <= 0 || height.int_value <= 0 || width.int_value > 1 << 20 || height.int_value > 1 << 20) return false;
+	if(bits_per_component != 1 && bits_per_component != 2 && bits_per_component != 4
+	   && bits_per_component != 8 && bits_per_component != 16) return false;
+	uint64_t row = ((uint64_t)width.int_value*components*bits_per_component + 7) / 8;
+	*out_length = (size_t)(row*(uint64_t)height.int_value);
+	return true;
+}
+
+// True if 'pos' is on an 'EI' keyword, which may end an inline image
+static bool pdf_content_is_inline_image_end(const uint8_t* data, size_t pos, size_t length)
+{
+	if(pos + 2 > length || data[pos] != 'E' || data[pos + 1] != 'I') return false;
+	return pos + 2 == length || !pdf_char_is_regular(data[pos + 2]);
+}
+
+// Skips the data of an inline image, 'inout_pos' is right after its 'ID'
+// and is moved on its 'EI' ('length' if there is none). The operands of
+// 'ID' (the image dictionary) give the length of the data when it is
+// known, it is jumped over if it lands on 'EI'. Otherwise, or if the
+// dictionary is wrong, we look for 'EI' (see pdf_find).
+// NOTE(Sam): The data searched ends at the first 'EI' between white spaces,
+//            binary data containing such a sequence cuts the image short.
+void pdf_content_skip_inline_image(const uint8_t* data, size_t* inout_pos, size_t length,
+								   const PdfObject* operands, size_t operands_count, size_t* out_data_length)
+{
+	size_t data_start = *inout_pos + 1; // The white space after 'ID'
+	if(data_start > length) data_start = length;
+	size_t data_length;
+	if(pdf_content_inline_image_length(operands, operands_count, &data_length) && data_length <= length - data_start)
+	{
+		// One EOL at most before 'EI', some writers put none
+		size_t end = data_start + data_length;
+		size_t pos = end;
+		if(pos < length && data[pos] == PDF_BYTE_TYPE_WHITE_SPACE_CARRIAGE_RETURN) ++pos;
+		if(pos < length && pdf_char_is_white_space(data[pos])) ++pos;
+		if(pdf_content_is_inline_image_end(data, pos, length))
+		{
+			*inout_pos = pos;
+			*out_data_length = data_length;
+			return;
+		}
+	}
+
+	size_t pos = data_start;
+	while(pos < length)
+	{
+		pos += pdf_find(data + pos, length - pos, "EI");
+		if(pos >= length) break;
+		if(pos > 0 && pdf_char_is_white_space(data[pos - 1]) && pdf_content_is_inline_image_end(data, pos, length))
+		{
+			*inout_pos = pos;
+			// The white space before 'EI' is not part of the data
+			*out_data_length = pos > data_start ? pos - 1 - data_start : 0;
+			return;
+		}
+		pos += 2;
+	}
+	*inout_pos = length;
+	*out_data_length = length - data_start;
+}
+
+// An operator of a content stream with its operands
+typedef struct {
+	PdfObject operands[PDF_CONTENT_MAX_OPERANDS];
+	size_t operands_count;
+	const char* op;
+	size_t op_len;
+	// For 'ID', whose operands are the inline image dictionary: its data
+	const uint8_t* image_data;
+	size_t image_length;
+} PdfContentOperator;
+
+void pdf_content_operator_free(PdfContentOperator* op)
+{
+	for(size_t i = 0; i < op->operands_count; ++i) pdf_object_free(&op->operands[i]);
+	op->operands_count = 0;
+}
+
+// Reads the next operator of the content stream 'data' with its operands,
+// false at the end. The operands of the previous operator in 'inout_op' are
+// freed first, pdf_content_operator_free frees those of the last one.
+// An inline image is read whole by its 'ID': 'inout_pos' moves after its
+// 'EI' without looking at the binary data, see pdf_content_skip_inline_image.
+bool pdf_content_next_operator(const uint8_t* data, size_t* inout_pos, size_t length, PdfContentOperator* inout_op)
+{
+	pdf_content_operator_free(inout_op);
+	inout_op->image_data = NULL;
+	inout_op->image_length = 0;
+	size_t pos = *inout_pos;
+	while(true)
+	{
+		pdf_skip_white_spaces_and_comments(data, &pos, length);
+		if(pos >= length) break;
+		PdfObject obj = {.type = PDF_OBJECT_TYPE_NONE};
+		size_t next = pos;
+		if(pdf_parse_object(data, &next, length, &obj))
+		{
+			if(inout_op->operands_count < PDF_CONTENT_MAX_OPERANDS) inout_op->operands[inout_op->operands_count++] = obj;
+			else pdf_object_free(&obj);
+			pos = next;
+			continue;
+		}
+
+		// Anything else is an operator, or a stray delimiter we skip
+		size_t start = pos;
+		while(pos < length && pdf_char_is_regular(data[pos])) ++pos;
+		if(pos == start) ++pos;
+		inout_op->op = (const char*)data + start;
+		inout_op->op_len = pos - start;
+		if(inout_op->op_len == 2 && memcmp(inout_op->op, "ID", 2) == 0)
+		{
+			inout_op->image_data = data + (pos + 1 < length ? pos + 1 : length);
+			pdf_content_skip_inline_image(data, &pos, length, inout_op->operands, inout_op->operands_count,
+										  &inout_op->image_length);
+			pos = pos + 2 < length ? pos + 2 : length;
+		}
+		*inout_pos = pos;
+		return true;
+	}
+	*inout_pos = pos;
+	pdf_content_operator_free(inout_op);
+	return false;
+}
+
+typedef struct {
+	PdfWriter* out;
+	bool at_line_start;
+	const PdfCMap* cmap; // Of the current font, see pdf_document_font_decoder, NULL if none
+} PdfTextOutput;
+
+static void pdf_text_write(PdfTextOutput* text, const PdfObject* obj)
+{
+	if(obj->type != PDF_OBJECT_TYPE_STRING || obj->string_value.length == 0) return;
+	const uint8_t* data = (const uint8_t*)obj->string_value.start;
+	size_t length = obj->string_value.length;
+	if(text->cmap == &pdf_cmap_none_composite)
+	{
+		for(size_t i = 0; i < length; i += 2) pdf_write_utf8(text->out, 0xFFFD);
+	}
+	else if(text->cmap != NULL && text->cmap != &pdf_cmap_none) pdf_cmap_write_utf8(text->cmap, data, length, text->out);
+	else
+	{
+		// ASCII runs as they are, the rest as Latin-1
+		size_t start = 0;
+		for(size_t i = 0; i < length; ++i)
+		{
+			if(data[i] < 0x80) continue;
+			pdf_write_bytes(text->out, data + start, i - start);
+			pdf_write_utf8(text->out, data[i]);
+			start = i + 1;
+		}
+		pdf_write_bytes(text->out, data + start, length - start);
+	}
+	text->at_line_start = false;
+}
+
+static void pdf_text_new_line(PdfTextOutput* text)
+{
+	if(text->at_line_start) return;
+	pdf_write_bytes(text->out, "\n", 1);
+	text->at_line_start = true;
+}
+
+// Writes the text of the page 'index' to 'out', see TEXT EXTRACTION
+bool pdf_document_extract_page_text(PdfDocument* doc, size_t index, PdfWriter* out)
+{
+	const PdfPage* page = pdf_document_get_page(doc, index);
+	uint8_t* data;
+	size_t length;
+	if(page == NULL || !pdf_document_page_contents(doc, page, &data, &length)) return false;
+
+	// The /Font resources, looked up by the Tf operators
+	PdfObject resources = page->resources;
+	PdfObject loaded_resources = {.type = PDF_OBJECT_TYPE_NONE};
+	if(resources.type == PDF_OBJECT_TYPE_REFERENCE
+	   && pdf_document_get_object(doc, resources.reference_value.number, &loaded_resources))
+		resources = loaded_resources;
+	PdfObject fonts = resources.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&resources.dictionary_value, pdf_name("Font"))
+		: (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+	PdfObject loaded_fonts = {.type = PDF_OBJECT_TYPE_NONE};
+	if(fonts.type == PDF_OBJECT_TYPE_REFERENCE && pdf_document_get_object(doc, fonts.reference_value.number, &loaded_fonts))
+		fonts = loaded_fonts;
+
+	PdfTextOutput text = {out, true, NULL};
+	PdfContentOperator content = {0};
+	size_t pos = 0;
+	while(pdf_content_next_operator(data, &pos, length, &content))
+	{
+		const PdfObject* operands = content.operands;
+		size_t operands_count = content.operands_count;
+		const char* op = content.op;
+		size_t op_len = content.op_len;
+		const PdfObject* last = operands_count > 0 ? &operands[operands_count - 1] : NULL;
+		if(op_len == 2 && memcmp(op, "Tj", 2) == 0 && last != NULL) pdf_text_write(&text, last);
+		else if(op_len == 1 && (op[0] == '\'' || op[0] == '"') && last != NULL)
+		{
+			pdf_text_new_line(&text);
+			pdf_text_write(&text, last);
+		}
+		else if(op_len == 2 && memcmp(op, "TJ", 2) == 0 && last != NULL && last->type == PDF_OBJECT_TYPE_ARRAY)
+		{
+			for(size_t i = 0; i < last->array_value.length; ++i)
+			{
+				const PdfObject* item = &last->array_value.start[i];
+				double adjustment = item->type == PDF_OBJECT_TYPE_INTEGER ? (double)item->int_value
+					: item->type == PDF_OBJECT_TYPE_REAL ? (double)item->real_value : 0;
+				if(adjustment < PDF_TEXT_SPACE_ADJUSTMENT && !text.at_line_start) pdf_write_bytes(out, " ", 1);
+				else pdf_text_write(&text, item);
+			}
+		}
+		else if(op_len == 2 && (memcmp(op, "T*", 2) == 0 || memcmp(op, "ET", 2) == 0)) pdf_text_new_line(&text);
+		else if(op_len == 2 && (memcmp(op, "Td", 2) == 0 || memcmp(op, "TD", 2) == 0) && operands_count == 2)
+		{
+			const PdfObject* ty = &operands[1];
+			if((ty->type == PDF_OBJECT_TYPE_INTEGER && ty->int_value != 0)
+			   || (ty->type == PDF_OBJECT_TYPE_REAL && ty->real_value != 0))
+				pdf_text_new_line(&text);
+		}
+		else if(op_len == 2 && memcmp(op, "Tf", 2) == 0 && operands_count == 2)
+		{
+			text.cmap = NULL;
+			PdfObject font = operands[0].type == PDF_OBJECT_TYPE_NAME && fonts.type == PDF_OBJECT_TYPE_DICTIONARY
+				? pdf_dictionary_get(&fonts.dictionary_value, operands[0].name_value)
+				: (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+			if(font.type == PDF_OBJECT_TYPE_REFERENCE) text.cmap = pdf_document_font_decoder(doc, font.reference_value.number);
+		}
+	}
+	pdf_content_operator_free(&content);
+	pdf_text_new_line(&text);
+	pdf_object_free(&loaded_fonts);
+	pdf_object_free(&loaded_resources);
+	pdf_free(data);
+	return !out->failed;
+}
+
+/*
+  COMMAND LINE:
+  - Runs one mode over many files on a pool of threads, each file being
+    handled by one thread from open to close with its own arena, and its
+    own memory budget when one is given.
+  - The output of a file is written in memory then to stdout in one go,
+    so the outputs of files done in parallel never mix (their order does).
+  - A report goes to stderr at the end: throughput, latency percentiles
+    over the files and the peak memory of the process.
+ */
+
+enum PDF_CLI_MODES {
+	PDF_CLI_MODE_VALIDATE,
+	PDF_CLI_MODE_STATS,
+	PDF_CLI_MODE_DUMP_JSON,
+	PDF_CLI_MODE_EXTRACT_TEXT,
+	PDF_CLI_MODE_METADATA,
+	PDF_CLI_MODE_COUNT,
+};
+
+static const char* pdf_cli_mode_names[PDF_CLI_MODE_COUNT] = {
+	"validate", "stats", "dump-json", "extract-text", "metadata",
+};
+
+static const char* pdf_cli_error_names[] = {
+	"ok", "could not open or read the file", "out of memory", "no usable xref", "could not write",
+	"encrypted with a password",
+};
+
+typedef struct {
+	int mode;
+	int open_flags;
+	size_t threads_count;
+	size_t memory_budget; // Per file, 0 for none
+	char** files;
+	size_t files_count;
+
+	PdfMutex mutex;		// Guards 'next_file' and stdout
+	size_t next_file;
+
+	// Per file results
+	double* seconds;
+	bool* failed;
+} PdfCli;
+
+typedef struct {
+	PdfCli* cli;
+	PdfArena arena;
+	PdfWriter output;
+	uint64_t bytes;
+#ifdef PDF_ENABLE_STATS
+	PdfStats stats; // Of every file processed by this worker
+#endif
+} PdfCliWorker;
+
+// Loads every object, returns how many could not be
+size_t pdf_cli_count_broken_objects(PdfDocument* doc, uint64_t* objects_by_type, uint64_t* stream_bytes)
+{
+	size_t broken = 0;
+	for(size_t i = 1; i < doc->xref_count; ++i)
+	{
+		uint8_t type = doc->xref[i].type;
+		if(type != PDF_XREF_ENTRY_IN_USE && type != PDF_XREF_ENTRY_COMPRESSED) continue;
+		PdfObject obj;
+		if(!pdf_document_get_object(doc, (uint32_t)i, &obj))
+		{
+			++broken;
+			continue;
+		}
+		if(objects_by_type != NULL) objects_by_type[obj.type] += 1;
+		if(stream_bytes != NULL && obj.type == PDF_OBJECT_TYPE_STREAM) *stream_bytes += obj.stream_value.length;
+		pdf_object_free(&obj);
+	}
+	return broken;
+}
+
+// Processes one file, its output goes to 'out'. Returns false if it failed.
+bool pdf_cli_process(PdfCli* cli, const char* filename, PdfWriter* out, uint64_t* out_size)
+{
+	PdfDocument doc;
+	int flags = cli->open_flags | (cli->mode == PDF_CLI_MODE_METADATA ? PDF_OPEN_METADATA : 0);
+	int error = pdf_document_open(&doc, filename, flags);
+	if(error)
+	{
+		pdf_write_format(out, "%s: error: %s\n", filename, pdf_cli_error_names[error]);
+		return false;
+	}
+	*out_size = doc.size;
+
+	// Files are the unit of parallelism, a page tree is walked by one thread
+	bool has_pages = cli->mode != PDF_CLI_MODE_METADATA && pdf_document_build_page_index(&doc, 1);
+	bool success = true;
+	switch(cli->mode)
+	{
+	case PDF_CLI_MODE_VALIDATE:
+	{
+		size_t broken = pdf_cli_count_broken_objects(&doc, NULL, NULL);
+		success = broken == 0 && has_pages;
+		pdf_write_format(out, "%s: ", filename);
+		if(broken > 0) pdf_write_format(out, "%zu unreadable objects, ", broken);
+		if(!has_pages) pdf_write_string(out, "broken page tree, ");
+		if(doc.was_repaired) pdf_write_string(out, "xref repaired, ");
+		if(pdf_memory_budget_failures() > 0) pdf_write_string(out, "over the memory budget, ");
+		success = success && pdf_memory_budget_failures() == 0;
+		pdf_write_string(out, success ? "ok\n" : "failed\n");
+	} break;
+	case PDF_CLI_MODE_STATS:
+	{
+		uint64_t objects_by_type[PDF_OBJECT_TYPE_COUNT] = {0};
+		uint64_t stream_bytes = 0;
+		size_t broken = pdf_cli_count_broken_objects(&doc, objects_by_type, &stream_bytes);
+		pdf_write_string(out, "{\"file\":");
+		pdf_write_json_string(out, (const uint8_t*)filename, strlen(filename));
+		pdf_write_format(out, ",\"size\":%zu,\"objects\":{", doc.size);
+		for(size_t i = 1; i < PDF_OBJECT_TYPE_COUNT; ++i)
+			pdf_write_format(out, "%s\"%s\":%llu", i > 1 ? "," : "", pdf_stats_object_type_names[i],
+							 (unsigned long long)objects_by_type[i]);
+		pdf_write_format(out, "},\"broken_objects\":%zu,\"stream_bytes\":%llu,\"pages\":%zu,\"revisions\":%zu,"
+						 "\"repaired\":%s,\"linearized\":%s,\"encrypted\":%s}\n", broken,
+						 (unsigned long long)stream_bytes, has_pages ? doc.pages_count : 0, doc.revisions_count,
+						 doc.was_repaired ? "true" : "false", doc.is_linearized ? "true" : "false",
+						 doc.is_encrypted ? "true" : "false");
+	} break;
+	case PDF_CLI_MODE_DUMP_JSON:
+	{
+		pdf_write_string(out, "{\"file\":");
+		pdf_write_json_string(out, (const uint8_t*)filename, strlen(filename));
+		pdf_write_string(out, ",\"trailer\":");
+		pdf_write_json_object(out, &doc.trailer);
+		pdf_write_string(out, ",\"objects\":");
+		pdf_document_write_json_objects(&doc, out);
+		pdf_write_string(out, "}\n");
+	} break;
+	case PDF_CLI_MODE_EXTRACT_TEXT:
+	{
+		// Contents and resources are read ahead while the first pages are extracted
+		PdfPrefetch prefetch;
+		bool is_prefetching = has_pages && pdf_document_prefetch_pages(&doc, &prefetch);
+		for(size_t i = 0; has_pages && i < doc.pages_count; ++i)
+		{
+			if(i > 0) pdf_write_bytes(out, "\f", 1);
+			pdf_document_extract_page_text(&doc, i, out);
+		}
+		if(is_prefetching) pdf_prefetch_end(&prefetch);
+		success = has_pages;
+	} break;
+	case PDF_CLI_MODE_METADATA:
+	{
+		PdfMetadata metadata;
+		success = pdf_document_read_metadata(&doc, &metadata);
+		pdf_write_string(out, "{\"file\":");
+		pdf_write_json_string(out, (const uint8_t*)filename, strlen(filename));
+		for(size_t i = 0; i < PDF_INFO_COUNT; ++i)
+		{
+			if(metadata.info[i].start == NULL) continue;
+			pdf_write_format(out, ",\"%s\":", pdf_info_key_names[i]);
+			pdf_write_json_string(out, (const uint8_t*)metadata.info[i].start, metadata.info[i].length);
+		}
+		pdf_write_format(out, ",\"pages\":%lld,\"xmp\":", (long long)metadata.pages_count);
+		if(metadata.xmp != NULL) pdf_write_json_string(out, metadata.xmp, metadata.xmp_length);
+		else pdf_write_string(out, "null");
+		pdf_write_string(out, "}\n");
+		pdf_metadata_free(&metadata);
+	} break;
+	}
+	pdf_document_close(&doc);
+	// Whatever was written is incomplete
+	return success && pdf_memory_budget_failures() == 0;
+}
+
+void pdf_cli_worker_run(void* param)
+{
+	PdfCliWorker* worker = (PdfCliWorker*)param;
+	PdfCli* cli = worker->cli;
+	while(true)
+	{
+		pdf_mutex_lock(&cli->mutex);
+		size_t index = cli->next_file++;
+		pdf_mutex_unlock(&cli->mutex);
+		if(index >= cli->files_count) break;
+
+		// The output buffer outlives the file, it must not be in the arena
+		uint64_t size = 0;
+		double start = pdf_time_seconds();
+		PdfMemoryBudget budget;
+		pdf_memory_budget_init(&budget, cli->memory_budget);
+		if(cli->memory_budget > 0) pdf_memory_budget_use(&budget);
+		pdf_arena_use(&worker->arena);
+		bool success = pdf_cli_process(cli, cli->files[index], &worker->output, &size);
+		pdf_arena_use(NULL);
+		pdf_memory_budget_use(NULL);
+		pdf_arena_reset(&worker->arena);
+		cli->seconds[index] = pdf_time_seconds() - start;
+		cli->failed[index] = !success;
+		worker->bytes += size;
+#ifdef PDF_ENABLE_STATS
+		// Counters are reset when the next document is opened
+		PdfStats stats = pdf_stats_get();
+		pdf_stats_merge(&worker->stats, &stats);
+#endif
+
+		pdf_mutex_lock(&cli->mutex);
+		fwrite(worker->output.buffer, 1, worker->output.length, stdout);
+		pdf_mutex_unlock(&cli->mutex);
+		pdf_writer_begin(&worker->output, NULL, 0);
+	}
+}
+
+// Adds the file names listed in 'list_filename' (one per line, '-' for
+// stdin) to the command line ones.
+bool pdf_cli_read_list(PdfCli* cli, const char* list_filename, size_t* inout_capacity)
+{
+	#pragma warning (disable : 4996)
+	FILE* file = strcmp(list_filename, "-") == 0 ? stdin : fopen(list_filename, "rb");
+	if(file == NULL) return false;
+	char line[4096];
+	bool success = true;
+	while(success && fgets(line, sizeof(line), file) != NULL)
+	{
+		size_t length = strlen(line);
+		while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = 0;
+		if(length == 0) continue;
+		if(cli->files_count == *inout_capacity)
+		{
+			size_t capacity = *inout_capacity ? 2*(*inout_capacity) : 64;
+			char** files = (char**)pdf_realloc(cli->files, capacity*sizeof(char*));
+			if(files == NULL) break;
+			cli->files = files;
+			*inout_capacity = capacity;
+		}
+		char* copy = (char*)pdf_malloc(length + 1);
+		success = copy != NULL;
+		if(success) memcpy(copy, line, length + 1);
+		if(success) cli->files[cli->files_count++] = copy;
+	}
+	if(file != stdin) fclose(file);
+	return success;
+}
+
+static int pdf_cli_compare_seconds(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void pdf_cli_usage(FILE* file)
+{
+	fprintf(file,
+			"Usage: main [options] <mode> <file>...\n"
+			"Modes:\n"
+			"  validate      Checks every object and the page tree can be read\n"
+			"  stats         Prints objects, pages and revisions counts as JSON lines\n"
+			"  dump-json     Prints every object as JSON, one document per line\n"
+			"  extract-text  Prints the text of every page, pages are separated by form feeds\n"
+			"  metadata      Prints /Info, the XMP metadata and the page count as JSON lines\n"
+			"Options:\n"
+			"  -j, --threads N   Number of threads (default: one per core)\n"
+			"  -l, --list FILE   Also processes the files listed in FILE, '-' for stdin\n"
+			"  -m, --memory MB   Memory budget per file, files needing more fail\n"
+			"  --repair          Always rebuilds the xref\n"
+			"  --no-repair       Fails instead of rebuilding a broken xref\n");
+}
+
+int pdf_cli_main(int argc, char** argv)
+{
+	PdfCli cli;
+	memset(&cli, 0, sizeof(PdfCli));
+	cli.mode = -1;
+	size_t files_capacity = 0;
+	for(int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		if((strcmp(arg, "-j") == 0 || strcmp(arg, "--threads") == 0) && i + 1 < argc)
+			cli.threads_count = (size_t)strtoul(argv[++i], NULL, 10);
+		else if((strcmp(arg, "-m") == 0 || strcmp(arg, "--memory") == 0) && i + 1 < argc)
+			cli.memory_budget = (size_t)strtoul(argv[++i], NULL, 10)*1024*1024;
+		else if((strcmp(arg, "-l") == 0 || strcmp(arg, "--list") == 0) && i + 1 < argc)
+		{
+			if(!pdf_cli_read_list(&cli, argv[++i], &files_capacity))
+			{
+				fprintf(stderr, "ERROR: Could not read the file list '%s'\n", argv[i]);
+				return 2;
+			}
+		}
+		else if(strcmp(arg, "--repair") == 0) cli.open_flags |= PDF_OPEN_FORCE_REPAIR;
+		else if(strcmp(arg, "--no-repair") == 0) cli.open_flags |= PDF_OPEN_NO_REPAIR;
+		else if(strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
+		{
+			pdf_cli_usage(stdout);
+			return 0;
+		}
+		else if(arg[0] == '-' && arg[1] != 0)
+		{
+			fprintf(stderr, "ERROR: Unknown option '%s'\n", arg);
+			pdf_cli_usage(stderr);
+			return 2;
+		}
+		else if(cli.mode < 0)
+		{
+			for(int mode = 0; mode < PDF_CLI_MODE_COUNT; ++mode)
+				if(strcmp(arg, pdf_cli_mode_names[mode]) == 0) cli.mode = mode;
+			if(cli.mode < 0)
+			{
+				fprintf(stderr, "ERROR: Unknown mode '%s'\n", arg);
+				pdf_cli_usage(stderr);
+				return 2;
+			}
+		}
+		else
+		{
+			if(cli.files_count == files_capacity)
+			{
+				files_capacity = files_capacity ? 2*files_capacity : 64;
+				char** files = (char**)pdf_realloc(cli.files, files_capacity*sizeof(char*));
+				if(files == NULL) return 2;
+				cli.files = files;
+			}
+			size_t length = strlen(arg);
+			cli.files[cli.files_count] = (char*)pdf_malloc(length + 1);
+			if(cli.files[cli.files_count] == NULL) return 2;
+			memcpy(cli.files[cli.files_count++], arg, length + 1);
+		}
+	}
+	if(cli.mode < 0 || cli.files_count == 0)
+	{
+		pdf_cli_usage(stderr);
+		return 2;
+	}
+
+	if(cli.threads_count == 0) cli.threads_count = pdf_cpu_count();
+	if(cli.threads_count > cli.files_count) cli.threads_count = cli.files_count;
+	cli.seconds = (double*)pdf_malloc(cli.files_count*sizeof(double));
+	cli.failed = (bool*)pdf_malloc(cli.files_count*sizeof(bool));
+	PdfCliWorker* workers = (PdfCliWorker*)pdf_malloc(cli.threads_count*sizeof(PdfCliWorker));
+	PdfThread* threads = (PdfThread*)pdf_malloc(cli.threads_count*sizeof(PdfThread));
+	bool* started = (bool*)pdf_malloc(cli.threads_count*sizeof(bool));
+	if(cli.seconds == NULL || cli.failed == NULL || workers == NULL || threads == NULL || started == NULL)
+	{
+		fprintf(stderr, "ERROR: Not enough memory...\n");
+		return 2;
+	}
+	memset(workers, 0, cli.threads_count*sizeof(PdfCliWorker));
+	pdf_mutex_init(&cli.mutex);
+
+	double start = pdf_time_seconds();
+	for(size_t i = 0; i < cli.threads_count; ++i)
+	{
+		workers[i].cli = &cli;
+		pdf_writer_begin(&workers[i].output, NULL, 0);
+		started[i] = i > 0 && pdf_thread_start(&threads[i], pdf_cli_worker_run, &workers[i]);
+	}
+	// The calling thread works too, threads which failed to start are not waited
+	pdf_cli_worker_run(&workers[0]);
+	uint64_t bytes = workers[0].bytes;
+	for(size_t i = 1; i < cli.threads_count; ++i)
+	{
+		if(started[i]) pdf_thread_join(&threads[i]);
+		bytes += workers[i].bytes;
+	}
+	double elapsed = pdf_time_seconds() - start;
+	fflush(stdout);
+
+	size_t failed_count = 0;
+	for(size_t i = 0; i < cli.files_count; ++i) failed_count += cli.failed[i];
+	qsort(cli.seconds, cli.files_count, sizeof(double), pdf_cli_compare_seconds);
+	double p50 = cli.seconds[(cli.files_count - 1)/2];
+	double p99 = cli.seconds[(size_t)((double)(cli.files_count - 1)*0.99)];
+	double megabytes = (double)bytes/(1024.0*1024.0);
+	if(elapsed <= 0) elapsed = 1e-9;
+	fprintf(stderr, "%zu files (%zu failed), %.1f MB in %.3f s with %zu threads\n",
+			cli.files_count, failed_count, megabytes, elapsed, cli.threads_count);
+	fprintf(stderr, "throughput: %.1f files/s, %.1f MB/s\n", (double)cli.files_count/elapsed, megabytes/elapsed);
+	fprintf(stderr, "latency per file: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			p50*1e3, p99*1e3, cli.seconds[cli.files_count - 1]*1e3);
+	fprintf(stderr, "peak RSS: %.1f MB\n", (double)pdf_peak_memory_usage()/(1024.0*1024.0));
+	PdfFontCacheStats font_cache = pdf_font_cache_get_stats();
+	if(font_cache.hits + font_cache.misses > 0)
+		fprintf(stderr, "font cache: %llu hits, %llu misses, %zu entries in %.1f KB\n",
+				(unsigned long long)font_cache.hits, (unsigned long long)font_cache.misses, font_cache.entries,
+				(double)font_cache.bytes/1024.0);
+
+#ifdef PDF_ENABLE_STATS
+	// Each worker counted in its own thread
+	PdfStats stats = {0};
+	for(size_t i = 0; i < cli.threads_count; ++i) pdf_stats_merge(&stats, &workers[i].stats);
+	pdf_stats_dump_json(stderr, &stats);
+#endif
+
+	for(size_t i = 0; i < cli.threads_count; ++i)
+	{
+		pdf_writer_free(&workers[i].output);
+		pdf_arena_free(&workers[i].arena);
+	}
+	for(size_t i = 0; i < cli.files_count; ++i) pdf_free(cli.files[i]);
+	pdf_mutex_destroy(&cli.mutex);
+	pdf_free(cli.files);
+	pdf_free(cli.seconds);
+	pdf_free(cli.failed);
+	pdf_free(workers);
+	pdf_free(threads);
+	pdf_free(started);
+	return failed_count > 0 ? 1 : 0;
+}
+
+// NOTE(Sam): Define PDF_NO_MAIN to include this file from another
+//            program (see bench.c) without pulling the command line tool.
+#ifndef PDF_NO_MAIN
+int main(int argc, char** argv)
+{
+	return pdf_cli_main(argc, argv);
 }
+#endif // PDF_NO_MAIN
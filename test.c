@@ -0,0 +1,2239 @@
+/*
+  Regression checks of the document API.
+
+  Most checks work on documents generated in memory, whose content is
+  known, and compare what the API reads from them with what was
+  generated. The files given on the command line (test03.pdf when none)
+  go through the checks which only compare a document with itself.
+  Compile it the same way as main.c, for example:
+
+    cl /O2 test.c
+    cc -O2 test.c -o test -lpthread -lm
+
+  Usage:
+    test [FILE...]
+
+  Prints one line per failed check and returns 1 if any failed.
+  The files some checks need are written in the current directory and
+  removed afterwards.
+ */
+
+#define PDF_NO_MAIN
+#include "main.c"
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+static size_t test_checks;
+static size_t test_failures;
+
+#define TEST_CHECK(condition, name, ...)								\
+	do {																\
+		++test_checks;													\
+		if(!(condition))												\
+		{																\
+			++test_failures;											\
+			printf("FAILED %s: ", (name));								\
+			printf(__VA_ARGS__);										\
+			printf(" (%s:%d)\n", __FILE__, __LINE__);					\
+		}																\
+	} while(0)
+
+// Growable bytes, always followed by the PDF_BUFFER_PADDING zeros the
+// documents opened from memory need
+typedef struct {
+	uint8_t* data;
+	size_t length;
+	size_t capacity;
+	bool failed;
+} TestBuffer;
+
+void test_buffer_free(TestBuffer* buffer)
+{
+	pdf_free(buffer->data);
+	memset(buffer, 0, sizeof(TestBuffer));
+}
+
+// Room for 'length' more bytes and the padding
+bool test_buffer_reserve(TestBuffer* buffer, size_t length)
+{
+	if(buffer->failed) return false;
+	size_t needed = buffer->length + length + PDF_BUFFER_PADDING;
+	if(needed <= buffer->capacity) return true;
+	size_t capacity = buffer->capacity ? 2*buffer->capacity : 4096;
+	while(capacity < needed) capacity *= 2;
+	uint8_t* data = (uint8_t*)pdf_realloc(buffer->data, capacity);
+	if(data == NULL)
+	{
+		buffer->failed = true;
+		return false;
+	}
+	buffer->data = data;
+	buffer->capacity = capacity;
+	return true;
+}
+
+void test_buffer_append(TestBuffer* buffer, const void* data, size_t length)
+{
+	if(!test_buffer_reserve(buffer, length)) return;
+	if(length > 0) memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	memset(buffer->data + buffer->length, 0, PDF_BUFFER_PADDING);
+}
+
+void test_buffer_format(TestBuffer* buffer, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	char small[256];
+	int length = vsnprintf(small, sizeof(small), format, args);
+	va_end(args);
+	if(length < 0) buffer->failed = true;
+	if(length < 0 || !test_buffer_reserve(buffer, (size_t)length + 1)) return;
+	if((size_t)length < sizeof(small)) memcpy(buffer->data + buffer->length, small, (size_t)length);
+	else
+	{
+		va_start(args, format);
+		vsnprintf((char*)buffer->data + buffer->length, (size_t)length + 1, format, args);
+		va_end(args);
+	}
+	buffer->length += (size_t)length;
+	memset(buffer->data + buffer->length, 0, PDF_BUFFER_PADDING);
+}
+
+bool test_buffers_are_equal(const TestBuffer* a, const TestBuffer* b)
+{
+	return a->length == b->length && (a->length == 0 || memcmp(a->data, b->data, a->length) == 0);
+}
+
+// True if 'text' (zero terminated) is somewhere in 'buffer'
+bool test_buffer_contains(const TestBuffer* buffer, const char* text)
+{
+	size_t length = strlen(text);
+	for(size_t i = 0; i + length <= buffer->length; ++i)
+		if(memcmp(buffer->data + i, text, length) == 0) return true;
+	return false;
+}
+
+bool test_read_file(const char* filename, TestBuffer* out)
+{
+	memset(out, 0, sizeof(TestBuffer));
+	#pragma warning (disable : 4996)
+	FILE* file = fopen(filename, "rb");
+	if(file == NULL) return false;
+	uint8_t chunk[1 << 16];
+	size_t read;
+	while((read = fread(chunk, 1, sizeof(chunk), file)) > 0) test_buffer_append(out, chunk, read);
+	fclose(file);
+	test_buffer_append(out, NULL, 0);
+	if(!out->failed) return true;
+	test_buffer_free(out);
+	return false;
+}
+
+bool test_write_file(const char* filename, const uint8_t* data, size_t length)
+{
+	#pragma warning (disable : 4996)
+	FILE* file = fopen(filename, "wb");
+	if(file == NULL) return false;
+	bool success = fwrite(data, 1, length, file) == length;
+	return fclose(file) == 0 && success;
+}
+
+// Takes the output of an in memory 'writer', which is freed
+bool test_buffer_from_writer(TestBuffer* buffer, PdfWriter* writer)
+{
+	memset(buffer, 0, sizeof(TestBuffer));
+	if(!writer->failed) test_buffer_append(buffer, writer->buffer, writer->length);
+	bool success = !writer->failed && !buffer->failed;
+	pdf_writer_free(writer);
+	if(!success) test_buffer_free(buffer);
+	return success;
+}
+
+// ----------------------------------------------------------------------------
+// Generated documents
+// ----------------------------------------------------------------------------
+
+#define TEST_PAGES 7
+// Big enough for the repair to scan several ranges in parallel
+#define TEST_BIG_PAGES 10000
+#define TEST_IMAGE_SIZE 16
+
+static const char test_xmp[] =
+	"<?xpacket begin=\"\xEF\xBB\xBF\" id=\"W5M0MpCehiHzreSzNTczkc9d\"?>"
+	"<x:xmpmeta xmlns:x=\"adobe:ns:meta/\"><rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\">"
+	"<rdf:Description xmlns:dc=\"http://purl.org/dc/elements/1.1/\"><dc:title>Round trip</dc:title>"
+	"</rdf:Description></rdf:RDF></x:xmpmeta><?xpacket end=\"w\"?>";
+
+enum TEST_CRYPT_METHODS {
+	TEST_CRYPT_RC4_40,	// Revision 2
+	TEST_CRYPT_AES_128,	// Revision 4, AESV2
+	TEST_CRYPT_AES_256,	// Revision 6, AESV3
+};
+
+// Standard security handler with an empty user password
+typedef struct {
+	int method;
+	int revision;
+	uint8_t key[32];
+	size_t key_length;
+	uint8_t owner[48];
+	uint8_t user[48];
+	uint8_t owner_key[32];
+	uint8_t user_key[32];
+	uint8_t permissions_check[16];
+	uint8_t id[16];
+} TestEncryption;
+
+#define TEST_PERMISSIONS -44
+
+// RC4 with 'key' xored with each byte of 'rounds' in turn, the
+// algorithms 3 and 5 of revisions 3 and 4
+void test_rc4_rounds(const uint8_t* key, size_t key_length, int rounds, uint8_t* data, size_t length)
+{
+	for(int i = 0; i < rounds; ++i)
+	{
+		uint8_t round_key[16];
+		for(size_t k = 0; k < key_length; ++k) round_key[k] = key[k] ^ (uint8_t)i;
+		PdfRc4 rc4;
+		pdf_rc4_init(&rc4, round_key, key_length);
+		pdf_rc4_apply(&rc4, data, data, length);
+	}
+}
+
+void test_encryption_init(TestEncryption* encryption, int method)
+{
+	memset(encryption, 0, sizeof(TestEncryption));
+	encryption->method = method;
+	for(int i = 0; i < 16; ++i) encryption->id[i] = (uint8_t)(0x30 + 7*i);
+	uint8_t p[4] = {(uint8_t)TEST_PERMISSIONS, (uint8_t)(TEST_PERMISSIONS >> 8), (uint8_t)(TEST_PERMISSIONS >> 16),
+					(uint8_t)(TEST_PERMISSIONS >> 24)};
+
+	if(method == TEST_CRYPT_AES_256)
+	{
+		// Algorithms 8 and 9 for the empty user password, the owner
+		// entries are not checked by readers
+		encryption->revision = 6;
+		encryption->key_length = 32;
+		for(int i = 0; i < 32; ++i) encryption->key[i] = (uint8_t)(0xA0 ^ 13*i);
+		for(int i = 0; i < 16; ++i) encryption->user[32 + i] = (uint8_t)(0x11*i + 3);
+		pdf_encryption_hash(6, encryption->user + 32, encryption->user);
+		uint8_t hash[32];
+		pdf_encryption_hash(6, encryption->user + 40, hash);
+		static const uint8_t zero_iv[16] = {0};
+		PdfAes aes;
+		pdf_aes_init(&aes, hash, 32);
+		pdf_aes_encrypt_cbc(&aes, zero_iv, encryption->key, encryption->user_key, 32);
+		for(int i = 0; i < 48; ++i) encryption->owner[i] = (uint8_t)(0x5A + i);
+		for(int i = 0; i < 32; ++i) encryption->owner_key[i] = (uint8_t)(0xC3 - i);
+		// Algorithm 10
+		uint8_t permissions[16] = {p[0], p[1], p[2], p[3], 0xFF, 0xFF, 0xFF, 0xFF, 'T', 'a', 'd', 'b', 1, 2, 3, 4};
+		pdf_aes_init(&aes, encryption->key, 32);
+		pdf_aes_encrypt_block(&aes, permissions, encryption->permissions_check);
+		return;
+	}
+
+	// Algorithm 3 with an empty owner password
+	encryption->revision = method == TEST_CRYPT_RC4_40 ? 2 : 4;
+	encryption->key_length = method == TEST_CRYPT_RC4_40 ? 5 : 16;
+	size_t key_length = encryption->key_length;
+	uint8_t hash[16];
+	pdf_md5(pdf_password_padding, 32, hash);
+	for(int i = 0; encryption->revision >= 3 && i < 50; ++i) pdf_md5(hash, 16, hash);
+	memcpy(encryption->owner, pdf_password_padding, 32);
+	test_rc4_rounds(hash, key_length, encryption->revision >= 3 ? 20 : 1, encryption->owner, 32);
+
+	// Algorithm 2
+	PdfMd5 md5;
+	pdf_md5_begin(&md5);
+	pdf_md5_update(&md5, pdf_password_padding, 32);
+	pdf_md5_update(&md5, encryption->owner, 32);
+	pdf_md5_update(&md5, p, 4);
+	pdf_md5_update(&md5, encryption->id, 16);
+	pdf_md5_end(&md5, hash);
+	for(int i = 0; encryption->revision >= 3 && i < 50; ++i) pdf_md5(hash, key_length, hash);
+	memcpy(encryption->key, hash, key_length);
+
+	// Algorithms 4 and 5 for /U, whose last 16 bytes are free in revision 4
+	if(encryption->revision == 2)
+	{
+		memcpy(encryption->user, pdf_password_padding, 32);
+		test_rc4_rounds(encryption->key, key_length, 1, encryption->user, 32);
+		return;
+	}
+	pdf_md5_begin(&md5);
+	pdf_md5_update(&md5, pdf_password_padding, 32);
+	pdf_md5_update(&md5, encryption->id, 16);
+	pdf_md5_end(&md5, encryption->user);
+	test_rc4_rounds(encryption->key, key_length, 20, encryption->user, 16);
+}
+
+// Appends 'data' encrypted with the key of the object 'number' (algorithm
+// 1, the file key itself for AES-256) to 'out'
+void test_encrypt(const TestEncryption* encryption, uint32_t number, const uint8_t* data, size_t length, TestBuffer* out)
+{
+	uint8_t key[32];
+	size_t key_length = encryption->key_length;
+	memcpy(key, encryption->key, key_length);
+	if(encryption->method != TEST_CRYPT_AES_256)
+	{
+		uint8_t salt[9] = {(uint8_t)number, (uint8_t)(number >> 8), (uint8_t)(number >> 16), 0, 0, 's', 'A', 'l', 'T'};
+		uint8_t hash[16];
+		PdfMd5 md5;
+		pdf_md5_begin(&md5);
+		pdf_md5_update(&md5, encryption->key, encryption->key_length);
+		pdf_md5_update(&md5, salt, encryption->method == TEST_CRYPT_AES_128 ? 9 : 5);
+		pdf_md5_end(&md5, hash);
+		key_length = key_length + 5 < 16 ? key_length + 5 : 16;
+		memcpy(key, hash, key_length);
+	}
+	if(encryption->method == TEST_CRYPT_RC4_40)
+	{
+		if(!test_buffer_reserve(out, length)) return;
+		PdfRc4 rc4;
+		pdf_rc4_init(&rc4, key, key_length);
+		pdf_rc4_apply(&rc4, data, out->data + out->length, length);
+		out->length += length;
+		memset(out->data + out->length, 0, PDF_BUFFER_PADDING);
+		return;
+	}
+
+	// The IV first, then the data padded to whole blocks (PKCS#7)
+	size_t padded_length = (length/16 + 1)*16;
+	if(!test_buffer_reserve(out, 16 + padded_length)) return;
+	uint8_t* iv = out->data + out->length;
+	for(int i = 0; i < 16; ++i) iv[i] = (uint8_t)(number*31 + i);
+	uint8_t* padded = iv + 16;
+	memcpy(padded, data, length);
+	memset(padded + length, (int)(padded_length - length), padded_length - length);
+	PdfAes aes;
+	pdf_aes_init(&aes, key, key_length);
+	pdf_aes_encrypt_cbc(&aes, iv, padded, padded, padded_length);
+	out->length += 16 + padded_length;
+	memset(out->data + out->length, 0, PDF_BUFFER_PADDING);
+}
+
+typedef struct {
+	size_t pages_count;
+	size_t padding_length; // Of comments before the first page and after the last
+	const TestEncryption* encryption; // NULL for a document in clear
+} TestDocumentOptions;
+
+void test_write_hex(TestBuffer* out, const uint8_t* data, size_t length)
+{
+	test_buffer_append(out, "<", 1);
+	for(size_t i = 0; i < length; ++i) test_buffer_format(out, "%02X", data[i]);
+	test_buffer_append(out, ">", 1);
+}
+
+void test_write_string(TestBuffer* out, const TestDocumentOptions* options, uint32_t number, const uint8_t* data,
+					   size_t length)
+{
+	TestBuffer encrypted = {0};
+	if(options->encryption != NULL)
+	{
+		test_encrypt(options->encryption, number, data, length, &encrypted);
+		data = encrypted.data;
+		length = encrypted.length;
+	}
+	test_write_hex(out, data, length);
+	test_buffer_free(&encrypted);
+}
+
+void test_write_stream(TestBuffer* out, const TestDocumentOptions* options, uint32_t number, const char* dictionary,
+					   const uint8_t* data, size_t length)
+{
+	TestBuffer encrypted = {0};
+	if(options->encryption != NULL)
+	{
+		test_encrypt(options->encryption, number, data, length, &encrypted);
+		data = encrypted.data;
+		length = encrypted.length;
+	}
+	test_buffer_format(out, "<<%s/Length %zu>>\nstream\n", dictionary, length);
+	test_buffer_append(out, data, length);
+	test_buffer_append(out, "\nendstream", 10);
+	test_buffer_free(&encrypted);
+}
+
+// A comment line of 'length' bytes
+void test_write_padding(TestBuffer* out, size_t length)
+{
+	if(length < 2 || !test_buffer_reserve(out, length)) return;
+	memset(out->data + out->length, ' ', length);
+	out->data[out->length] = '%';
+	out->data[out->length + length - 1] = '\n';
+	out->length += length;
+	memset(out->data + out->length, 0, PDF_BUFFER_PADDING);
+}
+
+// Text drawn by the page 'page' of the generated documents
+int test_page_content(char* content, size_t size, size_t page)
+{
+	return snprintf(content, size,
+					"BT /F1 12 Tf 72 700 Td (Page %zu of the round trip) Tj T* (caf\\351 cr\\350me) Tj ET\n"
+					"q 16 0 0 16 72 600 cm /Im0 Do Q\n", page + 1);
+}
+
+// A document of 'pages_count' pages under two intermediate nodes of the
+// page tree, which give their /MediaBox, /Resources and /Rotate. Every
+// page draws the same uncompressed image, odd pages through an identical
+// copy of it, and object 9 is reached by nothing.
+bool test_generate_document(const TestDocumentOptions* options, TestBuffer* out)
+{
+	enum { CATALOG = 1, ROOT, LEFT, RIGHT, FONT, IMAGE, IMAGE_COPY, INFO, ORPHAN, METADATA, ENCRYPT, FIRST_PAGE };
+	size_t pages_count = options->pages_count;
+	uint32_t count = (uint32_t)(FIRST_PAGE + 2*pages_count);
+	uint64_t* offsets = (uint64_t*)pdf_malloc(count*sizeof(uint64_t));
+	memset(out, 0, sizeof(TestBuffer));
+	if(offsets == NULL) return false;
+	test_buffer_append(out, "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n", 15);
+
+	uint8_t image[TEST_IMAGE_SIZE*TEST_IMAGE_SIZE];
+	for(size_t i = 0; i < sizeof(image); ++i) image[i] = (uint8_t)((i % TEST_IMAGE_SIZE)*(i / TEST_IMAGE_SIZE));
+	char image_dictionary[128];
+	snprintf(image_dictionary, sizeof(image_dictionary),
+			 "/Type/XObject/Subtype/Image/Width %d/Height %d/BitsPerComponent 8/ColorSpace/DeviceGray",
+			 TEST_IMAGE_SIZE, TEST_IMAGE_SIZE);
+	size_t left_count = pages_count/2;
+	const TestEncryption* encryption = options->encryption;
+
+	for(uint32_t number = 1; number < count; ++number)
+	{
+		if(number == FIRST_PAGE) test_write_padding(out, options->padding_length);
+		offsets[number] = out->length;
+		if(number == ENCRYPT && encryption == NULL)
+		{
+			// A free entry
+			offsets[number] = 0;
+			continue;
+		}
+		test_buffer_format(out, "%u 0 obj\n", number);
+		switch(number)
+		{
+		case CATALOG:
+		{
+			test_buffer_format(out, "<</Type/Catalog/Pages %u 0 R/Metadata %u 0 R>>", ROOT, METADATA);
+		} break;
+		case ROOT:
+		{
+			test_buffer_format(out, "<</Type/Pages/Kids[%u 0 R %u 0 R]/Count %zu/MediaBox[0 0 612 792]"
+							   "/Resources<</Font<</F1 %u 0 R>>/XObject<</Im0 %u 0 R>>>>>>",
+							   LEFT, RIGHT, pages_count, FONT, IMAGE);
+		} break;
+		case LEFT:
+		case RIGHT:
+		{
+			size_t first = number == LEFT ? 0 : left_count;
+			size_t end = number == LEFT ? left_count : pages_count;
+			test_buffer_format(out, "<</Type/Pages/Parent %u 0 R/Count %zu/Kids[", ROOT, end - first);
+			for(size_t i = first; i < end; ++i) test_buffer_format(out, "%zu 0 R ", FIRST_PAGE + 2*i);
+			test_buffer_append(out, "]", 1);
+			if(number == RIGHT) test_buffer_append(out, "/Rotate 90", 10);
+			test_buffer_append(out, ">>", 2);
+		} break;
+		case FONT:
+		{
+			test_buffer_format(out, "<</Type/Font/Subtype/Type1/BaseFont/Helvetica/Encoding/WinAnsiEncoding>>");
+		} break;
+		case IMAGE:
+		case IMAGE_COPY: test_write_stream(out, options, number, image_dictionary, image, sizeof(image)); break;
+		case INFO:
+		{
+			// A PDFDocEncoding title and an UTF-16BE author
+			static const uint8_t author[] = {0xFE, 0xFF, 0x00, 'Z', 0x00, 'o', 0x00, 0xEB};
+			test_buffer_append(out, "<</Title", 8);
+			test_write_string(out, options, number, (const uint8_t*)"Round trip", 10);
+			test_buffer_append(out, "/Author", 7);
+			test_write_string(out, options, number, author, sizeof(author));
+			test_buffer_append(out, ">>", 2);
+		} break;
+		case ORPHAN:
+		{
+			const char* data = "Nothing refers to this stream.";
+			test_write_stream(out, options, number, "", (const uint8_t*)data, strlen(data));
+		} break;
+		case METADATA:
+		{
+			test_write_stream(out, options, number, "/Type/Metadata/Subtype/XML", (const uint8_t*)test_xmp,
+							  sizeof(test_xmp) - 1);
+		} break;
+		case ENCRYPT:
+		{
+			static const char* filters[] = {"", "/CF<</StdCF<</CFM/AESV2/AuthEvent/DocOpen/Length 16>>>>",
+											"/CF<</StdCF<</CFM/AESV3/AuthEvent/DocOpen/Length 32>>>>"};
+			int version = encryption->method == TEST_CRYPT_RC4_40 ? 1 : encryption->method == TEST_CRYPT_AES_128 ? 4 : 5;
+			test_buffer_format(out, "<</Filter/Standard/V %d/R %d/Length %zu%s", version, encryption->revision,
+							   8*encryption->key_length, filters[encryption->method]);
+			if(version >= 4) test_buffer_format(out, "/StmF/StdCF/StrF/StdCF");
+			size_t length = encryption->revision >= 5 ? 48 : 32;
+			test_buffer_format(out, "/P %d/O", TEST_PERMISSIONS);
+			test_write_hex(out, encryption->owner, length);
+			test_buffer_append(out, "/U", 2);
+			test_write_hex(out, encryption->user, length);
+			if(encryption->revision >= 5)
+			{
+				test_buffer_append(out, "/OE", 3);
+				test_write_hex(out, encryption->owner_key, 32);
+				test_buffer_append(out, "/UE", 3);
+				test_write_hex(out, encryption->user_key, 32);
+				test_buffer_append(out, "/Perms", 6);
+				test_write_hex(out, encryption->permissions_check, 16);
+			}
+			test_buffer_append(out, ">>", 2);
+		} break;
+		default:
+		{
+			size_t page = (number - FIRST_PAGE)/2;
+			if((number - FIRST_PAGE) % 2 == 0)
+			{
+				test_buffer_format(out, "<</Type/Page/Parent %u 0 R/Contents %u 0 R", page < left_count ? LEFT : RIGHT,
+								   number + 1);
+				// Odd pages draw the copy of the image
+				if(page % 2 == 1)
+					test_buffer_format(out, "/Resources<</Font<</F1 %u 0 R>>/XObject<</Im0 %u 0 R>>>>", FONT, IMAGE_COPY);
+				test_buffer_append(out, ">>", 2);
+			}
+			else
+			{
+				char content[256];
+				int length = test_page_content(content, sizeof(content), page);
+				test_write_stream(out, options, number, "", (const uint8_t*)content, (size_t)length);
+			}
+		} break;
+		}
+		test_buffer_append(out, "\nendobj\n", 8);
+	}
+	test_write_padding(out, options->padding_length);
+
+	uint64_t xref = out->length;
+	test_buffer_format(out, "xref\n0 %u\n0000000000 65535 f \n", count);
+	for(uint32_t number = 1; number < count; ++number)
+	{
+		if(offsets[number] == 0) test_buffer_append(out, "0000000000 00000 f \n", 20);
+		else test_buffer_format(out, "%010llu 00000 n \n", (unsigned long long)offsets[number]);
+	}
+	test_buffer_format(out, "trailer\n<</Size %u/Root %u 0 R/Info %u 0 R", count, CATALOG, INFO);
+	if(encryption != NULL)
+	{
+		test_buffer_format(out, "/Encrypt %u 0 R/ID[", ENCRYPT);
+		test_write_hex(out, encryption->id, 16);
+		test_write_hex(out, encryption->id, 16);
+		test_buffer_append(out, "]", 1);
+	}
+	test_buffer_format(out, ">>\nstartxref\n%llu\n%%%%EOF\n", (unsigned long long)xref);
+	pdf_free(offsets);
+	if(!out->failed) return true;
+	test_buffer_free(out);
+	return false;
+}
+
+bool test_generate(size_t pages_count, TestBuffer* out)
+{
+	TestDocumentOptions options = {0};
+	options.pages_count = pages_count;
+	return test_generate_document(&options, out);
+}
+
+// A document of one page drawing 'content' with the resources 'resources'.
+// The 'objects_count' objects given are numbered from 5, after the catalog,
+// the pages, the page and its content stream.
+bool test_generate_page(const char* resources, const uint8_t* content, size_t content_length,
+						const TestBuffer* objects, size_t objects_count, TestBuffer* out)
+{
+	uint32_t count = (uint32_t)(5 + objects_count);
+	uint64_t* offsets = (uint64_t*)pdf_malloc(count*sizeof(uint64_t));
+	memset(out, 0, sizeof(TestBuffer));
+	if(offsets == NULL) return false;
+	test_buffer_append(out, "%PDF-1.4\n", 9);
+	for(uint32_t number = 1; number < count; ++number)
+	{
+		offsets[number] = out->length;
+		test_buffer_format(out, "%u 0 obj\n", number);
+		if(number == 1) test_buffer_format(out, "<</Type/Catalog/Pages 2 0 R>>");
+		else if(number == 2) test_buffer_format(out, "<</Type/Pages/Kids[3 0 R]/Count 1>>");
+		else if(number == 3)
+			test_buffer_format(out, "<</Type/Page/Parent 2 0 R/MediaBox[0 0 612 792]/Resources%s/Contents 4 0 R>>", resources);
+		else if(number == 4)
+		{
+			test_buffer_format(out, "<</Length %zu>>\nstream\n", content_length);
+			test_buffer_append(out, content, content_length);
+			test_buffer_append(out, "\nendstream", 10);
+		}
+		else test_buffer_append(out, objects[number - 5].data, objects[number - 5].length);
+		test_buffer_append(out, "\nendobj\n", 8);
+	}
+	uint64_t xref = out->length;
+	test_buffer_format(out, "xref\n0 %u\n0000000000 65535 f \n", count);
+	for(uint32_t number = 1; number < count; ++number)
+		test_buffer_format(out, "%010llu 00000 n \n", (unsigned long long)offsets[number]);
+	test_buffer_format(out, "trailer\n<</Size %u/Root 1 0 R>>\nstartxref\n%llu\n%%%%EOF\n", count,
+					   (unsigned long long)xref);
+	pdf_free(offsets);
+	if(!out->failed) return true;
+	test_buffer_free(out);
+	return false;
+}
+
+// Body of a stream object for test_generate_page
+void test_stream_object(TestBuffer* out, const char* dictionary, const uint8_t* data, size_t length)
+{
+	memset(out, 0, sizeof(TestBuffer));
+	test_buffer_format(out, "<<%s/Length %zu>>\nstream\n", dictionary, length);
+	test_buffer_append(out, data, length);
+	test_buffer_append(out, "\nendstream", 10);
+}
+
+// Offset of the last 'text' (zero terminated) in 'buffer', its length if
+// there is none
+size_t test_find_last(const TestBuffer* buffer, const char* text)
+{
+	size_t length = strlen(text);
+	for(size_t i = buffer->length; i >= length; --i)
+		if(memcmp(buffer->data + i - length, text, length) == 0) return i - length;
+	return buffer->length;
+}
+
+// Text of every page, one after the other
+bool test_document_text(PdfDocument* doc, TestBuffer* out)
+{
+	PdfWriter writer = {0};
+	pdf_writer_begin(&writer, NULL, 0);
+	size_t count = pdf_document_page_count(doc);
+	bool success = true;
+	for(size_t i = 0; i < count; ++i)
+	{
+		success = success && pdf_document_extract_page_text(doc, i, &writer);
+		pdf_write_bytes(&writer, "\f", 1);
+	}
+	return test_buffer_from_writer(out, &writer) && success;
+}
+
+// Every object of 'doc' can be loaded, and how many there are of each type
+// with the bytes of stream data (xref and object streams left out).
+// Returns the number of objects which can't be loaded.
+size_t test_count_objects(PdfDocument* doc, uint64_t* objects_by_type, uint64_t* stream_bytes)
+{
+	size_t broken = 0;
+	for(size_t i = 1; i < doc->xref_count; ++i)
+	{
+		uint8_t type = doc->xref[i].type;
+		if(type != PDF_XREF_ENTRY_IN_USE && type != PDF_XREF_ENTRY_COMPRESSED) continue;
+		PdfObject obj;
+		if(!pdf_document_get_object(doc, (uint32_t)i, &obj))
+		{
+			broken += 1;
+			continue;
+		}
+		PdfObject stream_type = obj.type == PDF_OBJECT_TYPE_STREAM
+			? pdf_dictionary_get(&obj.stream_value.dictionary, pdf_name("Type")) : (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+		bool is_rebuilt = stream_type.type == PDF_OBJECT_TYPE_NAME
+			&& (pdf_names_are_equals(stream_type.name_value, pdf_name("XRef"))
+				|| pdf_names_are_equals(stream_type.name_value, pdf_name("ObjStm")));
+		if(!is_rebuilt)
+		{
+			objects_by_type[obj.type] += 1;
+			if(obj.type == PDF_OBJECT_TYPE_STREAM) *stream_bytes += obj.stream_value.length;
+		}
+		pdf_object_free(&obj);
+	}
+	return broken;
+}
+
+// ----------------------------------------------------------------------------
+// Xref repair
+// ----------------------------------------------------------------------------
+
+// Checks 'repaired' found every object of 'doc' where its xref says
+void test_check_repaired(const char* name, const char* what, PdfDocument* doc, PdfDocument* repaired)
+{
+	TEST_CHECK(repaired->was_repaired, name, "%s: not repaired", what);
+	size_t missing = 0;
+	for(size_t i = 1; i < doc->xref_count; ++i)
+	{
+		const PdfXrefEntry* entry = &doc->xref[i];
+		if(entry->type == PDF_XREF_ENTRY_FREE) continue;
+		if(i >= repaired->xref_count || repaired->xref[i].type != entry->type
+		   || repaired->xref[i].offset != entry->offset) missing += 1;
+	}
+	TEST_CHECK(missing == 0, name, "%s: %zu objects not found where they are", what, missing);
+	PdfObject root = pdf_dictionary_get(&doc->trailer.dictionary_value, pdf_name("Root"));
+	PdfObject repaired_root = pdf_dictionary_get(&repaired->trailer.dictionary_value, pdf_name("Root"));
+	TEST_CHECK(repaired_root.type == PDF_OBJECT_TYPE_REFERENCE && root.type == PDF_OBJECT_TYPE_REFERENCE
+			   && repaired_root.reference_value.number == root.reference_value.number, name, "%s: no catalog", what);
+	TestBuffer text, repaired_text;
+	bool has_text = test_document_text(doc, &text);
+	bool has_repaired_text = test_document_text(repaired, &repaired_text);
+	TEST_CHECK(has_text && has_repaired_text && test_buffers_are_equal(&text, &repaired_text), name,
+			   "%s: text differs", what);
+	if(has_text) test_buffer_free(&text);
+	if(has_repaired_text) test_buffer_free(&repaired_text);
+}
+
+// Opens a broken copy of 'buffer', which must be repaired unless
+// PDF_OPEN_NO_REPAIR is given
+void test_repair_copy(const char* name, const char* what, PdfDocument* doc, const TestBuffer* broken)
+{
+	PdfDocument repaired;
+	int error = pdf_document_open_memory(&repaired, broken->data, broken->length, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_XREF, name, "%s: opens with error %d without repair", what, error);
+	if(!error) pdf_document_close(&repaired);
+	error = pdf_document_open_memory(&repaired, broken->data, broken->length, 0);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "%s: repair gives error %d", what, error);
+	if(error) return;
+	test_check_repaired(name, what, doc, &repaired);
+	pdf_document_close(&repaired);
+}
+
+void test_repair(const char* name, const TestBuffer* buffer, size_t threads_count)
+{
+	PdfDocument doc;
+	int error = pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "repair: open gives error %d", error);
+	if(error) return;
+	TEST_CHECK(!doc.was_repaired, name, "repair: a sound file is repaired");
+
+	PdfDocument repaired;
+	error = pdf_document_open_memory(&repaired, buffer->data, buffer->length, PDF_OPEN_FORCE_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "forced repair: error %d", error);
+	if(!error)
+	{
+		test_check_repaired(name, "forced repair", &doc, &repaired);
+		pdf_document_close(&repaired);
+	}
+	if(threads_count > 1
+	   && pdf_document_open_memory(&repaired, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE)
+	{
+		bool success = pdf_document_repair_xref(&repaired, threads_count);
+		TEST_CHECK(success, name, "repair on %zu threads failed", threads_count);
+		if(success) test_check_repaired(name, "parallel repair", &doc, &repaired);
+		pdf_document_close(&repaired);
+	}
+
+	// A startxref pointing to the header
+	size_t startxref = test_find_last(buffer, "startxref");
+	if(startxref < buffer->length)
+	{
+		TestBuffer broken = {0};
+		test_buffer_append(&broken, buffer->data, buffer->length);
+		for(size_t i = startxref + 9; i < broken.length && broken.data[i] != '%'; ++i)
+			if(broken.data[i] >= '1' && broken.data[i] <= '9') broken.data[i] = '0';
+		if(!broken.failed) test_repair_copy(name, "bad startxref", &doc, &broken);
+		test_buffer_free(&broken);
+	}
+
+	// The xref table and trailer cut out, when the file has a single one
+	size_t xref = test_find_last(buffer, "\nxref");
+	size_t startxref_count = 0;
+	for(size_t i = 0; i + 9 <= buffer->length; ++i)
+		if(memcmp(buffer->data + i, "startxref", 9) == 0) startxref_count += 1;
+	if(startxref_count != 1) xref = buffer->length;
+	// Without its trailer an encrypted document loses its /Encrypt
+	if(doc.is_encrypted) xref = buffer->length;
+	if(xref < buffer->length)
+	{
+		TestBuffer broken = {0};
+		test_buffer_append(&broken, buffer->data, xref + 1);
+		test_buffer_append(&broken, "%%EOF\n", 6);
+		if(!broken.failed) test_repair_copy(name, "no xref nor trailer", &doc, &broken);
+		test_buffer_free(&broken);
+	}
+	pdf_document_close(&doc);
+}
+
+// ----------------------------------------------------------------------------
+// Incremental update
+// ----------------------------------------------------------------------------
+
+void test_incremental_update(const char* name, const TestBuffer* buffer)
+{
+	PdfDocument doc;
+	int error = pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "incremental update: open gives error %d", error);
+	if(error) return;
+	size_t pages = pdf_document_page_count(&doc);
+
+	// A new /Info, the update must leave the original bytes as they are
+	static const uint8_t info_source[64 + PDF_BUFFER_PADDING] = "<</Title(Updated)>>";
+	PdfObject info = {0};
+	size_t pos = 0;
+	bool has_info = pdf_parse_object(info_source, &pos, strlen((const char*)info_source), &info);
+	uint32_t info_number = 0;
+	PdfObject reference = pdf_dictionary_get(&doc.trailer.dictionary_value, pdf_name("Info"));
+	if(reference.type == PDF_OBJECT_TYPE_REFERENCE) info_number = reference.reference_value.number;
+	TEST_CHECK(has_info && info_number != 0 && pdf_document_set_object(&doc, info_number, info), name,
+			   "incremental update: can't change /Info");
+	size_t revisions_count = doc.revisions_count;
+	const char* filename = "test-incremental.pdf";
+	error = pdf_document_save_incremental(&doc, filename);
+	pdf_document_close(&doc);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "incremental update: error %d", error);
+	if(error) return;
+
+	TestBuffer updated;
+	bool has_updated = test_read_file(filename, &updated);
+	remove(filename);
+	TEST_CHECK(has_updated && updated.length > buffer->length && memcmp(updated.data, buffer->data, buffer->length) == 0,
+			   name, "incremental update: the original bytes changed");
+	if(!has_updated) return;
+	error = pdf_document_open_memory(&doc, updated.data, updated.length, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "incremental update: reopen gives error %d", error);
+	if(!error)
+	{
+		TEST_CHECK(pdf_document_page_count(&doc) == pages, name, "incremental update: pages changed");
+		TEST_CHECK(doc.revisions_count == revisions_count + 1, name, "incremental update: %zu revisions instead of %zu",
+				   doc.revisions_count, revisions_count + 1);
+		PdfObject updated_info;
+		bool has_updated_info = pdf_document_get_object(&doc, info_number, &updated_info);
+		PdfObject title = has_updated_info && updated_info.type == PDF_OBJECT_TYPE_DICTIONARY
+			? pdf_dictionary_get(&updated_info.dictionary_value, pdf_name("Title")) : (PdfObject){0};
+		TEST_CHECK(title.type == PDF_OBJECT_TYPE_STRING && title.string_value.length == 7
+				   && memcmp(title.string_value.start, "Updated", 7) == 0, name, "incremental update: /Info not updated");
+		if(has_updated_info) pdf_object_free(&updated_info);
+
+		// The previous revision still has the previous /Info
+		PdfObject old_info;
+		bool has_old_info = revisions_count > 0
+			&& pdf_document_get_object_at_revision(&doc, info_number, revisions_count - 1, &old_info);
+		PdfObject old_title = has_old_info && old_info.type == PDF_OBJECT_TYPE_DICTIONARY
+			? pdf_dictionary_get(&old_info.dictionary_value, pdf_name("Title")) : (PdfObject){0};
+		TEST_CHECK(old_title.type != PDF_OBJECT_TYPE_STRING || old_title.string_value.length != 7
+				   || memcmp(old_title.string_value.start, "Updated", 7) != 0, name,
+				   "incremental update: the previous revision is lost");
+		TEST_CHECK(has_old_info, name, "incremental update: no previous revision");
+		if(has_old_info) pdf_object_free(&old_info);
+		pdf_document_close(&doc);
+	}
+	test_buffer_free(&updated);
+}
+
+// ----------------------------------------------------------------------------
+// Full saves
+// ----------------------------------------------------------------------------
+
+// Checks the document written in 'saved' reads back without repair with
+// the objects, pages and text of 'doc'. 'same_objects' is false for saves
+// which may drop or merge objects.
+void test_check_written(const char* name, const char* what, PdfDocument* doc, const TestBuffer* saved,
+						bool same_objects)
+{
+	PdfDocument reopened;
+	int error = pdf_document_open_memory(&reopened, saved->data, saved->length, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "%s: reopen gives error %d", what, error);
+	if(error) return;
+	uint64_t objects[PDF_OBJECT_TYPE_COUNT] = {0}, reopened_objects[PDF_OBJECT_TYPE_COUNT] = {0};
+	uint64_t stream_bytes = 0, reopened_stream_bytes = 0;
+	test_count_objects(doc, objects, &stream_bytes);
+	size_t broken = test_count_objects(&reopened, reopened_objects, &reopened_stream_bytes);
+	// Encrypted documents are written in clear, without their /Encrypt
+	if(doc->is_encrypted && objects[PDF_OBJECT_TYPE_DICTIONARY] > 0) objects[PDF_OBJECT_TYPE_DICTIONARY] -= 1;
+	TEST_CHECK(broken == 0, name, "%s: %zu objects can't be read", what, broken);
+	TEST_CHECK(!same_objects || memcmp(objects, reopened_objects, sizeof(objects)) == 0, name,
+			   "%s: other objects", what);
+	size_t pages = pdf_document_page_count(doc);
+	size_t reopened_pages = pdf_document_page_count(&reopened);
+	TEST_CHECK(reopened_pages == pages, name, "%s: %zu pages instead of %zu", what, reopened_pages, pages);
+	TestBuffer text, reopened_text;
+	bool has_text = test_document_text(doc, &text);
+	bool has_reopened_text = test_document_text(&reopened, &reopened_text);
+	TEST_CHECK(has_text && has_reopened_text && test_buffers_are_equal(&text, &reopened_text), name, "%s: text differs",
+			   what);
+	if(has_text) test_buffer_free(&text);
+	if(has_reopened_text) test_buffer_free(&reopened_text);
+	TEST_CHECK(!reopened.is_encrypted, name, "%s: still encrypted", what);
+	pdf_document_close(&reopened);
+}
+
+bool test_save(PdfDocument* doc, int flags, TestBuffer* out)
+{
+	PdfWriter writer = {0};
+	pdf_writer_begin(&writer, NULL, 0);
+	int error = pdf_document_write(doc, &writer, flags);
+	return test_buffer_from_writer(out, &writer) && error == PDF_ERROR_NONE;
+}
+
+static const struct {
+	int flags;
+	const char* name;
+} test_saves[] = {
+	{0, "classic save"},
+	{PDF_SAVE_XREF_STREAM, "xref stream save"},
+	{PDF_SAVE_OBJECT_STREAMS, "object streams save"},
+	{PDF_SAVE_OPTIMIZE, "optimized save"},
+	{PDF_SAVE_OPTIMIZE | PDF_SAVE_OBJECT_STREAMS, "optimized object streams save"},
+};
+
+void test_save_round_trips(const char* name, PdfDocument* doc)
+{
+	for(size_t i = 0; i < sizeof(test_saves)/sizeof(test_saves[0]); ++i)
+	{
+		int flags = test_saves[i].flags;
+		const char* what = test_saves[i].name;
+		TestBuffer saved;
+		bool has_saved = test_save(doc, flags, &saved);
+		TEST_CHECK(has_saved, name, "%s failed", what);
+		if(!has_saved) continue;
+		test_check_written(name, what, doc, &saved, !(flags & PDF_SAVE_OPTIMIZE));
+
+		// Saving what we wrote again must give the same objects, and not
+		// copy the xref and object streams of the first save
+		PdfDocument reopened;
+		if(pdf_document_open_memory(&reopened, saved.data, saved.length, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE)
+		{
+			TestBuffer again;
+			bool has_again = test_save(&reopened, flags, &again);
+			TEST_CHECK(has_again, name, "%s: can't save the saved document", what);
+			if(has_again)
+			{
+				test_check_written(name, what, &reopened, &again, true);
+				TEST_CHECK(again.length <= saved.length + saved.length/10, name, "%s: saving again grows from %zu to %zu bytes",
+						   what, saved.length, again.length);
+				test_buffer_free(&again);
+			}
+			pdf_document_close(&reopened);
+		}
+		test_buffer_free(&saved);
+	}
+}
+
+// ----------------------------------------------------------------------------
+// Linearized files
+// ----------------------------------------------------------------------------
+
+#define TEST_LINEARIZED_PAGES 5
+
+// A linearized file of TEST_LINEARIZED_PAGES pages: the linearization
+// dictionary, the xref section of the first page, the hint stream, the
+// catalog, the page tree and the first page, then the other pages and the
+// main xref. Offsets are written on 10 digits and filled in at the end.
+// The byte ranges of the pages go to 'out_ranges' (offset then length).
+bool test_generate_linearized(TestBuffer* out, uint64_t* out_ranges)
+{
+	// The objects of the first page section, then two per other page
+	enum { LINEARIZATION = 1, CATALOG, ROOT, FIRST_PAGE, FIRST_CONTENTS, FONT, HINTS, FIRST_PAGE_END };
+	uint32_t count = FIRST_PAGE_END + 2*(TEST_LINEARIZED_PAGES - 1);
+	uint64_t offsets[FIRST_PAGE_END + 2*(TEST_LINEARIZED_PAGES - 1)] = {0};
+	memset(out, 0, sizeof(TestBuffer));
+	test_buffer_append(out, "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n", 15);
+
+	offsets[LINEARIZATION] = out->length;
+	test_buffer_format(out, "%u 0 obj\n<</Linearized 1/L %010u/H[%010u %010u]/O %u/E %010u/N %d/T %010u>>\nendobj\n",
+					   LINEARIZATION, 0, 0, 0, FIRST_PAGE, 0, TEST_LINEARIZED_PAGES, 0);
+	size_t first_xref = out->length;
+	test_buffer_format(out, "xref\n0 %u\n0000000000 65535 f \n", FIRST_PAGE_END);
+	size_t first_entries = out->length;
+	for(uint32_t number = 1; number < FIRST_PAGE_END; ++number) test_buffer_format(out, "%010u 00000 n \n", 0);
+	test_buffer_format(out, "trailer\n<</Size %u/Root %u 0 R/Prev ", count, CATALOG);
+	size_t prev = out->length;
+	test_buffer_format(out, "%010u>>\n", 0);
+
+	// The hint stream, only the page offset hint table with every page
+	// made of 2 objects and its length on 16 bits
+	offsets[HINTS] = out->length;
+	uint8_t hints[36 + 2*TEST_LINEARIZED_PAGES] = {0};
+	hints[3] = 2;	// Least number of objects
+	hints[15] = 16;	// Bits of the page lengths
+	test_buffer_format(out, "%u 0 obj\n<</S 36/Length %zu>>\nstream\n", HINTS, sizeof(hints));
+	size_t hints_data = out->length;
+	test_buffer_append(out, hints, sizeof(hints));
+	test_buffer_append(out, "\nendstream\nendobj\n", 18);
+	uint64_t hint_offset = offsets[HINTS], hint_length = out->length - hint_offset;
+
+	for(uint32_t number = CATALOG; number < count; ++number)
+	{
+		if(number == HINTS) continue;
+		offsets[number] = out->length;
+		test_buffer_format(out, "%u 0 obj\n", number);
+		bool is_page = number == FIRST_PAGE || (number >= FIRST_PAGE_END && (number - FIRST_PAGE_END) % 2 == 0);
+		bool is_contents = number == FIRST_CONTENTS || (number >= FIRST_PAGE_END && (number - FIRST_PAGE_END) % 2 == 1);
+		size_t page = number < FIRST_PAGE_END ? 0 : (number - FIRST_PAGE_END)/2 + 1;
+		if(number == CATALOG) test_buffer_format(out, "<</Type/Catalog/Pages %u 0 R>>", ROOT);
+		else if(number == FONT) test_buffer_format(out, "<</Type/Font/Subtype/Type1/BaseFont/Helvetica>>");
+		else if(number == ROOT)
+		{
+			test_buffer_format(out, "<</Type/Pages/Count %d/Kids[%u 0 R", TEST_LINEARIZED_PAGES, FIRST_PAGE);
+			for(uint32_t kid = FIRST_PAGE_END; kid < count; kid += 2) test_buffer_format(out, " %u 0 R", kid);
+			test_buffer_format(out, "]/MediaBox[0 0 612 792]>>");
+		}
+		else if(is_page)
+		{
+			test_buffer_format(out, "<</Type/Page/Parent %u 0 R/Resources<</Font<</F1 %u 0 R>>>>/Contents %u 0 R>>", ROOT,
+							   FONT, number + 1);
+		}
+		else if(is_contents)
+		{
+			char content[256];
+			int length = test_page_content(content, sizeof(content), page);
+			test_buffer_format(out, "<</Length %d>>\nstream\n", length);
+			test_buffer_append(out, content, (size_t)length);
+			test_buffer_append(out, "\nendstream", 10);
+		}
+		test_buffer_append(out, "\nendobj\n", 8);
+		// A page goes from its page object to the end of its content
+		// stream, the first one to the end of the first page section
+		if(is_page) out_ranges[2*page] = offsets[number];
+		if((is_contents && page > 0) || number == FONT) out_ranges[2*page + 1] = out->length - out_ranges[2*page];
+	}
+	uint64_t first_page_end = offsets[FIRST_PAGE_END];
+
+	uint64_t main_xref = out->length;
+	test_buffer_format(out, "xref\n0 1\n0000000000 65535 f \n%u %u\n", FIRST_PAGE_END, count - FIRST_PAGE_END);
+	for(uint32_t number = FIRST_PAGE_END; number < count; ++number)
+		test_buffer_format(out, "%010llu 00000 n \n", (unsigned long long)offsets[number]);
+	test_buffer_format(out, "trailer\n<</Size %u>>\nstartxref\n%zu\n%%%%EOF\n", count, first_xref);
+	if(out->failed) return false;
+
+	// Fills in the offsets, those of the hint table as if the hint stream
+	// was not in the file
+	char digits[11];
+	uint8_t* data = out->data;
+	size_t pos = (size_t)offsets[LINEARIZATION];
+	struct { const char* key; uint64_t value; } fields[] = {
+		{"/L ", out->length}, {"/H[", hint_offset}, {" ", hint_length}, {"/E ", first_page_end}, {"/T ", main_xref},
+	};
+	for(size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i)
+	{
+		size_t key_length = strlen(fields[i].key);
+		while(memcmp(data + pos, fields[i].key, key_length) != 0) ++pos;
+		pos += key_length;
+		snprintf(digits, sizeof(digits), "%010llu", (unsigned long long)fields[i].value);
+		memcpy(data + pos, digits, 10);
+	}
+	pos = first_entries;
+	for(uint32_t number = 1; number < FIRST_PAGE_END; ++number, pos += 20)
+	{
+		snprintf(digits, sizeof(digits), "%010llu", (unsigned long long)offsets[number]);
+		memcpy(data + pos, digits, 10);
+	}
+	snprintf(digits, sizeof(digits), "%010llu", (unsigned long long)main_xref);
+	memcpy(data + prev, digits, 10);
+
+	uint8_t* table = data + hints_data;
+	uint64_t first_page_offset = out_ranges[0] - hint_length;
+	for(int i = 0; i < 4; ++i) table[4 + i] = (uint8_t)(first_page_offset >> (24 - 8*i));
+	for(int i = 0; i < TEST_LINEARIZED_PAGES; ++i)
+	{
+		table[36 + 2*i] = (uint8_t)(out_ranges[2*i + 1] >> 8);
+		table[36 + 2*i + 1] = (uint8_t)out_ranges[2*i + 1];
+	}
+	return true;
+}
+
+void test_linearized(void)
+{
+	const char* name = "linearized";
+	TestBuffer buffer;
+	uint64_t ranges[2*TEST_LINEARIZED_PAGES] = {0};
+	bool has_buffer = test_generate_linearized(&buffer, ranges);
+	TEST_CHECK(has_buffer, name, "can't generate the document");
+	if(!has_buffer) return;
+
+	PdfDocument doc;
+	int error = pdf_document_open_memory(&doc, buffer.data, buffer.length, PDF_OPEN_FIRST_PAGE | PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "open gives error %d", error);
+	if(!error)
+	{
+		TEST_CHECK(doc.is_linearized && doc.has_partial_xref, name, "the first page section is not used");
+		uint32_t first_page = pdf_document_first_page(&doc);
+		PdfObject page;
+		bool has_page = first_page != 0 && pdf_document_get_object(&doc, first_page, &page);
+		TEST_CHECK(has_page && page.type == PDF_OBJECT_TYPE_DICTIONARY, name, "no first page");
+		PdfObject contents = has_page && page.type == PDF_OBJECT_TYPE_DICTIONARY
+			? pdf_dictionary_get(&page.dictionary_value, pdf_name("Contents")) : (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+		PdfObject stream;
+		bool has_stream = contents.type == PDF_OBJECT_TYPE_REFERENCE
+			&& pdf_document_get_object(&doc, contents.reference_value.number, &stream);
+		TEST_CHECK(has_stream && stream.type == PDF_OBJECT_TYPE_STREAM, name, "no content for the first page");
+		if(has_stream) pdf_object_free(&stream);
+		if(has_page) pdf_object_free(&page);
+		TEST_CHECK(doc.has_partial_xref, name, "the main xref is read for the first page");
+
+		for(uint32_t i = 0; i < TEST_LINEARIZED_PAGES; ++i)
+		{
+			uint64_t offset = 0, length = 0;
+			bool has_range = pdf_document_page_range(&doc, i, &offset, &length);
+			TEST_CHECK(has_range && offset == ranges[2*i] && length == ranges[2*i + 1], name,
+					   "page %u is at %llu (%llu bytes) instead of %llu (%llu bytes)", i, (unsigned long long)offset,
+					   (unsigned long long)length, (unsigned long long)ranges[2*i], (unsigned long long)ranges[2*i + 1]);
+		}
+		// The other pages need the main xref
+		size_t pages = pdf_document_page_count(&doc);
+		TEST_CHECK(pages == TEST_LINEARIZED_PAGES, name, "%zu pages", pages);
+		pdf_document_close(&doc);
+	}
+
+	// An update breaks the linearization, the file is opened as any other
+	static const char update[] = "\n% Appended after the linearization\n";
+	test_buffer_append(&buffer, update, sizeof(update) - 1);
+	error = pdf_document_open_memory(&doc, buffer.data, buffer.length, PDF_OPEN_FIRST_PAGE | PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "open after /L changed gives error %d", error);
+	if(!error)
+	{
+		TEST_CHECK(!doc.is_linearized && !doc.has_partial_xref, name, "still linearized after /L changed");
+		uint64_t offset, length;
+		TEST_CHECK(!pdf_document_page_range(&doc, 0, &offset, &length), name, "page range after /L changed");
+		PdfObject page;
+		uint32_t first_page = pdf_document_first_page(&doc);
+		bool has_page = first_page != 0 && pdf_document_get_object(&doc, first_page, &page);
+		TEST_CHECK(has_page && page.type == PDF_OBJECT_TYPE_DICTIONARY, name, "no first page after /L changed");
+		if(has_page) pdf_object_free(&page);
+		pdf_document_close(&doc);
+	}
+	test_buffer_free(&buffer);
+}
+
+// ----------------------------------------------------------------------------
+// Page index
+// ----------------------------------------------------------------------------
+
+// Checks the inherited attributes of the pages of a generated document
+void test_page_index(const char* name, const TestBuffer* buffer, size_t pages_count)
+{
+	PdfDocument doc, parallel_doc;
+	if(pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR) != PDF_ERROR_NONE) return;
+	size_t count = pdf_document_page_count(&doc);
+	TEST_CHECK(count == pages_count, name, "%zu pages instead of %zu", count, pages_count);
+	size_t wrong = 0;
+	for(size_t i = 0; i < count; ++i)
+	{
+		const PdfPage* page = pdf_document_get_page(&doc, i);
+		bool is_right = i >= pages_count/2;
+		if(page == NULL || page->rotate != (is_right ? 90 : 0) || page->media_box.type != PDF_OBJECT_TYPE_ARRAY
+		   || page->media_box.array_value.length != 4 || page->resources.type == PDF_OBJECT_TYPE_NONE) wrong += 1;
+	}
+	TEST_CHECK(wrong == 0, name, "%zu pages without their inherited attributes", wrong);
+
+	// Walked by several threads, the index must be the same
+	if(pdf_document_open_memory(&parallel_doc, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE)
+	{
+		bool success = pdf_document_build_page_index(&parallel_doc, 4);
+		TEST_CHECK(success && pdf_document_page_count(&parallel_doc) == count, name, "parallel page index failed");
+		size_t different = 0;
+		for(size_t i = 0; success && i < count && pdf_document_page_count(&parallel_doc) == count; ++i)
+		{
+			const PdfPage* page = pdf_document_get_page(&doc, i);
+			const PdfPage* parallel_page = pdf_document_get_page(&parallel_doc, i);
+			if(page->number != parallel_page->number || page->rotate != parallel_page->rotate) different += 1;
+		}
+		TEST_CHECK(different == 0, name, "%zu pages differ in the parallel page index", different);
+		pdf_document_close(&parallel_doc);
+	}
+	pdf_document_close(&doc);
+}
+
+// ----------------------------------------------------------------------------
+// Sidecar index
+// ----------------------------------------------------------------------------
+
+// Opens 'filename' with its index and checks it reads as 'doc', the index
+// being used or not as expected
+void test_check_indexed(const char* name, const char* what, PdfDocument* doc, const char* filename,
+						const char* index_filename, bool uses_index)
+{
+	PdfDocument indexed;
+	int error = pdf_document_open_indexed(&indexed, filename, index_filename, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "%s: open gives error %d", what, error);
+	if(error) return;
+	TEST_CHECK((indexed.index != NULL) == uses_index, name, "%s: the index is %s", what, uses_index ? "not used" : "used");
+	TEST_CHECK(indexed.xref_count == doc->xref_count, name, "%s: %zu objects instead of %zu", what, indexed.xref_count,
+			   doc->xref_count);
+	size_t different = 0;
+	for(size_t i = 1; i < doc->xref_count && i < indexed.xref_count; ++i)
+	{
+		PdfObject obj, indexed_obj;
+		bool has_obj = pdf_document_get_object(doc, (uint32_t)i, &obj);
+		bool has_indexed_obj = pdf_document_get_object(&indexed, (uint32_t)i, &indexed_obj);
+		PdfWriter writer = {0}, indexed_writer = {0};
+		pdf_writer_begin(&writer, NULL, 0);
+		pdf_writer_begin(&indexed_writer, NULL, 0);
+		if(has_obj) pdf_write_object(&writer, &obj);
+		if(has_indexed_obj) pdf_write_object(&indexed_writer, &indexed_obj);
+		if(has_obj != has_indexed_obj || writer.length != indexed_writer.length
+		   || memcmp(writer.buffer, indexed_writer.buffer, writer.length) != 0) different += 1;
+		pdf_writer_free(&writer);
+		pdf_writer_free(&indexed_writer);
+		if(has_obj) pdf_object_free(&obj);
+		if(has_indexed_obj) pdf_object_free(&indexed_obj);
+	}
+	TEST_CHECK(different == 0, name, "%s: %zu objects differ", what, different);
+	size_t pages = pdf_document_page_count(doc);
+	TEST_CHECK(pdf_document_page_count(&indexed) == pages, name, "%s: the pages differ", what);
+	pdf_document_close(&indexed);
+}
+
+void test_sidecar_index(const char* name, const TestBuffer* buffer)
+{
+	const char* filename = "test-index.pdf";
+	const char* index_filename = "test-index.pdf.idx";
+	remove(index_filename);
+	if(!test_write_file(filename, buffer->data, buffer->length))
+	{
+		TEST_CHECK(false, name, "index: can't write %s", filename);
+		return;
+	}
+	PdfDocument doc;
+	int error = pdf_document_open(&doc, filename, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "index: open gives error %d", error);
+	if(error)
+	{
+		remove(filename);
+		return;
+	}
+
+	// The first open writes the index, the next ones use it
+	test_check_indexed(name, "index written", &doc, filename, index_filename, false);
+	test_check_indexed(name, "index read", &doc, filename, index_filename, true);
+
+	// A damaged index is ignored, then written again
+	TestBuffer index;
+	if(test_read_file(index_filename, &index))
+	{
+		index.data[index.length - 1] ^= 0x55;
+		test_write_file(index_filename, index.data, index.length);
+		test_buffer_free(&index);
+		test_check_indexed(name, "damaged index", &doc, filename, index_filename, false);
+		test_check_indexed(name, "index rewritten", &doc, filename, index_filename, true);
+	}
+	else TEST_CHECK(false, name, "index: no index written");
+
+	// So is the index of a file modified since, by its time then its size
+	pdf_document_close(&doc);
+	struct stat status;
+	if(stat(filename, &status) == 0)
+	{
+		struct utimbuf times = {status.st_atime, status.st_mtime - 100};
+		utime(filename, &times);
+	}
+	if(pdf_document_open(&doc, filename, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE)
+	{
+		test_check_indexed(name, "index of another time", &doc, filename, index_filename, false);
+		pdf_document_close(&doc);
+	}
+	TestBuffer longer = {0};
+	test_buffer_append(&longer, buffer->data, buffer->length);
+	test_buffer_append(&longer, "\n", 1);
+	test_write_file(filename, longer.data, longer.length);
+	test_buffer_free(&longer);
+	if(pdf_document_open(&doc, filename, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE)
+	{
+		test_check_indexed(name, "index of another size", &doc, filename, index_filename, false);
+		pdf_document_close(&doc);
+	}
+	remove(index_filename);
+	remove(filename);
+}
+
+// ----------------------------------------------------------------------------
+// Text extraction
+// ----------------------------------------------------------------------------
+
+void test_generated_text(const char* name, const TestBuffer* buffer, size_t pages_count)
+{
+	PdfDocument doc;
+	if(pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR) != PDF_ERROR_NONE) return;
+	size_t wrong = 0;
+	for(size_t i = 0; i < pages_count; ++i)
+	{
+		PdfWriter writer = {0};
+		pdf_writer_begin(&writer, NULL, 0);
+		char expected[128];
+		int length = snprintf(expected, sizeof(expected), "Page %zu of the round trip\ncaf\xC3\xA9 cr\xC3\xA8me\n", i + 1);
+		if(!pdf_document_extract_page_text(&doc, i, &writer) || writer.length != (size_t)length
+		   || memcmp(writer.buffer, expected, (size_t)length) != 0) wrong += 1;
+		pdf_writer_free(&writer);
+	}
+	TEST_CHECK(wrong == 0, name, "text of %zu pages differs", wrong);
+	pdf_document_close(&doc);
+}
+
+// ----------------------------------------------------------------------------
+// Prefetch
+// ----------------------------------------------------------------------------
+
+// Text of the pages of 'filename' with all its objects prefetched
+bool test_prefetched_text(const char* filename, TestBuffer* out, size_t* out_reads_count)
+{
+#ifndef _WIN32
+	// Out of the page cache, or the prefetch has nothing to read
+	int fd = open(filename, O_RDONLY);
+	if(fd >= 0)
+	{
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#endif
+	PdfDocument doc;
+	if(pdf_document_open(&doc, filename, PDF_OPEN_NO_REPAIR) != PDF_ERROR_NONE) return false;
+	// Every object, before the page index reads the page tree
+	uint32_t* numbers = (uint32_t*)pdf_malloc(doc.xref_count*sizeof(uint32_t));
+	size_t count = 0;
+	for(size_t i = 1; numbers != NULL && i < doc.xref_count; ++i)
+		if(doc.xref[i].type == PDF_XREF_ENTRY_IN_USE) numbers[count++] = (uint32_t)i;
+	PdfPrefetch prefetch;
+	bool success = pdf_document_prefetch_begin(&doc, numbers, count, &prefetch) && numbers != NULL;
+	pdf_free(numbers);
+	*out_reads_count = prefetch.reads_count;
+	success = test_document_text(&doc, out) && success;
+	pdf_prefetch_end(&prefetch);
+	pdf_document_close(&doc);
+	return success;
+}
+
+// More than the system reads ahead around the catalog and the xref when
+// the document is opened, so the pages are still to be read
+#define TEST_PREFETCH_PADDING (8 << 20)
+
+void test_prefetch(void)
+{
+	const char* name = "prefetch";
+	const char* filename = "test-prefetch.pdf";
+	TestDocumentOptions options = {0};
+	options.pages_count = TEST_PAGES;
+	options.padding_length = TEST_PREFETCH_PADDING;
+	TestBuffer buffer;
+	if(!test_generate_document(&options, &buffer) || !test_write_file(filename, buffer.data, buffer.length))
+	{
+		TEST_CHECK(false, name, "can't write %s", filename);
+		return;
+	}
+	PdfDocument doc;
+	TestBuffer text = {0};
+	bool has_text = pdf_document_open_memory(&doc, buffer.data, buffer.length, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE;
+	if(has_text)
+	{
+		has_text = test_document_text(&doc, &text);
+		pdf_document_close(&doc);
+	}
+
+	// With io_uring when there is, then with the pread threads
+	for(int disable_ring = 0; disable_ring < 2; ++disable_ring)
+	{
+		pdf_prefetch_disable_ring(disable_ring != 0);
+		TestBuffer prefetched_text;
+		size_t reads_count = 0;
+		bool has_prefetched_text = test_prefetched_text(filename, &prefetched_text, &reads_count);
+		const char* what = disable_ring ? "pread" : "default";
+		TEST_CHECK(has_prefetched_text && reads_count > 0, name, "%s: nothing read", what);
+		TEST_CHECK(has_text && has_prefetched_text && test_buffers_are_equal(&text, &prefetched_text), name,
+				   "%s: text differs", what);
+		if(has_prefetched_text) test_buffer_free(&prefetched_text);
+	}
+	pdf_prefetch_disable_ring(false);
+	if(has_text) test_buffer_free(&text);
+	test_buffer_free(&buffer);
+	remove(filename);
+}
+
+// ----------------------------------------------------------------------------
+// Encryption
+// ----------------------------------------------------------------------------
+
+bool test_bytes_are(const uint8_t* data, const char* hex)
+{
+	for(size_t i = 0; hex[2*i] != '\0'; ++i)
+	{
+		unsigned int value;
+		if(sscanf(hex + 2*i, "%2x", &value) != 1 || data[i] != value) return false;
+	}
+	return true;
+}
+
+// Known answers of FIPS-197 (appendix C) for both implementations of AES,
+// and of the hashes of revisions 5 and 6 for the salt 01..08
+void test_ciphers(void)
+{
+	const char* name = "ciphers";
+	uint8_t key[32], plain[16], block[16], back[16];
+	for(int i = 0; i < 32; ++i) key[i] = (uint8_t)i;
+	for(int i = 0; i < 16; ++i) plain[i] = (uint8_t)(0x11*i);
+	static const struct {
+		size_t key_length;
+		const char* cipher;
+	} vectors[] = {
+		{16, "69c4e0d86a7b0430d8cdb78070b4c55a"},
+		{32, "8ea2b7ca516745bfeafc49904b496089"},
+	};
+	static const uint8_t zero_iv[16] = {0};
+	for(size_t i = 0; i < sizeof(vectors)/sizeof(vectors[0]); ++i)
+	{
+		PdfAes aes;
+		pdf_aes_init(&aes, key, vectors[i].key_length);
+		bool has_aes_ni = aes.has_aes_ni;
+		for(int use_aes_ni = has_aes_ni; use_aes_ni >= 0; --use_aes_ni)
+		{
+			// One block of CBC with a zero IV is the block cipher itself
+			aes.has_aes_ni = use_aes_ni != 0;
+			const char* implementation = use_aes_ni ? "AES-NI" : "software";
+			pdf_aes_encrypt_cbc(&aes, zero_iv, plain, block, 16);
+			TEST_CHECK(test_bytes_are(block, vectors[i].cipher), name, "AES-%zu (%s) encrypts wrong",
+					   8*vectors[i].key_length, implementation);
+			pdf_aes_decrypt_cbc(&aes, zero_iv, block, back, 16);
+			TEST_CHECK(memcmp(back, plain, 16) == 0, name, "AES-%zu (%s) decrypts wrong", 8*vectors[i].key_length,
+					   implementation);
+		}
+		pdf_aes_encrypt_block(&aes, plain, block);
+		pdf_aes_decrypt_block(&aes, block, back);
+		TEST_CHECK(test_bytes_are(block, vectors[i].cipher) && memcmp(back, plain, 16) == 0, name,
+				   "AES-%zu block functions are wrong", 8*vectors[i].key_length);
+	}
+
+	uint8_t salt[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+	uint8_t hash[32];
+	pdf_encryption_hash(5, salt, hash);
+	TEST_CHECK(test_bytes_are(hash, "66840dda154e8a113c31dd0ad32f7f3a366a80e8136979d8f5a101d3d29d6f72"), name,
+			   "the revision 5 hash is wrong");
+	pdf_encryption_hash(6, salt, hash);
+	TEST_CHECK(test_bytes_are(hash, "8d1efb4f1bdbb651341704c2139de4f6be05d6d4609af56916b21646ed74825c"), name,
+			   "the revision 6 hash is wrong");
+}
+
+// The encrypted copies must read as the clear document
+void test_encrypted(const char* name, const TestBuffer* clear, const TestBuffer* encrypted)
+{
+	PdfDocument clear_doc, doc;
+	if(pdf_document_open_memory(&clear_doc, clear->data, clear->length, 0) != PDF_ERROR_NONE) return;
+	int error = pdf_document_open_memory(&doc, encrypted->data, encrypted->length, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "open gives error %d", error);
+	if(!error)
+	{
+		TEST_CHECK(doc.is_encrypted, name, "not seen as encrypted");
+		TestBuffer clear_text, text;
+		bool has_clear_text = test_document_text(&clear_doc, &clear_text);
+		bool has_text = test_document_text(&doc, &text);
+		TEST_CHECK(has_clear_text && has_text && test_buffers_are_equal(&clear_text, &text), name,
+				   "text differs from the clear document");
+		if(has_clear_text) test_buffer_free(&clear_text);
+		if(has_text) test_buffer_free(&text);
+
+		// Every stream decoded in parallel, strings as they are parsed
+		uint32_t numbers[64];
+		size_t count = 0;
+		for(size_t i = 1; i < doc.xref_count && count < 64; ++i)
+			if(doc.xref[i].type == PDF_XREF_ENTRY_IN_USE) numbers[count++] = (uint32_t)i;
+		PdfDecodedStream clear_streams[64], streams[64];
+		int clear_error = pdf_document_decode_streams(&clear_doc, numbers, count, clear_streams, 1);
+		error = pdf_document_decode_streams(&doc, numbers, count, streams, 4);
+		TEST_CHECK(clear_error == PDF_ERROR_NONE && error == PDF_ERROR_NONE, name, "decoding streams gives error %d", error);
+		size_t different = 0;
+		for(size_t i = 0; i < count; ++i)
+		{
+			if(clear_streams[i].length != streams[i].length || (clear_streams[i].data == NULL) != (streams[i].data == NULL)
+			   || (streams[i].data != NULL && memcmp(clear_streams[i].data, streams[i].data, streams[i].length) != 0))
+				different += 1;
+			pdf_free(clear_streams[i].data);
+			pdf_free(streams[i].data);
+		}
+		TEST_CHECK(different == 0, name, "%zu streams differ from the clear document", different);
+		PdfObject info_ref = pdf_dictionary_get(&doc.trailer.dictionary_value, pdf_name("Info"));
+		PdfObject info;
+		bool has_info = info_ref.type == PDF_OBJECT_TYPE_REFERENCE
+			&& pdf_document_get_object(&doc, info_ref.reference_value.number, &info);
+		PdfObject title = has_info && info.type == PDF_OBJECT_TYPE_DICTIONARY
+			? pdf_dictionary_get(&info.dictionary_value, pdf_name("Title")) : (PdfObject){.type = PDF_OBJECT_TYPE_NONE};
+		TEST_CHECK(title.type == PDF_OBJECT_TYPE_STRING && title.string_value.length == 10
+				   && memcmp(title.string_value.start, "Round trip", 10) == 0, name, "strings are not decrypted");
+		if(has_info) pdf_object_free(&info);
+		pdf_document_close(&doc);
+	}
+	pdf_document_close(&clear_doc);
+}
+
+// ----------------------------------------------------------------------------
+// CMaps and the font cache
+// ----------------------------------------------------------------------------
+
+// One page drawing with a composite font whose /ToUnicode maps codes
+// through bfrange arrays and to surrogate pairs
+bool test_generate_cmap_document(TestBuffer* out)
+{
+	static const char cmap[] =
+		"/CIDInit /ProcSet findresource begin\n12 dict begin\nbegincmap\n"
+		"/CMapName /Test-UCS def\n/CMapType 2 def\n"
+		"1 begincodespacerange\n<0000> <FFFF>\nendcodespacerange\n"
+		"2 beginbfrange\n<0001> <0003> [<0041> <D83DDE00> <00660069>]\n<0010> <0012> <0061>\nendbfrange\n"
+		"1 beginbfchar\n<0020> <D835DC00>\nendbfchar\n"
+		"endcmap\nCMapName currentdict /CMap defineresource pop\nend\nend\n";
+	static const char content[] = "BT /F1 12 Tf 72 700 Td <00010002000300100011001200200005> Tj ET\n";
+	TestBuffer objects[3];
+	memset(&objects[0], 0, sizeof(TestBuffer));
+	test_buffer_format(&objects[0], "<</Type/Font/Subtype/Type0/BaseFont/Test/Encoding/Identity-H"
+					   "/DescendantFonts[6 0 R]/ToUnicode 7 0 R>>");
+	memset(&objects[1], 0, sizeof(TestBuffer));
+	test_buffer_format(&objects[1], "<</Type/Font/Subtype/CIDFontType2/BaseFont/Test"
+					   "/CIDSystemInfo<</Registry(Adobe)/Ordering(Identity)/Supplement 0>>>>");
+	test_stream_object(&objects[2], "", (const uint8_t*)cmap, sizeof(cmap) - 1);
+	bool success = test_generate_page("<</Font<</F1 5 0 R>>>>", (const uint8_t*)content, sizeof(content) - 1, objects, 3,
+									  out);
+	for(int i = 0; i < 3; ++i) test_buffer_free(&objects[i]);
+	return success;
+}
+
+bool test_cmap_text(const TestBuffer* buffer, TestBuffer* out)
+{
+	PdfDocument doc;
+	if(pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR) != PDF_ERROR_NONE) return false;
+	bool success = test_document_text(&doc, out);
+	pdf_document_close(&doc);
+	return success;
+}
+
+void test_cmaps(void)
+{
+	const char* name = "cmap";
+	TestBuffer buffer;
+	bool has_buffer = test_generate_cmap_document(&buffer);
+	TEST_CHECK(has_buffer, name, "can't generate the document");
+	if(!has_buffer) return;
+
+	// A, U+1F600, fi, abc, U+1D400 and an unmapped code
+	static const char expected[] = "A\xF0\x9F\x98\x80" "fiabc\xF0\x9D\x90\x80\xEF\xBF\xBD\n\f";
+	pdf_font_cache_clear();
+	PdfFontCacheStats before = pdf_font_cache_get_stats();
+	TestBuffer text;
+	bool has_text = test_cmap_text(&buffer, &text);
+	TEST_CHECK(has_text && text.length == sizeof(expected) - 1 && memcmp(text.data, expected, text.length) == 0, name,
+			   "wrong text \"%.*s\"", has_text ? (int)text.length : 0, has_text ? (const char*)text.data : "");
+	if(has_text) test_buffer_free(&text);
+
+	// Another document with the same CMap finds it in the cache
+	TestBuffer copy = {0};
+	test_buffer_append(&copy, buffer.data, buffer.length);
+	PdfFontCacheStats first = pdf_font_cache_get_stats();
+	has_text = test_cmap_text(&copy, &text);
+	PdfFontCacheStats second = pdf_font_cache_get_stats();
+	TEST_CHECK(first.misses > before.misses && first.entries > 0, name, "the CMap is not cached");
+	TEST_CHECK(has_text && second.hits > first.hits && second.misses == first.misses, name,
+			   "the CMap of the second document is not found in the cache");
+	if(has_text) test_buffer_free(&text);
+	test_buffer_free(&copy);
+
+	// No budget leaves nothing in the cache
+	pdf_font_cache_set_budget(0);
+	PdfFontCacheStats empty = pdf_font_cache_get_stats();
+	TEST_CHECK(empty.entries == 0 && empty.bytes == 0, name, "%zu entries (%zu bytes) left without budget", empty.entries,
+			   empty.bytes);
+	has_text = test_cmap_text(&buffer, &text);
+	empty = pdf_font_cache_get_stats();
+	TEST_CHECK(has_text && empty.entries == 0 && empty.bytes == 0, name, "cached without budget");
+	if(has_text) test_buffer_free(&text);
+	pdf_font_cache_set_budget(PDF_FONT_CACHE_DEFAULT_BUDGET);
+	test_buffer_free(&buffer);
+}
+
+// ----------------------------------------------------------------------------
+// Optimized saves
+// ----------------------------------------------------------------------------
+
+// The orphan stream is dropped and the copy of the image merged
+void test_optimize(const char* name, const TestBuffer* buffer)
+{
+	PdfDocument doc;
+	if(pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_NO_REPAIR) != PDF_ERROR_NONE) return;
+	TestBuffer saved;
+	if(test_save(&doc, PDF_SAVE_OPTIMIZE, &saved))
+	{
+		PdfDocument optimized;
+		if(pdf_document_open_memory(&optimized, saved.data, saved.length, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE)
+		{
+			uint64_t objects[PDF_OBJECT_TYPE_COUNT] = {0}, optimized_objects[PDF_OBJECT_TYPE_COUNT] = {0};
+			uint64_t stream_bytes = 0, optimized_stream_bytes = 0;
+			test_count_objects(&doc, objects, &stream_bytes);
+			test_count_objects(&optimized, optimized_objects, &optimized_stream_bytes);
+			TEST_CHECK(optimized_objects[PDF_OBJECT_TYPE_STREAM] + 2 == objects[PDF_OBJECT_TYPE_STREAM], name,
+					   "optimized save: %llu streams instead of %llu",
+					   (unsigned long long)optimized_objects[PDF_OBJECT_TYPE_STREAM],
+					   (unsigned long long)objects[PDF_OBJECT_TYPE_STREAM] - 2);
+			TEST_CHECK(optimized_stream_bytes < stream_bytes, name, "optimized save: streams are not smaller");
+			pdf_document_close(&optimized);
+		}
+		test_buffer_free(&saved);
+	}
+	pdf_document_close(&doc);
+}
+
+// ----------------------------------------------------------------------------
+// JSON strings
+// ----------------------------------------------------------------------------
+
+int test_hex_digit(uint8_t c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// Decodes the JSON string 'json', false if it is not a valid one. Escapes
+// of code points up to U+00FF give back the byte of that value.
+bool test_json_decode_string(const uint8_t* json, size_t length, TestBuffer* out)
+{
+	memset(out, 0, sizeof(TestBuffer));
+	if(length < 2 || json[0] != '"' || json[length - 1] != '"') return false;
+	for(size_t i = 1; i + 1 < length; ++i)
+	{
+		uint8_t c = json[i];
+		// Raw bytes must be printable ASCII (or UTF-8, never written here)
+		if(c < 0x20 || c >= 0x80 || c == '"') return false;
+		if(c != '\\')
+		{
+			test_buffer_append(out, &c, 1);
+			continue;
+		}
+		if(++i + 1 >= length) return false;
+		static const char escapes[] = "\"\\/bfnrt";
+		static const char values[] = "\"\\/\b\f\n\r\t";
+		const char* escape = strchr(escapes, json[i]);
+		if(escape != NULL && json[i] != '\0')
+		{
+			test_buffer_append(out, &values[escape - escapes], 1);
+			continue;
+		}
+		if(json[i] != 'u' || i + 4 >= length - 1) return false;
+		int value = 0;
+		for(int k = 1; k <= 4; ++k)
+		{
+			int digit = test_hex_digit(json[i + k]);
+			if(digit < 0) return false;
+			value = 16*value + digit;
+		}
+		if(value > 0xFF) return false;
+		uint8_t byte = (uint8_t)value;
+		test_buffer_append(out, &byte, 1);
+		i += 4;
+	}
+	return !out->failed;
+}
+
+// Strings of every length around the 16 bytes chunks, with a byte to
+// escape at each position
+void test_json_strings(void)
+{
+	const char* name = "json strings";
+	static const uint8_t specials[] = {'"', '\\', '/', 0x00, 0x01, '\n', 0x1F, 0x7F, 0x80, 0xC3, 0xFF};
+	size_t invalid = 0, different = 0;
+	for(size_t length = 1; length <= 40; ++length)
+	{
+		for(size_t s = 0; s < sizeof(specials); ++s)
+		{
+			for(size_t pos = 0; pos < length; ++pos)
+			{
+				uint8_t string[40];
+				for(size_t i = 0; i < length; ++i) string[i] = (uint8_t)('a' + i % 26);
+				string[pos] = specials[s];
+				// And the same byte again at the end of the string
+				string[length - 1] = specials[(s + pos) % sizeof(specials)];
+				PdfWriter writer = {0};
+				pdf_writer_begin(&writer, NULL, 0);
+				pdf_write_json_string(&writer, string, length);
+				TestBuffer decoded;
+				bool is_valid = !writer.failed && test_json_decode_string(writer.buffer, writer.length, &decoded);
+				if(!is_valid) invalid += 1;
+				else if(decoded.length != length || memcmp(decoded.data, string, length) != 0) different += 1;
+				test_buffer_free(&decoded);
+				pdf_writer_free(&writer);
+			}
+		}
+	}
+	TEST_CHECK(invalid == 0, name, "%zu strings are not valid JSON", invalid);
+	TEST_CHECK(different == 0, name, "%zu strings decode to other bytes", different);
+}
+
+// ----------------------------------------------------------------------------
+// Memory budget
+// ----------------------------------------------------------------------------
+
+#define TEST_BUDGET_STREAMS 8
+#define TEST_BUDGET_STREAM_SIZE (4 << 20)
+
+// Streams decoded on several threads must be charged to the budget of the
+// caller, and the open of a document must fail cleanly when over budget
+void test_memory_budget(void)
+{
+	const char* name = "memory budget";
+	uint8_t* zeros = (uint8_t*)pdf_malloc(TEST_BUDGET_STREAM_SIZE);
+	uint8_t* compressed = NULL;
+	size_t compressed_length = 0;
+	if(zeros != NULL) memset(zeros, 'z', TEST_BUDGET_STREAM_SIZE);
+	bool has_stream = zeros != NULL && pdf_flate_encode(zeros, TEST_BUDGET_STREAM_SIZE, &compressed, &compressed_length);
+	pdf_free(zeros);
+	TEST_CHECK(has_stream, name, "can't compress the streams");
+	if(!has_stream) return;
+	TestBuffer objects[TEST_BUDGET_STREAMS];
+	for(int i = 0; i < TEST_BUDGET_STREAMS; ++i)
+		test_stream_object(&objects[i], "/Filter/FlateDecode", compressed, compressed_length);
+	pdf_free(compressed);
+	TestBuffer buffer;
+	static const char content[] = "BT /F1 12 Tf 72 700 Td (Big streams) Tj ET\n";
+	bool has_buffer = test_generate_page("<<>>", (const uint8_t*)content, sizeof(content) - 1, objects,
+										 TEST_BUDGET_STREAMS, &buffer);
+	for(int i = 0; i < TEST_BUDGET_STREAMS; ++i) test_buffer_free(&objects[i]);
+	TEST_CHECK(has_buffer, name, "can't generate the document");
+	if(!has_buffer) return;
+
+	uint32_t numbers[TEST_BUDGET_STREAMS];
+	for(int i = 0; i < TEST_BUDGET_STREAMS; ++i) numbers[i] = (uint32_t)(5 + i);
+	static const struct {
+		size_t limit;
+		int error;
+	} cases[] = {
+		{256 << 20, PDF_ERROR_NONE},
+		{3*TEST_BUDGET_STREAM_SIZE, PDF_ERROR_MEMORY},
+	};
+	for(size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i)
+	{
+		PdfMemoryBudget budget;
+		pdf_memory_budget_init(&budget, cases[i].limit);
+		pdf_memory_budget_use(&budget);
+		PdfDocument doc;
+		int error = pdf_document_open_memory(&doc, buffer.data, buffer.length, PDF_OPEN_NO_REPAIR);
+		TEST_CHECK(error == PDF_ERROR_NONE, name, "open gives error %d", error);
+		if(!error)
+		{
+			PdfDecodedStream streams[TEST_BUDGET_STREAMS];
+			error = pdf_document_decode_streams(&doc, numbers, TEST_BUDGET_STREAMS, streams, 4);
+			TEST_CHECK(error == cases[i].error, name, "decoding %d streams of %d MB in %zu MB gives error %d instead of %d",
+					   TEST_BUDGET_STREAMS, TEST_BUDGET_STREAM_SIZE >> 20, cases[i].limit >> 20, error, cases[i].error);
+			size_t decoded = 0;
+			for(int k = 0; k < TEST_BUDGET_STREAMS; ++k)
+			{
+				if(streams[k].data != NULL && streams[k].length == TEST_BUDGET_STREAM_SIZE) decoded += 1;
+				pdf_free(streams[k].data);
+			}
+			TEST_CHECK(error != PDF_ERROR_NONE || decoded == TEST_BUDGET_STREAMS, name, "%zu streams decoded", decoded);
+			pdf_document_close(&doc);
+		}
+		pdf_memory_budget_use(NULL);
+	}
+
+	// Too small for the xref of a big document
+	TestBuffer big;
+	if(test_generate(TEST_BIG_PAGES, &big))
+	{
+		PdfMemoryBudget budget;
+		pdf_memory_budget_init(&budget, 64 << 10);
+		pdf_memory_budget_use(&budget);
+		PdfDocument doc;
+		int error = pdf_document_open_memory(&doc, big.data, big.length, 0);
+		pdf_memory_budget_use(NULL);
+		TEST_CHECK(error == PDF_ERROR_MEMORY, name, "open over budget gives error %d", error);
+		if(!error) pdf_document_close(&doc);
+		test_buffer_free(&big);
+	}
+	test_buffer_free(&buffer);
+}
+
+// ----------------------------------------------------------------------------
+// Push parser
+// ----------------------------------------------------------------------------
+
+// FNV-1a, fed byte per byte so it does not depend on how data is sliced
+uint64_t test_hash_bytes(uint64_t hash, const uint8_t* data, size_t length)
+{
+	for(size_t i = 0; i < length; ++i) hash = (hash ^ data[i])*0x100000001B3ULL;
+	return hash;
+}
+
+// Events of the push parser for 'buffer' fed in slices of 'slice' bytes,
+// written one per line with stream data summed up at the end of the stream
+bool test_push_events(const TestBuffer* buffer, size_t slice, TestBuffer* out)
+{
+	PdfWriter writer = {0};
+	pdf_writer_begin(&writer, NULL, 0);
+	PdfPushParser parser;
+	pdf_push_parser_init(&parser);
+	uint64_t stream_hash = 0xCBF29CE484222325ULL;
+	uint64_t stream_bytes = 0;
+	for(size_t pos = 0; ; pos += slice)
+	{
+		if(pos < buffer->length)
+		{
+			size_t length = buffer->length - pos < slice ? buffer->length - pos : slice;
+			pdf_push_parser_feed(&parser, buffer->data + pos, length);
+		}
+		else pdf_push_parser_finish(&parser);
+		PdfPushEvent event;
+		while(pdf_push_parser_next(&parser, &event))
+		{
+			if(event.type == PDF_PUSH_EVENT_STREAM_DATA)
+			{
+				stream_hash = test_hash_bytes(stream_hash, event.data, event.length);
+				stream_bytes += event.length;
+				continue;
+			}
+			pdf_write_format(&writer, "%d %llu %u %u %llu ", event.type, (unsigned long long)event.offset, event.number,
+							 event.generation, (unsigned long long)event.value);
+			if(event.type == PDF_PUSH_EVENT_STREAM_END)
+			{
+				pdf_write_format(&writer, "%llu %016llx", (unsigned long long)stream_bytes, (unsigned long long)stream_hash);
+				stream_hash = 0xCBF29CE484222325ULL;
+				stream_bytes = 0;
+			}
+			if(event.object.type != PDF_OBJECT_TYPE_NONE) pdf_write_object(&writer, &event.object);
+			pdf_write_bytes(&writer, "\n", 1);
+			pdf_object_free(&event.object);
+		}
+		if(pos >= buffer->length) break;
+	}
+	pdf_push_parser_free(&parser);
+	return test_buffer_from_writer(out, &writer);
+}
+
+void test_push_parser_slices(const char* name, const TestBuffer* buffer)
+{
+	TestBuffer whole;
+	if(!test_push_events(buffer, buffer->length > 0 ? buffer->length : 1, &whole))
+	{
+		TEST_CHECK(false, name, "push parser: out of memory");
+		return;
+	}
+	static const size_t slices[] = {1, 7, 100, 5000};
+	for(size_t i = 0; i < sizeof(slices)/sizeof(slices[0]); ++i)
+	{
+		TestBuffer events;
+		bool has_events = test_push_events(buffer, slices[i], &events);
+		TEST_CHECK(has_events && test_buffers_are_equal(&whole, &events), name,
+				   "push parser: slices of %zu bytes give other events", slices[i]);
+		if(has_events) test_buffer_free(&events);
+	}
+	test_buffer_free(&whole);
+}
+
+// ----------------------------------------------------------------------------
+// Text strings
+// ----------------------------------------------------------------------------
+
+// Code points of the PDFDocEncoding bytes which are not Latin-1 (Annex D.3)
+uint32_t test_doc_encoding(uint8_t byte)
+{
+	static const uint16_t low[8] = {0x02D8, 0x02C7, 0x02C6, 0x02D9, 0x02DD, 0x02DB, 0x02DA, 0x02DC};
+	static const uint16_t high[32] = {
+		0x2022, 0x2020, 0x2021, 0x2026, 0x2014, 0x2013, 0x0192, 0x2044, 0x2039, 0x203A, 0x2212, 0x2030, 0x201E, 0x201C,
+		0x201D, 0x2018, 0x2019, 0x201A, 0x2122, 0xFB01, 0xFB02, 0x0141, 0x0152, 0x0160, 0x0178, 0x017D, 0x0131, 0x0142,
+		0x0153, 0x0161, 0x017E, 0xFFFD,
+	};
+	if(byte >= 0x18 && byte < 0x20) return low[byte - 0x18];
+	if(byte >= 0x80 && byte < 0xA0) return high[byte - 0x80];
+	if(byte == 0xA0) return 0x20AC;
+	if(byte == 0x7F || byte == 0xAD) return 0xFFFD;
+	return byte;
+}
+
+void test_utf8_append(TestBuffer* out, uint32_t code_point)
+{
+	uint8_t bytes[4];
+	size_t length = 0;
+	if(code_point == 0) return;
+	if(code_point < 0x80) bytes[length++] = (uint8_t)code_point;
+	else if(code_point < 0x800)
+	{
+		bytes[length++] = (uint8_t)(0xC0 | code_point >> 6);
+		bytes[length++] = (uint8_t)(0x80 | (code_point & 0x3F));
+	}
+	else if(code_point < 0x10000)
+	{
+		bytes[length++] = (uint8_t)(0xE0 | code_point >> 12);
+		bytes[length++] = (uint8_t)(0x80 | (code_point >> 6 & 0x3F));
+		bytes[length++] = (uint8_t)(0x80 | (code_point & 0x3F));
+	}
+	else
+	{
+		bytes[length++] = (uint8_t)(0xF0 | code_point >> 18);
+		bytes[length++] = (uint8_t)(0x80 | (code_point >> 12 & 0x3F));
+		bytes[length++] = (uint8_t)(0x80 | (code_point >> 6 & 0x3F));
+		bytes[length++] = (uint8_t)(0x80 | (code_point & 0x3F));
+	}
+	test_buffer_append(out, bytes, length);
+}
+
+// Decodes 'data' with pdf_string_decode_text and compares with 'expected'
+bool test_text_string_is(const uint8_t* data, size_t length, const TestBuffer* expected)
+{
+	PdfString string = {(char*)data, length}, text;
+	if(!pdf_string_decode_text(&string, &text)) return false;
+	bool is_equal = text.length == expected->length && memcmp(text.start, expected->data, text.length) == 0
+		&& text.start[text.length] == '\0';
+	pdf_free(text.start);
+	return is_equal;
+}
+
+// Inputs of 15 to 17 bytes (either side of a 16 bytes block), with the
+// characters to convert at every position
+void test_text_strings(void)
+{
+	const char* name = "text strings";
+	size_t wrong_doc_encoding = 0, wrong_utf16 = 0, wrong_surrogates = 0;
+	for(size_t length = 15; length <= 17; ++length)
+	{
+		// PDFDocEncoding, every byte of 0x18 to 0x1F and 0x7F to 0xA0
+		for(uint32_t byte = 0x18; byte <= 0xA0; ++byte)
+		{
+			if(byte == 0x20) byte = 0x7F;
+			for(size_t pos = 0; pos < length; ++pos)
+			{
+				uint8_t data[17];
+				TestBuffer expected = {0};
+				for(size_t i = 0; i < length; ++i)
+				{
+					data[i] = i == pos ? (uint8_t)byte : (uint8_t)('A' + i);
+					test_utf8_append(&expected, test_doc_encoding(data[i]));
+				}
+				if(!test_text_string_is(data, length, &expected)) wrong_doc_encoding += 1;
+				test_buffer_free(&expected);
+			}
+		}
+
+		// UTF-16BE after its mark, with a surrogate pair, then a lone high
+		// and a lone low surrogate, at every position
+		size_t units = (length - 2)/2;
+		for(size_t pos = 0; pos + 1 < units; ++pos)
+		{
+			static const uint16_t pairs[3][2] = {{0xD83D, 0xDE00}, {0xD800, 'x'}, {0xDC00, 'y'}};
+			static const uint32_t decoded[3][2] = {{0x1F600, 0}, {0xFFFD, 'x'}, {0xFFFD, 'y'}};
+			for(int kind = 0; kind < 3; ++kind)
+			{
+				uint8_t data[2 + 2*17] = {0xFE, 0xFF};
+				TestBuffer expected = {0};
+				for(size_t i = 0; i < units; ++i)
+				{
+					uint16_t unit = (uint16_t)('a' + i);
+					if(i == pos) unit = pairs[kind][0];
+					else if(i == pos + 1) unit = pairs[kind][1];
+					data[2 + 2*i] = (uint8_t)(unit >> 8);
+					data[2 + 2*i + 1] = (uint8_t)unit;
+					if(i == pos) test_utf8_append(&expected, decoded[kind][0]);
+					else if(i == pos + 1) test_utf8_append(&expected, decoded[kind][1]);
+					else test_utf8_append(&expected, unit);
+				}
+				if(!test_text_string_is(data, 2 + 2*units, &expected))
+				{
+					if(kind == 0) wrong_utf16 += 1;
+					else wrong_surrogates += 1;
+				}
+				test_buffer_free(&expected);
+			}
+		}
+	}
+	TEST_CHECK(wrong_doc_encoding == 0, name, "%zu PDFDocEncoding strings decode wrong", wrong_doc_encoding);
+	TEST_CHECK(wrong_utf16 == 0, name, "%zu UTF-16BE strings with a surrogate pair decode wrong", wrong_utf16);
+	TEST_CHECK(wrong_surrogates == 0, name, "%zu lone surrogates are not U+FFFD", wrong_surrogates);
+
+	// A high surrogate at the very end, and a UTF-8 string after its mark
+	static const uint8_t dangling[] = {0xFE, 0xFF, 0x00, 'a', 0xD8, 0x3D};
+	static const uint8_t utf8[] = {0xEF, 0xBB, 0xBF, 'c', 'a', 'f', 0xC3, 0xA9};
+	TestBuffer expected = {0};
+	test_buffer_append(&expected, "a\xEF\xBF\xBD", 4);
+	TEST_CHECK(test_text_string_is(dangling, sizeof(dangling), &expected), name, "a dangling high surrogate is not U+FFFD");
+	test_buffer_free(&expected);
+	test_buffer_append(&expected, "caf\xC3\xA9", 5);
+	TEST_CHECK(test_text_string_is(utf8, sizeof(utf8), &expected), name, "UTF-8 string decodes wrong");
+	test_buffer_free(&expected);
+}
+
+// ----------------------------------------------------------------------------
+// Metadata
+// ----------------------------------------------------------------------------
+
+// What PDF_OPEN_METADATA reads must be what a full open finds
+void test_metadata(const char* name, const TestBuffer* buffer)
+{
+	PdfDocument doc, full;
+	int error = pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_METADATA);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "metadata: open gives error %d", error);
+	if(error) return;
+	if(pdf_document_open_memory(&full, buffer->data, buffer->length, 0) != PDF_ERROR_NONE)
+	{
+		pdf_document_close(&doc);
+		return;
+	}
+	PdfMetadata metadata;
+	bool success = pdf_document_read_metadata(&doc, &metadata);
+	TEST_CHECK(success, name, "metadata: can't read");
+
+	// The /Info strings
+	PdfObject info_ref = pdf_dictionary_get(&full.trailer.dictionary_value, pdf_name("Info"));
+	PdfObject info = {.type = PDF_OBJECT_TYPE_NONE};
+	if(info_ref.type == PDF_OBJECT_TYPE_REFERENCE) pdf_document_get_object(&full, info_ref.reference_value.number, &info);
+	for(size_t i = 0; success && i < PDF_INFO_COUNT; ++i)
+	{
+		PdfObject value = info.type == PDF_OBJECT_TYPE_DICTIONARY
+			? pdf_dictionary_get(&info.dictionary_value, pdf_name(pdf_info_key_names[i])) : info;
+		PdfString text = {0};
+		if(value.type == PDF_OBJECT_TYPE_STRING) pdf_string_decode_text(&value.string_value, &text);
+		TEST_CHECK((text.start == NULL) == (metadata.info[i].start == NULL) && text.length == metadata.info[i].length
+				   && (text.length == 0 || memcmp(text.start, metadata.info[i].start, text.length) == 0), name,
+				   "metadata: /%s differs", pdf_info_key_names[i]);
+		pdf_free(text.start);
+	}
+	pdf_object_free(&info);
+
+	// The /Count of the page tree and the XMP packet
+	int64_t count = -1;
+	PdfObject root_ref = pdf_dictionary_get(&full.trailer.dictionary_value, pdf_name("Root"));
+	PdfObject root = {.type = PDF_OBJECT_TYPE_NONE};
+	if(root_ref.type == PDF_OBJECT_TYPE_REFERENCE) pdf_document_get_object(&full, root_ref.reference_value.number, &root);
+	PdfObject pages_ref = root.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&root.dictionary_value, pdf_name("Pages")) : root;
+	PdfObject pages = {.type = PDF_OBJECT_TYPE_NONE};
+	if(pages_ref.type == PDF_OBJECT_TYPE_REFERENCE) pdf_document_get_object(&full, pages_ref.reference_value.number, &pages);
+	PdfObject count_obj = pages.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&pages.dictionary_value, pdf_name("Count")) : pages;
+	if(count_obj.type == PDF_OBJECT_TYPE_INTEGER) count = (int64_t)count_obj.int_value;
+	TEST_CHECK(!success || metadata.pages_count == count, name, "metadata: /Count is %lld instead of %lld",
+			   (long long)metadata.pages_count, (long long)count);
+	PdfObject xmp_ref = root.type == PDF_OBJECT_TYPE_DICTIONARY
+		? pdf_dictionary_get(&root.dictionary_value, pdf_name("Metadata")) : root;
+	PdfObject xmp = {.type = PDF_OBJECT_TYPE_NONE};
+	uint8_t* xmp_data = NULL;
+	size_t xmp_length = 0;
+	if(xmp_ref.type == PDF_OBJECT_TYPE_REFERENCE && pdf_document_get_object(&full, xmp_ref.reference_value.number, &xmp)
+	   && xmp.type == PDF_OBJECT_TYPE_STREAM)
+		pdf_document_decode_stream(&full, xmp_ref.reference_value.number, xmp_ref.reference_value.generation,
+								   &xmp.stream_value, &xmp_data, &xmp_length);
+	TEST_CHECK(!success || (xmp_length == metadata.xmp_length
+							&& (xmp_length == 0 || memcmp(xmp_data, metadata.xmp, xmp_length) == 0)), name,
+			   "metadata: the XMP packet differs");
+	pdf_free(xmp_data);
+	pdf_object_free(&xmp);
+	pdf_object_free(&pages);
+	pdf_object_free(&root);
+	if(success) pdf_metadata_free(&metadata);
+	pdf_document_close(&full);
+	pdf_document_close(&doc);
+}
+
+// The strings of the generated documents, in clear or not
+void test_generated_metadata(const char* name, const TestBuffer* buffer)
+{
+	PdfDocument doc;
+	if(pdf_document_open_memory(&doc, buffer->data, buffer->length, PDF_OPEN_METADATA) != PDF_ERROR_NONE) return;
+	PdfMetadata metadata;
+	if(pdf_document_read_metadata(&doc, &metadata))
+	{
+		const PdfString* title = &metadata.info[PDF_INFO_TITLE];
+		const PdfString* author = &metadata.info[PDF_INFO_AUTHOR];
+		TEST_CHECK(title->length == 10 && memcmp(title->start, "Round trip", 10) == 0, name, "metadata: wrong /Title");
+		TEST_CHECK(author->length == 4 && memcmp(author->start, "Zo\xC3\xAB", 4) == 0, name, "metadata: wrong /Author");
+		TEST_CHECK(metadata.pages_count == TEST_PAGES, name, "metadata: wrong /Count");
+		TEST_CHECK(metadata.xmp_length == sizeof(test_xmp) - 1 && memcmp(metadata.xmp, test_xmp, metadata.xmp_length) == 0,
+				   name, "metadata: wrong XMP packet");
+		pdf_metadata_free(&metadata);
+	}
+	else TEST_CHECK(false, name, "metadata: can't read");
+	pdf_document_close(&doc);
+}
+
+// ----------------------------------------------------------------------------
+// Split and merge
+// ----------------------------------------------------------------------------
+
+void test_split_merge(const char* name, PdfDocument* doc)
+{
+	size_t pages = pdf_document_page_count(doc);
+	if(pages == 0) return;
+
+	// The document split in two halves merged back must be the same pages
+	PdfPageRange halves[2] = {{doc, 0, pages/2}, {doc, pages/2, pages - pages/2}};
+	PdfWriter writer = {0};
+	pdf_writer_begin(&writer, NULL, 0);
+	int error = pdf_write_pages(&writer, halves, 2, PDF_SAVE_OBJECT_STREAMS);
+	TestBuffer merged;
+	bool has_merged = test_buffer_from_writer(&merged, &writer);
+	TEST_CHECK(error == PDF_ERROR_NONE && has_merged, name, "split and merge: error %d", error);
+	if(!error && has_merged) test_check_written(name, "split and merge", doc, &merged, false);
+	if(has_merged) test_buffer_free(&merged);
+
+	// The last page alone, then the whole document
+	PdfPageRange ranges[2] = {{doc, pages - 1, 1}, {doc, 0, pages}};
+	pdf_writer_begin(&writer, NULL, 0);
+	error = pdf_write_pages(&writer, ranges, 2, 0);
+	has_merged = test_buffer_from_writer(&merged, &writer);
+	TEST_CHECK(error == PDF_ERROR_NONE && has_merged, name, "page ranges: error %d", error);
+	if(error || !has_merged) return;
+	PdfDocument reopened;
+	error = pdf_document_open_memory(&reopened, merged.data, merged.length, PDF_OPEN_NO_REPAIR);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "page ranges: reopen gives error %d", error);
+	if(!error)
+	{
+		size_t count = pdf_document_page_count(&reopened);
+		TEST_CHECK(count == pages + 1, name, "page ranges: %zu pages instead of %zu", count, pages + 1);
+		for(size_t i = 0; i < count && count == pages + 1; ++i)
+		{
+			PdfWriter expected = {0}, got = {0};
+			pdf_writer_begin(&expected, NULL, 0);
+			pdf_writer_begin(&got, NULL, 0);
+			pdf_document_extract_page_text(doc, i == 0 ? pages - 1 : i - 1, &expected);
+			pdf_document_extract_page_text(&reopened, i, &got);
+			TEST_CHECK(expected.length == got.length && memcmp(expected.buffer, got.buffer, got.length) == 0,
+					   name, "page ranges: text of page %zu differs", i);
+			pdf_writer_free(&expected);
+			pdf_writer_free(&got);
+		}
+		pdf_document_close(&reopened);
+	}
+	test_buffer_free(&merged);
+}
+
+// ----------------------------------------------------------------------------
+// Inline images
+// ----------------------------------------------------------------------------
+
+// The text around an inline image must be read whatever its data, which
+// here looks like the end of the image followed by a string
+void test_inline_images(void)
+{
+	const char* name = "inline images";
+	static const struct {
+		const char* what;
+		const char* dictionary;
+		const char* data;
+		size_t length;
+	} images[] = {
+		{"sized image", "/W 4/H 1/BPC 8/CS/G", "EI (", 4},
+		{"image without size", "/BPC 8/CS/G/F/AHx", "0aEI(EI)>", 9},
+	};
+	static const char before[] = "BT /F1 12 Tf 72 700 Td (Before) Tj ET\n";
+	static const char after[] = "\nBT /F1 12 Tf 72 680 Td (After) Tj ET\n";
+	for(size_t i = 0; i < sizeof(images)/sizeof(images[0]); ++i)
+	{
+		TestBuffer content = {0};
+		test_buffer_append(&content, before, sizeof(before) - 1);
+		test_buffer_format(&content, "BI %s ID ", images[i].dictionary);
+		size_t data_start = content.length;
+		test_buffer_append(&content, images[i].data, images[i].length);
+		test_buffer_append(&content, "\nEI", 3);
+		test_buffer_append(&content, after, sizeof(after) - 1);
+
+		// The operators with the data of the image
+		size_t pos = 0, operators = 0;
+		PdfContentOperator op = {0};
+		const uint8_t* image_data = NULL;
+		size_t image_length = 0;
+		while(pdf_content_next_operator(content.data, &pos, content.length, &op))
+		{
+			operators += 1;
+			if(op.op_len == 2 && memcmp(op.op, "ID", 2) == 0)
+			{
+				image_data = op.image_data;
+				image_length = op.image_length;
+			}
+		}
+		pdf_content_operator_free(&op);
+		TEST_CHECK(image_data == content.data + data_start && image_length == images[i].length, name,
+				   "%s: data of %zu bytes instead of %zu", images[i].what, image_length, images[i].length);
+		// Its 'EI' is read with the 'ID'
+		TEST_CHECK(operators == 12, name, "%s: %zu operators instead of 12", images[i].what, operators);
+
+		// The text around it
+		TestBuffer buffer;
+		if(test_generate_page("<<>>", content.data, content.length, NULL, 0, &buffer))
+		{
+			PdfDocument doc;
+			if(pdf_document_open_memory(&doc, buffer.data, buffer.length, PDF_OPEN_NO_REPAIR) == PDF_ERROR_NONE)
+			{
+				TestBuffer text;
+				bool has_text = test_document_text(&doc, &text);
+				static const char expected[] = "Before\nAfter\n\f";
+				TEST_CHECK(has_text && text.length == sizeof(expected) - 1 && memcmp(text.data, expected, text.length) == 0,
+						   name, "%s: wrong text", images[i].what);
+				if(has_text) test_buffer_free(&text);
+				pdf_document_close(&doc);
+			}
+			test_buffer_free(&buffer);
+		}
+		test_buffer_free(&content);
+	}
+}
+
+// ----------------------------------------------------------------------------
+
+// The checks of a document which only compare it with itself
+void test_document(const char* name, const TestBuffer* buffer)
+{
+	test_repair(name, buffer, 1);
+	PdfDocument doc;
+	int error = pdf_document_open_memory(&doc, buffer->data, buffer->length, 0);
+	TEST_CHECK(error == PDF_ERROR_NONE, name, "open gives error %d", error);
+	if(error) return;
+	test_save_round_trips(name, &doc);
+	test_split_merge(name, &doc);
+	pdf_document_close(&doc);
+	test_push_parser_slices(name, buffer);
+	test_metadata(name, buffer);
+}
+
+int main(int argc, char** argv)
+{
+	TestBuffer generated, big;
+	bool has_generated = test_generate(TEST_PAGES, &generated);
+	TEST_CHECK(has_generated, "generated", "can't generate the document");
+	if(has_generated)
+	{
+		test_document("generated", &generated);
+		test_incremental_update("generated", &generated);
+		test_page_index("generated", &generated, TEST_PAGES);
+		test_sidecar_index("generated", &generated);
+		test_generated_text("generated", &generated, TEST_PAGES);
+		test_optimize("generated", &generated);
+		test_generated_metadata("generated", &generated);
+	}
+	if(test_generate(TEST_BIG_PAGES, &big))
+	{
+		test_repair("big", &big, 4);
+		test_page_index("big", &big, TEST_BIG_PAGES);
+		test_buffer_free(&big);
+	}
+	else TEST_CHECK(false, "big", "can't generate the document");
+	test_linearized();
+	test_prefetch();
+
+	// Encrypted copies of the generated document
+	test_ciphers();
+	static const struct {
+		int method;
+		const char* name;
+	} encryptions[] = {
+		{TEST_CRYPT_RC4_40, "RC4 40 bits"},
+		{TEST_CRYPT_AES_128, "AESV2"},
+		{TEST_CRYPT_AES_256, "AESV3"},
+	};
+	for(size_t i = 0; i < sizeof(encryptions)/sizeof(encryptions[0]) && has_generated; ++i)
+	{
+		TestEncryption encryption;
+		test_encryption_init(&encryption, encryptions[i].method);
+		TestDocumentOptions options = {.pages_count = TEST_PAGES, .encryption = &encryption};
+		TestBuffer encrypted;
+		bool has_encrypted = test_generate_document(&options, &encrypted);
+		TEST_CHECK(has_encrypted, encryptions[i].name, "can't generate the document");
+		if(!has_encrypted) continue;
+		test_encrypted(encryptions[i].name, &generated, &encrypted);
+		test_document(encryptions[i].name, &encrypted);
+		test_generated_metadata(encryptions[i].name, &encrypted);
+		test_buffer_free(&encrypted);
+	}
+	test_cmaps();
+	test_json_strings();
+	test_memory_budget();
+	test_text_strings();
+	test_inline_images();
+	if(has_generated) test_buffer_free(&generated);
+
+	const char* default_files[] = {"test03.pdf"};
+	const char** files = argc > 1 ? (const char**)argv + 1 : default_files;
+	size_t files_count = argc > 1 ? (size_t)argc - 1 : 1;
+	for(size_t i = 0; i < files_count; ++i)
+	{
+		TestBuffer buffer;
+		bool has_file = test_read_file(files[i], &buffer);
+		TEST_CHECK(has_file, files[i], "can't read the file");
+		if(!has_file) continue;
+		test_document(files[i], &buffer);
+		test_buffer_free(&buffer);
+	}
+
+	printf("%zu checks, %zu failed\n", test_checks, test_failures);
+	return test_failures > 0 ? 1 : 0;
+}